@@ -12,17 +12,47 @@ int test_game(void);
 int test_first_one(void);
 int test_nth_one_index(void);
 int test_unstep(void);
+int test_hash(void);
 int test_random_ai(void);
 int test_rollout(void);
 int test_multiallocator(void);
 int test_allocn(void);
+int test_allocn_mt(void);
+int test_arena(void);
+int test_cursors(void);
+int test_rng(void);
 int test_mcts_init_free(void);
 int test_simulate(void);
+int test_tree_parallel(void);
 int test_get_3moves_0(void);
 int test_get_3moves_1(void);
 int test_get_3moves_2(void);
 int test_get_3moves_3(void);
 int test_all_3moves(void);
 int test_nn(void);
+int test_nn_ignore(void);
 int test_nn_rollout(void);
 int test_nn_simulate(void);
+int test_parallel_go(void);
+int test_tree_reuse(void);
+int test_transpositions(void);
+int test_turn_mode(void);
+int test_nn_accumulators(void);
+int test_nn_kernels(void);
+int test_nn_precision(void);
+int test_nn_binary(void);
+int test_time_control(void);
+int test_ponder(void);
+int test_stop(void);
+int test_progress(void);
+int test_solver(void);
+int test_endgame(void);
+int test_gc(void);
+int test_rng_seed(void);
+int test_ubc_select(void);
+int test_turn_gc(void);
+int test_batch_rollout(void);
+int test_std_next_steps(void);
+int test_wide_board(void);
+int test_wide_game(void);
+int test_incremental_steps(void);
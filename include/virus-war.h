@@ -2,6 +2,7 @@
 #define YOO__VIRUS_WAR__H__
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -12,6 +13,10 @@
 
 #define   ACTIVE_X          1
 #define   ACTIVE_O          2
+#define   DEAD_STONE        4
+
+#define   ZOBRIST_DEAD      0
+#define   QZOBRIST_KINDS    3
 
 
 
@@ -31,8 +36,15 @@ struct multiallocator_type
     size_t sz;
     size_t qitems;
     size_t counter;
+    size_t chunk;
 };
 
+/* Backends for blocks, mmap ones reserve all blocks in one arena. */
+#define ARENA_MALLOC    0
+#define ARENA_MMAP      1
+#define ARENA_THP       2  /* madvise(MADV_HUGEPAGE) */
+#define ARENA_HUGETLB   3  /* MAP_HUGETLB */
+
 struct multiallocator
 {
     void * data;
@@ -42,6 +54,23 @@ struct multiallocator
     void * * blocks;
     unsigned int qtypes;
     struct multiallocator_type * types;
+    pthread_mutex_t lock;
+    char * arena;
+    size_t arena_sz;
+    int backend;
+    size_t epoch;
+};
+
+/*
+ * Per thread allocation state for one item type, a zeroed cursor is empty.
+ * Items are taken from the shared counter by chunks, cursors become empty
+ * after multiallocator_reset (epoch is changed).
+ */
+struct multiallocator_cursor
+{
+    size_t epoch;
+    size_t next;
+    size_t end;
 };
 
 struct multiallocator * create_multiallocator(
@@ -53,6 +82,16 @@ struct multiallocator * create_multiallocator(
 void destroy_multiallocator(
     struct multiallocator * restrict const me);
 
+/*
+ * Maps an arena for all blocks before the first allocation. Backends are tried
+ * from the requested one down to ARENA_MMAP, the active one is stored in
+ * me->backend. With is_prefault all pages are touched at once.
+ */
+int multiallocator_map_arena(
+    struct multiallocator * restrict const me,
+    const int backend,
+    const int is_prefault);
+
 void multiallocator_reset(
     struct multiallocator * restrict const me);
 
@@ -65,6 +104,34 @@ size_t multiallocator_allocn(
     const int itype,
     size_t n);
 
+/* Thread safe version, concurrent calls are allowed for the same allocator. */
+size_t multiallocator_allocn_mt(
+    struct multiallocator * restrict const me,
+    const int itype,
+    size_t n);
+
+size_t multiallocator_allocn_chunk(
+    struct multiallocator * restrict const me,
+    struct multiallocator_cursor * restrict const cursor,
+    const int itype,
+    size_t n);
+
+/* Thread safe if every thread uses its own cursor. */
+static inline size_t multiallocator_allocn_local(
+    struct multiallocator * restrict const me,
+    struct multiallocator_cursor * restrict const cursor,
+    const int itype,
+    size_t n)
+{
+    const size_t next = cursor->next;
+    if (cursor->epoch == me->epoch && next + n <= cursor->end) {
+        cursor->next = next + n;
+        return next;
+    }
+
+    return multiallocator_allocn_chunk(me, cursor, itype, n);
+}
+
 static inline void * multiallocator_get(
     struct multiallocator * restrict const me,
     const unsigned int itype,
@@ -79,6 +146,61 @@ static inline void * multiallocator_get(
 
 
 
+static inline uint64_t splitmix64(uint64_t * restrict const seed)
+{
+    uint64_t z = (*seed += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+/*
+ * xoshiro256** generator, every thread owns its state. The state is filled
+ * with splitmix64 from the seed, then it jumps 2^128 values ahead stream
+ * times, so streams of one seed never overlap.
+ */
+struct rng
+{
+    uint64_t s[4];
+};
+
+void rng_seed(
+    struct rng * restrict const me,
+    const uint64_t seed,
+    const unsigned int stream);
+
+static inline uint64_t rng_next(struct rng * restrict const me)
+{
+    uint64_t * restrict const s = me->s;
+    const uint64_t x = s[1] * 5;
+    const uint64_t result = ((x << 7) | (x >> 57)) * 9;
+    const uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = (s[3] << 45) | (s[3] >> 19);
+    return result;
+}
+
+/* Uniform value in 0..bound-1 without modulo bias (Lemire's method). */
+static inline uint32_t rng_uniform(
+    struct rng * restrict const me,
+    const uint32_t bound)
+{
+    uint64_t m = (rng_next(me) >> 32) * bound;
+    if ((uint32_t)m < bound) {
+        const uint32_t threshold = -bound % bound;
+        while ((uint32_t)m < threshold) {
+            m = (rng_next(me) >> 32) * bound;
+        }
+    }
+    return m >> 32;
+}
+
+
+
 typedef __uint128_t bb_t;
 
 static inline int pop_count32(uint32_t value)
@@ -119,17 +241,275 @@ static inline int nth_one_index(const bb_t bb, int index);
 
 
 
+/*
+ * Move generation on the standard board of size n. Board masks are derived
+ * from n, so after inlining with a constant n all shift counts and masks are
+ * immediate, and boards up to MAX_WORD64_N work with 64 bit words.
+ */
+#define MAX_WORD64_N  8
+#define MAX_STD_N    11
+
+#define ALWAYS_INLINE  inline __attribute__((always_inline))
+
+static ALWAYS_INLINE uint64_t std_grow64(const uint64_t bb, const int n)
+{
+    const uint64_t all = n * n == 64 ? ~(uint64_t)0 : ((uint64_t)1 << n * n) - 1;
+    const uint64_t lside = all / (((uint64_t)1 << n) - 1);
+    const uint64_t rside = lside << (n - 1);
+    const uint64_t lbb = (bb & ~lside) >> 1;
+    const uint64_t rbb = (bb & ~rside) << 1;
+    const uint64_t hgrow = bb | lbb | rbb;
+    return hgrow | ((hgrow << n) & all) | (hgrow >> n);
+}
+
+static ALWAYS_INLINE bb_t std_grow128(const bb_t bb, const int n)
+{
+    const bb_t all = (BB_ONE << n * n) - 1;
+    const bb_t lside = all / ((BB_ONE << n) - 1);
+    const bb_t rside = lside << (n - 1);
+    const bb_t lbb = (bb & ~lside) >> 1;
+    const bb_t rbb = (bb & ~rside) << 1;
+    const bb_t hgrow = bb | lbb | rbb;
+    return hgrow | ((hgrow << n) & all) | (hgrow >> n);
+}
+
+/*
+ * Cloud is the grown reach: live stones of the side and dead opponent stones
+ * connected to them. Next steps are cloud squares to place or to kill.
+ */
+static ALWAYS_INLINE uint64_t std_cloud64(
+    const uint64_t my,
+    const uint64_t opp,
+    const uint64_t dead,
+    const int n)
+{
+    uint64_t opp_dead = opp & dead;
+    uint64_t my_live = my & ~dead;
+
+    for (;;) {
+        const uint64_t cloud = std_grow64(my_live, n);
+        const uint64_t extra = cloud & opp_dead;
+        if (extra == 0) {
+            return cloud;
+        }
+
+        my_live |= extra;
+        opp_dead ^= extra;
+    }
+}
+
+static ALWAYS_INLINE bb_t std_cloud128(
+    const bb_t my,
+    const bb_t opp,
+    const bb_t dead,
+    const int n)
+{
+    bb_t opp_dead = opp & dead;
+    bb_t my_live = my & ~dead;
+
+    for (;;) {
+        const bb_t cloud = std_grow128(my_live, n);
+        const bb_t extra = cloud & opp_dead;
+        if (extra == 0) {
+            return cloud;
+        }
+
+        my_live |= extra;
+        opp_dead ^= extra;
+    }
+}
+
+static ALWAYS_INLINE bb_t std_cloud(
+    const bb_t my,
+    const bb_t opp,
+    const bb_t dead,
+    const int n)
+{
+    if (n <= MAX_WORD64_N) {
+        return std_cloud64(my, opp, dead, n);
+    }
+    return std_cloud128(my, opp, dead, n);
+}
+
+static ALWAYS_INLINE bb_t std_next_steps(
+    const bb_t my,
+    const bb_t opp,
+    const bb_t dead,
+    const int n)
+{
+    if (n <= MAX_WORD64_N) {
+        const uint64_t all = n * n == 64 ? ~(uint64_t)0 : ((uint64_t)1 << n * n) - 1;
+        const uint64_t place = (all ^ (my | opp)) | (opp & ~dead);
+        return std_cloud64(my, opp, dead, n) & place;
+    }
+
+    const bb_t all = (BB_ONE << n * n) - 1;
+    const bb_t place = (all ^ (my | opp)) | (opp & ~dead);
+    return std_cloud128(my, opp, dead, n) & place;
+}
+
+typedef bb_t (*next_steps_t)(bb_t my, bb_t opp, bb_t dead);
+typedef bb_t (*cloud_t)(bb_t my, bb_t opp, bb_t dead);
+
+
+
+/*
+ * Wide bitboards for boards up to MAX_WIDE_N, squares are numbered as in bb_t
+ * and kept in WBB_WORDS words from the lowest one. Wide boards have their own
+ * geometry and state, struct geometry and struct state refer to them for
+ * boards above MAX_STD_N, the 128 bit bb_t path stays the default up to
+ * MAX_STD_N.
+ */
+#define MAX_WIDE_N   16
+#define WBB_WORDS     4
+
+typedef struct
+{
+    uint64_t w[WBB_WORDS];
+} wbb_t;
+
+static inline wbb_t wbb_square(const int sq)
+{
+    wbb_t result = { { 0, 0, 0, 0 } };
+    result.w[sq / 64] = (uint64_t)1 << (sq % 64);
+    return result;
+}
+
+static inline int wbb_test(const wbb_t * const bb, const int sq)
+{
+    return (bb->w[sq / 64] >> (sq % 64)) & 1;
+}
+
+static inline wbb_t wbb_or(const wbb_t a, const wbb_t b)
+{
+    wbb_t result;
+    for (int i=0; i<WBB_WORDS; ++i) {
+        result.w[i] = a.w[i] | b.w[i];
+    }
+    return result;
+}
+
+static inline wbb_t wbb_and(const wbb_t a, const wbb_t b)
+{
+    wbb_t result;
+    for (int i=0; i<WBB_WORDS; ++i) {
+        result.w[i] = a.w[i] & b.w[i];
+    }
+    return result;
+}
+
+static inline wbb_t wbb_xor(const wbb_t a, const wbb_t b)
+{
+    wbb_t result;
+    for (int i=0; i<WBB_WORDS; ++i) {
+        result.w[i] = a.w[i] ^ b.w[i];
+    }
+    return result;
+}
+
+static inline int wbb_is_empty(const wbb_t bb)
+{
+    return (bb.w[0] | bb.w[1] | bb.w[2] | bb.w[3]) == 0;
+}
+
+static inline int wbb_pop_count(const wbb_t bb)
+{
+    int result = 0;
+    for (int i=0; i<WBB_WORDS; ++i) {
+        result += __builtin_popcountll(bb.w[i]);
+    }
+    return result;
+}
+
+static inline int wbb_nth_one_index(const wbb_t bb, int index)
+{
+    const bb_t lo = bb.w[0] | (bb_t)bb.w[1] << 64;
+    const bb_t hi = bb.w[2] | (bb_t)bb.w[3] << 64;
+    const int qlo = pop_count(lo);
+    return index < qlo ? nth_one_index(lo, index) : 128 + nth_one_index(hi, index - qlo);
+}
+
+struct wide_geometry;
+
+typedef wbb_t (*wide_next_steps_t)(
+    const struct wide_geometry * geometry,
+    const wbb_t * my, const wbb_t * opp, const wbb_t * dead);
+
+struct wide_geometry
+{
+    int n;
+    wbb_t lside, rside, all;
+    wbb_t not_lside, not_rside;
+    wbb_t x_first_step;
+    wbb_t o_first_step;
+
+    /* Generic or AVX2 flood fill, it is chosen with cpuid on create. */
+    wide_next_steps_t next_steps;
+};
+
+struct wide_geometry * create_wide_geometry(const int n);
+void destroy_wide_geometry(struct wide_geometry * restrict const me);
+
+struct wide_state
+{
+    const struct wide_geometry * geometry;
+    int active;
+    wbb_t x, o, dead;
+    wbb_t next;
+};
+
+void init_wide_state(
+    struct wide_state * restrict const me,
+    const struct wide_geometry * const geometry);
+
+static inline int wide_state_status(const struct wide_state * const me)
+{
+    return !wbb_is_empty(me->next) ? 0 : me->active ^ 3;
+}
+
+int wide_state_step(struct wide_state * restrict const me, const int step);
+int wide_state_unstep(struct wide_state * restrict const me, const int step);
+
+/* Plays random steps until the end of the game and returns the winner. */
+int wide_rollout(
+    const struct wide_state * const state,
+    struct rng * restrict const rng,
+    uint32_t * restrict const qthink);
+
+
+
 struct geometry
 {
     int n;
     bb_t lside, rside, all;
     bb_t x_first_step;
     bb_t o_first_step;
+
+    /* next_steps specialised for n, it is chosen in create_std_geometry. */
+    next_steps_t next_steps;
+
+    /* std_cloud specialised for n, it recalculates the cloud after removals. */
+    cloud_t cloud;
+
+    /* Square with its 8 neighbours, it is used to extend the cloud. */
+    bb_t near[8*sizeof(bb_t)];
+
+    /* Zobrist keys indexed by ACTIVE_X, ACTIVE_O or ZOBRIST_DEAD and square. */
+    uint64_t zobrist[QZOBRIST_KINDS][8*sizeof(bb_t)];
+
+    /* Boards above MAX_STD_N, only n is set among other fields then. */
+    struct wide_geometry * wide;
 };
 
+/* Standard geometry up to MAX_STD_N, wide one up to MAX_WIDE_N. */
+struct geometry * create_geometry(const int n);
 struct geometry * create_std_geometry(const int n);
 void destroy_geometry(struct geometry * restrict const me);
 
+uint64_t calc_hash(
+    const struct geometry * const geometry,
+    bb_t x, bb_t o, bb_t dead);
+
 
 
 struct state
@@ -138,6 +518,21 @@ struct state
     int active;
     bb_t x, o, dead;
     bb_t next;
+    uint64_t hash;
+
+    /*
+     * Cloud (see std_cloud) of ACTIVE_X and ACTIVE_O, index is active-1. The
+     * state_step extends it near the new stone. Removals only set the stale
+     * bit (1 << index), and the cloud is recalculated when the side is to move.
+     */
+    bb_t cloud[2];
+    int stale;
+
+    /*
+     * Position on wide boards (geometry->wide), active is kept in both, other
+     * fields above are zero. See accessors below for code used with both.
+     */
+    struct wide_state wide;
 };
 
 void init_state(
@@ -147,16 +542,65 @@ void init_state(
 struct state * create_state(const struct geometry * const geometry);
 void destroy_state(struct state * restrict const me);
 
+static inline int state_is_wide(const struct state * const me)
+{
+    return me->geometry->wide != NULL;
+}
+
 static inline int state_status(const struct state * const me)
 {
+    if (state_is_wide(me)) {
+        return wide_state_status(&me->wide);
+    }
     return me->next != 0 ? 0 : me->active ^ 3;
 }
 
+/* Only for boards up to MAX_STD_N. */
 static inline bb_t state_get_steps(const struct state * const me)
 {
     return me->next;
 }
 
+static inline int state_qnext(const struct state * const me)
+{
+    return state_is_wide(me) ? wbb_pop_count(me->wide.next) : pop_count(me->next);
+}
+
+static inline int state_nth_next(const struct state * const me, const int index)
+{
+    return state_is_wide(me) ? wbb_nth_one_index(me->wide.next, index) : nth_one_index(me->next, index);
+}
+
+static inline int state_is_next(const struct state * const me, const int sq)
+{
+    return state_is_wide(me) ? wbb_test(&me->wide.next, sq) : (me->next & BB_SQUARE(sq)) != 0;
+}
+
+/* Count of squares with stones, both live and dead. */
+static inline int state_qstones(const struct state * const me)
+{
+    return state_is_wide(me) ? wbb_pop_count(wbb_or(me->wide.x, me->wide.o)) : pop_count(me->x | me->o);
+}
+
+static inline int state_qdead(const struct state * const me)
+{
+    return state_is_wide(me) ? wbb_pop_count(me->wide.dead) : pop_count(me->dead);
+}
+
+/* ACTIVE_X or ACTIVE_O with DEAD_STONE for killed stones, zero for empty squares. */
+static inline int state_get_square(const struct state * const me, const int sq)
+{
+    if (state_is_wide(me)) {
+        const struct wide_state * const wide = &me->wide;
+        const int owner = wbb_test(&wide->x, sq) ? ACTIVE_X : wbb_test(&wide->o, sq) ? ACTIVE_O : 0;
+        return owner | (wbb_test(&wide->dead, sq) ? DEAD_STONE : 0);
+    }
+
+    const bb_t bb = BB_SQUARE(sq);
+    const int owner = bb & me->x ? ACTIVE_X : bb & me->o ? ACTIVE_O : 0;
+    return owner | (bb & me->dead ? DEAD_STONE : 0);
+}
+
 int state_step(struct state * restrict const me, const int step);
 int state_unstep(struct state * restrict const me, const int step);
 
@@ -177,6 +621,19 @@ struct ai_explanation
     double score;
 };
 
+#define MAX_PV_LEN  32
+
+/* Snapshot of the running search, values are approximate. */
+struct ai_progress
+{
+    uint64_t qthink;        /* steps simulated by the current search */
+    uint64_t qplayouts;
+    size_t memory;          /* bytes used by search trees */
+    double score;           /* of pv[0] for the first player, -1 if unknown */
+    unsigned int qpv;
+    int pv[MAX_PV_LEN];     /* most visited children from the root */
+};
+
 enum param_type
 {
     NO_TYPE=0,
@@ -225,6 +682,16 @@ struct ai
         struct ai * restrict const ai,
 		struct ai_explanation * restrict const explanation);
 
+    /*
+     * Both are safe to call from another thread while ai->go is running.
+     * When the stop flag is set ai->go returns the best step found so far
+     * without a further search, the flag is kept until it is cleared.
+     */
+    void (*set_stop)(struct ai * restrict const ai, const int is_stop);
+    void (*get_progress)(
+        const struct ai * const ai,
+        struct ai_progress * restrict const progress);
+
     const struct ai_param * (*get_params)(const struct ai * const ai);
 
     int (*set_param)(
@@ -252,6 +719,25 @@ int init_mcts_ai(
 
 
 
+/* NN files */
+
+struct nn;
+
+struct nn * load_nn(
+    const char * const path,
+    char * restrict const error_buf,
+    const size_t buf_sz);
+
+int save_binary_nn(
+    const struct nn * const me,
+    const char * const path,
+    char * restrict const error_buf,
+    const size_t buf_sz);
+
+void destroy_nn(struct nn * restrict const me);
+
+
+
 /* Debug */
 
 void mcts_test_game(void);
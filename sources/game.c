@@ -2,6 +2,18 @@
 
 #include <string.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAS_X86_KERNELS
+#endif
+
+#ifdef MAKE_CHECK
+static void check_next_steps(const struct state * const me);
+#define CHECK_NEXT_STEPS(me) check_next_steps(me)
+#else
+#define CHECK_NEXT_STEPS(me)
+#endif
+
 const size_t param_sizes[QPARAM_TYPES] = {
     [U32] = sizeof(uint32_t),
     [I32] = sizeof(int32_t),
@@ -9,6 +21,72 @@ const size_t param_sizes[QPARAM_TYPES] = {
     [STR] = VARIABLE_SZ
 };
 
+static void init_zobrist(struct geometry * restrict const me)
+{
+    uint64_t seed = 0x5649525553574152ull;
+    for (int kind=0; kind<QZOBRIST_KINDS; ++kind) {
+        for (int sq=0; sq<8*sizeof(bb_t); ++sq) {
+            me->zobrist[kind][sq] = splitmix64(&seed);
+        }
+    }
+}
+
+#define DEFINE_STD_NEXT_STEPS(N) \
+    static bb_t std_next_steps_##N(const bb_t my, const bb_t opp, const bb_t dead) \
+    { \
+        return std_next_steps(my, opp, dead, N); \
+    }
+
+DEFINE_STD_NEXT_STEPS(3)
+DEFINE_STD_NEXT_STEPS(4)
+DEFINE_STD_NEXT_STEPS(5)
+DEFINE_STD_NEXT_STEPS(6)
+DEFINE_STD_NEXT_STEPS(7)
+DEFINE_STD_NEXT_STEPS(8)
+DEFINE_STD_NEXT_STEPS(9)
+DEFINE_STD_NEXT_STEPS(10)
+DEFINE_STD_NEXT_STEPS(11)
+
+static const next_steps_t std_next_steps_table[MAX_STD_N + 1] = {
+    [3] = &std_next_steps_3,
+    [4] = &std_next_steps_4,
+    [5] = &std_next_steps_5,
+    [6] = &std_next_steps_6,
+    [7] = &std_next_steps_7,
+    [8] = &std_next_steps_8,
+    [9] = &std_next_steps_9,
+    [10] = &std_next_steps_10,
+    [11] = &std_next_steps_11
+};
+
+#define DEFINE_STD_CLOUD(N) \
+    static bb_t std_cloud_##N(const bb_t my, const bb_t opp, const bb_t dead) \
+    { \
+        return std_cloud(my, opp, dead, N); \
+    }
+
+DEFINE_STD_CLOUD(3)
+DEFINE_STD_CLOUD(4)
+DEFINE_STD_CLOUD(5)
+DEFINE_STD_CLOUD(6)
+DEFINE_STD_CLOUD(7)
+DEFINE_STD_CLOUD(8)
+DEFINE_STD_CLOUD(9)
+DEFINE_STD_CLOUD(10)
+DEFINE_STD_CLOUD(11)
+
+static const cloud_t std_cloud_table[MAX_STD_N + 1] = {
+    [3] = &std_cloud_3,
+    [4] = &std_cloud_4,
+    [5] = &std_cloud_5,
+    [6] = &std_cloud_6,
+    [7] = &std_cloud_7,
+    [8] = &std_cloud_8,
+    [9] = &std_cloud_9,
+    [10] = &std_cloud_10,
+    [11] = &std_cloud_11
+};
+
 struct geometry * create_std_geometry(const int n)
 {
     if (n <= 2) {
@@ -47,16 +125,70 @@ struct geometry * create_std_geometry(const int n)
     me->all = (BB_ONE << qsquares) - 1;
     me->x_first_step = BB_ONE;
     me->o_first_step = BB_SQUARE(qsquares-1);
+    me->next_steps = std_next_steps_table[n];
+    me->cloud = std_cloud_table[n];
+    for (int sq=0; sq<8*sizeof(bb_t); ++sq) {
+        me->near[sq] = sq < qsquares ? std_grow128(BB_SQUARE(sq), n) : 0;
+    }
+    init_zobrist(me);
+    me->wide = NULL;
+    return me;
+}
+
+struct geometry * create_geometry(const int n)
+{
+    if (n <= MAX_STD_N) {
+        return create_std_geometry(n);
+    }
+
+    struct geometry * restrict const me = malloc(sizeof(struct geometry));
+    if (me == NULL) {
+        return NULL;
+    }
+
+    memset(me, 0, sizeof(struct geometry));
+    me->n = n;
+    me->wide = create_wide_geometry(n);
+    if (me->wide == NULL) {
+        free(me);
+        return NULL;
+    }
+
     return me;
 }
 
 void destroy_geometry(struct geometry * restrict const me)
 {
+    if (me->wide != NULL) {
+        destroy_wide_geometry(me->wide);
+    }
     free(me);
 }
 
 
 
+static uint64_t calc_bb_hash(const uint64_t * const keys, bb_t bb)
+{
+    uint64_t hash = 0;
+    while (bb != 0) {
+        const int sq = first_one(bb);
+        bb ^= BB_SQUARE(sq);
+        hash ^= keys[sq];
+    }
+    return hash;
+}
+
+uint64_t calc_hash(
+    const struct geometry * const geometry,
+    bb_t x, bb_t o, bb_t dead)
+{
+    uint64_t hash = 0;
+    hash ^= calc_bb_hash(geometry->zobrist[ACTIVE_X], x);
+    hash ^= calc_bb_hash(geometry->zobrist[ACTIVE_O], o);
+    hash ^= calc_bb_hash(geometry->zobrist[ZOBRIST_DEAD], dead);
+    return hash;
+}
+
 void init_state(
     struct state * restrict const me,
     const struct geometry * const geometry)
@@ -64,6 +196,10 @@ void init_state(
     memset(me, 0, sizeof(struct state));
     me->geometry = geometry;
     me->active = ACTIVE_X;
+    if (geometry->wide != NULL) {
+        init_wide_state(&me->wide, geometry->wide);
+        return;
+    }
     me->next = geometry->x_first_step;
 }
 
@@ -84,61 +220,96 @@ void destroy_state(struct state * restrict const me)
     free(me);
 }
 
-static bb_t grow(
-    const bb_t bb,
-    const int n,
-    const bb_t all,
-    const bb_t not_lside,
-    const bb_t not_rside)
+/*
+ * Extends the cloud with added squares and chain squares connected to them.
+ * Chain squares in the cloud are already reached, so the new ones are
+ * joined square by square without the full recalculation.
+ */
+static inline bb_t extend_cloud(
+    const struct geometry * const geometry,
+    bb_t cloud,
+    bb_t added,
+    const bb_t chain)
 {
-    const bb_t lbb = (bb & not_lside) >> 1;
-    const bb_t rbb = (bb & not_rside) << 1;
-    const bb_t hgrow = bb | lbb | rbb;
-
-    const bb_t ubb = lshift(hgrow, n) & all;
-    const bb_t dbb = rshift(hgrow, n);
-    return hgrow | ubb | dbb;
+    while (added != 0) {
+        const int sq = first_one(added);
+        added &= added - 1;
+        const bb_t near = geometry->near[sq];
+        added |= near & chain & ~cloud;
+        cloud |= near;
+    }
+    return cloud;
 }
 
-static bb_t next_steps(
-    const bb_t my,
-    const bb_t opp,
-    const bb_t dead,
-    const int n,
-    const bb_t all,
-    const bb_t not_lside,
-    const bb_t not_rside)
+/* Same as calc_next_steps, but steps are taken from the kept cloud. */
+static bb_t get_next_steps(
+    struct state * restrict const me)
 {
-    const bb_t empty = all ^ (my | opp);
-    const bb_t my_dead = my & dead;
-    bb_t opp_dead = opp & dead;
-    bb_t my_live = my ^ my_dead;
-    const bb_t opp_live = opp ^ opp_dead;
-    const bb_t place = empty | opp_live;
+    const struct geometry * const geometry = me->geometry;
+    const bb_t dead = me->dead;
+    const bb_t x = me->x;
+    const bb_t o = me->o;
+    const int side = me->active - 1;
+    const bb_t my = me->active == ACTIVE_X ? x : o;
+    const bb_t opp = me->active == ACTIVE_X ? o : x;
 
-    for (;;) {
-        const bb_t cloud = grow(my_live, n, all, not_lside, not_rside);
-        const bb_t extra = cloud & opp_dead;
-        if (extra == 0) {
-            return cloud & place;
-        }
+    if (me->stale & (1 << side)) {
+        me->stale ^= 1 << side;
+        me->cloud[side] = geometry->cloud(my, opp, dead);
+    }
 
-        my_live |= extra;
-        opp_dead ^= extra;
+    const int all_qsteps = pop_count(x|o) + pop_count(dead);
+
+    if (all_qsteps == 0) {
+        return geometry->x_first_step;
+    }
+
+    if (all_qsteps == 3) {
+        return geometry->o_first_step;
+    }
+
+    const bb_t all = geometry->all;
+    const bb_t steps = me->cloud[side] & ((all ^ (my | opp)) | (opp & ~dead));
+    if (all_qsteps % 3 != 0) {
+        return steps;
+    }
+
+    if (steps == 0) {
+        return 0;
+    }
+
+    int qsteps = pop_count(steps);
+    if (qsteps >= 3) {
+        return steps;
     }
+
+    const bb_t dead2 = dead | (steps & opp);
+    const bb_t my2 = my | (steps & ~opp);
+    const bb_t cloud2 = extend_cloud(geometry, me->cloud[side], steps, opp & dead2);
+    const bb_t steps2 = cloud2 & ((all ^ (my2 | opp)) | (opp & ~dead2));
+    if (steps2 == 0) {
+        return 0;
+    }
+
+    qsteps += pop_count(steps2);
+    if (qsteps >= 3) {
+        return steps;
+    }
+
+    const bb_t dead3 = dead2 | (steps2 & opp);
+    const bb_t my3 = my2 | (steps2 & ~opp);
+    const bb_t cloud3 = extend_cloud(geometry, cloud2, steps2, opp & dead3);
+    const bb_t steps3 = cloud3 & ((all ^ (my3 | opp)) | (opp & ~dead3));
+    qsteps += pop_count(steps3);
+    return qsteps >= 3 ? steps : 0;
 }
 
+#ifdef MAKE_CHECK
+/* Full recalculation, it is used to check get_next_steps in tests. */
 static bb_t calc_next_steps(
     const struct state * const me)
 {
     const struct geometry * const geometry = me->geometry;
-    const int n = geometry->n;
-    const bb_t all = geometry->all;
-    const bb_t lside = geometry->lside;
-    const bb_t rside = geometry->rside;
-    const bb_t not_lside = all ^ lside;
-    const bb_t not_rside = all ^ rside;
-
     const bb_t dead = me->dead;
     const bb_t x = me->x;
     const bb_t o = me->o;
@@ -156,7 +327,7 @@ static bb_t calc_next_steps(
     const bb_t my = me->active == ACTIVE_X ? x : o;
     const bb_t opp = me->active == ACTIVE_X ? o : x;
 
-    const bb_t steps = next_steps(my, opp, dead, n, all, not_lside, not_rside);
+    const bb_t steps = geometry->next_steps(my, opp, dead);
     if (mod != 0) {
         return steps;
     }
@@ -174,7 +345,7 @@ static bb_t calc_next_steps(
     const bb_t expansion2 = steps ^ killed2;
     const bb_t dead2 = dead | killed2;
     const bb_t my2 = my | expansion2;
-    const bb_t steps2 = next_steps(my2, opp, dead2, n, all, not_lside, not_rside);
+    const bb_t steps2 = geometry->next_steps(my2, opp, dead2);
 
     if (steps2 == 0) {
         return 0;
@@ -189,16 +360,23 @@ static bb_t calc_next_steps(
     const bb_t expansion3 = steps2 ^ killed3;
     const bb_t dead3 = dead2 | killed3;
     const bb_t my3 = my2 | expansion3;
-    const bb_t steps3 = next_steps(my3, opp, dead3, n, all, not_lside, not_rside);
+    const bb_t steps3 = geometry->next_steps(my3, opp, dead3);
 
     qsteps += pop_count(steps3);
     return qsteps >= 3 ? steps : 0;
 }
+#endif
 
 int state_step(
     struct state * restrict const me,
     const int step)
 {
+    if (me->geometry->wide != NULL) {
+        const int status = wide_state_step(&me->wide, step);
+        me->active = me->wide.active;
+        return status;
+    }
+
     const bb_t bb = BB_SQUARE(step);
     const int bad = (bb & me->next) == 0;
     if (bad) {
@@ -208,10 +386,20 @@ int state_step(
     bb_t * restrict const my = me->active == ACTIVE_X ? &me->x : &me->o;
     bb_t * restrict const opp = me->active != ACTIVE_X ? &me->x : &me->o;
 
+    const struct geometry * const geometry = me->geometry;
+    bb_t * restrict const my_cloud = me->cloud + me->active - 1;
     if (bb & *opp) {
         me->dead |= bb;
+        me->hash ^= geometry->zobrist[ZOBRIST_DEAD][step];
+        me->stale |= 1 << ((me->active ^ 3) - 1);
+        /* The first O step might kill a stone out of the cloud. */
+        if (bb & *my_cloud) {
+            *my_cloud = extend_cloud(geometry, *my_cloud, bb, *opp & me->dead);
+        }
     } else {
         *my |= bb;
+        me->hash ^= geometry->zobrist[me->active][step];
+        *my_cloud = extend_cloud(geometry, *my_cloud, bb, *opp & me->dead);
     }
 
     const int qsteps = pop_count(*my|*opp) + pop_count(me->dead);
@@ -220,26 +408,34 @@ int state_step(
         me->active ^= 3;
     }
 
-    me->next = calc_next_steps(me);
+    me->next = get_next_steps(me);
+    CHECK_NEXT_STEPS(me);
     return 0;
 }
 
 static int unstep_bb(struct state * restrict const me, const int step)
 {
     const bb_t bb = BB_SQUARE(step);
+    const struct geometry * const geometry = me->geometry;
 
     if (bb & me->dead) {
         me->dead ^= bb;
+        me->hash ^= geometry->zobrist[ZOBRIST_DEAD][step];
+        me->stale = 3;
         return 0;
     }
 
     if (bb & me->x) {
         me->x ^= bb;
+        me->hash ^= geometry->zobrist[ACTIVE_X][step];
+        me->stale |= 1 << 0;
         return 0;
     }
 
     if (bb & me->o) {
         me->o ^= bb;
+        me->hash ^= geometry->zobrist[ACTIVE_O][step];
+        me->stale |= 1 << 1;
         return 0;
     }
 
@@ -248,6 +444,12 @@ static int unstep_bb(struct state * restrict const me, const int step)
 
 int state_unstep(struct state * restrict const me, const int step)
 {
+    if (me->geometry->wide != NULL) {
+        const int status = wide_state_unstep(&me->wide, step);
+        me->active = me->wide.active;
+        return status;
+    }
+
     const int status = unstep_bb(me, step);
     if (status != 0) {
         return status;
@@ -256,18 +458,374 @@ int state_unstep(struct state * restrict const me, const int step)
     const int qsteps = pop_count(me->x|me->o) + pop_count(me->dead);
     const int mod = (qsteps / 3) % 2;
     me->active = mod == 0 ? 1 : 2;
-    me->next = calc_next_steps(me);
+    me->next = get_next_steps(me);
+    CHECK_NEXT_STEPS(me);
     return 0;
 }
 
 
 
+/* Shifts of wide bitboards, 0 < c < 64. */
+static inline wbb_t wbb_lshift(const wbb_t bb, const int c)
+{
+    wbb_t result;
+    result.w[0] = bb.w[0] << c;
+    for (int i=1; i<WBB_WORDS; ++i) {
+        result.w[i] = bb.w[i] << c | bb.w[i-1] >> (64 - c);
+    }
+    return result;
+}
+
+static inline wbb_t wbb_rshift(const wbb_t bb, const int c)
+{
+    wbb_t result;
+    for (int i=0; i<WBB_WORDS-1; ++i) {
+        result.w[i] = bb.w[i] >> c | bb.w[i+1] << (64 - c);
+    }
+    result.w[WBB_WORDS-1] = bb.w[WBB_WORDS-1] >> c;
+    return result;
+}
+
+static inline wbb_t wide_grow(
+    const struct wide_geometry * const geometry,
+    const wbb_t bb)
+{
+    const wbb_t lbb = wbb_rshift(wbb_and(bb, geometry->not_lside), 1);
+    const wbb_t rbb = wbb_lshift(wbb_and(bb, geometry->not_rside), 1);
+    const wbb_t hgrow = wbb_or(bb, wbb_or(lbb, rbb));
+
+    const wbb_t ubb = wbb_and(wbb_lshift(hgrow, geometry->n), geometry->all);
+    const wbb_t dbb = wbb_rshift(hgrow, geometry->n);
+    return wbb_or(hgrow, wbb_or(ubb, dbb));
+}
+
+static wbb_t generic_wide_next_steps(
+    const struct wide_geometry * const geometry,
+    const wbb_t * const my,
+    const wbb_t * const opp,
+    const wbb_t * const dead)
+{
+    const wbb_t empty = wbb_xor(geometry->all, wbb_or(*my, *opp));
+    const wbb_t my_dead = wbb_and(*my, *dead);
+    wbb_t opp_dead = wbb_and(*opp, *dead);
+    wbb_t my_live = wbb_xor(*my, my_dead);
+    const wbb_t opp_live = wbb_xor(*opp, opp_dead);
+    const wbb_t place = wbb_or(empty, opp_live);
+
+    for (;;) {
+        const wbb_t cloud = wide_grow(geometry, my_live);
+        const wbb_t extra = wbb_and(cloud, opp_dead);
+        if (wbb_is_empty(extra)) {
+            return wbb_and(cloud, place);
+        }
+
+        my_live = wbb_or(my_live, extra);
+        opp_dead = wbb_xor(opp_dead, extra);
+    }
+}
+
+#ifdef HAS_X86_KERNELS
+
+/* Whole wide bitboard is one register, carries are moved with permutes. */
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_wbb_lshift(const __m256i bb, const __m128i c, const __m128i rc)
+{
+    const __m256i prev = _mm256_permute4x64_epi64(bb, _MM_SHUFFLE(2, 1, 0, 3));
+    const __m256i carry = _mm256_blend_epi32(prev, _mm256_setzero_si256(), 0x03);
+    return _mm256_or_si256(_mm256_sll_epi64(bb, c), _mm256_srl_epi64(carry, rc));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_wbb_rshift(const __m256i bb, const __m128i c, const __m128i rc)
+{
+    const __m256i next = _mm256_permute4x64_epi64(bb, _MM_SHUFFLE(0, 3, 2, 1));
+    const __m256i carry = _mm256_blend_epi32(next, _mm256_setzero_si256(), 0xC0);
+    return _mm256_or_si256(_mm256_srl_epi64(bb, c), _mm256_sll_epi64(carry, rc));
+}
+
+__attribute__((target("avx2")))
+static wbb_t avx2_wide_next_steps(
+    const struct wide_geometry * const geometry,
+    const wbb_t * const my,
+    const wbb_t * const opp,
+    const wbb_t * const dead)
+{
+    const __m128i one = _mm_cvtsi32_si128(1);
+    const __m128i r_one = _mm_cvtsi32_si128(63);
+    const __m128i n = _mm_cvtsi32_si128(geometry->n);
+    const __m128i rn = _mm_cvtsi32_si128(64 - geometry->n);
+    const __m256i all = _mm256_loadu_si256((const __m256i *)geometry->all.w);
+    const __m256i not_lside = _mm256_loadu_si256((const __m256i *)geometry->not_lside.w);
+    const __m256i not_rside = _mm256_loadu_si256((const __m256i *)geometry->not_rside.w);
+
+    const __m256i my_bb = _mm256_loadu_si256((const __m256i *)my->w);
+    const __m256i opp_bb = _mm256_loadu_si256((const __m256i *)opp->w);
+    const __m256i dead_bb = _mm256_loadu_si256((const __m256i *)dead->w);
+    const __m256i empty = _mm256_xor_si256(all, _mm256_or_si256(my_bb, opp_bb));
+    __m256i opp_dead = _mm256_and_si256(opp_bb, dead_bb);
+    __m256i my_live = _mm256_andnot_si256(dead_bb, my_bb);
+    const __m256i place = _mm256_or_si256(empty, _mm256_xor_si256(opp_bb, opp_dead));
+
+    for (;;) {
+        const __m256i lbb = avx2_wbb_rshift(_mm256_and_si256(my_live, not_lside), one, r_one);
+        const __m256i rbb = avx2_wbb_lshift(_mm256_and_si256(my_live, not_rside), one, r_one);
+        const __m256i hgrow = _mm256_or_si256(my_live, _mm256_or_si256(lbb, rbb));
+        const __m256i ubb = _mm256_and_si256(avx2_wbb_lshift(hgrow, n, rn), all);
+        const __m256i dbb = avx2_wbb_rshift(hgrow, n, rn);
+        const __m256i cloud = _mm256_or_si256(hgrow, _mm256_or_si256(ubb, dbb));
+
+        const __m256i extra = _mm256_and_si256(cloud, opp_dead);
+        if (_mm256_testz_si256(extra, extra)) {
+            wbb_t result;
+            _mm256_storeu_si256((__m256i *)result.w, _mm256_and_si256(cloud, place));
+            return result;
+        }
+
+        my_live = _mm256_or_si256(my_live, extra);
+        opp_dead = _mm256_xor_si256(opp_dead, extra);
+    }
+}
+
+#endif
+
+struct wide_geometry * create_wide_geometry(const int n)
+{
+    if (n <= 2 || n > MAX_WIDE_N) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct wide_geometry * restrict const me = malloc(sizeof(struct wide_geometry));
+    if (me == NULL) {
+        return NULL;
+    }
+
+    memset(me, 0, sizeof(struct wide_geometry));
+    const int qsquares = n * n;
+    for (int i=0; i<n; ++i) {
+        me->lside = wbb_or(me->lside, wbb_square(i * n));
+        me->rside = wbb_or(me->rside, wbb_square(i * n + n - 1));
+    }
+
+    for (int sq=0; sq<qsquares; ++sq) {
+        me->all = wbb_or(me->all, wbb_square(sq));
+    }
+
+    me->n = n;
+    me->not_lside = wbb_xor(me->all, me->lside);
+    me->not_rside = wbb_xor(me->all, me->rside);
+    me->x_first_step = wbb_square(0);
+    me->o_first_step = wbb_square(qsquares - 1);
+
+    me->next_steps = &generic_wide_next_steps;
+    #ifdef HAS_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            me->next_steps = &avx2_wide_next_steps;
+        }
+    #endif
+
+    return me;
+}
+
+void destroy_wide_geometry(struct wide_geometry * restrict const me)
+{
+    free(me);
+}
+
+void init_wide_state(
+    struct wide_state * restrict const me,
+    const struct wide_geometry * const geometry)
+{
+    memset(me, 0, sizeof(struct wide_state));
+    me->geometry = geometry;
+    me->active = ACTIVE_X;
+    me->next = geometry->x_first_step;
+}
+
+static inline void wbb_apply(
+    wbb_t * restrict const my,
+    const wbb_t * const opp,
+    wbb_t * restrict const dead,
+    const int sq)
+{
+    wbb_t * restrict const target = wbb_test(opp, sq) ? dead : my;
+    *target = wbb_or(*target, wbb_square(sq));
+}
+
+/* Same rules as calc_next_steps: a turn is played when all 3 steps are possible. */
+static wbb_t calc_wide_next_steps(const struct wide_state * const me)
+{
+    static const wbb_t none = { { 0, 0, 0, 0 } };
+    const struct wide_geometry * const geometry = me->geometry;
+    const int all_qsteps = wbb_pop_count(wbb_or(me->x, me->o)) + wbb_pop_count(me->dead);
+
+    if (all_qsteps == 0) {
+        return geometry->x_first_step;
+    }
+
+    if (all_qsteps == 3) {
+        return geometry->o_first_step;
+    }
+
+    const wbb_t * const opp = me->active == ACTIVE_X ? &me->o : &me->x;
+    wbb_t my = me->active == ACTIVE_X ? me->x : me->o;
+    wbb_t dead = me->dead;
+    const wbb_t steps = geometry->next_steps(geometry, &my, opp, &dead);
+    if (all_qsteps % 3 != 0) {
+        return steps;
+    }
+
+    /* Like calc_next_steps, whole next steps are applied to check the turn. */
+    int qsteps = wbb_pop_count(steps);
+    wbb_t new_steps = steps;
+    for (int i=0; i<2 && qsteps < 3; ++i) {
+        if (wbb_is_empty(new_steps)) {
+            return none;
+        }
+
+        const wbb_t killed = wbb_and(new_steps, *opp);
+        dead = wbb_or(dead, killed);
+        my = wbb_or(my, wbb_xor(new_steps, killed));
+        new_steps = geometry->next_steps(geometry, &my, opp, &dead);
+        qsteps += wbb_pop_count(new_steps);
+    }
+
+    return qsteps >= 3 ? steps : none;
+}
+
+int wide_state_step(
+    struct wide_state * restrict const me,
+    const int step)
+{
+    if (step < 0 || step >= 8 * (int)sizeof(wbb_t) || !wbb_test(&me->next, step)) {
+        return errno = EINVAL;
+    }
+
+    wbb_t * restrict const my = me->active == ACTIVE_X ? &me->x : &me->o;
+    const wbb_t * const opp = me->active != ACTIVE_X ? &me->x : &me->o;
+    wbb_apply(my, opp, &me->dead, step);
+
+    const int qsteps = wbb_pop_count(wbb_or(me->x, me->o)) + wbb_pop_count(me->dead);
+    if (qsteps % 3 == 0) {
+        me->active ^= 3;
+    }
+
+    me->next = calc_wide_next_steps(me);
+    return 0;
+}
+
+int wide_state_unstep(struct wide_state * restrict const me, const int step)
+{
+    if (step < 0 || step >= 8 * (int)sizeof(wbb_t)) {
+        return errno = EINVAL;
+    }
+
+    const wbb_t bb = wbb_square(step);
+    if (wbb_test(&me->dead, step)) {
+        me->dead = wbb_xor(me->dead, bb);
+    } else if (wbb_test(&me->x, step)) {
+        me->x = wbb_xor(me->x, bb);
+    } else if (wbb_test(&me->o, step)) {
+        me->o = wbb_xor(me->o, bb);
+    } else {
+        return errno = EINVAL;
+    }
+
+    const int qsteps = wbb_pop_count(wbb_or(me->x, me->o)) + wbb_pop_count(me->dead);
+    me->active = (qsteps / 3) % 2 == 0 ? ACTIVE_X : ACTIVE_O;
+    me->next = calc_wide_next_steps(me);
+    return 0;
+}
+
+int wide_rollout(
+    const struct wide_state * const state,
+    struct rng * restrict const rng,
+    uint32_t * restrict const qthink)
+{
+    const struct wide_geometry * const geometry = state->geometry;
+    const int n = geometry->n;
+    wbb_t x = state->x;
+    wbb_t o = state->o;
+    wbb_t dead = state->dead;
+    int all_qsteps = wbb_pop_count(wbb_or(x, o)) + wbb_pop_count(dead);
+
+    for (;;) {
+        ++*qthink;
+        const int is_x = (all_qsteps / 3) % 2 == 0;
+        wbb_t * restrict const my = is_x ? &x : &o;
+        const wbb_t * const opp = is_x ? &o : &x;
+        if (all_qsteps == 0 || all_qsteps == 3) {
+            wbb_apply(my, opp, &dead, all_qsteps == 0 ? 0 : n * n - 1);
+        } else {
+            const wbb_t steps = geometry->next_steps(geometry, my, opp, &dead);
+            const int qsteps = wbb_pop_count(steps);
+            if (qsteps == 0) {
+                return is_x ? ACTIVE_O : ACTIVE_X;
+            }
+
+            const int index = qsteps == 1 ? 0 : rng_uniform(rng, qsteps);
+            wbb_apply(my, opp, &dead, wbb_nth_one_index(steps, index));
+        }
+
+        ++all_qsteps;
+    }
+}
+
+
+
 #ifdef MAKE_CHECK
 
 #include "insider.h"
 
 #include <stdio.h>
 
+/* Reference implementation, the game uses geometry->next_steps. */
+static bb_t grow(
+    const bb_t bb,
+    const int n,
+    const bb_t all,
+    const bb_t not_lside,
+    const bb_t not_rside)
+{
+    const bb_t lbb = (bb & not_lside) >> 1;
+    const bb_t rbb = (bb & not_rside) << 1;
+    const bb_t hgrow = bb | lbb | rbb;
+
+    const bb_t ubb = lshift(hgrow, n) & all;
+    const bb_t dbb = rshift(hgrow, n);
+    return hgrow | ubb | dbb;
+}
+
+static bb_t next_steps(
+    const bb_t my,
+    const bb_t opp,
+    const bb_t dead,
+    const int n,
+    const bb_t all,
+    const bb_t not_lside,
+    const bb_t not_rside)
+{
+    const bb_t empty = all ^ (my | opp);
+    const bb_t my_dead = my & dead;
+    bb_t opp_dead = opp & dead;
+    bb_t my_live = my ^ my_dead;
+    const bb_t opp_live = opp ^ opp_dead;
+    const bb_t place = empty | opp_live;
+
+    for (;;) {
+        const bb_t cloud = grow(my_live, n, all, not_lside, not_rside);
+        const bb_t extra = cloud & opp_dead;
+        if (extra == 0) {
+            return cloud & place;
+        }
+
+        my_live |= extra;
+        opp_dead ^= extra;
+    }
+}
+
 #define  N  9
 
 enum square_placement
@@ -450,6 +1008,202 @@ int test_next_steps(void)
     return 0;
 }
 
+int test_std_next_steps(void)
+{
+    for (int n=3; n<=MAX_STD_N; ++n) {
+        struct geometry * restrict const geometry = create_std_geometry(n);
+        if (geometry == NULL) {
+            test_fail("create_std_geometry(%d) failed, errno = %d.", n, errno);
+        }
+
+        const bb_t all = geometry->all;
+        const bb_t not_lside = all ^ geometry->lside;
+        const bb_t not_rside = all ^ geometry->rside;
+        struct state * restrict const state = create_state(geometry);
+        if (state == NULL) {
+            test_fail("create_state(geometry) failed, errno = %d.", errno);
+        }
+
+        for (int game=0; game<20; ++game) {
+            init_state(state, geometry);
+            while (state_status(state) == 0) {
+                const bb_t x = state->x;
+                const bb_t o = state->o;
+                const bb_t dead = state->dead;
+                const bb_t x_steps = next_steps(x, o, dead, n, all, not_lside, not_rside);
+                const bb_t o_steps = next_steps(o, x, dead, n, all, not_lside, not_rside);
+                if (geometry->next_steps(x, o, dead) != x_steps || geometry->next_steps(o, x, dead) != o_steps) {
+                    test_fail("Specialised next_steps differs from generic one for n = %d.", n);
+                }
+
+                const bb_t steps = state_get_steps(state);
+                const int sq = nth_one_index(steps, rand() % pop_count(steps));
+                const int status = state_step(state, sq);
+                if (status != 0) {
+                    test_fail("state_step(state, %d) fails with code %d, %s.", sq, status, strerror(status));
+                }
+            }
+        }
+
+        destroy_state(state);
+        destroy_geometry(geometry);
+    }
+
+    return 0;
+}
+
+static wbb_t to_wbb(const bb_t bb)
+{
+    const wbb_t result = { { (uint64_t)bb, (uint64_t)(bb >> 64), 0, 0 } };
+    return result;
+}
+
+static int wbb_equal(const wbb_t a, const wbb_t b)
+{
+    return wbb_is_empty(wbb_xor(a, b));
+}
+
+static int wide_state_equal(const struct wide_state * const a, const struct wide_state * const b)
+{
+    return a->active == b->active && wbb_equal(a->x, b->x) && wbb_equal(a->o, b->o)
+        && wbb_equal(a->dead, b->dead) && wbb_equal(a->next, b->next);
+}
+
+static void check_wide_kernels(
+    const wide_next_steps_t * const kernels,
+    const struct wide_state * const state)
+{
+    const struct wide_geometry * const geometry = state->geometry;
+    const wbb_t x_steps = kernels[0](geometry, &state->x, &state->o, &state->dead);
+    const wbb_t o_steps = kernels[0](geometry, &state->o, &state->x, &state->dead);
+    if (kernels[1] == NULL) {
+        return;
+    }
+
+    if (!wbb_equal(kernels[1](geometry, &state->x, &state->o, &state->dead), x_steps)
+     || !wbb_equal(kernels[1](geometry, &state->o, &state->x, &state->dead), o_steps)) {
+        test_fail("AVX2 wide next_steps differs from generic one for n = %d.", geometry->n);
+    }
+}
+
+int test_wide_board(void)
+{
+    if (create_wide_geometry(MAX_WIDE_N + 1) != NULL) {
+        test_fail("create_wide_geometry(%d) is expected to fail.", MAX_WIDE_N + 1);
+    }
+
+    wide_next_steps_t kernels[2] = { &generic_wide_next_steps, NULL };
+    #ifdef HAS_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            kernels[1] = &avx2_wide_next_steps;
+        }
+    #endif
+
+    /* Wide boards play the same games as bb_t ones. */
+    for (int n=3; n<=MAX_STD_N; ++n) {
+        struct geometry * restrict const geometry = create_std_geometry(n);
+        struct wide_geometry * restrict const wide_geometry = create_wide_geometry(n);
+        if (geometry == NULL || wide_geometry == NULL) {
+            test_fail("Cannot create geometries for n = %d, errno = %d.", n, errno);
+        }
+
+        struct state state;
+        struct wide_state wide;
+        for (int game=0; game<10; ++game) {
+            init_state(&state, geometry);
+            init_wide_state(&wide, wide_geometry);
+            for (;;) {
+                if (wide.active != state.active || !wbb_equal(wide.next, to_wbb(state.next))) {
+                    test_fail("Wide state differs from state for n = %d.", n);
+                }
+
+                const wbb_t x_steps = to_wbb(geometry->next_steps(state.x, state.o, state.dead));
+                const wbb_t o_steps = to_wbb(geometry->next_steps(state.o, state.x, state.dead));
+                if (!wbb_equal(kernels[0](wide_geometry, &wide.x, &wide.o, &wide.dead), x_steps)
+                 || !wbb_equal(kernels[0](wide_geometry, &wide.o, &wide.x, &wide.dead), o_steps)) {
+                    test_fail("Wide next_steps differs from next_steps for n = %d.", n);
+                }
+                check_wide_kernels(kernels, &wide);
+
+                if (state_status(&state) != 0) {
+                    break;
+                }
+
+                const bb_t steps = state_get_steps(&state);
+                const int sq = nth_one_index(steps, rand() % pop_count(steps));
+                if (state_step(&state, sq) != 0 || wide_state_step(&wide, sq) != 0) {
+                    test_fail("Step %d fails for n = %d.", sq, n);
+                }
+            }
+
+            if (wide_state_status(&wide) != state_status(&state)) {
+                test_fail("Wide state status %d differs from %d for n = %d.",
+                    wide_state_status(&wide), state_status(&state), n);
+            }
+        }
+
+        destroy_wide_geometry(wide_geometry);
+        destroy_geometry(geometry);
+    }
+
+    /* Bigger boards: games end, unsteps restore positions, rollouts finish. */
+    for (int n=MAX_STD_N+1; n<=MAX_WIDE_N; ++n) {
+        struct wide_geometry * restrict const geometry = create_wide_geometry(n);
+        if (geometry == NULL) {
+            test_fail("create_wide_geometry(%d) failed, errno = %d.", n, errno);
+        }
+
+        struct wide_state history[2*n*n];
+        int steps[2*n*n];
+        for (int game=0; game<4; ++game) {
+            struct wide_state state;
+            init_wide_state(&state, geometry);
+            int qsteps = 0;
+            while (wide_state_status(&state) == 0) {
+                if (qsteps >= 2*n*n) {
+                    test_fail("Too long game for n = %d.", n);
+                }
+
+                check_wide_kernels(kernels, &state);
+                history[qsteps] = state;
+                const int qnext = wbb_pop_count(state.next);
+                const int sq = wbb_nth_one_index(state.next, rand() % qnext);
+                if (wide_state_step(&state, sq) != 0) {
+                    test_fail("wide_state_step(%d) fails for n = %d.", sq, n);
+                }
+                steps[qsteps++] = sq;
+            }
+
+            if (qsteps < 4 || (wide_state_status(&state) != ACTIVE_X && wide_state_status(&state) != ACTIVE_O)) {
+                test_fail("Unexpected end of the game after %d steps for n = %d.", qsteps, n);
+            }
+
+            while (qsteps > 0) {
+                --qsteps;
+                if (wide_state_unstep(&state, steps[qsteps]) != 0) {
+                    test_fail("wide_state_unstep(%d) fails for n = %d.", steps[qsteps], n);
+                }
+                if (!wide_state_equal(&state, history + qsteps)) {
+                    test_fail("wide_state_unstep(%d) does not restore the position for n = %d.", steps[qsteps], n);
+                }
+            }
+
+            struct rng rng;
+            rng_seed(&rng, 1000 * n + game, 0);
+            uint32_t qthink = 0;
+            const int winner = wide_rollout(&state, &rng, &qthink);
+            if ((winner != ACTIVE_X && winner != ACTIVE_O) || qthink < 4) {
+                test_fail("wide_rollout returns %d after %u steps for n = %d.", winner, qthink, n);
+            }
+        }
+
+        destroy_wide_geometry(geometry);
+    }
+
+    return 0;
+}
+
 struct calc_next_steps_data
 {
     const char * title;
@@ -992,4 +1746,157 @@ int test_unstep(void)
     return 0;
 }
 
+int test_hash(void)
+{
+    struct geometry * restrict const geometry = create_std_geometry(N);
+    if (geometry == NULL) {
+        test_fail("create_std_geometry(%d) failed, errno = %d.", N, errno);
+    }
+
+    struct state * restrict const me = create_state(geometry);
+    if (me == NULL) {
+        test_fail("create_state(geometry) failed, errno = %d.", errno);
+    }
+
+    for (int igame=0; igame<100; ++igame) {
+        uint64_t hashes[2*N*N];
+        int game[2*N*N];
+        int qhistory = 0;
+
+        init_state(me, geometry);
+        for (;;) {
+            const uint64_t expected = calc_hash(geometry, me->x, me->o, me->dead);
+            if (me->hash != expected) {
+                test_fail("Incremental hash %016lx differs from calculated %016lx on step %d.",
+                    me->hash, expected, qhistory);
+            }
+
+            const bb_t steps = state_get_steps(me);
+            if (steps == 0) {
+                break;
+            }
+
+            const int qsteps = pop_count(steps);
+            const int sq = nth_one_index(steps, rand() % qsteps);
+            hashes[qhistory] = me->hash;
+            game[qhistory] = sq;
+            ++qhistory;
+
+            const int status = state_step(me, sq);
+            if (status != 0) {
+                test_fail("state_step(%d) failed, status %d.", sq, status);
+            }
+        }
+
+        while (qhistory > 0) {
+            --qhistory;
+            const int status = state_unstep(me, game[qhistory]);
+            if (status != 0) {
+                test_fail("state_unstep(%d) failed, status %d.", game[qhistory], status);
+            }
+
+            if (me->hash != hashes[qhistory]) {
+                test_fail("Hash is not restored after unstep on step %d.", qhistory);
+            }
+        }
+    }
+
+    destroy_state(me);
+    destroy_geometry(geometry);
+    return 0;
+}
+
+static void check_next_steps(const struct state * const me)
+{
+    const bb_t expected = calc_next_steps(me);
+    if (me->next != expected) {
+        test_fail("Incremental next steps differ from calculated ones, x = %016lx%016lx, o = %016lx%016lx, dead = %016lx%016lx.",
+            (uint64_t)(me->x >> 64), (uint64_t)me->x,
+            (uint64_t)(me->o >> 64), (uint64_t)me->o,
+            (uint64_t)(me->dead >> 64), (uint64_t)me->dead);
+    }
+}
+
+static void check_cloud(const struct state * const me, const int step)
+{
+    const struct geometry * const geometry = me->geometry;
+    const int n = geometry->n;
+    const bb_t all = geometry->all;
+    const bb_t not_lside = all ^ geometry->lside;
+    const bb_t not_rside = all ^ geometry->rside;
+
+    for (int side=0; side<2; ++side) {
+        const bb_t my = side == 0 ? me->x : me->o;
+        const bb_t opp = side == 0 ? me->o : me->x;
+        const bb_t chain = opp & me->dead;
+        bb_t reach = my & ~me->dead;
+        for (;;) {
+            const bb_t extra = grow(reach, n, all, not_lside, not_rside) & chain & ~reach;
+            if (extra == 0) {
+                break;
+            }
+            reach |= extra;
+        }
+
+        const int is_stale = (me->stale & (1 << side)) != 0;
+        if (!is_stale && me->cloud[side] != grow(reach, n, all, not_lside, not_rside)) {
+            test_fail("Incremental cloud differs from calculated one on step %d, n = %d.", step, n);
+        }
+    }
+}
+
+int test_incremental_steps(void)
+{
+    for (int n=3; n<=MAX_STD_N; ++n) {
+        struct geometry * restrict const geometry = create_std_geometry(n);
+        if (geometry == NULL) {
+            test_fail("create_std_geometry(%d) failed, errno = %d.", n, errno);
+        }
+
+        struct state * restrict const me = create_state(geometry);
+        if (me == NULL) {
+            test_fail("create_state(geometry) failed, errno = %d.", errno);
+        }
+
+        for (int igame=0; igame<50; ++igame) {
+            int game[2*MAX_STD_N*MAX_STD_N];
+            int qhistory = 0;
+
+            init_state(me, geometry);
+            for (;;) {
+                check_cloud(me, qhistory);
+                const bb_t steps = state_get_steps(me);
+                if (steps == 0) {
+                    break;
+                }
+
+                if (qhistory > 0 && rand() % 8 == 0) {
+                    const int qunsteps = 1 + rand() % (qhistory < 3 ? qhistory : 3);
+                    for (int i=0; i<qunsteps; ++i) {
+                        --qhistory;
+                        const int status = state_unstep(me, game[qhistory]);
+                        if (status != 0) {
+                            test_fail("state_unstep(%d) failed, status %d.", game[qhistory], status);
+                        }
+                        check_cloud(me, qhistory);
+                    }
+                    continue;
+                }
+
+                const int sq = nth_one_index(steps, rand() % pop_count(steps));
+                game[qhistory++] = sq;
+                const int status = state_step(me, sq);
+                if (status != 0) {
+                    test_fail("state_step(%d) failed, status %d.", sq, status);
+                }
+            }
+        }
+
+        destroy_state(me);
+        destroy_geometry(geometry);
+    }
+
+    return 0;
+}
+
 #endif
@@ -2,9 +2,12 @@
 #include "virus-war.h"
 #include "parser.h"
 
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 #define FILE_CHARS "abcdefghiklmnoprst"
 
@@ -23,6 +26,10 @@
 #define KW_SCORE           13
 #define KW_STEPS           14
 #define KW_DEBUG           15
+#define KW_STOP            16
+#define KW_ISREADY         17
+
+#define DEF_INFO_PERIOD_MS   1000
 
 #define ITEM(name) { #name, KW_##name }
 struct keyword_desc keywords[] = {
@@ -42,6 +49,8 @@ struct keyword_desc keywords[] = {
     ITEM(SCORE),
     ITEM(STEPS),
     ITEM(DEBUG),
+    ITEM(STOP),
+    ITEM(ISREADY),
     { NULL, 0 }
 };
 
@@ -75,6 +84,18 @@ struct cmd_parser
     struct ai * ai;
     struct ai ai_storage;
     const struct ai_desc * ai_desc;
+
+    /*
+     * AI GO runs in the search thread, so STOP, ISREADY and PING are
+     * processed during the search. Any other command waits for the result.
+     */
+    pthread_t search_thread;
+    int is_searching;
+    int is_search_done;
+    int search_status;
+    unsigned int search_flags;
+    uint64_t search_start;
+    int info_period;
 };
 
 
@@ -113,6 +134,8 @@ int init_cmd_parser(struct cmd_parser * restrict const me)
     me->state = NULL;
 
     me->ai = NULL;
+    me->is_searching = 0;
+    me->info_period = DEF_INFO_PERIOD_MS;
 
     me->tracker = create_keyword_tracker(keywords, KW_TRACKER__IGNORE_CASE);
     if (me->tracker == NULL) {
@@ -120,7 +143,7 @@ int init_cmd_parser(struct cmd_parser * restrict const me)
         return ENOMEM;
     }
 
-    me->geometry = create_std_geometry(me->n);
+    me->geometry = create_geometry(me->n);
     if (me->geometry == NULL) {
         free_cmd_parser(me);
         return ENOMEM;
@@ -172,9 +195,9 @@ void new_game(struct cmd_parser * restrict const me, const int n)
     const int new_geometry = n != me->geometry->n;
 
     if (new_geometry) {
-        struct geometry * restrict const geometry = create_std_geometry(n);
+        struct geometry * restrict const geometry = create_geometry(n);
         if (geometry == NULL) {
-            fprintf(stderr, "Error: create_std_geometry fails with code %d: %s\n", errno, strerror(errno));
+            fprintf(stderr, "Error: create_geometry fails with code %d: %s\n", errno, strerror(errno));
             return;
         }
 
@@ -211,16 +234,14 @@ void new_game(struct cmd_parser * restrict const me, const int n)
 
 void print_steps(const struct state * const me)
 {
-    const bb_t steps = state_get_steps(me);
-    if (steps == 0) {
+    if (state_qnext(me) == 0) {
         return;
     }
 
     const char * separator = "";
     const int n = me->geometry->n;
     for (int sq=0; sq<n*n; ++sq) {
-        const bb_t bb = BB_SQUARE(sq);
-        if (bb & steps) {
+        if (state_is_next(me, sq)) {
             const int rank = sq / n;
             const int file = sq % n;
             printf("%s%c%d", separator, FILE_CHARS[file], rank+1);
@@ -379,7 +400,10 @@ int ai_play(
         me->history[me->qhistory++] = step;
 
         if (flags) {
+            flockfile(stdout);
             explain_step(step, n, flags, &explanation);
+            fflush(stdout);
+            funlockfile(stdout);
         }
 
         if (state->active != active) {
@@ -392,32 +416,29 @@ int ai_play(
     }
 }
 
-void ai_go(
-    struct cmd_parser * restrict const me,
-    const unsigned int flags)
+static uint64_t get_time_ms(void)
 {
-    if (state_status(me->state) != 0) {
-        fprintf(stderr, "Game over, no moves possible.\n");
-        return;
-    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    struct ai * restrict const ai = me->ai;
-    if (ai == NULL) {
-        fprintf(stderr, "No AI set, use “set ai [name]” command before.\n");
-        return;
-    }
+static void * search_thread(void * arg)
+{
+    struct cmd_parser * restrict const me = arg;
 
     struct state backup = *me->state;
     const int saved_qhistory = me->qhistory;
-    const int status = ai_play(me, flags);
+    const int status = ai_play(me, me->search_flags);
     if (status != 0){
         *me->state = backup;
         me->qhistory = saved_qhistory;
-        ai->free(ai);
-        me->ai = NULL;
-        return;
+        me->search_status = status;
+        __atomic_store_n(&me->is_search_done, 1, __ATOMIC_RELEASE);
+        return NULL;
     }
 
+    flockfile(stdout);
     const int n = me->n;
     const int * step_ptr = me->history + saved_qhistory;
     const int * const end = me->history + me->qhistory;
@@ -430,6 +451,157 @@ void ai_go(
         separator = " ";
     }
     printf("\n");
+    fflush(stdout);
+    funlockfile(stdout);
+
+    __atomic_store_n(&me->is_search_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void wait_search(struct cmd_parser * restrict const me)
+{
+    if (!me->is_searching) {
+        return;
+    }
+
+    pthread_join(me->search_thread, NULL);
+    me->is_searching = 0;
+
+    if (me->search_status != 0) {
+        me->ai->free(me->ai);
+        me->ai = NULL;
+    }
+}
+
+static void stop_search(struct cmd_parser * restrict const me)
+{
+    if (!me->is_searching) {
+        return;
+    }
+
+    me->ai->set_stop(me->ai, 1);
+    wait_search(me);
+}
+
+static void print_info(const struct cmd_parser * const me)
+{
+    struct ai_progress progress;
+    me->ai->get_progress(me->ai, &progress);
+
+    const uint64_t elapsed = get_time_ms() - me->search_start;
+    const uint64_t nps = elapsed > 0 ? 1000 * progress.qthink / elapsed : 0;
+
+    flockfile(stdout);
+    printf("info time %lu.%03lu playouts %lu qthink %lu nps %lu memory %luM",
+        elapsed / 1000, elapsed % 1000, progress.qplayouts, progress.qthink, nps,
+        (unsigned long)(progress.memory >> 20));
+
+    if (progress.score >= 0.0 && progress.score <= 1.0) {
+        printf(" score %.1f%%", 100.0 * progress.score);
+    }
+
+    if (progress.qpv > 0) {
+        const int n = me->n;
+        printf(" pv");
+        for (unsigned int i=0; i<progress.qpv; ++i) {
+            const int sq = progress.pv[i];
+            const int rank = sq / n;
+            const int file = sq % n;
+            printf(" %c%d", FILE_CHARS[file], rank+1);
+        }
+    }
+
+    printf("\n");
+    fflush(stdout);
+    funlockfile(stdout);
+}
+
+/*
+ * Print info lines until the input is available or the search is over.
+ * The AI is only polled here, so the search loop is not slowed down.
+ */
+static void wait_input(struct cmd_parser * restrict const me)
+{
+    struct pollfd fds = { .fd = STDIN_FILENO, .events = POLLIN };
+    const int period = me->info_period;
+    uint64_t next_info = me->search_start + period;
+
+    while (me->is_searching) {
+        if (__atomic_load_n(&me->is_search_done, __ATOMIC_ACQUIRE)) {
+            wait_search(me);
+            return;
+        }
+
+        if (period == 0) {
+            poll(&fds, 1, -1);
+            return;
+        }
+
+        const uint64_t now = get_time_ms();
+        if (now >= next_info) {
+            print_info(me);
+            next_info = now + period;
+        }
+
+        const int timeout = next_info - now;
+        const int status = poll(&fds, 1, timeout);
+        if (status != 0) {
+            return;
+        }
+    }
+}
+
+void ai_go(
+    struct cmd_parser * restrict const me,
+    const unsigned int flags)
+{
+    if (state_status(me->state) != 0) {
+        fprintf(stderr, "Game over, no moves possible.\n");
+        return;
+    }
+
+    struct ai * restrict const ai = me->ai;
+    if (ai == NULL) {
+        fprintf(stderr, "No AI set, use “set ai [name]” command before.\n");
+        return;
+    }
+
+    ai->set_stop(ai, 0);
+    me->search_flags = flags;
+    me->search_status = 0;
+    me->is_search_done = 0;
+    me->search_start = get_time_ms();
+
+    const int status = pthread_create(&me->search_thread, NULL, search_thread, me);
+    if (status != 0) {
+        fprintf(stderr, "Error: pthread_create fails with code %d: %s\n", status, strerror(status));
+        return;
+    }
+
+    me->is_searching = 1;
+}
+
+void process_stop(struct cmd_parser * restrict const me)
+{
+    struct line_parser * restrict const lp = &me->line_parser;
+    if (!parser_check_eol(lp)) {
+        error(lp, "End of line expected (STOP command is parsed), but someting was found.");
+        return;
+    }
+
+    stop_search(me);
+}
+
+void process_isready(struct cmd_parser * restrict const me)
+{
+    struct line_parser * restrict const lp = &me->line_parser;
+    if (!parser_check_eol(lp)) {
+        error(lp, "End of line expected (ISREADY command is parsed), but someting was found.");
+        return;
+    }
+
+    printf("readyok\n");
+    fflush(stdout);
 }
 
 int process_quit(struct cmd_parser * restrict const me)
@@ -442,11 +614,33 @@ int process_quit(struct cmd_parser * restrict const me)
     return 1;
 }
 
+/* AI generator follows SRAND when the AI has “rng_seed” parameter. */
+static void seed_ai(struct cmd_parser * restrict const me, const uint32_t seed)
+{
+    struct ai * restrict const ai = me->ai;
+    if (ai == NULL) {
+        return;
+    }
+
+    const struct ai_param * param = ai->get_params(ai);
+    for (; param->name != NULL; ++param) {
+        if (strcmp(param->name, "rng_seed") == 0) {
+            const int status = ai->set_param(ai, param->name, &seed);
+            if (status != 0) {
+                fprintf(stderr, "%s\n", ai->error);
+            }
+            return;
+        }
+    }
+}
+
 void process_srand(struct cmd_parser * restrict const me)
 {
     struct line_parser * restrict const lp = &me->line_parser;
     if (parser_check_eol(lp)) {
-        srand(time(NULL));
+        const unsigned int seed = time(NULL);
+        srand(seed);
+        seed_ai(me, seed);
         return;
     }
 
@@ -458,6 +652,7 @@ void process_srand(struct cmd_parser * restrict const me)
     }
 
     srand((unsigned int)value);
+    seed_ai(me, (unsigned int)value);
 }
 
 void process_new(struct cmd_parser * restrict const me)
@@ -470,7 +665,7 @@ void process_new(struct cmd_parser * restrict const me)
         const unsigned char * const lexem = lp->lexem_start;
         const int status = parser_read_last_int(lp, &n);
         if (status != 0) {
-            error(lp, "Board size (integer constant in range 3..11) or EOL expected in NEW command.");
+            error(lp, "Board size (integer constant in range 3..16) or EOL expected in NEW command.");
             return;
         }
 
@@ -480,9 +675,9 @@ void process_new(struct cmd_parser * restrict const me)
             return;
         }
 
-        if (n > 11) {
+        if (n > MAX_WIDE_N) {
             lp->lexem_start = lexem;
-            error(lp, "Board size too large, maximum value is 11.");
+            error(lp, "Board size too large, maximum value is 16.");
             return;
         }
     }
@@ -532,7 +727,7 @@ void process_status(struct cmd_parser * restrict const me)
 
     printf("%*s%*s %s\n", indent, "", param_len, "Active:", active_str(state));
 
-    const int qsteps = pop_count(state->x | state->o) + pop_count(state->dead);
+    const int qsteps = state_qstones(state) + state_qdead(state);
     const int move_num = (qsteps / 6) + 1;
     const int step_num = (qsteps % 3) + 1;
     printf("%*s%*s move %d, step %d\n", indent, "", param_len, "Move:", move_num, step_num);
@@ -541,15 +736,13 @@ void process_status(struct cmd_parser * restrict const me)
 
     printf("%*s%*s\n", indent, "", param_len, "Board:");
 
-    bb_t steps = state_get_steps(state);
     const int n = me->n;
     for (int rank = n-1; rank >= 0; --rank) {
         printf("%*s%2d | ", 2*indent, "", rank+1);
         int is_green = 0;
         for (int file = 0; file < n; ++file) {
             const int bit_index = n * rank + file;
-            const bb_t bb = BB_SQUARE(bit_index);
-            if (bb & steps) {
+            if (state_is_next(state, bit_index)) {
                 if (!is_green) {
                     printf("\033[0;32m");
                     is_green = 1;
@@ -560,9 +753,10 @@ void process_status(struct cmd_parser * restrict const me)
                     is_green = 0;
                 }
             }
-            const int is_x = (bb & state->x) != 0;
-            const int is_o = (bb & state->o) != 0;
-            const int is_dead = (bb & state->dead) != 0;
+            const int content = state_get_square(state, bit_index);
+            const int is_x = (content & ACTIVE_X) != 0;
+            const int is_o = (content & ACTIVE_O) != 0;
+            const int is_dead = (content & DEAD_STONE) != 0;
             printf("%c", get_ch(is_x, is_o, is_dead));
         }
         if (is_green) {
@@ -849,6 +1043,33 @@ void process_set_ai(struct cmd_parser * restrict const me)
     error(lp, "AI not found.");
 }
 
+void process_set_info(struct cmd_parser * restrict const me)
+{
+    struct line_parser * restrict const lp = &me->line_parser;
+    parser_skip_spaces(lp);
+
+    if (parser_check_eol(lp)) {
+        printf("%d\n", me->info_period);
+        return;
+    }
+
+    int value;
+    const unsigned char * const lexem = lp->current;
+    const int status = parser_read_last_int(lp, &value);
+    if (status != 0) {
+        error(lp, "Info period in milliseconds expected.");
+        return;
+    }
+
+    if (value < 0) {
+        lp->lexem_start = lexem;
+        error(lp, "Info period might be positive or zero.");
+        return;
+    }
+
+    me->info_period = value;
+}
+
 void process_set(struct cmd_parser * restrict const me)
 {
     struct line_parser * restrict const lp = &me->line_parser;
@@ -862,6 +1083,8 @@ void process_set(struct cmd_parser * restrict const me)
     switch (keyword) {
         case KW_AI:
             return process_set_ai(me);
+        case KW_INFO:
+            return process_set_info(me);
     }
 
     error(lp, "Invalid option name in SET command.");
@@ -1007,9 +1230,14 @@ int process_cmd(struct cmd_parser * restrict const me, const char * const line)
     }
 
     if (keyword == KW_QUIT) {
+        stop_search(me);
         return process_quit(me);
     }
 
+    if (keyword != KW_PING && keyword != KW_ISREADY && keyword != KW_STOP) {
+        wait_search(me);
+    }
+
     switch (keyword) {
         case KW_PING:
             printf("pong%s", lp->current);
@@ -1040,6 +1268,12 @@ int process_cmd(struct cmd_parser * restrict const me, const char * const line)
         case KW_DEBUG:
             process_debug(me);
             break;
+        case KW_STOP:
+            process_stop(me);
+            break;
+        case KW_ISREADY:
+            process_isready(me);
+            break;
         default:
             error(lp, "Unexpected keyword at the begginning of the line.");
             break;
@@ -1048,17 +1282,98 @@ int process_cmd(struct cmd_parser * restrict const me, const char * const line)
     return 0;
 }
 
+/*
+ * Standard input is read with read(2) into our own buffer instead of stdio,
+ * so no complete line waits in a stdio buffer while wait_input polls fd.
+ */
+struct input_buffer
+{
+    char * data;
+    size_t len;
+    size_t capacity;
+    char * line;
+    int is_eof;
+};
+
+#define INPUT_CHUNK_SZ 4096
+
+/* Read available input, it blocks only when nothing is available. */
+static int read_input(struct input_buffer * restrict const me)
+{
+    if (me->capacity - me->len < INPUT_CHUNK_SZ) {
+        const size_t capacity = me->capacity + INPUT_CHUNK_SZ;
+        char * restrict const data = realloc(me->data, capacity);
+        if (data == NULL) {
+            return ENOMEM;
+        }
+        me->data = data;
+
+        /* A line never exceeds the buffer, so it fits with its '\0'. */
+        char * restrict const line = realloc(me->line, capacity + 1);
+        if (line == NULL) {
+            return ENOMEM;
+        }
+        me->line = line;
+        me->capacity = capacity;
+    }
+
+    const ssize_t has_read = read(STDIN_FILENO, me->data + me->len, me->capacity - me->len);
+    if (has_read > 0) {
+        me->len += has_read;
+        return 0;
+    }
+
+    if (has_read == 0) {
+        me->is_eof = 1;
+        return 0;
+    }
+
+    return errno == EINTR ? 0 : errno;
+}
+
+/*
+ * Returns the next complete line with its '\n' like getline does, the last
+ * line without '\n' is returned at EOF. NULL means more input is needed.
+ */
+static const char * take_line(struct input_buffer * restrict const me)
+{
+    if (me->len == 0) {
+        return NULL;
+    }
+
+    const char * const eol = memchr(me->data, '\n', me->len);
+    if (eol == NULL && !me->is_eof) {
+        return NULL;
+    }
+
+    const size_t line_len = eol != NULL ? eol - me->data + 1 : me->len;
+    memcpy(me->line, me->data, line_len);
+    me->line[line_len] = '\0';
+    me->len -= line_len;
+    memmove(me->data, me->data + line_len, me->len);
+    return me->line;
+}
+
 int main()
 {
     struct cmd_parser cmd_parser;
     init_cmd_parser(&cmd_parser);
 
-    char * line = 0;
-    size_t len = 0;
+    struct input_buffer input = { 0 };
     for (;; ) {
-        const ssize_t has_read = getline(&line, &len, stdin);
-        if (has_read == -1) {
-            break;
+        const char * const line = take_line(&input);
+        if (line == NULL) {
+            if (input.is_eof) {
+                break;
+            }
+
+            wait_input(&cmd_parser);
+            const int status = read_input(&input);
+            if (status != 0) {
+                fprintf(stderr, "Error: reading input fails with code %d: %s\n", status, strerror(status));
+                break;
+            }
+            continue;
         }
 
         const int is_quit = process_cmd(&cmd_parser, line);
@@ -1067,11 +1382,11 @@ int main()
         }
     }
 
+    /* No command follows EOF, so the search is stopped instead of waited. */
+    stop_search(&cmd_parser);
     free_cmd_parser(&cmd_parser);
 
-    if (line) {
-        free(line);
-    }
-
+    free(input.data);
+    free(input.line);
     return 0;
 }
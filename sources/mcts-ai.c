@@ -1,49 +1,219 @@
 #include "virus-war.h"
 
+#include <fcntl.h>
 #include <math.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
-#define QMATRIXES   6
-#define MAX_BLOCKS  (64)
-#define BLOCK_SZ    (1024*1024)
-
-#define TERMINAL_MARK  0xFFFF
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAS_X86_KERNELS
+#endif
 
-static const float        def_C      = 1.4;
-static const uint32_t     def_qthink = 6 * 1024 * 1024;
+#define QMATRIXES   6
+#define QNN_STEPS   (QMATRIXES/2)
+#define QCODES      5
+
+#define NN_INT32    0
+#define NN_INT16    1
+#define NN_INT8     2
+
+#define NN_BINARY_MAGIC      "VWARNN\r\n"
+#define NN_BINARY_VERSION    1
+#define NN_LAYOUT_INT32_T    1  /* int32 matrixes and transposed layer1 */
+#define NN_BINARY_ALIGN    128
+#define QNN_SECTIONS       (QMATRIXES + QNN_STEPS)
+#define BLOCK_SZ    (1024*1024)   /* so memory_mb is the number of blocks */
+#define MIN_MEMORY_MB    4
+#define MAX_MEMORY_MB   (64*1024)  /* node indexes are 32 bit */
+
+#define TERMINAL_MARK   0xFFFF
+#define EXPANDING_MARK  0xFFFE
+
+#define MAX_THREADS  64
+#define MAX_LANES    16
+
+#define PARALLEL_TREE  0
+#define PARALLEL_ROOT  1
+
+#define TREE_STEP  0
+#define TREE_TURN  1
+
+#define NODE_TYPE       0
+#define TURN_NODE_TYPE  1
+#define QNODE_TYPES     2
+
+static const float        def_C       = 1.4;
+static const uint32_t     def_qthink  = 6 * 1024 * 1024;
+static const uint32_t     def_threads = 1;
+static const uint32_t     def_time    = 0;
+static const uint32_t     def_endgame = 24;
+static const uint32_t     def_memory  = 64;
+static const uint32_t     def_seed    = 1;
+static const uint32_t     def_leaf_rollouts = 0;
 
 #define ONE_GAME_COST   100
 #define SCORE_FACTOR (1/(float)ONE_GAME_COST)
+#define VIRTUAL_LOSS    ONE_GAME_COST
 
 #define INT_POWER     10
 #define INT_FACTOR    ((float)(1 << INT_POWER))
 #define FLOAT_FACTOR  (1.0/INT_FACTOR)
 
 #define BEST_QSTEPS   4
+#define BEST_QTURNS  16
 
-#define QPARAMS                 3
+#define UBC_TABLE_SZ  4096
+
+#define TT_BITS       18
+#define TT_SIZE       (1 << TT_BITS)
+#define TT_MASK       (TT_SIZE - 1)
+
+#define NS_IN_MS              1000000ull
+#define MIN_MOVES_TO_GO             4
+#define TIME_CHECK_PERIOD          16
+
+#define QPARAMS                17
 #define MAX_PATH             4096
 #define MAX_ERROR_MSG_LEN    1024
+#define MAX_MODE_LEN           16
 
 typedef int32_t nn_value_t;
 
+static inline uint64_t get_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * The step square and node flags share one 16 bit word: the low SQUARE_BITS
+ * hold the square (all 256 squares of a 16x16 board and NO_SQUARE), flags are
+ * above them, so the node stays 16 bytes long.
+ *
+ * MCTS-Solver proofs are stored in node flags, they are given for the side
+ * which made the step (or the turn) into the node. PARTIAL_NODE is set when
+ * not all steps are expanded, so losses of all children prove nothing.
+ */
+#define SQUARE_BITS    9
+#define SQUARE_MASK    ((1 << SQUARE_BITS) - 1)
+#define NO_SQUARE      SQUARE_MASK
+
+#define PROVEN_WIN     (1 << SQUARE_BITS)
+#define PROVEN_LOSS    (2 << SQUARE_BITS)
+#define PROOF_MASK     (PROVEN_WIN | PROVEN_LOSS)
+#define PARTIAL_NODE   (4 << SQUARE_BITS)
+#define GC_MARK        (8 << SQUARE_BITS)  /* used only during garbage collection */
+
 struct node
 {
-    int16_t square;
+    uint16_t square_flags;
     uint16_t qchildren;
     int32_t score;
     int32_t qgames;
     uint32_t children;
 };
 
+static inline int get_square(const struct node * const node)
+{
+    return node->square_flags & SQUARE_MASK;
+}
+
+/*
+ * Item of the turn tree (tree_mode=turn), every edge is a whole turn. A list
+ * of q children takes q items: q node stats are followed by q moves, so the
+ * selection walks packed stats as in the step tree and a move is read only on
+ * descent. The move is a bitboard of all steps of the turn, square is not
+ * used. The root is a list of one node with an empty move.
+ */
+#define TURN_NODE_SZ (sizeof(struct node) + sizeof(bb_t))
+
+static const size_t node_type_sizes[QNODE_TYPES] = {
+    [NODE_TYPE] = sizeof(struct node),
+    [TURN_NODE_TYPE] = TURN_NODE_SZ
+};
+
+/*
+ * NN inference kernels, one of them is selected with cpuid on NN load:
+ *   add_rows    -- add rows of transposed layer1 (by indexes) to the output;
+ *   update_row  -- subtract one row and add another one;
+ *   layer2      -- ReLU on layer1 output and all not ignored dot products.
+ * Kernels with 16 and 8 suffixes work with quantised weights, int8 values are
+ * scaled by 2^shift. Accumulators are int32 in all cases.
+ */
+struct nn_kernels
+{
+    const char * name;
+    void (*add_rows)(nn_value_t * restrict output, const nn_value_t * columns,
+        const int * rows, int qrows, int MID);
+    void (*update_row)(nn_value_t * restrict output, const nn_value_t * sub,
+        const nn_value_t * add, int MID);
+    void (*layer2)(nn_value_t * restrict output_2, const nn_value_t * layer2,
+        const nn_value_t * layer1_output, bb_t ignore, int qsquares, int MID);
+
+    void (*add_rows16)(nn_value_t * restrict output, const int16_t * columns,
+        const int * rows, int qrows, int MID);
+    void (*update_row16)(nn_value_t * restrict output, const int16_t * sub,
+        const int16_t * add, int MID);
+    void (*add_rows8)(nn_value_t * restrict output, const int8_t * columns,
+        const int * rows, int qrows, int MID, int shift);
+    void (*update_row8)(nn_value_t * restrict output, const int8_t * sub,
+        const int8_t * add, int MID, int shift);
+    void (*layer2_16)(nn_value_t * restrict output_2, const nn_value_t * bias,
+        const int16_t * layer2, const nn_value_t * layer1_output, bb_t ignore, int qsquares, int MID);
+};
+
+/*
+ * Binary NN file: header, then matrixes and transposed first layers in the
+ * same layout as in struct nn, every section is aligned to NN_BINARY_ALIGN.
+ * The checksum covers everything after the header. Values are stored in the
+ * host byte order, so files are not portable between endianness.
+ */
+struct nn_binary_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t layout;
+    uint32_t value_sz;
+    uint32_t n;
+    uint32_t MID;
+    uint32_t reserved;
+    uint64_t file_sz;
+    uint64_t checksum;
+    uint64_t offsets[QNN_SECTIONS];
+};
+
 struct nn
 {
     void * data;
+    void * map;
+    size_t map_sz;
+    const struct nn_kernels * kernels;
     int MID;
     int n;
     const nn_value_t * matrixes[QMATRIXES];
+
+    /*
+     * Transposed first layers without bias row: MID weights of each square
+     * code are continuous, row index is QCODES * sq + code.
+     */
+    const nn_value_t * columns[QNN_STEPS];
+
+    /*
+     * Quantised copies used instead of columns and layer2 weights when
+     * precision is not NN_INT32, biases are always taken from matrixes.
+     */
+    int precision;
+    int shift8;
+    void * quantized_data;
+    const int16_t * columns16[QNN_STEPS];
+    const int8_t * columns8[QNN_STEPS];
+    const int16_t * layer2_16[QNN_STEPS];
 };
 
 void destroy_nn(struct nn * restrict const me)
@@ -52,6 +222,10 @@ void destroy_nn(struct nn * restrict const me)
         return;
     }
 
+    free(me->quantized_data);
+    if (me->map != NULL) {
+        munmap(me->map, me->map_sz);
+    }
     free(me->data);
 }
 
@@ -111,6 +285,620 @@ static int read_matrix(nn_value_t * restrict ptr, size_t rows, size_t cols, FILE
     return 0;
 }
 
+static void generic_add_rows(
+    nn_value_t * restrict const output,
+    const nn_value_t * const columns,
+    const int * const rows,
+    const int qrows,
+    const int MID)
+{
+    for (int k=0; k<qrows; ++k) {
+        const nn_value_t * const row = columns + rows[k] * MID;
+        for (int i=0; i<MID; ++i) {
+            output[i] += row[i];
+        }
+    }
+}
+
+static void generic_update_row(
+    nn_value_t * restrict const output,
+    const nn_value_t * const sub,
+    const nn_value_t * const add,
+    const int MID)
+{
+    for (int i=0; i<MID; ++i) {
+        output[i] += add[i] - sub[i];
+    }
+}
+
+static void generic_layer2(
+    nn_value_t * restrict const output_2,
+    const nn_value_t * const layer2,
+    const nn_value_t * const layer1_output,
+    const bb_t ignore,
+    const int qsquares,
+    const int MID)
+{
+    nn_value_t output_1[MID];
+    for (int i=0; i<MID; ++i) {
+        output_1[i] = layer1_output[i] > 0 ? layer1_output[i] : 0;
+    }
+
+    const nn_value_t * const weights = layer2 + qsquares;
+    for (int i=0; i<qsquares; ++i) {
+        if (BB_SQUARE(i) & ignore) {
+            continue;
+        }
+
+        const nn_value_t * const column = weights + i * MID;
+        nn_value_t sum = layer2[i];
+        for (int j=0; j<MID; ++j) {
+            sum += output_1[j] * column[j];
+        }
+        output_2[i] = sum;
+    }
+}
+
+static inline int16_t saturate_int16(const nn_value_t value)
+{
+    return value < INT16_MIN ? INT16_MIN : value > INT16_MAX ? INT16_MAX : value;
+}
+
+static void generic_add_rows16(
+    nn_value_t * restrict const output,
+    const int16_t * const columns,
+    const int * const rows,
+    const int qrows,
+    const int MID)
+{
+    for (int k=0; k<qrows; ++k) {
+        const int16_t * const row = columns + rows[k] * MID;
+        for (int i=0; i<MID; ++i) {
+            output[i] += row[i];
+        }
+    }
+}
+
+static void generic_update_row16(
+    nn_value_t * restrict const output,
+    const int16_t * const sub,
+    const int16_t * const add,
+    const int MID)
+{
+    for (int i=0; i<MID; ++i) {
+        output[i] += add[i] - sub[i];
+    }
+}
+
+static void generic_add_rows8(
+    nn_value_t * restrict const output,
+    const int8_t * const columns,
+    const int * const rows,
+    const int qrows,
+    const int MID,
+    const int shift)
+{
+    for (int i=0; i<MID; ++i) {
+        nn_value_t sum = 0;
+        for (int k=0; k<qrows; ++k) {
+            sum += columns[rows[k] * MID + i];
+        }
+        output[i] += sum * (1 << shift);
+    }
+}
+
+static void generic_update_row8(
+    nn_value_t * restrict const output,
+    const int8_t * const sub,
+    const int8_t * const add,
+    const int MID,
+    const int shift)
+{
+    for (int i=0; i<MID; ++i) {
+        output[i] += (add[i] - sub[i]) * (1 << shift);
+    }
+}
+
+static void generic_layer2_16(
+    nn_value_t * restrict const output_2,
+    const nn_value_t * const bias,
+    const int16_t * const layer2,
+    const nn_value_t * const layer1_output,
+    const bb_t ignore,
+    const int qsquares,
+    const int MID)
+{
+    int16_t output_1[MID];
+    for (int i=0; i<MID; ++i) {
+        output_1[i] = layer1_output[i] > 0 ? saturate_int16(layer1_output[i]) : 0;
+    }
+
+    for (int i=0; i<qsquares; ++i) {
+        if (BB_SQUARE(i) & ignore) {
+            continue;
+        }
+
+        const int16_t * const column = layer2 + i * MID;
+        nn_value_t sum = bias[i];
+        for (int j=0; j<MID; ++j) {
+            sum += output_1[j] * column[j];
+        }
+        output_2[i] = sum;
+    }
+}
+
+static const struct nn_kernels generic_kernels = {
+    .name = "generic",
+    .add_rows = &generic_add_rows,
+    .update_row = &generic_update_row,
+    .layer2 = &generic_layer2,
+    .add_rows16 = &generic_add_rows16,
+    .update_row16 = &generic_update_row16,
+    .add_rows8 = &generic_add_rows8,
+    .update_row8 = &generic_update_row8,
+    .layer2_16 = &generic_layer2_16
+};
+
+#ifdef HAS_X86_KERNELS
+
+__attribute__((target("avx2")))
+static void avx2_add_rows(
+    nn_value_t * restrict const output,
+    const nn_value_t * const columns,
+    const int * const rows,
+    const int qrows,
+    const int MID)
+{
+    int i = 0;
+    for (; i+8 <= MID; i += 8) {
+        __m256i sum = _mm256_loadu_si256((const __m256i *)(output + i));
+        for (int k=0; k<qrows; ++k) {
+            const nn_value_t * const row = columns + rows[k] * MID;
+            sum = _mm256_add_epi32(sum, _mm256_loadu_si256((const __m256i *)(row + i)));
+        }
+        _mm256_storeu_si256((__m256i *)(output + i), sum);
+    }
+
+    for (; i<MID; ++i) {
+        for (int k=0; k<qrows; ++k) {
+            output[i] += columns[rows[k] * MID + i];
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static void avx2_update_row(
+    nn_value_t * restrict const output,
+    const nn_value_t * const sub,
+    const nn_value_t * const add,
+    const int MID)
+{
+    int i = 0;
+    for (; i+8 <= MID; i += 8) {
+        __m256i value = _mm256_loadu_si256((const __m256i *)(output + i));
+        value = _mm256_add_epi32(value, _mm256_loadu_si256((const __m256i *)(add + i)));
+        value = _mm256_sub_epi32(value, _mm256_loadu_si256((const __m256i *)(sub + i)));
+        _mm256_storeu_si256((__m256i *)(output + i), value);
+    }
+
+    for (; i<MID; ++i) {
+        output[i] += add[i] - sub[i];
+    }
+}
+
+__attribute__((target("avx2")))
+static void avx2_layer2(
+    nn_value_t * restrict const output_2,
+    const nn_value_t * const layer2,
+    const nn_value_t * const layer1_output,
+    const bb_t ignore,
+    const int qsquares,
+    const int MID)
+{
+    const int qvectors = (MID + 7) / 8;
+    __m256i output_1[qvectors];
+    nn_value_t * const relu = (nn_value_t *)output_1;
+    memset(output_1, 0, sizeof(output_1));
+    memcpy(relu, layer1_output, MID * sizeof(nn_value_t));
+    const __m256i zero = _mm256_setzero_si256();
+    for (int j=0; j<qvectors; ++j) {
+        output_1[j] = _mm256_max_epi32(output_1[j], zero);
+    }
+
+    const int qfull = MID / 8;
+    const nn_value_t * const weights = layer2 + qsquares;
+    for (int i=0; i<qsquares; ++i) {
+        if (BB_SQUARE(i) & ignore) {
+            continue;
+        }
+
+        const nn_value_t * const column = weights + i * MID;
+        __m256i acc = zero;
+        for (int j=0; j<qfull; ++j) {
+            const __m256i w = _mm256_loadu_si256((const __m256i *)(column + 8*j));
+            acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(output_1[j], w));
+        }
+
+        const __m128i half = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+        const __m128i quarter = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0x4E));
+        const __m128i one = _mm_add_epi32(quarter, _mm_shuffle_epi32(quarter, 0xB1));
+
+        nn_value_t sum = layer2[i] + _mm_cvtsi128_si32(one);
+        for (int j=8*qfull; j<MID; ++j) {
+            sum += relu[j] * column[j];
+        }
+        output_2[i] = sum;
+    }
+}
+
+__attribute__((target("avx2")))
+static void avx2_add_rows16(
+    nn_value_t * restrict const output,
+    const int16_t * const columns,
+    const int * const rows,
+    const int qrows,
+    const int MID)
+{
+    int i = 0;
+    for (; i+8 <= MID; i += 8) {
+        __m256i sum = _mm256_loadu_si256((const __m256i *)(output + i));
+        for (int k=0; k<qrows; ++k) {
+            const int16_t * const row = columns + rows[k] * MID;
+            const __m128i values = _mm_loadu_si128((const __m128i *)(row + i));
+            sum = _mm256_add_epi32(sum, _mm256_cvtepi16_epi32(values));
+        }
+        _mm256_storeu_si256((__m256i *)(output + i), sum);
+    }
+
+    for (; i<MID; ++i) {
+        for (int k=0; k<qrows; ++k) {
+            output[i] += columns[rows[k] * MID + i];
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static void avx2_update_row16(
+    nn_value_t * restrict const output,
+    const int16_t * const sub,
+    const int16_t * const add,
+    const int MID)
+{
+    int i = 0;
+    for (; i+8 <= MID; i += 8) {
+        __m256i value = _mm256_loadu_si256((const __m256i *)(output + i));
+        const __m128i a = _mm_loadu_si128((const __m128i *)(add + i));
+        const __m128i s = _mm_loadu_si128((const __m128i *)(sub + i));
+        value = _mm256_add_epi32(value, _mm256_cvtepi16_epi32(a));
+        value = _mm256_sub_epi32(value, _mm256_cvtepi16_epi32(s));
+        _mm256_storeu_si256((__m256i *)(output + i), value);
+    }
+
+    for (; i<MID; ++i) {
+        output[i] += add[i] - sub[i];
+    }
+}
+
+__attribute__((target("avx2")))
+static void avx2_add_rows8(
+    nn_value_t * restrict const output,
+    const int8_t * const columns,
+    const int * const rows,
+    const int qrows,
+    const int MID,
+    const int shift)
+{
+    const __m128i count = _mm_cvtsi32_si128(shift);
+    int i = 0;
+    for (; i+8 <= MID; i += 8) {
+        __m256i sum = _mm256_setzero_si256();
+        for (int k=0; k<qrows; ++k) {
+            const int8_t * const row = columns + rows[k] * MID;
+            const __m128i values = _mm_loadl_epi64((const __m128i *)(row + i));
+            sum = _mm256_add_epi32(sum, _mm256_cvtepi8_epi32(values));
+        }
+        const __m256i value = _mm256_loadu_si256((const __m256i *)(output + i));
+        sum = _mm256_add_epi32(value, _mm256_sll_epi32(sum, count));
+        _mm256_storeu_si256((__m256i *)(output + i), sum);
+    }
+
+    for (; i<MID; ++i) {
+        nn_value_t sum = 0;
+        for (int k=0; k<qrows; ++k) {
+            sum += columns[rows[k] * MID + i];
+        }
+        output[i] += sum * (1 << shift);
+    }
+}
+
+__attribute__((target("avx2")))
+static void avx2_update_row8(
+    nn_value_t * restrict const output,
+    const int8_t * const sub,
+    const int8_t * const add,
+    const int MID,
+    const int shift)
+{
+    const __m128i count = _mm_cvtsi32_si128(shift);
+    int i = 0;
+    for (; i+8 <= MID; i += 8) {
+        const __m256i a = _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *)(add + i)));
+        const __m256i s = _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *)(sub + i)));
+        const __m256i delta = _mm256_sll_epi32(_mm256_sub_epi32(a, s), count);
+        const __m256i value = _mm256_loadu_si256((const __m256i *)(output + i));
+        _mm256_storeu_si256((__m256i *)(output + i), _mm256_add_epi32(value, delta));
+    }
+
+    for (; i<MID; ++i) {
+        output[i] += (add[i] - sub[i]) * (1 << shift);
+    }
+}
+
+__attribute__((target("avx2")))
+static void avx2_layer2_16(
+    nn_value_t * restrict const output_2,
+    const nn_value_t * const bias,
+    const int16_t * const layer2,
+    const nn_value_t * const layer1_output,
+    const bb_t ignore,
+    const int qsquares,
+    const int MID)
+{
+    const int qfull = MID / 16;
+    int16_t output_1[MID];
+    for (int i=0; i<MID; ++i) {
+        output_1[i] = layer1_output[i] > 0 ? saturate_int16(layer1_output[i]) : 0;
+    }
+
+    for (int i=0; i<qsquares; ++i) {
+        if (BB_SQUARE(i) & ignore) {
+            continue;
+        }
+
+        const int16_t * const column = layer2 + i * MID;
+        __m256i acc = _mm256_setzero_si256();
+        for (int j=0; j<qfull; ++j) {
+            const __m256i x = _mm256_loadu_si256((const __m256i *)(output_1 + 16*j));
+            const __m256i w = _mm256_loadu_si256((const __m256i *)(column + 16*j));
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(x, w));
+        }
+
+        const __m128i half = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+        const __m128i quarter = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0x4E));
+        const __m128i one = _mm_add_epi32(quarter, _mm_shuffle_epi32(quarter, 0xB1));
+
+        nn_value_t sum = bias[i] + _mm_cvtsi128_si32(one);
+        for (int j=16*qfull; j<MID; ++j) {
+            sum += output_1[j] * column[j];
+        }
+        output_2[i] = sum;
+    }
+}
+
+static const struct nn_kernels avx2_kernels = {
+    .name = "avx2",
+    .add_rows = &avx2_add_rows,
+    .update_row = &avx2_update_row,
+    .layer2 = &avx2_layer2,
+    .add_rows16 = &avx2_add_rows16,
+    .update_row16 = &avx2_update_row16,
+    .add_rows8 = &avx2_add_rows8,
+    .update_row8 = &avx2_update_row8,
+    .layer2_16 = &avx2_layer2_16
+};
+
+__attribute__((target("avx512f")))
+static void avx512_add_rows(
+    nn_value_t * restrict const output,
+    const nn_value_t * const columns,
+    const int * const rows,
+    const int qrows,
+    const int MID)
+{
+    for (int i=0; i<MID; i += 16) {
+        const __mmask16 mask = MID - i >= 16 ? 0xFFFF : (1u << (MID - i)) - 1;
+        __m512i sum = _mm512_maskz_loadu_epi32(mask, output + i);
+        for (int k=0; k<qrows; ++k) {
+            const nn_value_t * const row = columns + rows[k] * MID;
+            sum = _mm512_add_epi32(sum, _mm512_maskz_loadu_epi32(mask, row + i));
+        }
+        _mm512_mask_storeu_epi32(output + i, mask, sum);
+    }
+}
+
+__attribute__((target("avx512f")))
+static void avx512_update_row(
+    nn_value_t * restrict const output,
+    const nn_value_t * const sub,
+    const nn_value_t * const add,
+    const int MID)
+{
+    for (int i=0; i<MID; i += 16) {
+        const __mmask16 mask = MID - i >= 16 ? 0xFFFF : (1u << (MID - i)) - 1;
+        __m512i value = _mm512_maskz_loadu_epi32(mask, output + i);
+        value = _mm512_add_epi32(value, _mm512_maskz_loadu_epi32(mask, add + i));
+        value = _mm512_sub_epi32(value, _mm512_maskz_loadu_epi32(mask, sub + i));
+        _mm512_mask_storeu_epi32(output + i, mask, value);
+    }
+}
+
+__attribute__((target("avx512f")))
+static void avx512_layer2(
+    nn_value_t * restrict const output_2,
+    const nn_value_t * const layer2,
+    const nn_value_t * const layer1_output,
+    const bb_t ignore,
+    const int qsquares,
+    const int MID)
+{
+    const int qvectors = (MID + 15) / 16;
+    __m512i output_1[qvectors];
+    const __m512i zero = _mm512_setzero_si512();
+    for (int j=0; j<qvectors; ++j) {
+        const int i = 16 * j;
+        const __mmask16 mask = MID - i >= 16 ? 0xFFFF : (1u << (MID - i)) - 1;
+        output_1[j] = _mm512_max_epi32(_mm512_maskz_loadu_epi32(mask, layer1_output + i), zero);
+    }
+
+    const nn_value_t * const weights = layer2 + qsquares;
+    for (int i=0; i<qsquares; ++i) {
+        if (BB_SQUARE(i) & ignore) {
+            continue;
+        }
+
+        const nn_value_t * const column = weights + i * MID;
+        __m512i acc = zero;
+        for (int j=0; j<qvectors; ++j) {
+            const int k = 16 * j;
+            const __mmask16 mask = MID - k >= 16 ? 0xFFFF : (1u << (MID - k)) - 1;
+            const __m512i w = _mm512_maskz_loadu_epi32(mask, column + k);
+            acc = _mm512_add_epi32(acc, _mm512_mullo_epi32(output_1[j], w));
+        }
+
+        output_2[i] = layer2[i] + _mm512_reduce_add_epi32(acc);
+    }
+}
+
+__attribute__((target("avx512f")))
+static void avx512_add_rows16(
+    nn_value_t * restrict const output,
+    const int16_t * const columns,
+    const int * const rows,
+    const int qrows,
+    const int MID)
+{
+    int i = 0;
+    for (; i+16 <= MID; i += 16) {
+        __m512i sum = _mm512_loadu_si512(output + i);
+        for (int k=0; k<qrows; ++k) {
+            const int16_t * const row = columns + rows[k] * MID;
+            const __m256i values = _mm256_loadu_si256((const __m256i *)(row + i));
+            sum = _mm512_add_epi32(sum, _mm512_cvtepi16_epi32(values));
+        }
+        _mm512_storeu_si512(output + i, sum);
+    }
+
+    for (; i<MID; ++i) {
+        for (int k=0; k<qrows; ++k) {
+            output[i] += columns[rows[k] * MID + i];
+        }
+    }
+}
+
+__attribute__((target("avx512f")))
+static void avx512_add_rows8(
+    nn_value_t * restrict const output,
+    const int8_t * const columns,
+    const int * const rows,
+    const int qrows,
+    const int MID,
+    const int shift)
+{
+    const __m128i count = _mm_cvtsi32_si128(shift);
+    int i = 0;
+    for (; i+16 <= MID; i += 16) {
+        __m512i sum = _mm512_setzero_si512();
+        for (int k=0; k<qrows; ++k) {
+            const int8_t * const row = columns + rows[k] * MID;
+            const __m128i values = _mm_loadu_si128((const __m128i *)(row + i));
+            sum = _mm512_add_epi32(sum, _mm512_cvtepi8_epi32(values));
+        }
+        const __m512i value = _mm512_loadu_si512(output + i);
+        _mm512_storeu_si512(output + i, _mm512_add_epi32(value, _mm512_sll_epi32(sum, count)));
+    }
+
+    for (; i<MID; ++i) {
+        nn_value_t sum = 0;
+        for (int k=0; k<qrows; ++k) {
+            sum += columns[rows[k] * MID + i];
+        }
+        output[i] += sum * (1 << shift);
+    }
+}
+
+__attribute__((target("avx512f")))
+static void avx512_layer2_16(
+    nn_value_t * restrict const output_2,
+    const nn_value_t * const bias,
+    const int16_t * const layer2,
+    const nn_value_t * const layer1_output,
+    const bb_t ignore,
+    const int qsquares,
+    const int MID)
+{
+    const int qfull = MID / 16;
+    __m512i output_1[qfull > 0 ? qfull : 1];
+    const __m512i zero = _mm512_setzero_si512();
+    for (int j=0; j<qfull; ++j) {
+        const __m512i value = _mm512_loadu_si512(layer1_output + 16*j);
+        output_1[j] = _mm512_min_epi32(_mm512_max_epi32(value, zero), _mm512_set1_epi32(INT16_MAX));
+    }
+
+    for (int i=0; i<qsquares; ++i) {
+        if (BB_SQUARE(i) & ignore) {
+            continue;
+        }
+
+        const int16_t * const column = layer2 + i * MID;
+        __m512i acc = zero;
+        for (int j=0; j<qfull; ++j) {
+            const __m512i w = _mm512_cvtepi16_epi32(_mm256_loadu_si256((const __m256i *)(column + 16*j)));
+            acc = _mm512_add_epi32(acc, _mm512_mullo_epi32(output_1[j], w));
+        }
+
+        nn_value_t sum = bias[i] + _mm512_reduce_add_epi32(acc);
+        for (int j=16*qfull; j<MID; ++j) {
+            const nn_value_t value = layer1_output[j];
+            sum += (value > 0 ? saturate_int16(value) : 0) * column[j];
+        }
+        output_2[i] = sum;
+    }
+}
+
+/* Accumulator updates touch one row only, AVX2 versions are used for them. */
+static const struct nn_kernels avx512_kernels = {
+    .name = "avx512",
+    .add_rows = &avx512_add_rows,
+    .update_row = &avx512_update_row,
+    .layer2 = &avx512_layer2,
+    .add_rows16 = &avx512_add_rows16,
+    .update_row16 = &avx2_update_row16,
+    .add_rows8 = &avx512_add_rows8,
+    .update_row8 = &avx2_update_row8,
+    .layer2_16 = &avx512_layer2_16
+};
+
+#endif
+
+static const struct nn_kernels * get_nn_kernels(void)
+{
+    #ifdef HAS_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            return &avx512_kernels;
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            return &avx2_kernels;
+        }
+    #endif
+
+    return &generic_kernels;
+}
+
+static void transpose_layer1(
+    nn_value_t * restrict const columns,
+    const nn_value_t * layer1,
+    const int n,
+    const int MID)
+{
+    const int qrows = QCODES * n * n;
+    layer1 += MID;
+    for (int i=0; i<MID; ++i)
+    for (int row=0; row<qrows; ++row) {
+        columns[row * MID + i] = *layer1++;
+    }
+}
+
 struct nn * load_text_nn(FILE * f, char * restrict const error_buf, const size_t buf_sz)
 {
     int n1, n2, MID;
@@ -159,25 +947,39 @@ struct nn * load_text_nn(FILE * f, char * restrict const error_buf, const size_t
     const size_t layer2_qvalues = layer2_qrows * layer2_qcols;
     const size_t layer2_sz = layer2_qvalues * sizeof(nn_value_t);
 
-    size_t sizes[QMATRIXES + 1];
-    sizes[QMATRIXES] = sizeof(struct nn);
+    const size_t columns_sz = layer1_sz - layer1_qcols * sizeof(nn_value_t);
+
+    size_t sizes[QMATRIXES + QNN_STEPS + 1];
+    sizes[QMATRIXES + QNN_STEPS] = sizeof(struct nn);
     for (int i=0; i<QMATRIXES; ++i) {
         sizes[i] = i & 1 ? layer2_sz : layer1_sz;
     }
+    for (int i=0; i<QNN_STEPS; ++i) {
+        sizes[QMATRIXES + i] = columns_sz;
+    }
 
-    void * ptrs[QMATRIXES+1];
-    void * data = multialloc(QMATRIXES+1, sizes, ptrs, 128);
+    void * ptrs[QMATRIXES + QNN_STEPS + 1];
+    void * data = multialloc(QMATRIXES + QNN_STEPS + 1, sizes, ptrs, 128);
     if (data == NULL) {
         return NULL;
     }
 
-    struct nn * restrict const me = ptrs[QMATRIXES];
+    struct nn * restrict const me = ptrs[QMATRIXES + QNN_STEPS];
     me->data = data;
+    me->map = NULL;
+    me->map_sz = 0;
+    me->kernels = get_nn_kernels();
+    me->precision = NN_INT32;
+    me->shift8 = 0;
+    me->quantized_data = NULL;
     me->MID = MID;
     me->n = n;
     for (int i=0; i<QMATRIXES; ++i) {
         me->matrixes[i] = ptrs[i];
     }
+    for (int i=0; i<QNN_STEPS; ++i) {
+        me->columns[i] = ptrs[QMATRIXES + i];
+    }
 
     int completed = 0;
 
@@ -227,51 +1029,397 @@ struct nn * load_text_nn(FILE * f, char * restrict const error_buf, const size_t
         completed |= mask;
     }
 
+    for (int i=0; i<QNN_STEPS; ++i) {
+        transpose_layer1(ptrs[QMATRIXES + i], me->matrixes[2*i], n, MID);
+    }
+
     return me;
 }
 
-void get_nn_weights(
-    const struct nn * const me,
-    const bb_t ignore,
-    const int nstep,
-    const int n,
-    const bb_t my, const bb_t opp, const bb_t dead,
-    int * restrict const weights)
+static uint64_t calc_nn_checksum(const void * const data, const size_t sz)
 {
-    const nn_value_t * layer1 = me->matrixes[2*nstep];
-    const nn_value_t * layer2 = me->matrixes[2*nstep+1];
+    const uint64_t * ptr = data;
+    const uint64_t * const end = ptr + sz / sizeof(uint64_t);
+    uint64_t result = 0xCBF29CE484222325ull;
+    for (; ptr != end; ++ptr) {
+        result = (result ^ *ptr) * 0x100000001B3ull;
+        result ^= result >> 29;
+    }
+    return result;
+}
 
-    const int MID = me->MID;
-    nn_value_t output_1[MID];
-    memcpy(output_1, layer1, sizeof(output_1));
-    layer1 += MID;
+static void calc_nn_binary_layout(
+    const int n,
+    const int MID,
+    uint64_t * restrict const offsets,
+    uint64_t * restrict const file_sz)
+{
+    const size_t layer1_sz = (QCODES*n*n + 1) * MID * sizeof(nn_value_t);
+    const size_t layer2_sz = (MID + 1) * n * n * sizeof(nn_value_t);
+    const size_t columns_sz = QCODES * n * n * MID * sizeof(nn_value_t);
 
-    for (int i=0; i<MID; ++i) {
-        for (int sq=0; sq<n*n; ++sq) {
-            const bb_t bb = BB_SQUARE(sq);
-            const int is_my = (bb & my) != 0;
-            const int is_opp = (bb & opp) != 0;
-            const int is_dead = (bb & dead) != 0;
-            output_1[i] += layer1[4 - 4*is_my - 2*is_opp + is_dead];
-            layer1 += 5;
-        }
-        if (output_1[i] < 0) {
-            output_1[i] = 0;
-        }
+    uint64_t offset = NN_BINARY_ALIGN;
+    for (int i=0; i<QNN_SECTIONS; ++i) {
+        offsets[i] = offset;
+        const size_t sz = i >= QMATRIXES ? columns_sz : i & 1 ? layer2_sz : layer1_sz;
+        offset += (sz + NN_BINARY_ALIGN - 1) / NN_BINARY_ALIGN * NN_BINARY_ALIGN;
     }
+    *file_sz = offset;
+}
 
-    nn_value_t output_2[n*n];
-    memcpy(output_2, layer2, sizeof(output_2));
-    layer2 += n*n;
+int save_binary_nn(
+    const struct nn * const me,
+    const char * const path,
+    char * restrict const error_buf,
+    const size_t buf_sz)
+{
+    struct nn_binary_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, NN_BINARY_MAGIC, sizeof(header.magic));
+    header.version = NN_BINARY_VERSION;
+    header.layout = NN_LAYOUT_INT32_T;
+    header.value_sz = sizeof(nn_value_t);
+    header.n = me->n;
+    header.MID = me->MID;
+    calc_nn_binary_layout(me->n, me->MID, header.offsets, &header.file_sz);
+
+    char * restrict const image = calloc(1, header.file_sz);
+    if (image == NULL) {
+        if (error_buf != NULL) {
+            snprintf(error_buf, buf_sz, "Cannot allocate %lu bytes for NN image.", (unsigned long)header.file_sz);
+        }
+        return ENOMEM;
+    }
 
-    for (int i=0; i<n*n; ++i) {
-        if (BB_SQUARE(i) & ignore) {
-            continue;
+    for (int i=0; i<QNN_SECTIONS; ++i) {
+        const nn_value_t * const src = i < QMATRIXES ? me->matrixes[i] : me->columns[i - QMATRIXES];
+        const size_t n = me->n;
+        const size_t MID = me->MID;
+        const size_t qvalues = i >= QMATRIXES ? QCODES*n*n*MID : i & 1 ? (MID+1)*n*n : (QCODES*n*n+1)*MID;
+        memcpy(image + header.offsets[i], src, qvalues * sizeof(nn_value_t));
+    }
+
+    header.checksum = calc_nn_checksum(image + NN_BINARY_ALIGN, header.file_sz - NN_BINARY_ALIGN);
+    memcpy(image, &header, sizeof(header));
+
+    FILE * f = fopen(path, "wb");
+    if (f == NULL) {
+        const int status = errno;
+        if (error_buf != NULL) {
+            snprintf(error_buf, buf_sz, "Cannot open “%s” for writing, error code is %d, %s.",
+                path, status, strerror(status));
+        }
+        free(image);
+        return status;
+    }
+
+    const size_t written = fwrite(image, 1, header.file_sz, f);
+    const int close_status = fclose(f);
+    free(image);
+
+    if (written != header.file_sz || close_status != 0) {
+        const int status = errno != 0 ? errno : EIO;
+        if (error_buf != NULL) {
+            snprintf(error_buf, buf_sz, "Write to “%s” failed, error code is %d, %s.",
+                path, status, strerror(status));
         }
+        return status;
+    }
 
-        for (int j=0; j<MID; ++j) {
-            output_2[i] += output_1[j] * *layer2++;
+    return 0;
+}
+
+/*
+ * Map binary NN file into memory, matrixes point directly to mapped pages,
+ * so processes which use the same file share them.
+ */
+struct nn * load_binary_nn(
+    const char * const path,
+    char * restrict const error_buf,
+    const size_t buf_sz)
+{
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        const int status = errno;
+        if (error_buf != NULL) {
+            snprintf(error_buf, buf_sz, "Cannot open NN file “%s”, error code is %d, %s.",
+                path, status, strerror(status));
+        }
+        errno = status;
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        const int status = errno;
+        close(fd);
+        errno = status;
+        return NULL;
+    }
+
+    const size_t map_sz = st.st_size;
+    if (map_sz < NN_BINARY_ALIGN) {
+        close(fd);
+        if (error_buf != NULL) {
+            snprintf(error_buf, buf_sz, "NN file “%s” is too short.", path);
+        }
+        errno = EINVAL;
+        return NULL;
+    }
+
+    void * const map = mmap(NULL, map_sz, PROT_READ, MAP_SHARED, fd, 0);
+    const int mmap_status = errno;
+    close(fd);
+    if (map == MAP_FAILED) {
+        if (error_buf != NULL) {
+            snprintf(error_buf, buf_sz, "mmap of NN file “%s” failed, error code is %d, %s.",
+                path, mmap_status, strerror(mmap_status));
+        }
+        errno = mmap_status;
+        return NULL;
+    }
+
+    struct nn_binary_header header;
+    memcpy(&header, map, sizeof(header));
+
+    const char * error = NULL;
+    uint64_t offsets[QNN_SECTIONS];
+    uint64_t file_sz = 0;
+    if (memcmp(header.magic, NN_BINARY_MAGIC, sizeof(header.magic)) != 0) {
+        error = "bad magic";
+    } else if (header.version != NN_BINARY_VERSION) {
+        error = "unsupported version";
+    } else if (header.layout != NN_LAYOUT_INT32_T || header.value_sz != sizeof(nn_value_t)) {
+        error = "unsupported layout";
+    } else if (header.n < 4 || header.n > 11 || header.MID < 10 || header.MID > 4096) {
+        error = "unsupported dimensions";
+    } else {
+        calc_nn_binary_layout(header.n, header.MID, offsets, &file_sz);
+        if (header.file_sz != file_sz || map_sz != file_sz) {
+            error = "invalid file size";
+        } else if (memcmp(header.offsets, offsets, sizeof(offsets)) != 0) {
+            error = "invalid section offsets";
+        } else {
+            const char * const base = map;
+            const uint64_t checksum = calc_nn_checksum(base + NN_BINARY_ALIGN, file_sz - NN_BINARY_ALIGN);
+            if (checksum != header.checksum) {
+                error = "checksum mismatch";
+            }
+        }
+    }
+
+    if (error != NULL) {
+        munmap(map, map_sz);
+        if (error_buf != NULL) {
+            snprintf(error_buf, buf_sz, "Cannot load binary NN “%s”, %s.", path, error);
+        }
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct nn * restrict const me = malloc(sizeof(struct nn));
+    if (me == NULL) {
+        munmap(map, map_sz);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    const char * const base = map;
+    me->data = me;
+    me->map = map;
+    me->map_sz = map_sz;
+    me->kernels = get_nn_kernels();
+    me->precision = NN_INT32;
+    me->shift8 = 0;
+    me->quantized_data = NULL;
+    me->MID = header.MID;
+    me->n = header.n;
+    for (int i=0; i<QMATRIXES; ++i) {
+        me->matrixes[i] = (const nn_value_t *)(base + offsets[i]);
+    }
+    for (int i=0; i<QNN_STEPS; ++i) {
+        me->columns[i] = (const nn_value_t *)(base + offsets[QMATRIXES + i]);
+    }
+
+    return me;
+}
+
+/* Load NN in binary or text format, the format is detected by magic. */
+struct nn * load_nn(
+    const char * const path,
+    char * restrict const error_buf,
+    const size_t buf_sz)
+{
+    FILE * f = fopen(path, "r");
+    if (f == NULL) {
+        const int status = errno;
+        if (error_buf != NULL) {
+            snprintf(error_buf, buf_sz, "Cannot open NN file “%s”, error code is %d, %s.",
+                path, status, strerror(status));
+        }
+        errno = status;
+        return NULL;
+    }
+
+    char magic[8];
+    const size_t qread = fread(magic, 1, sizeof(magic), f);
+    if (qread == sizeof(magic) && memcmp(magic, NN_BINARY_MAGIC, sizeof(magic)) == 0) {
+        fclose(f);
+        return load_binary_nn(path, error_buf, buf_sz);
+    }
+
+    rewind(f);
+    struct nn * const result = load_text_nn(f, error_buf, buf_sz);
+    fclose(f);
+    return result;
+}
+
+static int calc_shift8(const struct nn * const me, const size_t qvalues)
+{
+    nn_value_t max_value = 0;
+    for (int k=0; k<QNN_STEPS; ++k)
+    for (size_t i=0; i<qvalues; ++i) {
+        const nn_value_t value = me->columns[k][i];
+        const nn_value_t abs_value = value >= 0 ? value : -value;
+        if (abs_value > max_value) {
+            max_value = abs_value;
+        }
+    }
+
+    int shift = 0;
+    while ((max_value >> shift) > INT8_MAX) {
+        ++shift;
+    }
+    return shift;
+}
+
+static inline int8_t quantize_int8(const nn_value_t value, const int shift)
+{
+    const nn_value_t half = shift > 0 ? 1 << (shift-1) : 0;
+    const nn_value_t result = (value + half) >> shift;
+    return result < INT8_MIN ? INT8_MIN : result > INT8_MAX ? INT8_MAX : result;
+}
+
+/*
+ * Build quantised copies of weights: int16 for both layers or int8 for the
+ * first layer. Values out of range are saturated, for int8 the common scale
+ * 2^shift8 is chosen to fit the largest first layer weight.
+ */
+int set_nn_precision(struct nn * restrict const me, const int precision)
+{
+    free(me->quantized_data);
+    me->quantized_data = NULL;
+    me->precision = NN_INT32;
+    if (precision == NN_INT32) {
+        return 0;
+    }
+
+    const int n = me->n;
+    const int MID = me->MID;
+    const size_t columns_qvalues = QCODES * n * n * MID;
+    const size_t layer2_qvalues = n * n * MID;
+    const size_t columns_sz = columns_qvalues * (precision == NN_INT16 ? sizeof(int16_t) : sizeof(int8_t));
+    const size_t layer2_sz = layer2_qvalues * sizeof(int16_t);
+
+    size_t sizes[2*QNN_STEPS];
+    for (int i=0; i<QNN_STEPS; ++i) {
+        sizes[i] = columns_sz;
+        sizes[QNN_STEPS + i] = layer2_sz;
+    }
+
+    void * ptrs[2*QNN_STEPS];
+    void * data = multialloc(2*QNN_STEPS, sizes, ptrs, 128);
+    if (data == NULL) {
+        return ENOMEM;
+    }
+
+    const int shift = precision == NN_INT8 ? calc_shift8(me, columns_qvalues) : 0;
+    for (int k=0; k<QNN_STEPS; ++k) {
+        const nn_value_t * const columns = me->columns[k];
+        if (precision == NN_INT16) {
+            int16_t * restrict const columns16 = ptrs[k];
+            for (size_t i=0; i<columns_qvalues; ++i) {
+                columns16[i] = saturate_int16(columns[i]);
+            }
+            me->columns16[k] = columns16;
+            me->columns8[k] = NULL;
+        } else {
+            int8_t * restrict const columns8 = ptrs[k];
+            for (size_t i=0; i<columns_qvalues; ++i) {
+                columns8[i] = quantize_int8(columns[i], shift);
+            }
+            me->columns8[k] = columns8;
+            me->columns16[k] = NULL;
+        }
+
+        const nn_value_t * const layer2 = me->matrixes[2*k+1] + n*n;
+        int16_t * restrict const layer2_16 = ptrs[QNN_STEPS + k];
+        for (size_t i=0; i<layer2_qvalues; ++i) {
+            layer2_16[i] = saturate_int16(layer2[i]);
         }
+        me->layer2_16[k] = layer2_16;
+    }
+
+    me->quantized_data = data;
+    me->precision = precision;
+    me->shift8 = shift;
+    return 0;
+}
+
+static inline int get_square_code(
+    const bb_t bb,
+    const bb_t my, const bb_t opp, const bb_t dead)
+{
+    const int is_my = (bb & my) != 0;
+    const int is_opp = (bb & opp) != 0;
+    const int is_dead = (bb & dead) != 0;
+    return 4 - 4*is_my - 2*is_opp + is_dead;
+}
+
+/* First layer before ReLU, it is the value kept in rollout accumulators. */
+static void calc_nn_layer1(
+    const struct nn * const me,
+    const int nstep,
+    const int n,
+    const bb_t my, const bb_t opp, const bb_t dead,
+    nn_value_t * restrict const output_1)
+{
+    const int MID = me->MID;
+    const nn_value_t * const columns = me->columns[nstep];
+    memcpy(output_1, me->matrixes[2*nstep], MID * sizeof(nn_value_t));
+
+    int rows[n*n];
+    for (int sq=0; sq<n*n; ++sq) {
+        rows[sq] = QCODES*sq + get_square_code(BB_SQUARE(sq), my, opp, dead);
+    }
+
+    switch (me->precision) {
+        case NN_INT16:
+            me->kernels->add_rows16(output_1, me->columns16[nstep], rows, n*n, MID);
+            break;
+        case NN_INT8:
+            me->kernels->add_rows8(output_1, me->columns8[nstep], rows, n*n, MID, me->shift8);
+            break;
+        default:
+            me->kernels->add_rows(output_1, columns, rows, n*n, MID);
+            break;
+    }
+}
+
+static void calc_nn_weights(
+    const struct nn * const me,
+    const bb_t ignore,
+    const int nstep,
+    const int n,
+    const nn_value_t * const layer1_output,
+    int * restrict const weights)
+{
+    nn_value_t output_2[n*n];
+    if (me->precision == NN_INT32) {
+        me->kernels->layer2(output_2, me->matrixes[2*nstep+1], layer1_output, ignore, n*n, me->MID);
+    } else {
+        me->kernels->layer2_16(output_2, me->matrixes[2*nstep+1], me->layer2_16[nstep],
+            layer1_output, ignore, n*n, me->MID);
     }
 
     for (int i=0; i<n*n; ++i) {
@@ -285,10 +1433,135 @@ void get_nn_weights(
     }
 }
 
+void get_nn_weights(
+    const struct nn * const me,
+    const bb_t ignore,
+    const int nstep,
+    const int n,
+    const bb_t my, const bb_t opp, const bb_t dead,
+    int * restrict const weights)
+{
+    nn_value_t output_1[me->MID];
+    calc_nn_layer1(me, nstep, n, my, opp, dead, output_1);
+    calc_nn_weights(me, ignore, nstep, n, output_1, weights);
+}
+
+/*
+ * Transposition table entry, it maps position hash to the children array of
+ * the first expanded node with this position. The check field is a XOR of the
+ * hash and data, so entries torn by concurrent stores are just not found.
+ */
+struct transposition
+{
+    uint64_t check;
+    uint64_t data; /* children | qchildren << 32 | is_partial << 48 */
+};
+
+/*
+ * Games of a batch rollout, see batch_rollout. Bitboards are split into low
+ * and high 64 bit halves, so the same halves of adjacent lanes are loaded
+ * into one SIMD register. A lanes kernel calculates next steps for all live
+ * lanes (bits of the live mask) at once.
+ */
+struct rollout_lanes
+{
+    uint64_t x[2][MAX_LANES];
+    uint64_t o[2][MAX_LANES];
+    uint64_t dead[2][MAX_LANES];
+    uint64_t steps[2][MAX_LANES];
+
+    /* Geometry, next_steps is specialised for n and used by the generic kernel. */
+    int n;
+    bb_t all;
+    bb_t not_lside;
+    bb_t not_rside;
+    next_steps_t next_steps;
+} __attribute__((aligned(64)));
+
+typedef void (*lanes_kernel_t)(struct rollout_lanes * lanes, unsigned int live, int is_x);
+
+struct mcts_ai;
+struct endgame_entry;
+
+struct mcts_worker
+{
+    struct mcts_ai * owner;
+    struct multiallocator * multiallocator;
+    struct multiallocator * own_multiallocator;
+    struct transposition * tt;
+    struct transposition * own_tt;
+    struct node * root;
+    struct node * turn_root;
+    bb_t * turns;
+    struct node * * game;
+    int weights[8*sizeof(bb_t)];
+    struct multiallocator_cursor cursors[QNODE_TYPES];
+    struct rng rng;
+    uint32_t qthink;
+    int vloss;
+    int status;
+    pthread_t thread;
+};
+
+struct mcts_search
+{
+    /* Game data */
+    bb_t x;
+    bb_t o;
+    bb_t dead;
+    uint64_t hash;
+    int active;
+
+    /* Game data for wide boards, bb_t fields are zero then */
+    struct wide_state wide;
+
+    /* Geometry */
+    int n;
+    bb_t all;
+    bb_t not_lside;
+    bb_t not_rside;
+
+    /* Limits, deadline is a monotonic time in ns or zero */
+    uint32_t max_qthink;
+    uint64_t deadline;
+
+    /* Shared between workers */
+    uint32_t qthink;
+    int stop;
+};
+
+/* The search is suspended to collect garbage in full trees, see run_workers. */
+#define STOP_COLLECT  2
+
+/* Time manager state, the budget is given for a whole turn. */
+struct mcts_clock
+{
+    int turn;
+    uint64_t turn_start;
+    uint64_t turn_budget;
+};
+
+/* Position of turn roots and the turn chosen by the last turn search. */
+struct mcts_turn_plan
+{
+    bb_t x;
+    bb_t o;
+    bb_t dead;
+    bb_t move;
+    int32_t qgames;
+    float score;
+    int is_valid;
+
+    bb_t root_x;
+    bb_t root_o;
+    bb_t root_dead;
+};
+
 struct mcts_ai
 {
     void * static_data;
     void * dynamic_data;
+    void * workers_data;
     struct ai_param params[QPARAMS+1];
     char error_buf[MAX_ERROR_MSG_LEN];
 
@@ -296,24 +1569,121 @@ struct mcts_ai
     int * history;
     size_t qhistory;
 
-    struct node * * game;
     struct step_stat * stats;
 
+    struct mcts_worker * workers;
+    unsigned int qworkers;
+    struct mcts_search search;
+
     struct nn * nn;
     char nn_file[MAX_PATH];
-    int weights[8*sizeof(bb_t)];
+    char nn_precision[MAX_MODE_LEN];
+    int precision;
 
     struct multiallocator * multiallocator;
+    struct transposition * tt;
+    const struct geometry * geometry;
 
     float C;
     uint32_t qthink;
+    uint32_t threads;
+
+    /*
+     * UCB selection kernel is chosen with cpuid on init, log and 1/sqrt of
+     * visit counts below UBC_TABLE_SZ are taken from tables.
+     */
+    int (*ubc_kernel)(const struct mcts_ai * me, struct rng * rng,
+        const struct node * node, int qchildren, const struct node * children);
+    float ubc_log[UBC_TABLE_SZ];
+    float ubc_inv_sqrt[UBC_TABLE_SZ];
+
+    /*
+     * Leaf evaluation: one NN rollout when leaf_rollouts is zero, otherwise
+     * leaf_rollouts random rollouts played in lockstep with lanes_kernel.
+     */
+    uint32_t leaf_rollouts;
+    lanes_kernel_t lanes_kernel;
+
+    char parallel_mode[MAX_MODE_LEN];
+    int parallel;
+    char tree_mode[MAX_MODE_LEN];
+    int tree;
+    struct mcts_turn_plan plan;
+
+    /* Time control in milliseconds, zero values are not used */
+    uint32_t move_time;
+    uint32_t time_left;
+    uint32_t time_inc;
+    struct mcts_clock clock;
+
+    /*
+     * Pondering: after the turn of the side which asked ai_go the search
+     * continues on a background thread until the next AI call.
+     */
+    char ponder_mode[MAX_MODE_LEN];
+    int ponder;
+    int our_side;
+    int is_pondering;
+    pthread_t ponder_thread;
+
+    /* Set with ai->set_stop from another thread, see init_search. */
+    int halt;
+
+    /*
+     * Exact solver is tried when at most endgame squares might be stepped
+     * on in the rest of the game, zero turns it off.
+     */
+    uint32_t endgame;
+    struct endgame_entry * endgame_tt;
+
+    /* Size of every search tree, the tree is pruned when it is full. */
+    uint32_t memory_mb;
+
+    /* Requested multiallocator backend, arena_name shows the active one. */
+    int arena;
+    char arena_name[MAX_MODE_LEN];
+    int prefault;
+    char prefault_mode[MAX_MODE_LEN];
+
+    /*
+     * Worker generators are seeded on every search with rng_seed, the position
+     * hash and the worker index, so a search does not depend on the history.
+     * With one thread or in root mode the same seed and the same count of
+     * threads give the same search.
+     */
+    uint32_t rng_seed;
+
+    /* Trees are walked by ai->get_progress only while has_progress is set. */
+    pthread_mutex_t progress_lock;
+    int has_progress;
+    int32_t progress_base;
 };
 
+/* Wide boards are searched in the step tree only, see wide_simulate. */
+static inline int is_turn_tree(const struct mcts_ai * const me)
+{
+    return me->tree == TREE_TURN && me->geometry->wide == NULL;
+}
+
 #define OFFSET(name) offsetof(struct mcts_ai, name)
 static struct ai_param def_params[QPARAMS+1] = {
     {         "C",         &def_C, F32, OFFSET(C) },
     {    "qthink",    &def_qthink, U32, OFFSET(qthink) },
     {   "nn_file",             "", STR, OFFSET(nn_file) },
+    {   "threads",   &def_threads, U32, OFFSET(threads) },
+    { "parallel_mode",       "tree", STR, OFFSET(parallel_mode) },
+    { "tree_mode",           "step", STR, OFFSET(tree_mode) },
+    { "nn_precision",       "int32", STR, OFFSET(nn_precision) },
+    { "move_time",         &def_time, U32, OFFSET(move_time) },
+    { "time_left",         &def_time, U32, OFFSET(time_left) },
+    { "time_inc",          &def_time, U32, OFFSET(time_inc) },
+    { "ponder",                 "off", STR, OFFSET(ponder_mode) },
+    { "endgame",       &def_endgame, U32, OFFSET(endgame) },
+    { "memory_mb",     &def_memory,  U32, OFFSET(memory_mb) },
+    { "arena",              "hugetlb", STR, OFFSET(arena_name) },
+    { "prefault",               "off", STR, OFFSET(prefault_mode) },
+    { "rng_seed",         &def_seed, U32, OFFSET(rng_seed) },
+    { "leaf_rollouts",    &def_leaf_rollouts, U32, OFFSET(leaf_rollouts) },
     { NULL, NULL, NO_TYPE, 0 }
 };
 
@@ -323,6 +1693,62 @@ static void * move_ptr(void * ptr, size_t offset)
     return base + offset;
 }
 
+static void free_workers(struct mcts_ai * restrict const me)
+{
+    if (me->workers_data == NULL) {
+        return;
+    }
+
+    for (unsigned int i=0; i<me->qworkers; ++i) {
+        struct multiallocator * restrict const multiallocator = me->workers[i].own_multiallocator;
+        if (multiallocator != NULL) {
+            destroy_multiallocator(multiallocator);
+        }
+        free(me->workers[i].own_tt);
+        free(me->workers[i].turns);
+    }
+
+    free(me->workers_data);
+    me->workers_data = NULL;
+}
+
+static int reset_workers(
+    struct mcts_ai * restrict const me,
+    const int n,
+    const unsigned int qworkers)
+{
+    const size_t game_maxlen = 2 * n * n + 1;
+    const size_t game_sz = game_maxlen * sizeof(struct node *);
+    size_t sizes[qworkers + 1];
+    void * ptrs[qworkers + 1];
+    sizes[qworkers] = qworkers * sizeof(struct mcts_worker);
+    for (unsigned int i=0; i<qworkers; ++i) {
+        sizes[i] = game_sz;
+    }
+
+    void * data = multialloc(qworkers + 1, sizes, ptrs, 64);
+    if (data == NULL) {
+        return ENOMEM;
+    }
+
+    free_workers(me);
+
+    struct mcts_worker * restrict const workers = ptrs[qworkers];
+    memset(workers, 0, sizes[qworkers]);
+    for (unsigned int i=0; i<qworkers; ++i) {
+        workers[i].owner = me;
+        workers[i].multiallocator = me->multiallocator;
+        workers[i].tt = me->tt;
+        workers[i].game = ptrs[i];
+        rng_seed(&workers[i].rng, me->rng_seed, i);
+    }
+
+    me->workers = workers;
+    me->qworkers = qworkers;
+    me->workers_data = data;
+    return 0;
+}
+
 static int reset_dynamic(
     struct mcts_ai * restrict const me,
     const struct geometry * const geometry)
@@ -331,26 +1757,32 @@ static int reset_dynamic(
     if (me->n != n) {
         const size_t game_maxlen = 2 * n * n;
         const size_t history_sz = game_maxlen * sizeof(int);
-        const size_t game_sz = game_maxlen * sizeof(struct node *);
         const size_t stats_sz = game_maxlen * sizeof(struct step_stat);
-        size_t sizes[3] = { history_sz, game_sz, stats_sz };
-        void * ptrs[3];
-        void * data = multialloc(3, sizes, ptrs, 64);
+        size_t sizes[2] = { history_sz, stats_sz };
+        void * ptrs[2];
+        void * data = multialloc(2, sizes, ptrs, 64);
         if (data == NULL) {
             return ENOMEM;
         }
 
+        const unsigned int qworkers = me->threads > 0 ? me->threads : 1;
+        const int status = reset_workers(me, n, qworkers);
+        if (status != 0) {
+            free(data);
+            return status;
+        }
+
         if (me->dynamic_data != NULL) {
             free(me->dynamic_data);
         }
 
         me->history = ptrs[0];
-        me->game = ptrs[1];
-        me->stats = ptrs[2];
+        me->stats = ptrs[1];
         me->dynamic_data = data;
     }
 
     me->n = n;
+    me->geometry = geometry;
     me->qhistory = 0;
     return 0;
 }
@@ -370,21 +1802,18 @@ int mcts_load_nn(
         return EINVAL;
     }
 
-    FILE * f = fopen(path, "r");
-    if (f == NULL) {
-        snprintf(me->error_buf, MAX_ERROR_MSG_LEN-1,
-            "Cannot open NN file “%s”, error code is %d, %s.",
-            path, errno, strerror(errno));
+    struct nn * restrict const nn = load_nn(path, me->error_buf, MAX_ERROR_MSG_LEN-1);
+    if (nn == NULL) {
         ai->error = me->error_buf;
         return errno;
     }
 
-    struct nn * restrict const nn = load_text_nn(f, me->error_buf, MAX_ERROR_MSG_LEN-1);
-    fclose(f);
-
-    if (nn == NULL) {
+    const int status = set_nn_precision(nn, me->precision);
+    if (status != 0) {
+        destroy_nn(nn);
+        sprintf(me->error_buf, "Cannot allocate quantised NN weights.");
         ai->error = me->error_buf;
-        return errno;
+        return status;
     }
 
     if (me->nn) {
@@ -396,6 +1825,28 @@ int mcts_load_nn(
     return 0;
 }
 
+static void forget_trees(struct mcts_ai * restrict const me)
+{
+    for (unsigned int i=0; i<me->qworkers; ++i) {
+        me->workers[i].root = NULL;
+        me->workers[i].turn_root = NULL;
+    }
+    me->plan.is_valid = 0;
+}
+
+static void rebase_trees(
+    struct mcts_ai * restrict const me,
+    const int step);
+
+static void start_ponder(
+    struct mcts_ai * restrict const me,
+    const struct state * const state);
+
+static void stop_ponder(struct mcts_ai * restrict const me);
+static void init_ubc(struct mcts_ai * restrict const me);
+static lanes_kernel_t get_lanes_kernel(void);
+static void clear_endgame_tt(struct mcts_ai * restrict const me);
+
 static int mcts_ai_reset(
 	struct ai * restrict const ai,
 	const struct geometry * const geometry)
@@ -403,12 +1854,17 @@ static int mcts_ai_reset(
     ai->error = NULL;
 
     struct mcts_ai * restrict const me = ai->data;
+    stop_ponder(me);
+    me->our_side = 0;
+
     const int status = reset_dynamic(me, geometry);
     if (status != 0) {
         ai->error = "reset_dynamic fails.";
         return status;
     }
 
+    forget_trees(me);
+    clear_endgame_tt(me);
     struct state * restrict const state = &ai->state;
     init_state(state, geometry);
     return 0;
@@ -421,12 +1877,16 @@ static int mcts_ai_do_step(
     ai->error = NULL;
     struct mcts_ai * restrict const me = ai->data;
     struct state * restrict const state = &ai->state;
+    stop_ponder(me);
+
     const int status = state_step(state, step);
     if (status != 0) {
         ai->error = "state_step(step) failed.";
         return status;
     }
     me->history[me->qhistory++] = step;
+    rebase_trees(me, step);
+    start_ponder(me, state);
 	return 0;
 }
 
@@ -441,6 +1901,7 @@ static int mcts_ai_do_steps(
 
     const size_t saved_qhistory = me->qhistory;
     const struct state saved_state = *state;
+    stop_ponder(me);
 
     for (int i=0; i<qsteps; ++i) {
         const int status = state_step(state, steps[i]);
@@ -448,10 +1909,14 @@ static int mcts_ai_do_steps(
             ai->error = "state_step(step) failed.";
             *state = saved_state;
             me->qhistory = saved_qhistory;
+            forget_trees(me);
             return status;
         }
+        me->history[me->qhistory++] = steps[i];
+        rebase_trees(me, steps[i]);
     }
 
+    start_ponder(me, state);
 	return 0;
 }
 
@@ -467,6 +1932,8 @@ static int mcts_ai_undo_step(struct ai * restrict const ai)
         return EINVAL;
     }
 
+    stop_ponder(me);
+
     const int sq = me->history[qhistory-1];
     const int status = state_unstep(state, sq);
     if (status != 0) {
@@ -475,6 +1942,7 @@ static int mcts_ai_undo_step(struct ai * restrict const ai)
     }
 
     --me->qhistory;
+    forget_trees(me);
     return 0;
 }
 
@@ -490,6 +1958,8 @@ static int mcts_ai_undo_steps(struct ai * restrict const ai, const unsigned int
         return EINVAL;
     }
 
+    stop_ponder(me);
+
     const struct state backup = *state;
     for (int i=1; i<= qsteps; ++i) {
         const int sq = me->history[qhistory-i];
@@ -502,6 +1972,7 @@ static int mcts_ai_undo_steps(struct ai * restrict const ai, const unsigned int
     }
 
     me->qhistory -= qsteps;
+    forget_trees(me);
     return 0;
 }
 
@@ -510,6 +1981,16 @@ static int ai_go(
     const struct state * const state,
     const int has_explanation);
 
+static void set_progress(struct mcts_ai * restrict const me, const int is_on);
+static int32_t count_root_games(const struct mcts_ai * const me);
+static size_t calc_tree_memory(const struct mcts_ai * const me);
+static void get_step_pv(
+    const struct mcts_ai * const me,
+    struct ai_progress * restrict const progress);
+static void get_turn_pv(
+    const struct mcts_ai * const me,
+    struct ai_progress * restrict const progress);
+
 static int mcts_ai_go(
 	struct ai * restrict const ai,
 	struct ai_explanation * restrict const explanation)
@@ -517,17 +1998,18 @@ static int mcts_ai_go(
     ai->error = NULL;
 
     const struct state * const state = &ai->state;
-    bb_t steps = state_get_steps(state);
-    if (steps == 0) {
+    const int qsteps = state_qnext(state);
+    if (qsteps == 0) {
         ai->error = "No moves";
         errno = EINVAL;
         return -1;
     }
 
-    const int qsteps = pop_count(steps);
-
     struct mcts_ai * restrict const me = ai->data;
-    double start;
+    stop_ponder(me);
+    me->our_side = state->active;
+
+    uint64_t start;
     const int has_explanation = explanation != NULL;
     if (has_explanation) {
         explanation->qstats = qsteps;
@@ -536,31 +2018,29 @@ static int mcts_ai_go(
         explanation->score = -1.0;
 
         struct step_stat * restrict stat = me->stats;
-        bb_t mask = steps;
-        while (mask != 0) {
-            const int sq = first_one(mask);
-            mask ^= BB_SQUARE(sq);
-            stat->square = sq;
+        for (int i=0; i<qsteps; ++i) {
+            stat->square = state_nth_next(state, i);
             stat->qgames = 0;
             stat->score = 0;
             ++stat;
         }
 
-        start = clock();
+        start = get_time_ns();
     }
 
     if (qsteps == 1) {
-        return first_one(steps);
+        return state_nth_next(state, 0);
     }
 
     const int square = ai_go(me, state, has_explanation);
+    set_progress(me, 0);
     if (square < 0) {
         ai->error = me->error_buf;
     }
 
     if (has_explanation) {
-        const double finish = clock();
-        explanation->time = (finish - start) / CLOCKS_PER_SEC;
+        const uint64_t finish = get_time_ns();
+        explanation->time = 1.0e-9 * (finish - start);
         const double score = me->stats[0].score;
         explanation->score = state->active == ACTIVE_X ? score : 1.0 - score;
     }
@@ -568,6 +2048,39 @@ static int mcts_ai_go(
     return square;
 }
 
+static void mcts_ai_set_stop(struct ai * restrict const ai, const int is_stop)
+{
+    struct mcts_ai * restrict const me = ai->data;
+    __atomic_store_n(&me->halt, is_stop, __ATOMIC_SEQ_CST);
+    if (is_stop) {
+        __atomic_store_n(&me->search.stop, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static void mcts_ai_get_progress(
+    const struct ai * const ai,
+    struct ai_progress * restrict const progress)
+{
+    struct mcts_ai * restrict const me = ai->data;
+    progress->qthink = __atomic_load_n(&me->search.qthink, __ATOMIC_RELAXED);
+    progress->qplayouts = 0;
+    progress->memory = 0;
+    progress->score = -1.0;
+    progress->qpv = 0;
+
+    pthread_mutex_lock(&me->progress_lock);
+    if (me->has_progress) {
+        progress->qplayouts = count_root_games(me) - me->progress_base;
+        progress->memory = calc_tree_memory(me);
+        if (is_turn_tree(me)) {
+            get_turn_pv(me, progress);
+        } else {
+            get_step_pv(me, progress);
+        }
+    }
+    pthread_mutex_unlock(&me->progress_lock);
+}
+
 static const struct ai_param * mcts_ai_get_params(const struct ai * const ai)
 {
     struct mcts_ai * restrict const me = ai->data;
@@ -616,6 +2129,357 @@ static int set_nn_file(
     return mcts_load_nn(ai, nn_file);
 }
 
+static int set_threads(
+	struct ai * restrict const ai,
+    const uint32_t * const value)
+{
+    struct mcts_ai * restrict const me = ai->data;
+
+    const uint32_t threads = *value;
+    if (threads == 0 || threads > MAX_THREADS) {
+        sprintf(me->error_buf, "Invalid value %u for parameter “threads”, it should be in range 1..%d.",
+            threads, MAX_THREADS);
+        ai->error = me->error_buf;
+        return EINVAL;
+    }
+
+    if (threads != me->qworkers) {
+        const int status = reset_workers(me, me->n, threads);
+        if (status != 0) {
+            sprintf(me->error_buf, "Cannot allocate %u search workers.", threads);
+            ai->error = me->error_buf;
+            return status;
+        }
+    }
+
+    me->threads = threads;
+    return 0;
+}
+
+static const char * const arena_names[] = {
+    [ARENA_MALLOC] = "malloc",
+    [ARENA_MMAP] = "mmap",
+    [ARENA_THP] = "thp",
+    [ARENA_HUGETLB] = "hugetlb"
+};
+
+static struct multiallocator * create_tree_multiallocator(const struct mcts_ai * const me)
+{
+    struct multiallocator * restrict const multiallocator = create_multiallocator(
+        me->memory_mb, BLOCK_SZ, QNODE_TYPES, node_type_sizes);
+    if (multiallocator == NULL) {
+        return NULL;
+    }
+
+    const int status = multiallocator_map_arena(multiallocator, me->arena, me->prefault);
+    if (status != 0) {
+        destroy_multiallocator(multiallocator);
+        errno = status;
+        return NULL;
+    }
+
+    return multiallocator;
+}
+
+/* All trees are dropped, private ones are recreated later by attach_workers. */
+static int replace_multiallocators(struct mcts_ai * restrict const me)
+{
+    struct multiallocator * restrict const multiallocator = create_tree_multiallocator(me);
+    if (multiallocator == NULL) {
+        sprintf(me->error_buf, "Cannot create %s multiallocator for %u MB.",
+            arena_names[me->arena], me->memory_mb);
+        return errno;
+    }
+
+    destroy_multiallocator(me->multiallocator);
+    me->multiallocator = multiallocator;
+    memset(me->tt, 0, TT_SIZE * sizeof(struct transposition));
+    strcpy(me->arena_name, arena_names[multiallocator->backend]);
+
+    for (unsigned int i=0; i<me->qworkers; ++i) {
+        struct mcts_worker * restrict const worker = me->workers + i;
+        if (worker->own_multiallocator != NULL) {
+            destroy_multiallocator(worker->own_multiallocator);
+            worker->own_multiallocator = NULL;
+        }
+        free(worker->own_tt);
+        worker->own_tt = NULL;
+        worker->multiallocator = me->multiallocator;
+        worker->tt = me->tt;
+        worker->root = NULL;
+        worker->turn_root = NULL;
+    }
+
+    return 0;
+}
+
+static int set_memory(
+	struct ai * restrict const ai,
+    const uint32_t * const value)
+{
+    struct mcts_ai * restrict const me = ai->data;
+
+    const uint32_t memory_mb = *value;
+    if (memory_mb < MIN_MEMORY_MB || memory_mb > MAX_MEMORY_MB) {
+        sprintf(me->error_buf, "Invalid value %u for parameter “memory_mb”, it should be in range %d..%d.",
+            memory_mb, MIN_MEMORY_MB, MAX_MEMORY_MB);
+        ai->error = me->error_buf;
+        return EINVAL;
+    }
+
+    if (memory_mb == me->memory_mb) {
+        return 0;
+    }
+
+    const uint32_t old_memory_mb = me->memory_mb;
+    me->memory_mb = memory_mb;
+    const int status = replace_multiallocators(me);
+    if (status != 0) {
+        me->memory_mb = old_memory_mb;
+        ai->error = me->error_buf;
+        return status;
+    }
+
+    return 0;
+}
+
+static int set_arena(
+	struct ai * restrict const ai,
+    const char * const value)
+{
+    struct mcts_ai * restrict const me = ai->data;
+
+    size_t len = strlen(value);
+    while (len > 0 && value[len-1] <= ' ') {
+        --len;
+    }
+
+    int arena = -1;
+    for (int i=ARENA_MALLOC; i<=ARENA_HUGETLB; ++i) {
+        if (len == strlen(arena_names[i]) && strncasecmp(value, arena_names[i], len) == 0) {
+            arena = i;
+        }
+    }
+
+    if (arena < 0) {
+        snprintf(me->error_buf, MAX_ERROR_MSG_LEN-1,
+            "Invalid value “%.*s” for parameter “arena”, “malloc”, “mmap”, “thp” or “hugetlb” expected.",
+            (int)len, value);
+        ai->error = me->error_buf;
+        return EINVAL;
+    }
+
+    if (arena == me->arena) {
+        return 0;
+    }
+
+    const int old_arena = me->arena;
+    me->arena = arena;
+    const int status = replace_multiallocators(me);
+    if (status != 0) {
+        me->arena = old_arena;
+        ai->error = me->error_buf;
+        return status;
+    }
+
+    return 0;
+}
+
+static int set_prefault(
+	struct ai * restrict const ai,
+    const char * const value)
+{
+    struct mcts_ai * restrict const me = ai->data;
+
+    size_t len = strlen(value);
+    while (len > 0 && value[len-1] <= ' ') {
+        --len;
+    }
+
+    int prefault;
+    if (len == 2 && strncasecmp(value, "on", 2) == 0) {
+        prefault = 1;
+    } else if (len == 3 && strncasecmp(value, "off", 3) == 0) {
+        prefault = 0;
+    } else {
+        snprintf(me->error_buf, MAX_ERROR_MSG_LEN-1,
+            "Invalid value “%.*s” for parameter “prefault”, “on” or “off” expected.",
+            (int)len, value);
+        ai->error = me->error_buf;
+        return EINVAL;
+    }
+
+    strcpy(me->prefault_mode, prefault ? "on" : "off");
+    if (prefault == me->prefault) {
+        return 0;
+    }
+
+    me->prefault = prefault;
+    const int status = replace_multiallocators(me);
+    if (status != 0) {
+        me->prefault = !prefault;
+        strcpy(me->prefault_mode, prefault ? "off" : "on");
+        ai->error = me->error_buf;
+        return status;
+    }
+
+    return 0;
+}
+
+static int set_parallel_mode(
+	struct ai * restrict const ai,
+    const char * const value)
+{
+    struct mcts_ai * restrict const me = ai->data;
+
+    size_t len = strlen(value);
+    while (len > 0 && value[len-1] <= ' ') {
+        --len;
+    }
+
+    int parallel;
+    if (len == 4 && strncasecmp(value, "tree", 4) == 0) {
+        parallel = PARALLEL_TREE;
+    } else if (len == 4 && strncasecmp(value, "root", 4) == 0) {
+        parallel = PARALLEL_ROOT;
+    } else {
+        snprintf(me->error_buf, MAX_ERROR_MSG_LEN-1,
+            "Invalid value “%.*s” for parameter “parallel_mode”, “tree” or “root” expected.",
+            (int)len, value);
+        ai->error = me->error_buf;
+        return EINVAL;
+    }
+
+    if (me->parallel != parallel) {
+        forget_trees(me);
+    }
+
+    me->parallel = parallel;
+    strcpy(me->parallel_mode, parallel == PARALLEL_ROOT ? "root" : "tree");
+    return 0;
+}
+
+static int set_tree_mode(
+	struct ai * restrict const ai,
+    const char * const value)
+{
+    struct mcts_ai * restrict const me = ai->data;
+
+    size_t len = strlen(value);
+    while (len > 0 && value[len-1] <= ' ') {
+        --len;
+    }
+
+    int tree;
+    if (len == 4 && strncasecmp(value, "step", 4) == 0) {
+        tree = TREE_STEP;
+    } else if (len == 4 && strncasecmp(value, "turn", 4) == 0) {
+        tree = TREE_TURN;
+    } else {
+        snprintf(me->error_buf, MAX_ERROR_MSG_LEN-1,
+            "Invalid value “%.*s” for parameter “tree_mode”, “step” or “turn” expected.",
+            (int)len, value);
+        ai->error = me->error_buf;
+        return EINVAL;
+    }
+
+    if (me->tree != tree) {
+        forget_trees(me);
+    }
+
+    me->tree = tree;
+    strcpy(me->tree_mode, tree == TREE_TURN ? "turn" : "step");
+    return 0;
+}
+
+static int set_nn_precision_param(
+	struct ai * restrict const ai,
+    const char * const value)
+{
+    struct mcts_ai * restrict const me = ai->data;
+
+    size_t len = strlen(value);
+    while (len > 0 && value[len-1] <= ' ') {
+        --len;
+    }
+
+    int precision;
+    if (len == 5 && strncasecmp(value, "int32", 5) == 0) {
+        precision = NN_INT32;
+    } else if (len == 5 && strncasecmp(value, "int16", 5) == 0) {
+        precision = NN_INT16;
+    } else if (len == 4 && strncasecmp(value, "int8", 4) == 0) {
+        precision = NN_INT8;
+    } else {
+        snprintf(me->error_buf, MAX_ERROR_MSG_LEN-1,
+            "Invalid value “%.*s” for parameter “nn_precision”, “int32”, “int16” or “int8” expected.",
+            (int)len, value);
+        ai->error = me->error_buf;
+        return EINVAL;
+    }
+
+    if (me->nn != NULL) {
+        const int status = set_nn_precision(me->nn, precision);
+        if (status != 0) {
+            sprintf(me->error_buf, "Cannot allocate quantised NN weights.");
+            ai->error = me->error_buf;
+            return status;
+        }
+    }
+
+    static const char * const names[] = { "int32", "int16", "int8" };
+    me->precision = precision;
+    strcpy(me->nn_precision, names[precision]);
+    return 0;
+}
+
+static int set_ponder(
+	struct ai * restrict const ai,
+    const char * const value)
+{
+    struct mcts_ai * restrict const me = ai->data;
+
+    size_t len = strlen(value);
+    while (len > 0 && value[len-1] <= ' ') {
+        --len;
+    }
+
+    int ponder;
+    if (len == 2 && strncasecmp(value, "on", 2) == 0) {
+        ponder = 1;
+    } else if (len == 3 && strncasecmp(value, "off", 3) == 0) {
+        ponder = 0;
+    } else {
+        snprintf(me->error_buf, MAX_ERROR_MSG_LEN-1,
+            "Invalid value “%.*s” for parameter “ponder”, “on” or “off” expected.",
+            (int)len, value);
+        ai->error = me->error_buf;
+        return EINVAL;
+    }
+
+    me->ponder = ponder;
+    strcpy(me->ponder_mode, ponder ? "on" : "off");
+    return 0;
+}
+
+static int set_leaf_rollouts(
+	struct ai * restrict const ai,
+    const uint32_t * const value)
+{
+    struct mcts_ai * restrict const me = ai->data;
+
+    const uint32_t leaf_rollouts = *value;
+    if (leaf_rollouts > MAX_LANES) {
+        sprintf(me->error_buf, "Invalid value %u for parameter “leaf_rollouts”, it should be in range 0..%d.",
+            leaf_rollouts, MAX_LANES);
+        ai->error = me->error_buf;
+        return EINVAL;
+    }
+
+    me->leaf_rollouts = leaf_rollouts;
+    return 0;
+}
+
 static int set_param(
 	struct ai * restrict const ai,
     const struct ai_param * const param,
@@ -625,6 +2489,42 @@ static int set_param(
         return set_nn_file(ai, value);
     }
 
+    if (strcmp(param->name, "threads") == 0) {
+        return set_threads(ai, value);
+    }
+
+    if (strcmp(param->name, "parallel_mode") == 0) {
+        return set_parallel_mode(ai, value);
+    }
+
+    if (strcmp(param->name, "tree_mode") == 0) {
+        return set_tree_mode(ai, value);
+    }
+
+    if (strcmp(param->name, "nn_precision") == 0) {
+        return set_nn_precision_param(ai, value);
+    }
+
+    if (strcmp(param->name, "ponder") == 0) {
+        return set_ponder(ai, value);
+    }
+
+    if (strcmp(param->name, "memory_mb") == 0) {
+        return set_memory(ai, value);
+    }
+
+    if (strcmp(param->name, "arena") == 0) {
+        return set_arena(ai, value);
+    }
+
+    if (strcmp(param->name, "prefault") == 0) {
+        return set_prefault(ai, value);
+    }
+
+    if (strcmp(param->name, "leaf_rollouts") == 0) {
+        return set_leaf_rollouts(ai, value);
+    }
+
     struct mcts_ai * restrict const me = ai->data;
     const size_t sz = param_sizes[param->type];
     if (sz == 0) {
@@ -651,14 +2551,20 @@ static int mcts_ai_set_param(
         return EINVAL;
     }
 
+    stop_ponder(me);
     return set_param(ai, param, value);
 }
 
 static void free_mcts_ai(struct ai * restrict const ai)
 {
     struct mcts_ai * restrict const me = ai->data;
+    stop_ponder(me);
+    pthread_mutex_destroy(&me->progress_lock);
+    free(me->endgame_tt);
     destroy_nn(me->nn);
     destroy_multiallocator(me->multiallocator);
+    free(me->tt);
+    free_workers(me);
     free(me->dynamic_data);
     free(me->static_data);
 }
@@ -707,22 +2613,50 @@ int init_mcts_ai(
         return ENOMEM;
     }
 
-    static const size_t type_sizes[1] = { sizeof(struct node) };
-    me->multiallocator = create_multiallocator(
-        MAX_BLOCKS,
-        BLOCK_SZ,
-        1, type_sizes);
+    init_ubc(me);
+    me->lanes_kernel = get_lanes_kernel();
+    me->memory_mb = def_memory;
+    me->arena = ARENA_HUGETLB;
+    me->prefault = 0;
+    me->multiallocator = create_tree_multiallocator(me);
     if (me->multiallocator == NULL) {
         ai->error = "create_multiallocator fails";
-        free(me->static_data);
+        free(me->workers_data);
         free(me->dynamic_data);
+        free(me->static_data);
         return errno;
     }
 
-    ai->data = me;
-    me->nn = NULL;
-    me->nn_file[0] = '\0';
-    me->nn_file[sizeof(me->nn_file) - 1] = '\0';
+    me->tt = malloc(TT_SIZE * sizeof(struct transposition));
+    if (me->tt == NULL) {
+        ai->error = "Cannot allocate transposition table";
+        destroy_multiallocator(me->multiallocator);
+        free(me->workers_data);
+        free(me->dynamic_data);
+        free(me->static_data);
+        return ENOMEM;
+    }
+
+    const int lock_status = pthread_mutex_init(&me->progress_lock, NULL);
+    if (lock_status != 0) {
+        ai->error = "pthread_mutex_init fails";
+        free(me->tt);
+        destroy_multiallocator(me->multiallocator);
+        free(me->workers_data);
+        free(me->dynamic_data);
+        free(me->static_data);
+        return lock_status;
+    }
+
+    memset(me->tt, 0, TT_SIZE * sizeof(struct transposition));
+    strcpy(me->arena_name, arena_names[me->multiallocator->backend]);
+    me->workers->multiallocator = me->multiallocator;
+    me->workers->tt = me->tt;
+
+    ai->data = me;
+    me->nn = NULL;
+    me->nn_file[0] = '\0';
+    me->nn_file[sizeof(me->nn_file) - 1] = '\0';
     init_params(ai);
 
     ai->reset = mcts_ai_reset;
@@ -731,6 +2665,8 @@ int init_mcts_ai(
     ai->undo_step = mcts_ai_undo_step;
     ai->undo_steps = mcts_ai_undo_steps;
     ai->go = mcts_ai_go;
+    ai->set_stop = mcts_ai_set_stop;
+    ai->get_progress = mcts_ai_get_progress;
     ai->get_params = mcts_ai_get_params;
     ai->set_param = mcts_ai_set_param;
     ai->get_state = ai_get_state;
@@ -739,7 +2675,9 @@ int init_mcts_ai(
     struct state * restrict const state = &ai->state;
     init_state(state, geometry);
 
-    mcts_load_nn(ai, "nn.txt");
+    if (mcts_load_nn(ai, "nn.bin") != 0) {
+        mcts_load_nn(ai, "nn.txt");
+    }
     ai->error = NULL;
     return 0;
 }
@@ -986,101 +2924,119 @@ int get_3moves_3(
     return ptr - output;
 }
 
-static inline bb_t select_step(const bb_t steps)
+static inline bb_t select_step(
+    struct rng * restrict const rng,
+    const bb_t steps)
 {
     const int qbits = pop_count(steps);
     if (qbits == 1) {
         return steps;
     }
 
-    const int sq = nth_one_index(steps, rand() % qbits);
+    const int sq = nth_one_index(steps, rng_uniform(rng, qbits));
     return BB_SQUARE(sq);
 }
 
 #ifdef MAKE_CHECK
 #define DEBUG_LOG_ARG , int * restrict debug_log
+#define DEBUG_LOG_PASS , debug_log
 #define PUT_DEBUG_LOG(bb) do if (debug_log) { *debug_log++ = (first_one(bb)); } while(0)
 #define ROLLOUT_LAST_ARG  , NULL
 #else
 #define DEBUG_LOG_ARG
+#define DEBUG_LOG_PASS
 #define PUT_DEBUG_LOG(bb)
 #define ROLLOUT_LAST_ARG
 #endif
 
-int rollout(
+/*
+ * The rollout body is inlined for every standard board size, so next_steps
+ * works with constant masks and shifts. Label addresses cannot be stored in
+ * a copied function, the entry step is chosen with a switch.
+ */
+static ALWAYS_INLINE int std_rollout(
     bb_t x, bb_t o, bb_t dead, /* Game data */
-    const int n, const bb_t all, const bb_t not_lside, const bb_t not_rside /* Geometry */,
+    const int n /* Geometry */,
+    struct rng * restrict const rng,
     uint32_t * restrict const qthink DEBUG_LOG_ARG)
 {
-    static void *labels[10] =
-        { &&step0, &&step1, &&step2, &&step3, &&step4,
-          &&step5, &&step6, &&step7, &&step8, &&step9 };
     const int all_qsteps = pop_count(x|o) + pop_count(dead);
     const int index = all_qsteps < 10 ? all_qsteps : ((all_qsteps-4) %6) + 4;
-    goto *labels[index];
+    switch (index) {
+        case 0: goto step0;
+        case 1: goto step1;
+        case 2: goto step2;
+        case 3: goto step3;
+        case 4: goto step4;
+        case 5: goto step5;
+        case 6: goto step6;
+        case 7: goto step7;
+        case 8: goto step8;
+        default: goto step9;
+    }
 
     step4: {
         ++*qthink;
-        bb_t steps = next_steps(o, x, dead, n, all, not_lside, not_rside);
+        bb_t steps = std_next_steps(o, x, dead, n);
         if (steps == 0) {
             return +ONE_GAME_COST;
         }
-        const bb_t bb = select_step(steps);
+        const bb_t bb = select_step(rng, steps);
         *(bb & x ? &dead : &o) |= bb;
         PUT_DEBUG_LOG(bb);
     }
 
     step5: {
         ++*qthink;
-        bb_t steps = next_steps(o, x, dead, n, all, not_lside, not_rside);
+        bb_t steps = std_next_steps(o, x, dead, n);
         if (steps == 0) {
             return +ONE_GAME_COST;
         }
-        const bb_t bb = select_step(steps);
+        const bb_t bb = select_step(rng, steps);
         *(bb & x ? &dead : &o) |= bb;
         PUT_DEBUG_LOG(bb);
     }
 
     step6: {
         ++*qthink;
-        bb_t steps = next_steps(x, o, dead, n, all, not_lside, not_rside);
+        bb_t steps = std_next_steps(x, o, dead, n);
         if (steps == 0) {
             return -ONE_GAME_COST;
         }
-        const bb_t bb = select_step(steps);
+        const bb_t bb = select_step(rng, steps);
         *(bb & o ? &dead : &x) |= bb;
         PUT_DEBUG_LOG(bb);
     }
 
     step7: {
         ++*qthink;
-        bb_t steps = next_steps(x, o, dead, n, all, not_lside, not_rside);
+        bb_t steps = std_next_steps(x, o, dead, n);
         if (steps == 0) {
             return -ONE_GAME_COST;
         }
-        const bb_t bb = select_step(steps);
+        const bb_t bb = select_step(rng, steps);
         *(bb & o ? &dead : &x) |= bb;
         PUT_DEBUG_LOG(bb);
     }
 
     step8: {
         ++*qthink;
-        bb_t steps = next_steps(x, o, dead, n, all, not_lside, not_rside);
+        bb_t steps = std_next_steps(x, o, dead, n);
         if (steps == 0) {
             return -ONE_GAME_COST;
         }
-        const bb_t bb = select_step(steps);
+        const bb_t bb = select_step(rng, steps);
         *(bb & o ? &dead : &x) |= bb;
         PUT_DEBUG_LOG(bb);
     }
 
     step9: {
         ++*qthink;
-        bb_t steps = next_steps(o, x, dead, n, all, not_lside, not_rside);
+        bb_t steps = std_next_steps(o, x, dead, n);
         if (steps == 0) {
             return +ONE_GAME_COST;
         }
-        const bb_t bb = select_step(steps);
+        const bb_t bb = select_step(rng, steps);
         *(bb & x ? &dead : &o) |= bb;
         PUT_DEBUG_LOG(bb);
     }
@@ -1095,22 +3051,22 @@ int rollout(
 
     step1: {
         ++*qthink;
-        bb_t steps = next_steps(x, o, dead, n, all, not_lside, not_rside);
+        bb_t steps = std_next_steps(x, o, dead, n);
         if (steps == 0) {
             return -ONE_GAME_COST;
         }
-        const bb_t bb = select_step(steps);
+        const bb_t bb = select_step(rng, steps);
         *(bb & o ? &dead : &x) |= bb;
         PUT_DEBUG_LOG(bb);
     }
 
     step2: {
         ++*qthink;
-        bb_t steps = next_steps(x, o, dead, n, all, not_lside, not_rside);
+        bb_t steps = std_next_steps(x, o, dead, n);
         if (steps == 0) {
             return -ONE_GAME_COST;
         }
-        const bb_t bb = select_step(steps);
+        const bb_t bb = select_step(rng, steps);
         *(bb & o ? &dead : &x) |= bb;
         PUT_DEBUG_LOG(bb);
     }
@@ -1124,6 +3080,352 @@ int rollout(
     goto step4;
 }
 
+#define DEFINE_STD_ROLLOUT(N) \
+    static int std_rollout_##N( \
+        bb_t x, bb_t o, bb_t dead, \
+        struct rng * restrict const rng, \
+        uint32_t * restrict const qthink DEBUG_LOG_ARG) \
+    { \
+        return std_rollout(x, o, dead, N, rng, qthink DEBUG_LOG_PASS); \
+    }
+
+DEFINE_STD_ROLLOUT(3)
+DEFINE_STD_ROLLOUT(4)
+DEFINE_STD_ROLLOUT(5)
+DEFINE_STD_ROLLOUT(6)
+DEFINE_STD_ROLLOUT(7)
+DEFINE_STD_ROLLOUT(8)
+DEFINE_STD_ROLLOUT(9)
+DEFINE_STD_ROLLOUT(10)
+DEFINE_STD_ROLLOUT(11)
+
+typedef int (*rollout_t)(bb_t x, bb_t o, bb_t dead, struct rng * rng, uint32_t * qthink DEBUG_LOG_ARG);
+
+static const rollout_t std_rollouts[MAX_STD_N + 1] = {
+    [3] = &std_rollout_3,
+    [4] = &std_rollout_4,
+    [5] = &std_rollout_5,
+    [6] = &std_rollout_6,
+    [7] = &std_rollout_7,
+    [8] = &std_rollout_8,
+    [9] = &std_rollout_9,
+    [10] = &std_rollout_10,
+    [11] = &std_rollout_11
+};
+
+/* Random rollout on the standard board, the variant for n is taken from a table. */
+int rollout(
+    bb_t x, bb_t o, bb_t dead, /* Game data */
+    const int n /* Geometry */,
+    struct rng * restrict const rng,
+    uint32_t * restrict const qthink DEBUG_LOG_ARG)
+{
+    return std_rollouts[n](x, o, dead, rng, qthink DEBUG_LOG_PASS);
+}
+
+static inline bb_t get_lane(uint64_t (*bb)[MAX_LANES], const int i)
+{
+    return bb[0][i] | (bb_t)bb[1][i] << 64;
+}
+
+static inline void set_lane(uint64_t (*bb)[MAX_LANES], const int i, const bb_t value)
+{
+    bb[0][i] = value;
+    bb[1][i] = value >> 64;
+}
+
+static void generic_lanes_next_steps(
+    struct rollout_lanes * restrict const lanes,
+    unsigned int live,
+    const int is_x)
+{
+    uint64_t (*my)[MAX_LANES] = is_x ? lanes->x : lanes->o;
+    uint64_t (*opp)[MAX_LANES] = is_x ? lanes->o : lanes->x;
+    while (live != 0) {
+        const int i = __builtin_ctz(live);
+        live &= live - 1;
+        const bb_t steps = lanes->next_steps(get_lane(my, i), get_lane(opp, i), get_lane(lanes->dead, i));
+        set_lane(lanes->steps, i, steps);
+    }
+}
+
+#ifdef HAS_X86_KERNELS
+
+/*
+ * SIMD kernels keep low and high halves of lane bitboards in separate
+ * registers, shifts carry bits between halves. A group of lanes is skipped
+ * when all of them are finished, the flood fill of a group goes on while any
+ * lane absorbs dead squares.
+ */
+
+__attribute__((target("avx2")))
+static inline void avx2_grow(
+    __m256i * restrict const result,
+    const __m256i * const bb,
+    const __m256i * const all,
+    const __m256i * const not_lside,
+    const __m256i * const not_rside,
+    const __m128i n,
+    const __m128i rn)
+{
+    const __m256i l0 = _mm256_and_si256(bb[0], not_lside[0]);
+    const __m256i l1 = _mm256_and_si256(bb[1], not_lside[1]);
+    const __m256i r0 = _mm256_and_si256(bb[0], not_rside[0]);
+    const __m256i r1 = _mm256_and_si256(bb[1], not_rside[1]);
+    const __m256i lbb0 = _mm256_or_si256(_mm256_srli_epi64(l0, 1), _mm256_slli_epi64(l1, 63));
+    const __m256i lbb1 = _mm256_srli_epi64(l1, 1);
+    const __m256i rbb0 = _mm256_slli_epi64(r0, 1);
+    const __m256i rbb1 = _mm256_or_si256(_mm256_slli_epi64(r1, 1), _mm256_srli_epi64(r0, 63));
+    const __m256i hgrow0 = _mm256_or_si256(bb[0], _mm256_or_si256(lbb0, rbb0));
+    const __m256i hgrow1 = _mm256_or_si256(bb[1], _mm256_or_si256(lbb1, rbb1));
+
+    const __m256i ubb0 = _mm256_and_si256(_mm256_sll_epi64(hgrow0, n), all[0]);
+    const __m256i ubb1 = _mm256_and_si256(_mm256_or_si256(_mm256_sll_epi64(hgrow1, n), _mm256_srl_epi64(hgrow0, rn)), all[1]);
+    const __m256i dbb0 = _mm256_or_si256(_mm256_srl_epi64(hgrow0, n), _mm256_sll_epi64(hgrow1, rn));
+    const __m256i dbb1 = _mm256_srl_epi64(hgrow1, n);
+    result[0] = _mm256_or_si256(hgrow0, _mm256_or_si256(ubb0, dbb0));
+    result[1] = _mm256_or_si256(hgrow1, _mm256_or_si256(ubb1, dbb1));
+}
+
+__attribute__((target("avx2")))
+static void avx2_lanes_next_steps(
+    struct rollout_lanes * restrict const lanes,
+    const unsigned int live,
+    const int is_x)
+{
+    uint64_t (*my)[MAX_LANES] = is_x ? lanes->x : lanes->o;
+    uint64_t (*opp)[MAX_LANES] = is_x ? lanes->o : lanes->x;
+    const __m128i n = _mm_cvtsi32_si128(lanes->n);
+    const __m128i rn = _mm_cvtsi32_si128(64 - lanes->n);
+    const __m256i all[2] = {
+        _mm256_set1_epi64x((uint64_t)lanes->all),
+        _mm256_set1_epi64x((uint64_t)(lanes->all >> 64))
+    };
+    const __m256i not_lside[2] = {
+        _mm256_set1_epi64x((uint64_t)lanes->not_lside),
+        _mm256_set1_epi64x((uint64_t)(lanes->not_lside >> 64))
+    };
+    const __m256i not_rside[2] = {
+        _mm256_set1_epi64x((uint64_t)lanes->not_rside),
+        _mm256_set1_epi64x((uint64_t)(lanes->not_rside >> 64))
+    };
+
+    for (int i=0; i<MAX_LANES; i += 4) {
+        if (((live >> i) & 0xF) == 0) {
+            continue;
+        }
+
+        __m256i my_live[2];
+        __m256i opp_dead[2];
+        __m256i place[2];
+        for (int h=0; h<2; ++h) {
+            const __m256i my_bb = _mm256_load_si256((const __m256i *)(my[h] + i));
+            const __m256i opp_bb = _mm256_load_si256((const __m256i *)(opp[h] + i));
+            const __m256i dead = _mm256_load_si256((const __m256i *)(lanes->dead[h] + i));
+            const __m256i empty = _mm256_xor_si256(all[h], _mm256_or_si256(my_bb, opp_bb));
+            opp_dead[h] = _mm256_and_si256(opp_bb, dead);
+            my_live[h] = _mm256_andnot_si256(dead, my_bb);
+            place[h] = _mm256_or_si256(empty, _mm256_xor_si256(opp_bb, opp_dead[h]));
+        }
+
+        for (;;) {
+            __m256i cloud[2];
+            avx2_grow(cloud, my_live, all, not_lside, not_rside, n, rn);
+            const __m256i extra0 = _mm256_and_si256(cloud[0], opp_dead[0]);
+            const __m256i extra1 = _mm256_and_si256(cloud[1], opp_dead[1]);
+            const __m256i extra = _mm256_or_si256(extra0, extra1);
+            if (_mm256_testz_si256(extra, extra)) {
+                _mm256_store_si256((__m256i *)(lanes->steps[0] + i), _mm256_and_si256(cloud[0], place[0]));
+                _mm256_store_si256((__m256i *)(lanes->steps[1] + i), _mm256_and_si256(cloud[1], place[1]));
+                break;
+            }
+
+            my_live[0] = _mm256_or_si256(my_live[0], extra0);
+            my_live[1] = _mm256_or_si256(my_live[1], extra1);
+            opp_dead[0] = _mm256_xor_si256(opp_dead[0], extra0);
+            opp_dead[1] = _mm256_xor_si256(opp_dead[1], extra1);
+        }
+    }
+}
+
+__attribute__((target("avx512f")))
+static inline void avx512_grow(
+    __m512i * restrict const result,
+    const __m512i * const bb,
+    const __m512i * const all,
+    const __m512i * const not_lside,
+    const __m512i * const not_rside,
+    const __m128i n,
+    const __m128i rn)
+{
+    const __m512i l0 = _mm512_and_si512(bb[0], not_lside[0]);
+    const __m512i l1 = _mm512_and_si512(bb[1], not_lside[1]);
+    const __m512i r0 = _mm512_and_si512(bb[0], not_rside[0]);
+    const __m512i r1 = _mm512_and_si512(bb[1], not_rside[1]);
+    const __m512i lbb0 = _mm512_or_si512(_mm512_srli_epi64(l0, 1), _mm512_slli_epi64(l1, 63));
+    const __m512i lbb1 = _mm512_srli_epi64(l1, 1);
+    const __m512i rbb0 = _mm512_slli_epi64(r0, 1);
+    const __m512i rbb1 = _mm512_or_si512(_mm512_slli_epi64(r1, 1), _mm512_srli_epi64(r0, 63));
+    const __m512i hgrow0 = _mm512_or_si512(bb[0], _mm512_or_si512(lbb0, rbb0));
+    const __m512i hgrow1 = _mm512_or_si512(bb[1], _mm512_or_si512(lbb1, rbb1));
+
+    const __m512i ubb0 = _mm512_and_si512(_mm512_sll_epi64(hgrow0, n), all[0]);
+    const __m512i ubb1 = _mm512_and_si512(_mm512_or_si512(_mm512_sll_epi64(hgrow1, n), _mm512_srl_epi64(hgrow0, rn)), all[1]);
+    const __m512i dbb0 = _mm512_or_si512(_mm512_srl_epi64(hgrow0, n), _mm512_sll_epi64(hgrow1, rn));
+    const __m512i dbb1 = _mm512_srl_epi64(hgrow1, n);
+    result[0] = _mm512_or_si512(hgrow0, _mm512_or_si512(ubb0, dbb0));
+    result[1] = _mm512_or_si512(hgrow1, _mm512_or_si512(ubb1, dbb1));
+}
+
+__attribute__((target("avx512f")))
+static void avx512_lanes_next_steps(
+    struct rollout_lanes * restrict const lanes,
+    const unsigned int live,
+    const int is_x)
+{
+    uint64_t (*my)[MAX_LANES] = is_x ? lanes->x : lanes->o;
+    uint64_t (*opp)[MAX_LANES] = is_x ? lanes->o : lanes->x;
+    const __m128i n = _mm_cvtsi32_si128(lanes->n);
+    const __m128i rn = _mm_cvtsi32_si128(64 - lanes->n);
+    const __m512i all[2] = {
+        _mm512_set1_epi64((uint64_t)lanes->all),
+        _mm512_set1_epi64((uint64_t)(lanes->all >> 64))
+    };
+    const __m512i not_lside[2] = {
+        _mm512_set1_epi64((uint64_t)lanes->not_lside),
+        _mm512_set1_epi64((uint64_t)(lanes->not_lside >> 64))
+    };
+    const __m512i not_rside[2] = {
+        _mm512_set1_epi64((uint64_t)lanes->not_rside),
+        _mm512_set1_epi64((uint64_t)(lanes->not_rside >> 64))
+    };
+
+    for (int i=0; i<MAX_LANES; i += 8) {
+        if (((live >> i) & 0xFF) == 0) {
+            continue;
+        }
+
+        __m512i my_live[2];
+        __m512i opp_dead[2];
+        __m512i place[2];
+        for (int h=0; h<2; ++h) {
+            const __m512i my_bb = _mm512_load_si512(my[h] + i);
+            const __m512i opp_bb = _mm512_load_si512(opp[h] + i);
+            const __m512i dead = _mm512_load_si512(lanes->dead[h] + i);
+            const __m512i empty = _mm512_xor_si512(all[h], _mm512_or_si512(my_bb, opp_bb));
+            opp_dead[h] = _mm512_and_si512(opp_bb, dead);
+            my_live[h] = _mm512_andnot_si512(dead, my_bb);
+            place[h] = _mm512_or_si512(empty, _mm512_xor_si512(opp_bb, opp_dead[h]));
+        }
+
+        for (;;) {
+            __m512i cloud[2];
+            avx512_grow(cloud, my_live, all, not_lside, not_rside, n, rn);
+            const __m512i extra0 = _mm512_and_si512(cloud[0], opp_dead[0]);
+            const __m512i extra1 = _mm512_and_si512(cloud[1], opp_dead[1]);
+            const __m512i extra = _mm512_or_si512(extra0, extra1);
+            if (_mm512_test_epi64_mask(extra, extra) == 0) {
+                _mm512_store_si512(lanes->steps[0] + i, _mm512_and_si512(cloud[0], place[0]));
+                _mm512_store_si512(lanes->steps[1] + i, _mm512_and_si512(cloud[1], place[1]));
+                break;
+            }
+
+            my_live[0] = _mm512_or_si512(my_live[0], extra0);
+            my_live[1] = _mm512_or_si512(my_live[1], extra1);
+            opp_dead[0] = _mm512_xor_si512(opp_dead[0], extra0);
+            opp_dead[1] = _mm512_xor_si512(opp_dead[1], extra1);
+        }
+    }
+}
+
+#endif
+
+static lanes_kernel_t get_lanes_kernel(void)
+{
+    #ifdef HAS_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            return &avx512_lanes_next_steps;
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            return &avx2_lanes_next_steps;
+        }
+    #endif
+
+    return &generic_lanes_next_steps;
+}
+
+/*
+ * Plays qlanes random rollouts from the same position in lockstep and returns
+ * the sum of results. All lanes step for the same side, so next steps of live
+ * lanes are calculated with one kernel call and a lane is masked out when it
+ * has no steps. Steps are selected in the lane order with one generator, the
+ * batch of one lane is exactly the rollout.
+ */
+int batch_rollout(
+    const lanes_kernel_t kernel,
+    const bb_t x, const bb_t o, const bb_t dead, /* Game data */
+    const int n, const bb_t all, const bb_t not_lside, const bb_t not_rside,
+    const next_steps_t next_steps /* Geometry */,
+    const int qlanes,
+    struct rng * restrict const rng,
+    uint32_t * restrict const qthink)
+{
+    struct rollout_lanes storage;
+    struct rollout_lanes * restrict const lanes = &storage;
+    for (int i=0; i<MAX_LANES; ++i) {
+        set_lane(lanes->x, i, x);
+        set_lane(lanes->o, i, o);
+        set_lane(lanes->dead, i, dead);
+    }
+    lanes->n = n;
+    lanes->all = all;
+    lanes->not_lside = not_lside;
+    lanes->not_rside = not_rside;
+    lanes->next_steps = next_steps;
+
+    int result = 0;
+    int all_qsteps = pop_count(x|o) + pop_count(dead);
+    unsigned int live = (1u << qlanes) - 1;
+    for (;;) {
+        const int is_x = (all_qsteps/3) % 2 == 0;
+        uint64_t (*my)[MAX_LANES] = is_x ? lanes->x : lanes->o;
+        uint64_t (*opp)[MAX_LANES] = is_x ? lanes->o : lanes->x;
+        if (all_qsteps == 0 || all_qsteps == 3) {
+            const bb_t first = BB_SQUARE(all_qsteps == 0 ? 0 : n*n-1);
+            for (int i=0; i<qlanes; ++i) {
+                set_lane(lanes->steps, i, first);
+            }
+        } else {
+            kernel(lanes, live, is_x);
+        }
+
+        unsigned int mask = live;
+        while (mask != 0) {
+            const int i = __builtin_ctz(mask);
+            mask &= mask - 1;
+
+            ++*qthink;
+            const bb_t steps = get_lane(lanes->steps, i);
+            if (steps == 0) {
+                result += is_x ? -ONE_GAME_COST : +ONE_GAME_COST;
+                live ^= 1u << i;
+                continue;
+            }
+
+            const bb_t bb = select_step(rng, steps);
+            uint64_t (*target)[MAX_LANES] = bb & get_lane(opp, i) ? lanes->dead : my;
+            set_lane(target, i, get_lane(target, i) | bb);
+        }
+
+        if (live == 0) {
+            return result;
+        }
+
+        ++all_qsteps;
+    }
+}
+
 struct nn_rollout_ctx
 {
     /* Game data */
@@ -1131,33 +3433,127 @@ struct nn_rollout_ctx
     bb_t o;
     bb_t dead;
 
-    /* Geometry */
+    /* Geometry, next_steps is specialised for n */
     int n;
     bb_t all;
     bb_t not_lside;
     bb_t not_rside;
+    next_steps_t next_steps;
 
     /* NN data */
     const struct nn * nn;
     int * weights;
+
+    /*
+     * First layer outputs for each NN step and active side, they are updated
+     * incrementally on every rollout step. Only accumulators marked in the
+     * mask are valid, others are calculated on the first use.
+     */
+    nn_value_t * accumulators;
+    unsigned int accumulators_mask;
+
+    struct rng * rng;
 };
 
-static inline bb_t nn_select_step(
+static inline int get_accumulator_index(const int nstep, const int active)
+{
+    return 2 * nstep + (active == ACTIVE_O);
+}
+
+static nn_value_t * get_accumulator(
+    struct nn_rollout_ctx * restrict const ctx,
+    const int nstep,
+    const int active)
+{
+    const int index = get_accumulator_index(nstep, active);
+    nn_value_t * restrict const accumulator = ctx->accumulators + index * ctx->nn->MID;
+    const unsigned int mask = 1u << index;
+    if ((ctx->accumulators_mask & mask) == 0) {
+        const bb_t my = active == ACTIVE_X ? ctx->x : ctx->o;
+        const bb_t opp = active == ACTIVE_X ? ctx->o : ctx->x;
+        calc_nn_layer1(ctx->nn, nstep, ctx->n, my, opp, ctx->dead, accumulator);
+        ctx->accumulators_mask |= mask;
+    }
+    return accumulator;
+}
+
+static inline void update_accumulator(
     const struct nn_rollout_ctx * const ctx,
+    const int index,
+    const int sq,
+    const int old_code,
+    const int new_code)
+{
+    const struct nn * const nn = ctx->nn;
+    const int MID = nn->MID;
+    const int nstep = index / 2;
+    const size_t sub = (QCODES*sq + old_code) * MID;
+    const size_t add = (QCODES*sq + new_code) * MID;
+    nn_value_t * restrict const accumulator = ctx->accumulators + index * MID;
+    switch (nn->precision) {
+        case NN_INT16:
+            nn->kernels->update_row16(accumulator, nn->columns16[nstep] + sub, nn->columns16[nstep] + add, MID);
+            break;
+        case NN_INT8:
+            nn->kernels->update_row8(accumulator, nn->columns8[nstep] + sub, nn->columns8[nstep] + add, MID, nn->shift8);
+            break;
+        default:
+            nn->kernels->update_row(accumulator, nn->columns[nstep] + sub, nn->columns[nstep] + add, MID);
+            break;
+    }
+}
+
+/* Do step in the rollout position and update valid accumulators. */
+static void nn_do_step(
+    struct nn_rollout_ctx * restrict const ctx,
+    const bb_t bb,
+    const int active)
+{
+    const int old_x_code = get_square_code(bb, ctx->x, ctx->o, ctx->dead);
+    const int old_o_code = get_square_code(bb, ctx->o, ctx->x, ctx->dead);
+
+    if (active == ACTIVE_X) {
+        *(bb & ctx->o ? &ctx->dead : &ctx->x) |= bb;
+    } else {
+        *(bb & ctx->x ? &ctx->dead : &ctx->o) |= bb;
+    }
+
+    unsigned int mask = ctx->accumulators_mask;
+    if (mask == 0) {
+        return;
+    }
+
+    const int sq = first_one(bb);
+    const int new_x_code = get_square_code(bb, ctx->x, ctx->o, ctx->dead);
+    const int new_o_code = get_square_code(bb, ctx->o, ctx->x, ctx->dead);
+    while (mask != 0) {
+        const int index = __builtin_ctz(mask);
+        mask &= mask - 1;
+        if (index & 1) {
+            update_accumulator(ctx, index, sq, old_o_code, new_o_code);
+        } else {
+            update_accumulator(ctx, index, sq, old_x_code, new_x_code);
+        }
+    }
+}
+
+static inline bb_t nn_select_step(
+    struct nn_rollout_ctx * restrict const ctx,
     const int nstep,
     const int active)
 {
     const struct nn * const nn = ctx->nn;
     const bb_t my = active == ACTIVE_X ? ctx->x : ctx->o;
     const bb_t opp = active == ACTIVE_X ? ctx->o : ctx->x;
-    bb_t steps = next_steps(my, opp, ctx->dead, ctx->n, ctx->all, ctx->not_lside, ctx->not_rside);
+    bb_t steps = ctx->next_steps(my, opp, ctx->dead);
     const int qbits = pop_count(steps);
     if (qbits <= 1) {
         return steps;
     }
 
     const bb_t ignore = ctx->all ^ steps;
-    get_nn_weights(nn, ignore, nstep, ctx->n, my, opp, ctx->dead, ctx->weights);
+    const nn_value_t * const accumulator = get_accumulator(ctx, nstep, active);
+    calc_nn_weights(nn, ignore, nstep, ctx->n, accumulator, ctx->weights);
 
     int qbest = 1;
     int best[8*sizeof(bb_t)];;
@@ -1183,7 +3579,7 @@ static inline bb_t nn_select_step(
         }
     }
 
-    const int index = qbest == 1 ? 0 : rand() % qbest;
+    const int index = qbest == 1 ? 0 : rng_uniform(ctx->rng, qbest);
     return BB_SQUARE(best[index]);
 }
 
@@ -1194,6 +3590,10 @@ int nn_rollout(
     static void *labels[10] =
         { &&step0, &&step1, &&step2, &&step3, &&step4,
           &&step5, &&step6, &&step7, &&step8, &&step9 };
+    nn_value_t accumulators[2 * QNN_STEPS * ctx->nn->MID];
+    ctx->accumulators = accumulators;
+    ctx->accumulators_mask = 0;
+
     const int all_qsteps = pop_count(ctx->x|ctx->o) + pop_count(ctx->dead);
     const int index = all_qsteps < 10 ? all_qsteps : ((all_qsteps-4) %6) + 4;
     goto *labels[index];
@@ -1204,7 +3604,7 @@ int nn_rollout(
         if (bb == 0) {
             return +ONE_GAME_COST;
         }
-        *(bb & ctx->x ? &ctx->dead : &ctx->o) |= bb;
+        nn_do_step(ctx, bb, ACTIVE_O);
         PUT_DEBUG_LOG(bb);
     }
 
@@ -1214,7 +3614,7 @@ int nn_rollout(
         if (bb == 0) {
             return +ONE_GAME_COST;
         }
-        *(bb & ctx->x ? &ctx->dead : &ctx->o) |= bb;
+        nn_do_step(ctx, bb, ACTIVE_O);
         PUT_DEBUG_LOG(bb);
     }
 
@@ -1224,7 +3624,7 @@ int nn_rollout(
         if (bb == 0) {
             return -ONE_GAME_COST;
         }
-        *(bb & ctx->o ? &ctx->dead : &ctx->x) |= bb;
+        nn_do_step(ctx, bb, ACTIVE_X);
         PUT_DEBUG_LOG(bb);
     }
 
@@ -1234,7 +3634,7 @@ int nn_rollout(
         if (bb == 0) {
             return -ONE_GAME_COST;
         }
-        *(bb & ctx->o ? &ctx->dead : &ctx->x) |= bb;
+        nn_do_step(ctx, bb, ACTIVE_X);
         PUT_DEBUG_LOG(bb);
     }
 
@@ -1244,7 +3644,7 @@ int nn_rollout(
         if (bb == 0) {
             return -ONE_GAME_COST;
         }
-        *(bb & ctx->o ? &ctx->dead : &ctx->x) |= bb;
+        nn_do_step(ctx, bb, ACTIVE_X);
         PUT_DEBUG_LOG(bb);
     }
 
@@ -1254,7 +3654,7 @@ int nn_rollout(
         if (bb == 0) {
             return +ONE_GAME_COST;
         }
-        *(bb & ctx->x ? &ctx->dead : &ctx->o) |= bb;
+        nn_do_step(ctx, bb, ACTIVE_O);
         PUT_DEBUG_LOG(bb);
     }
 
@@ -1263,7 +3663,7 @@ int nn_rollout(
     step0: {
         ++*qthink;
         const bb_t bb = BB_SQUARE(0);
-        ctx->x |= bb;
+        nn_do_step(ctx, bb, ACTIVE_X);
         PUT_DEBUG_LOG(bb);
     }
 
@@ -1273,7 +3673,7 @@ int nn_rollout(
         if (bb == 0) {
             return -ONE_GAME_COST;
         }
-        *(bb & ctx->o ? &ctx->dead : &ctx->x) |= bb;
+        nn_do_step(ctx, bb, ACTIVE_X);
         PUT_DEBUG_LOG(bb);
     }
 
@@ -1283,7 +3683,7 @@ int nn_rollout(
         if (bb == 0) {
             return -ONE_GAME_COST;
         }
-        *(bb & ctx->o ? &ctx->dead : &ctx->x) |= bb;
+        nn_do_step(ctx, bb, ACTIVE_X);
         PUT_DEBUG_LOG(bb);
     }
 
@@ -1291,47 +3691,106 @@ int nn_rollout(
         ++*qthink;
         const int sq = ctx->n * ctx->n - 1;
         const bb_t bb = BB_SQUARE(sq);
-        ctx->o |= bb;
+        nn_do_step(ctx, bb, ACTIVE_O);
         PUT_DEBUG_LOG(bb);
     }
 
     goto step4;
 }
 
-static inline int is_leaf(const struct node * const node)
+static inline int get_qchildren(const struct node * const node)
 {
-    return node->qchildren == 0;
+    return __atomic_load_n(&node->qchildren, __ATOMIC_ACQUIRE);
 }
 
-static inline int is_terminal(const struct node * const node)
+static inline struct node * get_node(
+    struct multiallocator * restrict const multiallocator,
+    size_t inode)
 {
-    return node->qchildren == TERMINAL_MARK;
+    return multiallocator_get(multiallocator, 0, inode);
 }
 
-static inline struct node * get_node(
-    struct mcts_ai * restrict const me,
-    size_t inode)
+static inline int try_lock_leaf(struct node * restrict const node)
+{
+    uint16_t expected = 0;
+    return __atomic_compare_exchange_n(&node->qchildren, &expected, EXPANDING_MARK,
+        0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void unlock_leaf(
+    struct node * restrict const node,
+    const uint16_t qchildren)
 {
-    return multiallocator_get(me->multiallocator, 0, inode);
+    __atomic_store_n(&node->qchildren, qchildren, __ATOMIC_RELEASE);
 }
 
+static inline void add_virtual_loss(
+    struct node * restrict const node,
+    const int vloss)
+{
+    __atomic_add_fetch(&node->qgames, 1, __ATOMIC_RELAXED);
+    if (vloss != 0) {
+        __atomic_sub_fetch(&node->score, vloss, __ATOMIC_RELAXED);
+    }
+}
+
+static int link_transposition(
+    struct mcts_worker * restrict const worker,
+    struct node * restrict const node,
+    const uint64_t hash)
+{
+    const struct transposition * const entry = worker->tt + (hash & TT_MASK);
+    const uint64_t check = __atomic_load_n(&entry->check, __ATOMIC_ACQUIRE);
+    const uint64_t data = __atomic_load_n(&entry->data, __ATOMIC_ACQUIRE);
+    if ((check ^ data) != hash) {
+        return 0;
+    }
+
+    const int qchildren = (data >> 32) & 0xFFFF;
+    if (qchildren == 0) {
+        return 0;
+    }
+
+    if (data >> 48) {
+        __atomic_or_fetch(&node->square_flags, PARTIAL_NODE, __ATOMIC_RELAXED);
+    }
+
+    node->children = (uint32_t)data;
+    unlock_leaf(node, qchildren);
+    return qchildren;
+}
+
+static void store_transposition(
+    struct mcts_worker * restrict const worker,
+    const uint64_t hash,
+    const uint32_t children,
+    const uint16_t qchildren,
+    const int is_partial)
+{
+    struct transposition * restrict const entry = worker->tt + (hash & TT_MASK);
+    const uint64_t data = children | (uint64_t)qchildren << 32 | (uint64_t)(is_partial != 0) << 48;
+    __atomic_store_n(&entry->data, data, __ATOMIC_RELEASE);
+    __atomic_store_n(&entry->check, hash ^ data, __ATOMIC_RELEASE);
+}
+
+/*
+ * Every node in the game path has been already counted in qgames (and
+ * penalized with virtual loss vloss) during the descent, so here the
+ * virtual loss is replaced with the real result.
+ */
 static void update_game_history(
     const int result,
+    const int vloss,
     struct node * * game, const size_t game_len,
     int active, int all_qsteps)
 {
     struct node * restrict const root = game[0];
-    ++root->qgames;
-    root->score += result;
+    __atomic_add_fetch(&root->score, result, __ATOMIC_RELAXED);
 
     for (int i=1; i<game_len; ++i) {
         struct node * restrict const node = game[i];
-        ++node->qgames;
-        if (active == ACTIVE_X) {
-            node->score += result;
-        } else {
-            node->score -= result;
-        }
+        const int delta = active == ACTIVE_X ? result : -result;
+        __atomic_add_fetch(&node->score, delta + vloss, __ATOMIC_RELAXED);
 
         ++all_qsteps;
         if ((all_qsteps % 3) == 0) {
@@ -1340,28 +3799,161 @@ static void update_game_history(
     }
 }
 
-static int ubc_select_step(
-    struct mcts_ai * restrict const me,
-    const struct node * const node)
+static void revert_game_history(
+    const int vloss,
+    struct node * * game, const size_t game_len)
 {
-    const int qchildren = node->qchildren;
-    if (qchildren == 1) {
-        return 0;
+    for (int i=0; i<game_len; ++i) {
+        struct node * restrict const node = game[i];
+        __atomic_sub_fetch(&node->qgames, 1, __ATOMIC_RELAXED);
+        if (i > 0 && vloss != 0) {
+            __atomic_add_fetch(&node->score, vloss, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static inline int get_proof(const struct node * const node)
+{
+    return __atomic_load_n(&node->square_flags, __ATOMIC_RELAXED) & PROOF_MASK;
+}
+
+static inline void set_node_flags(
+    struct node * restrict const node,
+    const int flags)
+{
+    __atomic_or_fetch(&node->square_flags, flags, __ATOMIC_RELAXED);
+}
+
+/* Side which made the last step, the empty board is treated as after O turn. */
+static inline int get_mover(const int all_qsteps)
+{
+    const int active = (all_qsteps/3) % 2 == 0 ? ACTIVE_X : ACTIVE_O;
+    return all_qsteps % 3 != 0 ? active : active ^ 3;
+}
+
+static inline int get_proof_result(
+    const int proof,
+    const int mover)
+{
+    const int is_x_win = (proof == PROVEN_WIN) == (mover == ACTIVE_X);
+    return is_x_win ? +ONE_GAME_COST : -ONE_GAME_COST;
+}
+
+/*
+ * MCTS-Solver rule, child_proof is given for the side to move in the parent.
+ * The parent is won when any child is won, and it is lost when all children
+ * are lost and no step is cut. Returns the proof of the parent for the side
+ * which moved into it or zero.
+ */
+static int prove_parent(
+    const struct node * const parent,
+    const int child_proof,
+    const struct node * const children,
+    const int is_same_mover)
+{
+    int proof = PROVEN_WIN;
+    if (child_proof != PROVEN_WIN) {
+        if (__atomic_load_n(&parent->square_flags, __ATOMIC_RELAXED) & PARTIAL_NODE) {
+            return 0;
+        }
+
+        const int qchildren = get_qchildren(parent);
+        for (int i=0; i<qchildren; ++i) {
+            if (get_proof(children + i) != PROVEN_LOSS) {
+                return 0;
+            }
+        }
+        proof = PROVEN_LOSS;
+    }
+
+    return is_same_mover ? proof : proof ^ PROOF_MASK;
+}
+
+/* The proof of the last node in the game path goes up while it proves parents. */
+static void propagate_step_proof(
+    struct multiallocator * restrict const multiallocator,
+    struct node * * game, const size_t game_len,
+    const int start_qsteps)
+{
+    for (size_t i=game_len-1; i>0; --i) {
+        const int child_proof = get_proof(game[i]);
+        if (child_proof == 0) {
+            return;
+        }
+
+        struct node * restrict const parent = game[i-1];
+        const struct node * const children = get_node(multiallocator, parent->children);
+        const int all_qsteps = start_qsteps + i - 1;
+        const int is_same_mover = get_mover(all_qsteps) == get_mover(all_qsteps + 1);
+        const int proof = prove_parent(parent, child_proof, children, is_same_mover);
+        if (proof == 0) {
+            return;
+        }
+
+        set_node_flags(parent, proof);
     }
+}
+
+/*
+ * UCB weight of a child is ev + C * sqrt(log(total) / qgames), it is computed
+ * as ev + C * sqrt(log(total)) * inv_sqrt(qgames) with ev = score * inv_sqrt^2,
+ * so small visit counts need no division or libm call per child. Tables keep
+ * 1.0f / sqrtf(q) values which the SIMD kernel computes directly.
+ * Children statistics are packed struct node arrays in both step and turn
+ * trees, so one selection is used for them. Proven losses are selected only
+ * when all children are lost, a proven win is selected at once. Ties are
+ * broken with the worker generator over best children in index order in
+ * every kernel.
+ */
+
+static inline float ubc_log(
+    const struct mcts_ai * const me,
+    const int32_t qgames)
+{
+    return (uint32_t)qgames < UBC_TABLE_SZ ? me->ubc_log[qgames] : logf(qgames);
+}
+
+static inline float ubc_inv_sqrt(
+    const struct mcts_ai * const me,
+    const int32_t qgames)
+{
+    return (uint32_t)qgames < UBC_TABLE_SZ ? me->ubc_inv_sqrt[qgames] : 1.0f / sqrtf(qgames);
+}
+
+static inline float get_ubc_factor(
+    const struct mcts_ai * const me,
+    const struct node * const node)
+{
+    const int32_t total = __atomic_load_n(&node->qgames, __ATOMIC_RELAXED);
+    return me->C * sqrtf(ubc_log(me, total));
+}
+
+static inline float get_ubc_weight(
+    const struct mcts_ai * const me,
+    const struct node * const child,
+    const float factor)
+{
+    const int32_t qgames = __atomic_load_n(&child->qgames, __ATOMIC_RELAXED);
+    const int32_t score = __atomic_load_n(&child->score, __ATOMIC_RELAXED);
+    const float inv_sqrt = ubc_inv_sqrt(me, qgames);
+    const float ev = qgames ? SCORE_FACTOR * score * inv_sqrt * inv_sqrt : 2;
+    const int proof = get_proof(child);
+    return proof == 0 ? ev + factor * inv_sqrt : proof == PROVEN_WIN ? 1.0e+9f : -1.0e+9f;
+}
 
+static int generic_ubc_select(
+    const struct mcts_ai * const me,
+    struct rng * restrict const rng,
+    const struct node * const node,
+    const int qchildren,
+    const struct node * const children)
+{
     int qbest = 0;
     int best_indexes[qchildren];
     float best_weight = -1.0e+10f;
-    const float total = node->qgames;
-    const float log_total = log(total);
-    const struct node * child = get_node(me, node->children);
+    const float factor = get_ubc_factor(me, node);
     for (int i=0; i<qchildren; ++i) {
-        const float score = child->qgames ? SCORE_FACTOR * child->score : 2;
-        const float qgames = child->qgames ? child->qgames : 1;
-        const float ev = score / qgames;
-        const float investigation = sqrt(log_total/qgames);
-        const float weight = ev + me->C * investigation;
-
+        const float weight = get_ubc_weight(me, children + i, factor);
         if (weight >= best_weight) {
             if (weight != best_weight) {
                 qbest = 0;
@@ -1369,53 +3961,195 @@ static int ubc_select_step(
             }
             best_indexes[qbest++] = i;
         }
-
-        ++child;
     }
 
-    const int index = qbest == 1 ? 0 : rand() % qbest;
-    const int choice = best_indexes[index];
-    return choice;
+    const int index = qbest == 1 ? 0 : rng_uniform(rng, qbest);
+    return best_indexes[index];
 }
 
-int simulate(
-    struct mcts_ai * restrict const me,
-    struct node * restrict node,
-    uint32_t * restrict const qthink,
-    bb_t x, bb_t o, bb_t dead, /* Game data */
-    const int n, const bb_t all, const bb_t not_lside, const bb_t not_rside /* Geometry */)
+#ifdef HAS_X86_KERNELS
+
+/*
+ * Eight children are taken with gathers, the tail is gathered with a mask, so
+ * equal children always get equal weights. The first pass stores weights and
+ * finds the maximum, the second one collects ties with movemask.
+ */
+__attribute__((target("avx2")))
+static int avx2_ubc_select(
+    const struct mcts_ai * const me,
+    struct rng * restrict const rng,
+    const struct node * const node,
+    const int qchildren,
+    const struct node * const children)
 {
-    struct node * * game = me->game;
-    size_t game_len = 0;
+    const float factor = get_ubc_factor(me, node);
+    const __m256i offsets = _mm256_setr_epi32(0, 4, 8, 12, 16, 20, 24, 28);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i proof_mask = _mm256_set1_epi32(PROOF_MASK);
+    const __m256i win = _mm256_set1_epi32(PROVEN_WIN);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 two = _mm256_set1_ps(2.0f);
+    const __m256 score_factor = _mm256_set1_ps(SCORE_FACTOR);
+    const __m256 ubc_factor = _mm256_set1_ps(factor);
+    const __m256 win_weight = _mm256_set1_ps(1.0e+9f);
+    const __m256 loss_weight = _mm256_set1_ps(-1.0e+9f);
+
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256 none = _mm256_set1_ps(-1.0e+10f);
+
+    float weights[qchildren + 7];
+    __m256 best = none;
+    for (int i=0; i<qchildren; i += 8) {
+        /* Every node is {square_flags, qchildren}, score, qgames, children. */
+        const int * const base = (const int *)(children + i);
+        const __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(qchildren - i), lanes);
+        const __m256i head = _mm256_mask_i32gather_epi32(zero, base, offsets, mask, 4);
+        const __m256i score = _mm256_mask_i32gather_epi32(zero, base + 1, offsets, mask, 4);
+        const __m256i qgames = _mm256_mask_i32gather_epi32(zero, base + 2, offsets, mask, 4);
+
+        const __m256 q = _mm256_max_ps(_mm256_cvtepi32_ps(qgames), one);
+        const __m256 inv_sqrt = _mm256_div_ps(one, _mm256_sqrt_ps(q));
+        __m256 ev = _mm256_mul_ps(score_factor, _mm256_cvtepi32_ps(score));
+        ev = _mm256_mul_ps(_mm256_mul_ps(ev, inv_sqrt), inv_sqrt);
+        ev = _mm256_blendv_ps(ev, two, _mm256_castsi256_ps(_mm256_cmpeq_epi32(qgames, zero)));
+        __m256 weight = _mm256_add_ps(ev, _mm256_mul_ps(ubc_factor, inv_sqrt));
+
+        const __m256i proof = _mm256_and_si256(head, proof_mask);
+        const __m256 is_win = _mm256_castsi256_ps(_mm256_cmpeq_epi32(proof, win));
+        const __m256 is_proven = _mm256_castsi256_ps(_mm256_cmpgt_epi32(proof, zero));
+        weight = _mm256_blendv_ps(weight, _mm256_blendv_ps(loss_weight, win_weight, is_win), is_proven);
+        weight = _mm256_blendv_ps(none, weight, _mm256_castsi256_ps(mask));
+
+        _mm256_storeu_ps(weights + i, weight);
+        best = _mm256_max_ps(best, weight);
+    }
+
+    __m128 best4 = _mm_max_ps(_mm256_castps256_ps128(best), _mm256_extractf128_ps(best, 1));
+    best4 = _mm_max_ps(best4, _mm_movehl_ps(best4, best4));
+    best4 = _mm_max_ss(best4, _mm_shuffle_ps(best4, best4, 1));
+    const __m256 target = _mm256_broadcastss_ps(best4);
 
-    const int start_qsteps = pop_count(x|o) + pop_count(dead);
-    const int start_mod = (start_qsteps/3) % 2;
-    const int start_active = start_mod == 0 ? ACTIVE_X : ACTIVE_O;
+    int qbest = 0;
+    int best_indexes[qchildren];
+    for (int i=0; i<qchildren; i += 8) {
+        unsigned int mask = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(weights + i), target, _CMP_EQ_OQ));
+        while (mask != 0) {
+            best_indexes[qbest++] = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
 
-    bb_t * my = start_active == ACTIVE_X ? &x : &o;
+    const int index = qbest == 1 ? 0 : rng_uniform(rng, qbest);
+    return best_indexes[index];
+}
+
+#endif
+
+static void init_ubc(struct mcts_ai * restrict const me)
+{
+    me->ubc_log[0] = 0.0f;
+    me->ubc_inv_sqrt[0] = 1.0f;
+    for (int i=1; i<UBC_TABLE_SZ; ++i) {
+        me->ubc_log[i] = logf(i);
+        me->ubc_inv_sqrt[i] = 1.0f / sqrtf(i);
+    }
+
+    me->ubc_kernel = &generic_ubc_select;
+    #ifdef HAS_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            me->ubc_kernel = &avx2_ubc_select;
+        }
+    #endif
+}
+
+static inline int ubc_select(
+    const struct mcts_ai * const me,
+    struct rng * restrict const rng,
+    const struct node * const node,
+    const int qchildren,
+    const struct node * const children)
+{
+    return qchildren == 1 ? 0 : me->ubc_kernel(me, rng, node, qchildren, children);
+}
+
+static int ubc_select_step(
+    struct mcts_worker * restrict const worker,
+    const struct node * const node,
+    const int qchildren)
+{
+    const struct node * const children = get_node(worker->multiallocator, node->children);
+    return ubc_select(worker->owner, &worker->rng, node, qchildren, children);
+}
+
+int simulate(
+    struct mcts_worker * restrict const worker,
+    struct node * restrict node,
+    uint32_t * restrict const qthink,
+    bb_t x, bb_t o, bb_t dead, uint64_t hash, /* Game data */
+    const int n, const bb_t all, const bb_t not_lside, const bb_t not_rside /* Geometry */)
+{
+    struct node * * game = worker->game;
+    size_t game_len = 0;
+    const int vloss = worker->vloss;
+    const struct geometry * const geometry = worker->owner->geometry;
+
+    const int start_qsteps = pop_count(x|o) + pop_count(dead);
+    const int start_mod = (start_qsteps/3) % 2;
+    const int start_active = start_mod == 0 ? ACTIVE_X : ACTIVE_O;
+
+    bb_t * my = start_active == ACTIVE_X ? &x : &o;
     bb_t * opp = start_active == ACTIVE_X ? &o : &x;
 
     int all_qsteps = start_qsteps;
     int active = start_active;
+    int is_locked = 0;
+    __atomic_add_fetch(&node->qgames, 1, __ATOMIC_RELAXED);
     for (;;) {
         game[game_len++] = node;
         ++*qthink;
 
-        if (is_leaf(node)) {
+        const int proof = get_proof(node);
+        if (proof != 0) {
+            propagate_step_proof(worker->multiallocator, game, game_len, start_qsteps);
+            const int result = get_proof_result(proof, get_mover(all_qsteps));
+            update_game_history(result, vloss, game, game_len, start_active, start_qsteps);
+            return 0;
+        }
+
+        int qchildren = get_qchildren(node);
+        if (qchildren == 0) {
+            is_locked = try_lock_leaf(node);
+            if (!is_locked) {
+                break;
+            }
+
+            qchildren = link_transposition(worker, node, hash);
+            if (qchildren == 0) {
+                break;
+            }
+
+            is_locked = 0;
+        }
+
+        if (qchildren == EXPANDING_MARK) {
             break;
         }
 
-        if (is_terminal(node)) {
+        if (qchildren == TERMINAL_MARK) {
             const int result = active == ACTIVE_X ? -ONE_GAME_COST : +ONE_GAME_COST;
-            update_game_history(result, game, game_len, start_active, start_qsteps);
+            update_game_history(result, vloss, game, game_len, start_active, start_qsteps);
             return 0;
         }
 
-        const int index = ubc_select_step(me, node);
-        node = get_node(me, node->children + index);
-        const int sq = node->square;
+        const int index = ubc_select_step(worker, node, qchildren);
+        node = get_node(worker->multiallocator, node->children + index);
+        add_virtual_loss(node, vloss);
+        const int sq = get_square(node);
         const bb_t bb = BB_SQUARE(sq);
-        *(bb & *opp ? &dead : my) |= bb;
+        const int kind = bb & *opp ? ZOBRIST_DEAD : active;
+        *(kind == ZOBRIST_DEAD ? &dead : my) |= bb;
+        hash ^= geometry->zobrist[kind][sq];
         ++all_qsteps;
 
         if ((all_qsteps % 3) == 0) {
@@ -1426,46 +4160,178 @@ int simulate(
         }
     }
 
-    bb_t steps;
-    if (all_qsteps == 0) {
-        steps = BB_SQUARE(0);
-    } else if (all_qsteps == 3) {
-        steps = BB_SQUARE(n*n-1);
-    } else {
-        steps = next_steps(*my, *opp, dead, n, all, not_lside, not_rside);
-    }
+    if (is_locked) {
+        bb_t steps;
+        if (all_qsteps == 0) {
+            steps = BB_SQUARE(0);
+        } else if (all_qsteps == 3) {
+            steps = BB_SQUARE(n*n-1);
+        } else {
+            steps = geometry->next_steps(*my, *opp, dead);
+        }
 
-    const int qsteps = pop_count(steps);
-    if (qsteps == 0) {
-        node->qchildren = TERMINAL_MARK;
-        const int result = active == ACTIVE_X ? -ONE_GAME_COST : +ONE_GAME_COST;
-        update_game_history(result, game, game_len, start_active, start_qsteps);
-        return 0;
-    }
+        const int qsteps = pop_count(steps);
+        if (qsteps == 0) {
+            set_node_flags(node, get_mover(all_qsteps) == active ? PROVEN_LOSS : PROVEN_WIN);
+            unlock_leaf(node, TERMINAL_MARK);
+            propagate_step_proof(worker->multiallocator, game, game_len, start_qsteps);
+            const int result = active == ACTIVE_X ? -ONE_GAME_COST : +ONE_GAME_COST;
+            update_game_history(result, vloss, game, game_len, start_active, start_qsteps);
+            return 0;
+        }
 
-    const size_t inode = multiallocator_allocn(me->multiallocator, 0, qsteps);
-    if (inode == BAD_ALLOC_INDEX) {
-        return ENOMEM;
+        const size_t inode = multiallocator_allocn_local(worker->multiallocator,
+            worker->cursors + NODE_TYPE, NODE_TYPE, qsteps);
+        if (inode == BAD_ALLOC_INDEX) {
+            unlock_leaf(node, 0);
+            revert_game_history(vloss, game, game_len);
+            return ENOMEM;
+        }
+
+        struct node * restrict child = get_node(worker->multiallocator, inode);
+        for (int i=0; i<qsteps; ++i) {
+            const int sq = first_one(steps);
+            steps ^= BB_SQUARE(sq);
+
+            child->square_flags = sq;
+            child->qchildren = 0;
+            child->score = 0;
+            child->qgames = 0;
+            child->children = 0;
+            ++child;
+        }
+
+        node->children = inode;
+        unlock_leaf(node, qsteps);
+        store_transposition(worker, hash, inode, qsteps, 0);
     }
 
-    struct node * restrict child = get_node(me, inode);
-    for (int i=0; i<qsteps; ++i) {
-        const int sq = first_one(steps);
-        steps ^= BB_SQUARE(sq);
+    const int result = rollout(x, o, dead, n, &worker->rng, qthink ROLLOUT_LAST_ARG);
+    update_game_history(result, vloss, game, game_len, start_active, start_qsteps);
+    return 0;
+}
 
-        child->square = sq;
-        child->qchildren = 0;
-        child->score = 0;
-        child->qgames = 0;
-        child->children = 0;
-        ++child;
+/*
+ * The step search on wide boards (geometry->wide) with the same descent and
+ * expansion as simulate, leaves are evaluated with wide_rollout. There are no
+ * Zobrist keys for wide boards, so transpositions are not linked.
+ */
+static int wide_simulate(
+    struct mcts_worker * restrict const worker,
+    struct node * restrict node,
+    uint32_t * restrict const qthink,
+    const struct wide_state * const state)
+{
+    struct node * * game = worker->game;
+    size_t game_len = 0;
+    const int vloss = worker->vloss;
+    const struct wide_geometry * const geometry = state->geometry;
+
+    struct wide_state leaf = *state;
+    wbb_t * const x = &leaf.x;
+    wbb_t * const o = &leaf.o;
+    wbb_t * const dead = &leaf.dead;
+
+    const int start_qsteps = wbb_pop_count(wbb_or(*x, *o)) + wbb_pop_count(*dead);
+    const int start_mod = (start_qsteps/3) % 2;
+    const int start_active = start_mod == 0 ? ACTIVE_X : ACTIVE_O;
+
+    wbb_t * my = start_active == ACTIVE_X ? x : o;
+    wbb_t * opp = start_active == ACTIVE_X ? o : x;
+
+    int all_qsteps = start_qsteps;
+    int active = start_active;
+    int is_locked = 0;
+    __atomic_add_fetch(&node->qgames, 1, __ATOMIC_RELAXED);
+    for (;;) {
+        game[game_len++] = node;
+        ++*qthink;
+
+        const int proof = get_proof(node);
+        if (proof != 0) {
+            propagate_step_proof(worker->multiallocator, game, game_len, start_qsteps);
+            const int result = get_proof_result(proof, get_mover(all_qsteps));
+            update_game_history(result, vloss, game, game_len, start_active, start_qsteps);
+            return 0;
+        }
+
+        const int qchildren = get_qchildren(node);
+        if (qchildren == 0) {
+            is_locked = try_lock_leaf(node);
+            break;
+        }
+
+        if (qchildren == EXPANDING_MARK) {
+            break;
+        }
+
+        if (qchildren == TERMINAL_MARK) {
+            const int result = active == ACTIVE_X ? -ONE_GAME_COST : +ONE_GAME_COST;
+            update_game_history(result, vloss, game, game_len, start_active, start_qsteps);
+            return 0;
+        }
+
+        const int index = ubc_select_step(worker, node, qchildren);
+        node = get_node(worker->multiallocator, node->children + index);
+        add_virtual_loss(node, vloss);
+        const int sq = get_square(node);
+        wbb_t * const target = wbb_test(opp, sq) ? dead : my;
+        *target = wbb_or(*target, wbb_square(sq));
+        ++all_qsteps;
+
+        if ((all_qsteps % 3) == 0) {
+            wbb_t * const tmp = my;
+            my = opp;
+            opp = tmp;
+            active ^= 3;
+        }
     }
 
-    node->qchildren = qsteps;
-    node->children = inode;
+    if (is_locked) {
+        wbb_t steps;
+        if (all_qsteps == 0) {
+            steps = geometry->x_first_step;
+        } else if (all_qsteps == 3) {
+            steps = geometry->o_first_step;
+        } else {
+            steps = geometry->next_steps(geometry, my, opp, dead);
+        }
+
+        const int qsteps = wbb_pop_count(steps);
+        if (qsteps == 0) {
+            set_node_flags(node, get_mover(all_qsteps) == active ? PROVEN_LOSS : PROVEN_WIN);
+            unlock_leaf(node, TERMINAL_MARK);
+            propagate_step_proof(worker->multiallocator, game, game_len, start_qsteps);
+            const int result = active == ACTIVE_X ? -ONE_GAME_COST : +ONE_GAME_COST;
+            update_game_history(result, vloss, game, game_len, start_active, start_qsteps);
+            return 0;
+        }
+
+        const size_t inode = multiallocator_allocn_local(worker->multiallocator,
+            worker->cursors + NODE_TYPE, NODE_TYPE, qsteps);
+        if (inode == BAD_ALLOC_INDEX) {
+            unlock_leaf(node, 0);
+            revert_game_history(vloss, game, game_len);
+            return ENOMEM;
+        }
+
+        struct node * restrict child = get_node(worker->multiallocator, inode);
+        for (int i=0; i<qsteps; ++i) {
+            child->square_flags = wbb_nth_one_index(steps, i);
+            child->qchildren = 0;
+            child->score = 0;
+            child->qgames = 0;
+            child->children = 0;
+            ++child;
+        }
 
-    const int result = rollout(x, o, dead, n, all, not_lside, not_rside, qthink ROLLOUT_LAST_ARG);
-    update_game_history(result, game, game_len, start_active, start_qsteps);
+        node->children = inode;
+        unlock_leaf(node, qsteps);
+    }
+
+    const int winner = wide_rollout(&leaf, &worker->rng, qthink);
+    const int result = winner == ACTIVE_X ? +ONE_GAME_COST : -ONE_GAME_COST;
+    update_game_history(result, vloss, game, game_len, start_active, start_qsteps);
     return 0;
 }
 
@@ -1539,15 +4405,55 @@ static bb_t select_best_weight(bb_t steps, const int * const weights)
     return bb;
 }
 
+/*
+ * Average result of rollouts from an expanded leaf, see leaf_rollouts. The
+ * leaf still counts as one game, so the sum is divided and rounded to the
+ * nearest. Truncation would move every fractional average towards a draw.
+ */
+static int leaf_rollout(
+    struct mcts_worker * restrict const worker,
+    uint32_t * restrict const qthink,
+    const bb_t x, const bb_t o, const bb_t dead, /* Game data */
+    const int n, const bb_t all, const bb_t not_lside, const bb_t not_rside /* Geometry */)
+{
+    const struct mcts_ai * const me = worker->owner;
+    const int qlanes = me->leaf_rollouts;
+    if (qlanes > 0) {
+        const int sum = batch_rollout(me->lanes_kernel, x, o, dead, n, all, not_lside, not_rside,
+            me->geometry->next_steps, qlanes, &worker->rng, qthink);
+        const int half = qlanes / 2;
+        return sum >= 0 ? (sum + half) / qlanes : -((half - sum) / qlanes);
+    }
+
+    struct nn_rollout_ctx rollout_ctx_storage;
+    struct nn_rollout_ctx * restrict const ctx = &rollout_ctx_storage;
+    ctx->x = x;
+    ctx->o = o;
+    ctx->dead = dead;
+    ctx->n = n;
+    ctx->all = all;
+    ctx->not_lside = not_lside;
+    ctx->not_rside = not_rside;
+    ctx->next_steps = me->geometry->next_steps;
+    ctx->nn = me->nn;
+    ctx->weights = worker->weights;
+    ctx->rng = &worker->rng;
+    const int result = nn_rollout(ctx, qthink ROLLOUT_LAST_ARG);
+    return result;
+}
+
 int nn_simulate(
-    struct mcts_ai * restrict const me,
+    struct mcts_worker * restrict const worker,
     struct node * restrict node,
     uint32_t * restrict const qthink,
-    bb_t x, bb_t o, bb_t dead, /* Game data */
+    bb_t x, bb_t o, bb_t dead, uint64_t hash, /* Game data */
     const int n, const bb_t all, const bb_t not_lside, const bb_t not_rside /* Geometry */)
 {
-    struct node * * game = me->game;
+    struct mcts_ai * restrict const me = worker->owner;
+    struct node * * game = worker->game;
     size_t game_len = 0;
+    const int vloss = worker->vloss;
+    const struct geometry * const geometry = worker->owner->geometry;
 
     const int start_qsteps = pop_count(x|o) + pop_count(dead);
     const int start_mod = (start_qsteps/3) % 2;
@@ -1558,25 +4464,53 @@ int nn_simulate(
 
     int all_qsteps = start_qsteps;
     int active = start_active;
+    int is_locked = 0;
+    __atomic_add_fetch(&node->qgames, 1, __ATOMIC_RELAXED);
     for (;;) {
         game[game_len++] = node;
         ++*qthink;
 
-        if (is_leaf(node)) {
+        const int proof = get_proof(node);
+        if (proof != 0) {
+            propagate_step_proof(worker->multiallocator, game, game_len, start_qsteps);
+            const int result = get_proof_result(proof, get_mover(all_qsteps));
+            update_game_history(result, vloss, game, game_len, start_active, start_qsteps);
+            return 0;
+        }
+
+        int qchildren = get_qchildren(node);
+        if (qchildren == 0) {
+            is_locked = try_lock_leaf(node);
+            if (!is_locked) {
+                break;
+            }
+
+            qchildren = link_transposition(worker, node, hash);
+            if (qchildren == 0) {
+                break;
+            }
+
+            is_locked = 0;
+        }
+
+        if (qchildren == EXPANDING_MARK) {
             break;
         }
 
-        if (is_terminal(node)) {
+        if (qchildren == TERMINAL_MARK) {
             const int result = active == ACTIVE_X ? -ONE_GAME_COST : +ONE_GAME_COST;
-            update_game_history(result, game, game_len, start_active, start_qsteps);
+            update_game_history(result, vloss, game, game_len, start_active, start_qsteps);
             return 0;
         }
 
-        const int index = ubc_select_step(me, node);
-        node = get_node(me, node->children + index);
-        const int sq = node->square;
+        const int index = ubc_select_step(worker, node, qchildren);
+        node = get_node(worker->multiallocator, node->children + index);
+        add_virtual_loss(node, vloss);
+        const int sq = get_square(node);
         const bb_t bb = BB_SQUARE(sq);
-        *(bb & *opp ? &dead : my) |= bb;
+        const int kind = bb & *opp ? ZOBRIST_DEAD : active;
+        *(kind == ZOBRIST_DEAD ? &dead : my) |= bb;
+        hash ^= geometry->zobrist[kind][sq];
         ++all_qsteps;
 
         if ((all_qsteps % 3) == 0) {
@@ -1587,853 +4521,4471 @@ int nn_simulate(
         }
     }
 
-    bb_t steps;
-    if (all_qsteps == 0) {
-        steps = BB_SQUARE(0);
-    } else if (all_qsteps == 3) {
-        steps = BB_SQUARE(n*n-1);
-    } else {
-        steps = next_steps(*my, *opp, dead, n, all, not_lside, not_rside);
-    }
+    if (is_locked) {
+        bb_t steps;
+        if (all_qsteps == 0) {
+            steps = BB_SQUARE(0);
+        } else if (all_qsteps == 3) {
+            steps = BB_SQUARE(n*n-1);
+        } else {
+            steps = geometry->next_steps(*my, *opp, dead);
+        }
 
-    int qsteps = pop_count(steps);
-    if (qsteps == 0) {
-        node->qchildren = TERMINAL_MARK;
-        const int result = active == ACTIVE_X ? -ONE_GAME_COST : +ONE_GAME_COST;
-        update_game_history(result, game, game_len, start_active, start_qsteps);
-        return 0;
-    }
+        int qsteps = pop_count(steps);
+        if (qsteps == 0) {
+            set_node_flags(node, get_mover(all_qsteps) == active ? PROVEN_LOSS : PROVEN_WIN);
+            unlock_leaf(node, TERMINAL_MARK);
+            propagate_step_proof(worker->multiallocator, game, game_len, start_qsteps);
+            const int result = active == ACTIVE_X ? -ONE_GAME_COST : +ONE_GAME_COST;
+            update_game_history(result, vloss, game, game_len, start_active, start_qsteps);
+            return 0;
+        }
 
-    if (qsteps > 1) {
-        const struct nn * const nn = me->nn;
-        const bb_t ignore = all ^ steps;
-        get_nn_weights(nn, ignore, all_qsteps % 3, n, *my, *opp, dead, me->weights);
-        steps = select_best_weight(steps, me->weights);
-        qsteps = pop_count(steps);
-    } else {
-        const int sq = first_one(steps);
-        me->weights[sq] = 1 << (INT_POWER-1);
-    }
+        int is_partial = 0;
+        if (qsteps > 1) {
+            const struct nn * const nn = me->nn;
+            const bb_t ignore = all ^ steps;
+            get_nn_weights(nn, ignore, all_qsteps % 3, n, *my, *opp, dead, worker->weights);
+            steps = select_best_weight(steps, worker->weights);
+            is_partial = pop_count(steps) != qsteps;
+            qsteps = pop_count(steps);
+        } else {
+            const int sq = first_one(steps);
+            worker->weights[sq] = 1 << (INT_POWER-1);
+        }
 
-    const size_t inode = multiallocator_allocn(me->multiallocator, 0, qsteps);
-    if (inode == BAD_ALLOC_INDEX) {
-        return ENOMEM;
-    }
+        const size_t inode = multiallocator_allocn_local(worker->multiallocator,
+            worker->cursors + NODE_TYPE, NODE_TYPE, qsteps);
+        if (inode == BAD_ALLOC_INDEX) {
+            unlock_leaf(node, 0);
+            revert_game_history(vloss, game, game_len);
+            return ENOMEM;
+        }
 
-    struct node * restrict child = get_node(me, inode);
-    for (int i=0; i<qsteps; ++i) {
-        const int sq = first_one(steps);
-        steps ^= BB_SQUARE(sq);
+        struct node * restrict child = get_node(worker->multiallocator, inode);
+        for (int i=0; i<qsteps; ++i) {
+            const int sq = first_one(steps);
+            steps ^= BB_SQUARE(sq);
 
-        const int weight = me->weights[sq] - (1 << (INT_POWER-1));
-        const int score = (ONE_GAME_COST * weight) >> INT_POWER;
+            const int weight = worker->weights[sq] - (1 << (INT_POWER-1));
+            const int score = (ONE_GAME_COST * weight) >> INT_POWER;
 
-        child->square = sq;
-        child->qchildren = 0;
-        child->score = score;
-        child->qgames = 1;
-        child->children = 0;
-        ++child;
-    }
+            child->square_flags = sq;
+            child->qchildren = 0;
+            child->score = score;
+            child->qgames = 1;
+            child->children = 0;
+            ++child;
+        }
 
-    node->qchildren = qsteps;
-    node->children = inode;
+        if (is_partial) {
+            set_node_flags(node, PARTIAL_NODE);
+        }
 
-    struct nn_rollout_ctx rollout_ctx_storage;
-    struct nn_rollout_ctx * restrict const ctx = &rollout_ctx_storage;
-    ctx->x = x;
-    ctx->o = o;
-    ctx->dead = dead;
-    ctx->n = n;
-    ctx->all = all;
-    ctx->not_lside = not_lside;
-    ctx->not_rside = not_rside;
-    ctx->nn = me->nn;
-    ctx->weights = me->weights;
-    const int result = nn_rollout(ctx, qthink ROLLOUT_LAST_ARG);
-    update_game_history(result, game, game_len, start_active, start_qsteps);
+        node->children = inode;
+        unlock_leaf(node, qsteps);
+        store_transposition(worker, hash, inode, qsteps, is_partial);
+    }
+
+    const int result = leaf_rollout(worker, qthink, x, o, dead, n, all, not_lside, not_rside);
+    update_game_history(result, vloss, game, game_len, start_active, start_qsteps);
     return 0;
 }
 
-static inline int cmp_stats(const void * const ptr_a, const void * const ptr_b)
+static inline struct node * get_turn_children(
+    struct multiallocator * restrict const multiallocator,
+    size_t inode)
 {
-    const struct step_stat * const a = ptr_a;
-    const struct step_stat * const b = ptr_b;
-    if (a->qgames > b->qgames) return -1;
-    if (a->qgames < b->qgames) return +1;
-    if (a->score < b->score) return -1;
-    if (a->score > b->score) return +1;
-    if (a->square < b->square) return +1;
-    if (a->square > b->square) return -1;
-    return 0;
+    return multiallocator_get(multiallocator, TURN_NODE_TYPE, inode);
 }
 
-static int ai_go(
-    struct mcts_ai * restrict const me,
-    const struct state * const state,
-    const int has_explanation)
+static inline bb_t * get_turn_moves(
+    const struct node * const children,
+    const int qchildren)
 {
-    if (me->nn == NULL) {
-        sprintf(me->error_buf, "NN is not set.");
-        errno = EINVAL;
-        return -1;
-    }
+    return (bb_t *)(children + qchildren);
+}
 
-    const struct geometry * const geometry = state->geometry;
+static inline void apply_move(
+    const bb_t move,
+    bb_t * restrict const my,
+    const bb_t opp,
+    bb_t * restrict const dead)
+{
+    const bb_t killed = move & opp;
+    *my |= move ^ killed;
+    *dead |= killed;
+}
 
-    multiallocator_reset(me->multiallocator);
+static inline size_t max_turns(const int n)
+{
+    const size_t qsquares = n * n;
+    return qsquares * (qsquares-1) * (qsquares-2) / 6 + qsquares;
+}
 
-    const size_t inode = multiallocator_alloc(me->multiallocator, 0);
-    if (inode == BAD_ALLOC_INDEX) {
-        sprintf(me->error_buf, "multiallocator_alloc failed.");
-        errno = ENOMEM;
-        return -1;
+/*
+ * Generate all different completions of the current turn when qleft steps
+ * are left. Completions are sets of squares, so permutations are merged.
+ */
+static int gen_turns(
+    const int qleft,
+    const bb_t my,
+    const bb_t opp,
+    const bb_t dead,
+    const int n,
+    const bb_t all,
+    const bb_t not_lside,
+    const bb_t not_rside,
+    bb_t * const output)
+{
+    if (qleft == 3) {
+        bb_t * ptr = output;
+        ptr += get_3moves_0(my, opp, dead, n, all, not_lside, not_rside, ptr);
+        ptr += get_3moves_1(my, opp, dead, n, all, not_lside, not_rside, ptr);
+        ptr += get_3moves_2(my, opp, dead, n, all, not_lside, not_rside, ptr);
+        ptr += get_3moves_3(my, opp, dead, n, all, not_lside, not_rside, ptr);
+        return ptr - output;
     }
 
-    struct node * restrict const node = get_node(me, inode);
-    node->square = -1;
-    node->qchildren = 0;
-    node->score = 0;
-    node->qgames = 0;
-    node->children = 0;
+    bb_t * restrict ptr = output;
+    const bb_t next = next_steps(my, opp, dead, n, all, not_lside, not_rside);
 
-    uint32_t qthink = 0;
-    const bb_t x = state->x;
-    const bb_t o = state->o;
-    const bb_t dead = state->dead;
+    bb_t bb1 = next;
+    while (bb1 != 0) {
+        const bb_t step1 = bb1 & (-bb1);
+        bb1 ^= step1;
 
-    const int n = geometry->n;
-    const bb_t all = geometry->all;
-    const bb_t not_lside = all ^ geometry->lside;
-    const bb_t not_rside = all ^ geometry->rside;
+        if (qleft == 1) {
+            *ptr++ = step1;
+            continue;
+        }
 
-    const int status = nn_simulate(me, node, &qthink, x, o, dead, n, all, not_lside, not_rside);
-    if (status != 0) {
-        errno = status;
-        return -1;
+        bb_t my1 = my;
+        bb_t dead1 = dead;
+        apply_move(step1, &my1, opp, &dead1);
+        bb_t bb2 = next_steps(my1, opp, dead1, n, all, not_lside, not_rside);
+        while (bb2 != 0) {
+            const bb_t step2 = bb2 & (-bb2);
+            bb2 ^= step2;
+
+            const int is_duplicate = (step2 & next) != 0 && step2 < step1;
+            if (!is_duplicate) {
+                *ptr++ = step1 | step2;
+            }
+        }
     }
 
-    while (qthink < me->qthink) {
-        const int status = nn_simulate(me, node, &qthink, x, o, dead, n, all, not_lside, not_rside);
-        if (status != 0) {
-            errno = status;
-            break;
-        }
+    return ptr - output;
+}
+
+static void update_turn_history(
+    const int result,
+    const int vloss,
+    struct node * * game, const size_t game_len,
+    int active)
+{
+    struct node * restrict const root = game[0];
+    __atomic_add_fetch(&root->score, result, __ATOMIC_RELAXED);
+
+    for (int i=1; i<game_len; ++i) {
+        struct node * restrict const node = game[i];
+        const int delta = active == ACTIVE_X ? result : -result;
+        __atomic_add_fetch(&node->score, delta + vloss, __ATOMIC_RELAXED);
+        active ^= 3;
     }
+}
+
+/*
+ * Only BEST_QTURNS turns with the best NN prior are added as children. The
+ * prior of the turn is an average NN weight of its steps in the position
+ * before the turn.
+ */
+static int expand_turn_node(
+    struct mcts_worker * restrict const worker,
+    struct node * restrict const node,
+    const int qleft,
+    const bb_t my, const bb_t opp, const bb_t dead,
+    const int n, const bb_t all, const bb_t not_lside, const bb_t not_rside)
+{
+    struct mcts_ai * restrict const me = worker->owner;
+    bb_t * restrict const turns = worker->turns;
+    const int qturns = gen_turns(qleft, my, opp, dead, n, all, not_lside, not_rside, turns);
+    if (qturns == 0) {
+        /* Only the root might be in the middle of a turn of its mover. */
+        set_node_flags(node, qleft < 3 ? PROVEN_LOSS : PROVEN_WIN);
+        unlock_leaf(node, TERMINAL_MARK);
+        return 0;
+    }
+
+    int * restrict const weights = worker->weights;
+    const int nstep = (3 - qleft) % 3;
+    get_nn_weights(me->nn, 0, nstep, n, my, opp, dead, weights);
 
-    const int qchildren = node->qchildren;
     int qbest = 0;
-    int best[qchildren];
-    uint32_t best_qgames = 0;
+    bb_t best_moves[BEST_QTURNS];
+    int best_priors[BEST_QTURNS];
+    for (int i=0; i<qturns; ++i) {
+        const bb_t move = turns[i];
+        int sum = 0;
+        bb_t bb = move;
+        while (bb != 0) {
+            const int sq = first_one(bb);
+            bb ^= BB_SQUARE(sq);
+            sum += weights[sq];
+        }
+        const int prior = sum / pop_count(move);
 
-    const struct node * const children = get_node(me, node->children);
-    const struct node * child = children;
-    for (int i=0; i<node->qchildren; ++i) {
-        const int32_t qgames = child->qgames;
-        if (qgames >= best_qgames) {
-            if (qgames != best_qgames) {
-                qbest = 0;
-                best_qgames = qgames;
-            }
-            best[qbest++] = i;
+        if (qbest == BEST_QTURNS && prior <= best_priors[qbest-1]) {
+            continue;
         }
 
-        ++child;
+        int index = qbest < BEST_QTURNS ? qbest++ : qbest - 1;
+        while (index > 0 && best_priors[index-1] < prior) {
+            best_moves[index] = best_moves[index-1];
+            best_priors[index] = best_priors[index-1];
+            --index;
+        }
+
+        best_moves[index] = move;
+        best_priors[index] = prior;
     }
 
-    const int ibest = qbest == 1 ? 0 : rand() % qbest;
-    const int index = best[ibest];
-    const int square = children[index].square;
+    const size_t inode = multiallocator_allocn_local(worker->multiallocator,
+        worker->cursors + TURN_NODE_TYPE, TURN_NODE_TYPE, qbest);
+    if (inode == BAD_ALLOC_INDEX) {
+        unlock_leaf(node, 0);
+        return ENOMEM;
+    }
 
-    if (has_explanation) {
-        struct step_stat * restrict const best_stat = me->stats;
-        struct step_stat * restrict stat = best_stat + 1;
-        const struct node * const children = get_node(me, node->children);
-        const struct node * child = children;
-        for (int i=0; i<node->qchildren; ++i) {
+    struct node * restrict const children = get_turn_children(worker->multiallocator, inode);
+    bb_t * restrict const moves = get_turn_moves(children, qbest);
+    for (int i=0; i<qbest; ++i) {
+        const int weight = best_priors[i] - (1 << (INT_POWER-1));
+        struct node * restrict const child = children + i;
+        child->square_flags = NO_SQUARE;
+        child->qchildren = 0;
+        child->score = (ONE_GAME_COST * weight) >> INT_POWER;
+        child->qgames = 1;
+        child->children = 0;
+        moves[i] = best_moves[i];
+    }
 
-            const float qgames = child->qgames;
-            const float score = SCORE_FACTOR * child->score;
+    if (qbest < qturns) {
+        set_node_flags(node, PARTIAL_NODE);
+    }
 
-            if (i == index) {
-                best_stat->square = child->square;
-                best_stat->qgames = child->qgames;
-                best_stat->score = 0.5 * (score/qgames + 1.0);
-            } else {
-                stat->square = child->square;
-                stat->qgames = child->qgames;
-                stat->score = 0.5 * (score/qgames + 1.0);
-                ++stat;
-            }
+    node->children = inode;
+    unlock_leaf(node, qbest);
+    return 0;
+}
 
-            ++child;
+static void propagate_turn_proof(
+    struct multiallocator * restrict const multiallocator,
+    struct node * * game, const size_t game_len,
+    const int start_qsteps)
+{
+    for (size_t i=game_len-1; i>0; --i) {
+        const int child_proof = get_proof(game[i]);
+        if (child_proof == 0) {
+            return;
         }
 
-        qsort(best_stat + 1, node->qchildren-1, sizeof(struct step_stat), &cmp_stats);
-    }
+        struct node * restrict const parent = game[i-1];
+        const struct node * const children = get_turn_children(multiallocator, parent->children);
+        const int is_same_mover = i == 1 && start_qsteps % 3 != 0;
+        const int proof = prove_parent(parent, child_proof, children, is_same_mover);
+        if (proof == 0) {
+            return;
+        }
 
-    return square;
+        set_node_flags(parent, proof);
+    }
 }
 
+int turn_simulate(
+    struct mcts_worker * restrict const worker,
+    struct node * restrict node,
+    uint32_t * restrict const qthink,
+    bb_t x, bb_t o, bb_t dead, /* Game data */
+    const int n, const bb_t all, const bb_t not_lside, const bb_t not_rside /* Geometry */)
+{
+    struct mcts_ai * restrict const me = worker->owner;
+    struct multiallocator * restrict const multiallocator = worker->multiallocator;
+    struct node * * game = worker->game;
+    size_t game_len = 0;
+    const int vloss = worker->vloss;
 
+    const int start_qsteps = pop_count(x|o) + pop_count(dead);
+    const int start_mod = (start_qsteps/3) % 2;
+    const int start_active = start_mod == 0 ? ACTIVE_X : ACTIVE_O;
 
-/* DEBUG */
+    bb_t * my = start_active == ACTIVE_X ? &x : &o;
+    bb_t * opp = start_active == ACTIVE_X ? &o : &x;
 
-static const int file_chars[256] = {
-    [0 ... 'a'-1] = -1,
-    ['a'] = 0, ['b'] = 1, ['c'] = 2, ['d'] = 3, ['e'] = 4,
-    ['f'] = 5, ['g'] = 6, ['h'] = 7, ['i'] = 8, ['j'] = -1, ['k'] = 9,
-    ['l' ... 255] = -1
-};
+    int qleft = 3 - start_qsteps % 3;
+    int active = start_active;
+    int is_locked = 0;
+    __atomic_add_fetch(&node->qgames, 1, __ATOMIC_RELAXED);
+    for (;;) {
+        game[game_len++] = node;
+        ++*qthink;
 
-static const int rank_chars[256] = {
-    [0 ... '0'] = -1,
-    ['1'] = 0, ['2'] = 1, ['3'] = 2, ['4'] = 3, ['5'] = 4,
-    ['6'] = 5, ['7'] = 6, ['8'] = 7, ['9'] = 8,
-    ['9' + 1 ... 'T'-1] = -1,
-    ['T'] = 9,
-    ['T'+1 ... 255] = -1
-};
+        const int proof = get_proof(node);
+        if (proof != 0) {
+            propagate_turn_proof(multiallocator, game, game_len, start_qsteps);
+            const int mover = game_len == 1 ? get_mover(start_qsteps) : active ^ 3;
+            const int result = get_proof_result(proof, mover);
+            update_turn_history(result, vloss, game, game_len, start_active);
+            return 0;
+        }
 
-static int parse_sq(const char * const s)
-{
-    if (s == NULL) {
-        printf("Error in parse_sq: cannot parse NULL");
-        return -1;
-    }
+        const int qchildren = get_qchildren(node);
+        if (qchildren == 0) {
+            is_locked = try_lock_leaf(node);
+            break;
+        }
 
-    const int file_ch = s[0];
-    const int file = file_chars[file_ch];
-    if (file < 0) {
-        printf("Invalid file char with code %d (“%c”)", file_ch, file_ch);
-        return -1;
+        if (qchildren == EXPANDING_MARK) {
+            break;
+        }
+
+        if (qchildren == TERMINAL_MARK) {
+            const int result = active == ACTIVE_X ? -ONE_GAME_COST : +ONE_GAME_COST;
+            update_turn_history(result, vloss, game, game_len, start_active);
+            return 0;
+        }
+
+        struct node * restrict const children = get_turn_children(multiallocator, node->children);
+        const int index = ubc_select(me, &worker->rng, node, qchildren, children);
+        node = children + index;
+        add_virtual_loss(node, vloss);
+        apply_move(get_turn_moves(children, qchildren)[index], my, *opp, &dead);
+
+        bb_t * const tmp = my;
+        my = opp;
+        opp = tmp;
+        active ^= 3;
+        qleft = 3;
     }
 
-    const int rank_ch = s[1];
-    const int rank = rank_chars[rank_ch];
-    if (rank < 0) {
-        printf("Invalid rank char with code %d (“%c”)", rank_ch, rank_ch);
-        return -1;
+    if (is_locked) {
+        const int status = expand_turn_node(worker, node, qleft, *my, *opp, dead, n, all, not_lside, not_rside);
+        if (status != 0) {
+            revert_game_history(vloss, game, game_len);
+            return status;
+        }
+
+        if (node->qchildren == TERMINAL_MARK) {
+            propagate_turn_proof(multiallocator, game, game_len, start_qsteps);
+            const int result = active == ACTIVE_X ? -ONE_GAME_COST : +ONE_GAME_COST;
+            update_turn_history(result, vloss, game, game_len, start_active);
+            return 0;
+        }
     }
 
-    return 10 * rank + file;
+    const int result = leaf_rollout(worker, qthink, x, o, dead, n, all, not_lside, not_rside);
+    update_turn_history(result, vloss, game, game_len, start_active);
+    return 0;
 }
 
-static const char * good_game[] = {
-    "a1", "b2", "c3",      "kT", "i9", "h8",
-    "d4", "d5", "e4",      "g7", "f8", "h6",
-    "f3", "g2", "c6",      "e9", "dT", "cT",
-    "h3", "i3", "b6",      "i6", "k6", "bT",
-    "k3", "g3", "a7",      "aT", "a9", "d9",
-    "a8", "a9", "k4",      "b9", "a8", "a7",
-    "k5", "k6", "i6",      "b6", "c6", "d5",
-    "a3", "c5", "h6",      "e4", "f3", "g3",
-    "g7", "h8", "g9",      "g9", "h3", "i3",
-    "i9", "f6", "f8",      "k4", "k5", "d4",
-    "h5", "k2", "k1",      "h4", "h5", "k3",
-    "h1", "f1", "hT",      "g2", "h1", "k2",
-    "i2", "f2", "c1",      "i2", "k1", "f2",
-    "g1", "h2", "i1",      "f1", "c3", "b2",
-    "d1", "e1", "a4",      "c1", "d1", "e1",
-    "c4", "d3", "e2",      "d3", "e2", "a1",
-    "a2", "b1", "c2",      "k9", "k8", "k7",
-    "k9", "kT", "e9",      "eT", "fT", "hT",
-    "fT", "iT", "d9",      "f9", "iT", "gT",
-    "f9", "d2", "e8",      "d2", "e3", "i7",
-    "i7", "c8", "b9",      "b7", "c8", "g8",
-    "g8", "i5", "h4",      "h9", "i8", "i5",
-    "a5", "a6", "b7",      "e5", "f6", "i4",
-    "g5", "f4", "e3",      "d7", "e8", "g5",
-    "g4", "i4", "e5",      "a6", "c5", "f4",
-    "f5", "e6", "d7",      "h7", "g6", "f5",
-    "f7", "g6", "cT",      "c9", "c7", "f7",
-    "c7", "d8", "c9",
-    NULL
-};
-
-int cmp_bb(const void * const ptr_a, const void * const ptr_b)
+static inline int cmp_stats(const void * const ptr_a, const void * const ptr_b)
 {
-    const bb_t * const a = ptr_a;
-    const bb_t * const b = ptr_b;
-    if (*a < *b) return -1;
-    if (*a > *b) return +1;
+    const struct step_stat * const a = ptr_a;
+    const struct step_stat * const b = ptr_b;
+    if (a->qgames > b->qgames) return -1;
+    if (a->qgames < b->qgames) return +1;
+    if (a->score < b->score) return -1;
+    if (a->score > b->score) return +1;
+    if (a->square < b->square) return +1;
+    if (a->square > b->square) return -1;
     return 0;
 }
 
-#define MAX_QSCANS 131072
-
-int full_scan(
+/*
+ * Budget for the whole turn: move_time if it is set, otherwise a share of the
+ * remaining game clock for expected turns to go plus most of the increment.
+ * With both parameters the smaller budget is used.
+ */
+static uint64_t calc_turn_budget(
+    const struct mcts_ai * const me,
     const struct state * const state)
 {
-    struct state storage = *state;
-    struct state * restrict const me = &storage;
-
-    int full_qscans = 0;
-    const size_t sz = MAX_QSCANS * sizeof(bb_t);
-    bb_t * restrict const buf = malloc(sz);
-    if (buf == NULL) {
-        return -1;
+    uint64_t budget = me->move_time > 0 ? me->move_time * NS_IN_MS : UINT64_MAX;
+
+    if (me->time_left > 0) {
+        const int n = state->geometry->n;
+        const int qfree = n * n - state_qstones(state);
+        const int moves_to_go = qfree / 6 > MIN_MOVES_TO_GO ? qfree / 6 : MIN_MOVES_TO_GO;
+        const uint64_t time_left = me->time_left * NS_IN_MS;
+        const uint64_t margin = time_left / 20 < 50 * NS_IN_MS ? time_left / 20 : 50 * NS_IN_MS;
+        uint64_t share = time_left / moves_to_go + me->time_inc * NS_IN_MS * 3 / 4;
+        if (share > time_left / 2) {
+            share = time_left / 2;
+        }
+        share = share > margin ? share - margin : 0;
+        if (share < budget) {
+            budget = share;
+        }
     }
 
-    int qerrors = 0;
+    return budget;
+}
 
-    bb_t steps1 = state_get_steps(me);
-    while (steps1 != 0) {
-        bb_t bb = steps1 & (-steps1);
-        steps1 ^= bb;
-        const int step1 = first_one(bb);
-        state_step(me, step1);
+/*
+ * Split the turn budget over its steps: the first step of a turn gets a half,
+ * the second and the third ones get 30% and 20%, unused time is carried over.
+ * In turn tree mode the first search chooses the whole turn.
+ */
+static uint64_t calc_deadline(
+    struct mcts_ai * restrict const me,
+    const struct state * const state)
+{
+    if (me->move_time == 0 && me->time_left == 0) {
+        return 0;
+    }
 
-        bb_t steps2 = state_get_steps(me);
-        while (steps2 != 0) {
-            bb_t bb = steps2 & (-steps2);
-            steps2 ^= bb;
-            const int step2 = first_one(bb);
+    static const unsigned int step_weights[3] = { 50, 30, 20 };
 
-            state_step(me, step2);
-            bb_t steps3 = state_get_steps(me);
-            while (steps3 != 0) {
-                bb_t bb = steps3 & (-steps3);
-                steps3 ^= bb;
-                const int step3 = first_one(bb);
-                if (full_qscans < MAX_QSCANS) {
-                    buf[full_qscans++] = BB_SQUARE(step1) | BB_SQUARE(step2) | BB_SQUARE(step3);
-                } else {
-                    ++full_qscans;
-                    ++qerrors;
-                }
-            }
-            state_unstep(me, step2);
-        }
+    const int all_qsteps = state_qstones(state) + state_qdead(state);
+    const int turn = all_qsteps / 3;
+    const int nstep = all_qsteps % 3;
+    const uint64_t now = get_time_ns();
 
-        state_unstep(me, step1);
+    struct mcts_clock * restrict const clock = &me->clock;
+    if (nstep == 0 || clock->turn != turn) {
+        clock->turn = turn;
+        clock->turn_start = now;
+        clock->turn_budget = calc_turn_budget(me, state);
     }
 
-    if (qerrors > 0) {
-        fprintf(stderr,
-            "full_qscans overflow, maximum value is %d, but current value is %d. "
-            "Please increase MAX_QSCANS.\n", MAX_QSCANS, full_qscans);
-        return -1;
+    const uint64_t elapsed = now - clock->turn_start;
+    const uint64_t remaining = clock->turn_budget > elapsed ? clock->turn_budget - elapsed : 0;
+    if (is_turn_tree(me)) {
+        return now + remaining;
     }
 
-    qsort(buf, full_qscans, sizeof(bb_t), cmp_bb);
-
-    int unique_qmoves = 1;
-    for (int i=1; i<full_qscans; ++i) {
-        unique_qmoves += buf[i-1] != buf[i];
+    unsigned int weights_sum = 0;
+    for (int i=nstep; i<3; ++i) {
+        weights_sum += step_weights[i];
     }
 
-    free(buf);
-    return unique_qmoves;
+    return now + remaining / weights_sum * step_weights[nstep];
 }
 
-void print_stats(
-    const struct geometry * const geometry,
-    const struct state * const me,
-    const bb_t move)
+static int simulate_once(
+    struct mcts_worker * restrict const worker,
+    uint32_t * restrict const qthink)
 {
-    const bb_t my = me->active == ACTIVE_X ? me->x : me->o;
-    const bb_t opp = me->active == ACTIVE_X ? me->o : me->x;
-    const bb_t dead = me->dead;
-    const int n = geometry->n;
-    const bb_t all = geometry->all;
-    const bb_t not_lside = all ^ geometry->lside;
-    const bb_t not_rside = all ^ geometry->rside;
+    const struct mcts_search * const search = &worker->owner->search;
+    if (search->wide.geometry != NULL) {
+        return wide_simulate(worker, worker->root, qthink, &search->wide);
+    }
 
-    bb_t output[4][4096];
-    int qmoves[4] = {
-        get_3moves_0(my, opp, dead, n, all, not_lside, not_rside, output[0]),
-        get_3moves_1(my, opp, dead, n, all, not_lside, not_rside, output[1]),
-        get_3moves_2(my, opp, dead, n, all, not_lside, not_rside, output[2]),
-        get_3moves_3(my, opp, dead, n, all, not_lside, not_rside, output[3])
-    };
+    if (is_turn_tree(worker->owner)) {
+        return turn_simulate(worker, worker->turn_root, qthink,
+            search->x, search->o, search->dead,
+            search->n, search->all, search->not_lside, search->not_rside);
+    }
 
-    int qmoves_with_killed[4][4];
-    memset(qmoves_with_killed, 0, sizeof(qmoves_with_killed));
-    for (int i=0; i<4; ++i) {
-        for (int j=0; j<qmoves[i]; ++j) {
-            int killed = pop_count(output[i][j] & opp);
-            ++qmoves_with_killed[i][killed];
+    return nn_simulate(worker, worker->root, qthink,
+        search->x, search->o, search->dead, search->hash,
+        search->n, search->all, search->not_lside, search->not_rside);
+}
+
+static void reset_tree(
+    struct multiallocator * restrict const multiallocator,
+    struct transposition * restrict const tt)
+{
+    multiallocator_reset(multiallocator);
+    memset(tt, 0, TT_SIZE * sizeof(struct transposition));
+}
+
+/*
+ * Garbage collection of a full tree: nodes reachable from the root are copied
+ * into a buffer, children of rarely visited nodes are dropped, so the kept
+ * part takes at most a half of the multiallocator. The copy is laid out with
+ * final node indexes and moved back after multiallocator reset. Children
+ * lists shared by transpositions are copied once: on the first visit GC_MARK
+ * of the first child is cleared and its children field points to the copy.
+ */
+
+struct gc_ctx
+{
+    struct multiallocator * multiallocator;
+    int itype;
+    size_t item_sz;
+    size_t qitems;
+    size_t counter;
+    size_t max_counter;
+    int32_t min_qgames;
+    char * items;
+    size_t histogram[32];
+};
+
+static void gc_count(
+    struct gc_ctx * restrict const ctx,
+    const struct node * const node)
+{
+    const int qchildren = node->qchildren;
+    if (qchildren == 0 || qchildren >= EXPANDING_MARK) {
+        return;
+    }
+
+    struct node * restrict const children = multiallocator_get(ctx->multiallocator, ctx->itype, node->children);
+    struct node * restrict const first = children;
+    if (first->square_flags & GC_MARK) {
+        return;
+    }
+
+    first->square_flags |= GC_MARK;
+    const int qgames = node->qgames;
+    const int ibucket = qgames > 1 ? 31 - __builtin_clz(qgames) : 0;
+    ctx->histogram[ibucket] += qchildren;
+
+    for (int i=0; i<qchildren; ++i) {
+        gc_count(ctx, children + i);
+    }
+}
+
+static void gc_copy(
+    struct gc_ctx * restrict const ctx,
+    struct node * restrict const node)
+{
+    const int qchildren = node->qchildren;
+    if (qchildren == 0 || qchildren >= EXPANDING_MARK) {
+        return;
+    }
+
+    struct node * restrict const children = multiallocator_get(ctx->multiallocator, ctx->itype, node->children);
+    struct node * restrict const first = children;
+    if ((first->square_flags & GC_MARK) == 0) {
+        node->children = first->children;
+        return;
+    }
+
+    /* The same layout as multiallocator_allocn gives after reset. */
+    size_t inode = ctx->counter;
+    const size_t iblock = (inode + qchildren - 1) / ctx->qitems;
+    if (inode / ctx->qitems != iblock) {
+        inode = iblock * ctx->qitems;
+    }
+
+    if (node->qgames < ctx->min_qgames || inode + qchildren > ctx->max_counter) {
+        node->square_flags &= SQUARE_MASK | PROOF_MASK;
+        node->qchildren = 0;
+        node->children = 0;
+        return;
+    }
+
+    ctx->counter = inode + qchildren;
+    struct node * restrict const copy = (struct node *)(ctx->items + inode * ctx->item_sz);
+    memcpy(copy, children, qchildren * ctx->item_sz);
+    copy->square_flags &= ~GC_MARK;
+    first->square_flags &= ~GC_MARK;
+    first->children = inode;
+    node->children = inode;
+
+    for (int i=0; i<qchildren; ++i) {
+        gc_copy(ctx, copy + i);
+    }
+}
+
+static int collect_garbage(
+    struct mcts_ai * restrict const me,
+    struct mcts_worker * restrict const worker)
+{
+    const int is_turn = is_turn_tree(me);
+    struct gc_ctx storage;
+    struct gc_ctx * restrict const ctx = &storage;
+    struct multiallocator * restrict const multiallocator = worker->multiallocator;
+    ctx->multiallocator = multiallocator;
+    ctx->itype = is_turn ? TURN_NODE_TYPE : NODE_TYPE;
+    ctx->item_sz = node_type_sizes[ctx->itype];
+    ctx->qitems = multiallocator->types[ctx->itype].qitems;
+    ctx->counter = 1;
+    ctx->max_counter = multiallocator->max_blocks * ctx->qitems / 2;
+    memset(ctx->histogram, 0, sizeof(ctx->histogram));
+
+    struct node * const root = is_turn ? worker->turn_root : worker->root;
+    gc_count(ctx, root);
+
+    /* The least power of two visits to keep not more than a half of the tree. */
+    size_t qkept = 0;
+    int ibucket = 32;
+    while (ibucket > 0 && qkept + ctx->histogram[ibucket-1] < ctx->max_counter) {
+        qkept += ctx->histogram[--ibucket];
+    }
+    ctx->min_qgames = ibucket == 0 ? 0 : ibucket < 31 ? (int32_t)1 << ibucket : INT32_MAX;
+
+    ctx->items = malloc(ctx->max_counter * ctx->item_sz);
+    if (ctx->items == NULL) {
+        return ENOMEM;
+    }
+
+    memcpy(ctx->items, root, ctx->item_sz);
+    gc_copy(ctx, (struct node *)ctx->items);
+
+    reset_tree(multiallocator, worker->tt);
+    size_t inode = multiallocator_alloc(multiallocator, ctx->itype);
+    for (size_t offset = 0; inode != BAD_ALLOC_INDEX && offset < ctx->counter; offset += ctx->qitems) {
+        const size_t end = offset + ctx->qitems < ctx->counter ? offset + ctx->qitems : ctx->counter;
+        const size_t start = offset == 0 ? 1 : offset;
+        inode = start < end ? multiallocator_allocn(multiallocator, ctx->itype, end - start) : start;
+        if (inode != BAD_ALLOC_INDEX) {
+            char * const block = multiallocator_get(multiallocator, ctx->itype, offset);
+            memcpy(block, ctx->items + offset * ctx->item_sz, (end - offset) * ctx->item_sz);
         }
     }
 
-    int mark[4] = { 0, 0, 0, 0 };
-    for (int i=0; i<4; ++i) {
-        for (int j=0; j<qmoves[i]; ++j) {
-            if (output[i][j] == move) {
-                mark[i] = 1;
-            }
+    free(ctx->items);
+    if (inode == BAD_ALLOC_INDEX) {
+        reset_tree(multiallocator, worker->tt);
+        return ENOMEM;
+    }
+
+    for (unsigned int i=0; i<me->qworkers; ++i) {
+        struct mcts_worker * restrict const other = me->workers + i;
+        if (other->multiallocator == multiallocator) {
+            other->root = is_turn ? NULL : get_node(multiallocator, 0);
+            other->turn_root = is_turn ? get_turn_children(multiallocator, 0) : NULL;
         }
     }
 
-    const int move_killed = pop_count(move & opp);
+    return 0;
+}
 
-    const int total = qmoves[0] + qmoves[1] + qmoves[2] + qmoves[3];
-    printf(" %5d", total);
-    for (int i=0; i<4; ++i) {
-        printf(" | %6d %s", qmoves[i], mark[i] ? "*" : " ");
-        for (int j=0; j<4; ++j) {
-            int put_mark = mark[i] && j == move_killed;
-            printf(" %5d %s", qmoves_with_killed[i][j], put_mark ? "x" : " ");
+/* Returns nonzero if the search suspended with STOP_COLLECT can be continued. */
+static int collect_full_trees(struct mcts_ai * restrict const me)
+{
+    struct mcts_search * restrict const search = &me->search;
+    if (__atomic_load_n(&search->stop, __ATOMIC_SEQ_CST) != STOP_COLLECT) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&me->progress_lock);
+
+    int status = 0;
+    const int is_shared = me->parallel == PARALLEL_TREE;
+    for (unsigned int i=0; i<me->qworkers && status == 0; ++i) {
+        struct mcts_worker * restrict const worker = me->workers + i;
+        if (worker->status != ENOMEM) {
+            continue;
+        }
+
+        status = collect_garbage(me, is_shared ? me->workers : worker);
+        if (is_shared) {
+            break;
         }
     }
 
-    const int full_qmoves = full_scan(me);
-    if (full_qmoves != total) {
-        printf(" error full_qmoves = %d", full_qmoves);
+    pthread_mutex_unlock(&me->progress_lock);
+
+    if (status != 0) {
+        return 0;
+    }
+
+    for (unsigned int i=0; i<me->qworkers; ++i) {
+        me->workers[i].status = 0;
     }
+
+    int expected = STOP_COLLECT;
+    return __atomic_compare_exchange_n(&search->stop, &expected, 0,
+        0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
 }
 
-void run_game(
-    const struct geometry * const geometry,
-    struct state * restrict const me)
+static void run_worker(struct mcts_worker * restrict const worker)
 {
-    struct state base = *me;
+    struct mcts_ai * restrict const me = worker->owner;
+    struct mcts_search * restrict const search = &me->search;
+    const uint64_t deadline = search->deadline;
+
+    /*
+     * Root workers do not share a tree, so every one of them spends an equal
+     * part of qthink and a search does not depend on thread timing.
+     */
+    const int is_shared = me->parallel == PARALLEL_TREE;
+    const uint32_t max_qthink = is_shared ? search->max_qthink : search->max_qthink / me->qworkers;
+
+    const struct node * const root = is_turn_tree(me) ? worker->turn_root : worker->root;
+    for (unsigned int iteration = 1; !__atomic_load_n(&search->stop, __ATOMIC_RELAXED); ++iteration) {
+        if (get_proof(root) != 0) {
+            /* The root is solved, the result is exact */
+            __atomic_store_n(&search->stop, 1, __ATOMIC_RELAXED);
+            break;
+        }
 
-    int active = 1;
-    for (int i=0;; ++i) {
-        const char * const square_str = good_game[i];
-        if (square_str == NULL) {
-            printf("%s", active == 1 ? "X" : "O");
-            printf("  %2s %2s %2s  ", good_game[i-3], good_game[i-2], good_game[i-1]);
-            printf("\n");
+        uint32_t qthink = 0;
+        const int status = simulate_once(worker, &qthink);
+
+        if (status == ENOMEM) {
+            /* The search is continued after garbage collection if not stopped yet. */
+            int expected = 0;
+            worker->status = status;
+            __atomic_compare_exchange_n(&search->stop, &expected, STOP_COLLECT,
+                0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
             break;
         }
 
-        const int status = state_status(me);
-        if (state_status(me) != 0) {
-            printf("Invalid state status %d on step %d.\n", status, i);
-            return;
+        if (status != 0) {
+            worker->status = status;
+            __atomic_store_n(&search->stop, 1, __ATOMIC_RELAXED);
+            break;
         }
 
-        if (i > 0 && (i % 3) == 0) {
-            const int sq1 = parse_sq(good_game[i-3]);
-            const int sq2 = parse_sq(good_game[i-2]);
-            const int sq3 = parse_sq(good_game[i-1]);
-            const bb_t bb = BB_SQUARE(sq1) | BB_SQUARE(sq2) | BB_SQUARE(sq3);
+        const uint32_t total = __atomic_add_fetch(&search->qthink, qthink, __ATOMIC_RELAXED);
+        worker->qthink += qthink;
+        if ((is_shared ? total : worker->qthink) >= max_qthink) {
+            break;
+        }
 
-            printf("%s", active == 1 ? "X" : "O");
-            printf("  %2s-%2s-%2s  ", good_game[i-3], good_game[i-2], good_game[i-1]);
-            print_stats(geometry, &base, bb);
-            printf("\n");
-            active ^= 3;
-            base = *me;
+        if (deadline != 0 && iteration % TIME_CHECK_PERIOD == 0 && get_time_ns() >= deadline) {
+            __atomic_store_n(&search->stop, 1, __ATOMIC_RELAXED);
+            break;
         }
+    }
+}
 
-        const int sq = parse_sq(square_str);
-        if (sq < 0) {
-            printf(" during parsing step %d (“%s”).\n", i, square_str);
-            return;
+static void * worker_thread(void * arg)
+{
+    run_worker(arg);
+    return NULL;
+}
+
+static void run_workers_once(struct mcts_ai * restrict const me)
+{
+    const unsigned int qworkers = me->qworkers;
+    const int is_shared = me->parallel == PARALLEL_TREE;
+    const int vloss = is_shared && qworkers > 1 ? VIRTUAL_LOSS : 0;
+
+    unsigned int qstarted = 1;
+    for (unsigned int i=0; i<qworkers; ++i) {
+        struct mcts_worker * restrict const worker = me->workers + i;
+        worker->vloss = vloss;
+        worker->status = 0;
+        if (i == 0) {
+            continue;
         }
 
-        state_step(me, sq);
+        const int status = pthread_create(&worker->thread, NULL, worker_thread, worker);
+        if (status != 0) {
+            break;
+        }
+        ++qstarted;
+    }
+
+    run_worker(me->workers);
+
+    for (unsigned int i=1; i<qstarted; ++i) {
+        pthread_join(me->workers[i].thread, NULL);
+    }
+}
+
+static void run_workers(struct mcts_ai * restrict const me)
+{
+    do {
+        run_workers_once(me);
+    } while (collect_full_trees(me));
+}
+
+static struct node * find_child(
+    struct multiallocator * restrict const multiallocator,
+    const struct node * const node,
+    const int square)
+{
+    const int qchildren = node->qchildren;
+    if (qchildren == 0 || qchildren >= EXPANDING_MARK) {
+        return NULL;
+    }
+
+    struct node * restrict child = get_node(multiallocator, node->children);
+    for (int i=0; i<qchildren; ++i) {
+        if (get_square(child) == square) {
+            return child;
+        }
+        ++child;
+    }
+
+    return NULL;
+}
+
+/*
+ * The subtree under the played step becomes a new root, so the search for
+ * the next step (or turn) continues from the already collected statistics.
+ */
+static void rebase_trees(
+    struct mcts_ai * restrict const me,
+    const int step)
+{
+    struct mcts_worker * restrict const first = me->workers;
+    for (unsigned int i=0; i<me->qworkers; ++i) {
+        struct mcts_worker * restrict const worker = me->workers + i;
+        if (worker->root == NULL) {
+            continue;
+        }
+
+        if (i > 0 && me->parallel == PARALLEL_TREE) {
+            worker->root = first->root;
+            continue;
+        }
+
+        worker->root = find_child(worker->multiallocator, worker->root, step);
+    }
+}
+
+static struct node * create_root(
+    struct multiallocator * restrict const multiallocator,
+    struct transposition * restrict const tt)
+{
+    reset_tree(multiallocator, tt);
+
+    const size_t inode = multiallocator_alloc(multiallocator, NODE_TYPE);
+    if (inode == BAD_ALLOC_INDEX) {
+        return NULL;
+    }
+
+    struct node * restrict const node = get_node(multiallocator, inode);
+    node->square_flags = NO_SQUARE;
+    node->qchildren = 0;
+    node->score = 0;
+    node->qgames = 0;
+    node->children = 0;
+    return node;
+}
+
+/*
+ * In tree mode all workers share the tree in me->multiallocator. In root mode
+ * every worker except the first one has a private multiallocator and searches
+ * its own tree, root statistics are merged after the search. Trees kept by
+ * rebase_trees are reused until half of the multiallocator is exhausted.
+ */
+static struct node * reuse_root(
+    struct multiallocator * restrict const multiallocator,
+    struct transposition * restrict const tt,
+    struct node * restrict const root)
+{
+    const int is_full = 2 * multiallocator->used_blocks > multiallocator->max_blocks;
+    if (root == NULL || is_full) {
+        return create_root(multiallocator, tt);
+    }
+
+    return root;
+}
+
+static int attach_workers(struct mcts_ai * restrict const me)
+{
+    for (unsigned int i=0; i<me->qworkers; ++i) {
+        struct mcts_worker * restrict const worker = me->workers + i;
+        if (i == 0 || me->parallel == PARALLEL_TREE) {
+            worker->multiallocator = me->multiallocator;
+            worker->tt = me->tt;
+            continue;
+        }
+
+        if (worker->own_multiallocator == NULL) {
+            worker->own_multiallocator = create_tree_multiallocator(me);
+            if (worker->own_multiallocator == NULL) {
+                sprintf(me->error_buf, "create_multiallocator fails for %u-th worker.", i);
+                return ENOMEM;
+            }
+        }
+
+        if (worker->own_tt == NULL) {
+            worker->own_tt = malloc(TT_SIZE * sizeof(struct transposition));
+            if (worker->own_tt == NULL) {
+                sprintf(me->error_buf, "Cannot allocate transposition table for %u-th worker.", i);
+                return ENOMEM;
+            }
+            worker->root = NULL;
+            worker->turn_root = NULL;
+        }
+
+        worker->multiallocator = worker->own_multiallocator;
+        worker->tt = worker->own_tt;
+    }
+
+    return 0;
+}
+
+static int prepare_workers(struct mcts_ai * restrict const me)
+{
+    const int status = attach_workers(me);
+    if (status != 0) {
+        return status;
+    }
+
+    struct mcts_worker * restrict const first = me->workers;
+    for (unsigned int i=0; i<me->qworkers; ++i) {
+        struct mcts_worker * restrict const worker = me->workers + i;
+        if (i > 0 && me->parallel == PARALLEL_TREE) {
+            worker->root = first->root;
+            continue;
+        }
+
+        worker->root = reuse_root(worker->multiallocator, worker->tt, worker->root);
+        if (worker->root == NULL) {
+            sprintf(me->error_buf, "multiallocator_alloc failed.");
+            return ENOMEM;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Indexes of the most visited children are stored into best. A proven win is
+ * taken alone, proven losses are skipped while there are other children.
+ */
+static int collect_best_children(
+    const struct node * const children,
+    const int qchildren,
+    int * restrict const best)
+{
+    int has_unlost = 0;
+    for (int i=0; i<qchildren; ++i) {
+        const struct node * const child = children + i;
+        const int proof = get_proof(child);
+        if (proof == PROVEN_WIN) {
+            best[0] = i;
+            return 1;
+        }
+        has_unlost |= proof != PROVEN_LOSS;
+    }
+
+    int qbest = 0;
+    int32_t best_qgames = 0;
+    for (int i=0; i<qchildren; ++i) {
+        const struct node * const child = children + i;
+        if (has_unlost && get_proof(child) == PROVEN_LOSS) {
+            continue;
+        }
+
+        const int32_t qgames = child->qgames;
+        if (qgames >= best_qgames) {
+            if (qgames != best_qgames) {
+                qbest = 0;
+                best_qgames = qgames;
+            }
+            best[qbest++] = i;
+        }
+    }
+
+    return qbest;
+}
+
+static int merge_root_children(
+    struct mcts_ai * restrict const me,
+    struct node * restrict const merged)
+{
+    const struct mcts_worker * const first = me->workers;
+    const int qchildren = first->root->qchildren;
+    const struct node * const children = get_node(first->multiallocator, first->root->children);
+    memcpy(merged, children, qchildren * sizeof(struct node));
+
+    if (me->parallel == PARALLEL_TREE) {
+        return qchildren;
+    }
+
+    int indexes[8*sizeof(wbb_t)];
+    for (int i=0; i<8*sizeof(wbb_t); ++i) {
+        indexes[i] = -1;
+    }
+
+    for (int i=0; i<qchildren; ++i) {
+        indexes[get_square(merged + i)] = i;
+    }
+
+    for (unsigned int i=1; i<me->qworkers; ++i) {
+        const struct mcts_worker * const worker = me->workers + i;
+        const int worker_qchildren = worker->root->qchildren;
+        if (worker_qchildren == 0 || worker_qchildren >= EXPANDING_MARK) {
+            continue;
+        }
+
+        const struct node * child = get_node(worker->multiallocator, worker->root->children);
+        for (int j=0; j<worker_qchildren; ++j) {
+            const int index = indexes[get_square(child)];
+            if (index >= 0) {
+                merged[index].qgames += child->qgames;
+                merged[index].score += child->score;
+                merged[index].square_flags |= child->square_flags & PROOF_MASK;
+            }
+            ++child;
+        }
+    }
+
+    return qchildren;
+}
+
+static void init_search(
+    struct mcts_ai * restrict const me,
+    const struct state * const state,
+    const uint64_t deadline)
+{
+    struct mcts_search * restrict const search = &me->search;
+    const struct geometry * const geometry = state->geometry;
+    search->deadline = deadline;
+    search->max_qthink = search->deadline != 0 ? UINT32_MAX : me->qthink;
+    search->x = state->x;
+    search->o = state->o;
+    search->dead = state->dead;
+    search->hash = state->hash;
+    search->active = state->active;
+    search->wide = state->wide;
+    search->n = geometry->n;
+    search->all = geometry->all;
+    search->not_lside = geometry->all ^ geometry->lside;
+    search->not_rside = geometry->all ^ geometry->rside;
+    search->qthink = 0;
+
+    for (unsigned int i=0; i<me->qworkers; ++i) {
+        rng_seed(&me->workers[i].rng, me->rng_seed ^ state->hash, i);
+        me->workers[i].qthink = 0;
+    }
+
+    /* Store before the check, so a concurrent set_stop is never lost. */
+    __atomic_store_n(&search->stop, 0, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&me->halt, __ATOMIC_SEQ_CST)) {
+        __atomic_store_n(&search->stop, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static inline int is_subposition(
+    const bb_t x, const bb_t o, const bb_t dead,
+    const struct state * const state)
+{
+    return (x & ~state->x) == 0 && (o & ~state->o) == 0 && (dead & ~state->dead) == 0;
+}
+
+/*
+ * Find the turn node with the state position in the subtree, positions are
+ * only growing during the game, so branches which are not subpositions of the
+ * state are skipped.
+ */
+static struct node * find_turn_node(
+    struct multiallocator * restrict const multiallocator,
+    struct node * restrict const node,
+    bb_t x, bb_t o, bb_t dead,
+    const struct state * const state)
+{
+    if (x == state->x && o == state->o && dead == state->dead) {
+        return node;
+    }
+
+    if (!is_subposition(x, o, dead, state)) {
+        return NULL;
+    }
+
+    const int qchildren = node->qchildren;
+    if (qchildren == 0 || qchildren >= EXPANDING_MARK) {
+        return NULL;
+    }
+
+    const int qsteps = pop_count(x|o) + pop_count(dead);
+    const int active = (qsteps/3) % 2 == 0 ? ACTIVE_X : ACTIVE_O;
+
+    struct node * restrict const children = get_turn_children(multiallocator, node->children);
+    const bb_t * const moves = get_turn_moves(children, qchildren);
+    for (int i=0; i<qchildren; ++i) {
+        bb_t new_x = x;
+        bb_t new_o = o;
+        bb_t new_dead = dead;
+        if (active == ACTIVE_X) {
+            apply_move(moves[i], &new_x, o, &new_dead);
+        } else {
+            apply_move(moves[i], &new_o, x, &new_dead);
+        }
+
+        struct node * restrict const result = find_turn_node(
+            multiallocator, children + i, new_x, new_o, new_dead, state);
+        if (result != NULL) {
+            return result;
+        }
+    }
+
+    return NULL;
+}
+
+static struct node * reuse_turn_root(
+    struct mcts_ai * restrict const me,
+    struct mcts_worker * restrict const worker,
+    const struct state * const state)
+{
+    struct multiallocator * restrict const multiallocator = worker->multiallocator;
+    const int is_full = 2 * multiallocator->used_blocks > multiallocator->max_blocks;
+    if (worker->turn_root != NULL && !is_full) {
+        const struct mcts_turn_plan * const plan = &me->plan;
+        struct node * restrict const root = find_turn_node(multiallocator, worker->turn_root,
+            plan->root_x, plan->root_o, plan->root_dead, state);
+        if (root != NULL) {
+            return root;
+        }
+    }
+
+    reset_tree(multiallocator, worker->tt);
+    worker->root = NULL;
+
+    const size_t inode = multiallocator_alloc(multiallocator, TURN_NODE_TYPE);
+    if (inode == BAD_ALLOC_INDEX) {
+        return NULL;
+    }
+
+    struct node * restrict const node = get_turn_children(multiallocator, inode);
+    node->square_flags = NO_SQUARE;
+    node->qchildren = 0;
+    node->score = 0;
+    node->qgames = 0;
+    node->children = 0;
+    get_turn_moves(node, 1)[0] = 0;
+    return node;
+}
+
+static int prepare_turn_workers(
+    struct mcts_ai * restrict const me,
+    const struct state * const state)
+{
+    const int status = attach_workers(me);
+    if (status != 0) {
+        return status;
+    }
+
+    const size_t turns_sz = max_turns(state->geometry->n) * sizeof(bb_t);
+    struct mcts_worker * restrict const first = me->workers;
+    for (unsigned int i=0; i<me->qworkers; ++i) {
+        struct mcts_worker * restrict const worker = me->workers + i;
+        if (worker->turns == NULL) {
+            worker->turns = malloc(turns_sz);
+            if (worker->turns == NULL) {
+                sprintf(me->error_buf, "Cannot allocate turn buffer for %u-th worker.", i);
+                return ENOMEM;
+            }
+        }
+
+        if (i > 0 && me->parallel == PARALLEL_TREE) {
+            worker->turn_root = first->turn_root;
+            continue;
+        }
+
+        worker->turn_root = reuse_turn_root(me, worker, state);
+        if (worker->turn_root == NULL) {
+            sprintf(me->error_buf, "multiallocator_alloc failed.");
+            return ENOMEM;
+        }
+    }
+
+    struct mcts_turn_plan * restrict const plan = &me->plan;
+    plan->root_x = state->x;
+    plan->root_o = state->o;
+    plan->root_dead = state->dead;
+    return 0;
+}
+
+static int merge_turn_children(
+    struct mcts_ai * restrict const me,
+    struct node * restrict const merged,
+    bb_t * restrict const merged_moves)
+{
+    const struct mcts_worker * const first = me->workers;
+    const int qchildren = first->turn_root->qchildren;
+    const struct node * const children = get_turn_children(first->multiallocator, first->turn_root->children);
+    memcpy(merged, children, qchildren * sizeof(struct node));
+    memcpy(merged_moves, get_turn_moves(children, qchildren), qchildren * sizeof(bb_t));
+
+    if (me->parallel == PARALLEL_TREE) {
+        return qchildren;
+    }
+
+    for (unsigned int i=1; i<me->qworkers; ++i) {
+        const struct mcts_worker * const worker = me->workers + i;
+        const int worker_qchildren = worker->turn_root->qchildren;
+        if (worker_qchildren == 0 || worker_qchildren >= EXPANDING_MARK) {
+            continue;
+        }
+
+        const struct node * const worker_children = get_turn_children(worker->multiallocator, worker->turn_root->children);
+        const bb_t * const worker_moves = get_turn_moves(worker_children, worker_qchildren);
+        for (int j=0; j<worker_qchildren; ++j) {
+            const struct node * const child = worker_children + j;
+            for (int k=0; k<qchildren; ++k) {
+                if (merged_moves[k] == worker_moves[j]) {
+                    merged[k].qgames += child->qgames;
+                    merged[k].score += child->score;
+                    merged[k].square_flags |= child->square_flags & PROOF_MASK;
+                    break;
+                }
+            }
+        }
+    }
+
+    return qchildren;
+}
+
+/*
+ * The turn chosen by the turn search is played step by step, next steps are
+ * taken from the plan while the state is a continuation of the planned turn.
+ */
+static int follow_plan(
+    const struct mcts_ai * const me,
+    const struct state * const state)
+{
+    const struct mcts_turn_plan * const plan = &me->plan;
+    if (!plan->is_valid) {
+        return -1;
+    }
+
+    if (!is_subposition(plan->x, plan->o, plan->dead, state)) {
+        return -1;
+    }
+
+    const bb_t played = (state->x ^ plan->x) | (state->o ^ plan->o) | (state->dead ^ plan->dead);
+    const int qplayed = pop_count(state->x | state->o) + pop_count(state->dead)
+        - pop_count(plan->x | plan->o) - pop_count(plan->dead);
+    if ((played & ~plan->move) != 0 || qplayed != pop_count(played)) {
+        return -1;
+    }
+
+    const bb_t steps = plan->move & ~played & state->next;
+    return steps != 0 ? first_one(steps) : -1;
+}
+
+static void explain_turn(
+    struct mcts_ai * restrict const me,
+    const struct state * const state,
+    const int square,
+    const struct node * const children,
+    const bb_t * const moves,
+    const int qchildren)
+{
+    struct step_stat * restrict const best_stat = me->stats;
+    struct step_stat * restrict stat = best_stat + 1;
+    const struct mcts_turn_plan * const plan = &me->plan;
+
+    best_stat->square = square;
+    best_stat->qgames = plan->qgames;
+    best_stat->score = plan->score;
+
+    bb_t steps = state->next ^ BB_SQUARE(square);
+    while (steps != 0) {
+        const int sq = first_one(steps);
+        steps ^= BB_SQUARE(sq);
+
+        stat->square = sq;
+        stat->qgames = 0;
+        stat->score = 0;
+        for (int i=0; i<qchildren; ++i) {
+            const struct node * const child = children + i;
+            if ((moves[i] & BB_SQUARE(sq)) && child->qgames > stat->qgames) {
+                const float score = SCORE_FACTOR * child->score;
+                stat->qgames = child->qgames;
+                stat->score = 0.5 * (score/stat->qgames + 1.0);
+            }
+        }
+        ++stat;
+    }
+
+    qsort(best_stat + 1, stat - best_stat - 1, sizeof(struct step_stat), &cmp_stats);
+}
+
+static int turn_go(
+    struct mcts_ai * restrict const me,
+    const struct state * const state,
+    const uint64_t deadline,
+    const int has_explanation)
+{
+    const int planned = follow_plan(me, state);
+    if (planned >= 0) {
+        if (has_explanation) {
+            explain_turn(me, state, planned, NULL, NULL, 0);
+        }
+        return planned;
+    }
+
+    me->plan.is_valid = 0;
+    const int prepare_status = prepare_turn_workers(me, state);
+    if (prepare_status != 0) {
+        errno = prepare_status;
+        return -1;
+    }
+
+    struct mcts_search * restrict const search = &me->search;
+    init_search(me, state, deadline);
+    set_progress(me, 1);
+
+    struct mcts_worker * restrict const first = me->workers;
+    first->vloss = 0;
+    const int status = turn_simulate(first, first->turn_root, &search->qthink,
+        search->x, search->o, search->dead,
+        search->n, search->all, search->not_lside, search->not_rside);
+    if (status != 0) {
+        errno = status;
+        return -1;
+    }
+
+    if (search->qthink < search->max_qthink) {
+        run_workers(me);
+        for (unsigned int i=0; i<me->qworkers; ++i) {
+            if (me->workers[i].status != 0) {
+                errno = me->workers[i].status;
+            }
+        }
+    }
+
+    const int root_qchildren = first->turn_root->qchildren;
+    if (root_qchildren == 0 || root_qchildren >= EXPANDING_MARK) {
+        /* No turn can be completed, the game is lost, any step is fine. */
+        const int square = first_one(state->next);
+        me->plan.qgames = 0;
+        me->plan.score = 0.0;
+        if (has_explanation) {
+            explain_turn(me, state, square, NULL, NULL, 0);
+        }
+        return square;
+    }
+
+    struct node children[root_qchildren];
+    bb_t moves[root_qchildren];
+    const int qchildren = merge_turn_children(me, children, moves);
+
+    int best[qchildren];
+    const int qbest = collect_best_children(children, qchildren, best);
+
+    const int ibest = qbest == 1 ? 0 : rng_uniform(&me->workers->rng, qbest);
+    const struct node * const choice = children + best[ibest];
+
+    struct mcts_turn_plan * restrict const plan = &me->plan;
+    plan->x = state->x;
+    plan->o = state->o;
+    plan->dead = state->dead;
+    plan->move = moves[best[ibest]];
+    plan->qgames = choice->qgames;
+    plan->score = 0.5 * (SCORE_FACTOR * choice->score / choice->qgames + 1.0);
+    plan->is_valid = 1;
+
+    const int square = follow_plan(me, state);
+    if (square < 0) {
+        sprintf(me->error_buf, "Planned turn has no legal step.");
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (has_explanation) {
+        explain_turn(me, state, square, children, moves, qchildren);
+    }
+
+    return square;
+}
+
+static int32_t count_root_games(const struct mcts_ai * const me)
+{
+    int32_t result = 0;
+    const unsigned int qroots = me->parallel == PARALLEL_TREE ? 1 : me->qworkers;
+    for (unsigned int i=0; i<qroots; ++i) {
+        const struct mcts_worker * const worker = me->workers + i;
+        const struct node * const root = is_turn_tree(me) ? worker->turn_root : worker->root;
+        result += __atomic_load_n(&root->qgames, __ATOMIC_RELAXED);
+    }
+    return result;
+}
+
+static size_t calc_tree_memory(const struct mcts_ai * const me)
+{
+    const struct multiallocator * const shared = me->workers[0].multiallocator;
+    size_t result = 0;
+    for (unsigned int i=0; i<me->qworkers; ++i) {
+        const struct multiallocator * const multiallocator = me->workers[i].multiallocator;
+        if (i > 0 && multiallocator == shared) {
+            continue;
+        }
+        const size_t used_blocks = __atomic_load_n(&multiallocator->used_blocks, __ATOMIC_RELAXED);
+        result += used_blocks * multiallocator->block_sz;
+    }
+    return result;
+}
+
+static void set_progress(struct mcts_ai * restrict const me, const int is_on)
+{
+    pthread_mutex_lock(&me->progress_lock);
+    if (is_on) {
+        me->progress_base = count_root_games(me);
+    }
+    me->has_progress = is_on;
+    pthread_mutex_unlock(&me->progress_lock);
+}
+
+static inline float get_progress_score(
+    const struct mcts_ai * const me,
+    const struct node * const node)
+{
+    const int32_t qgames = __atomic_load_n(&node->qgames, __ATOMIC_RELAXED);
+    const int32_t score = __atomic_load_n(&node->score, __ATOMIC_RELAXED);
+    const float result = 0.5 * (SCORE_FACTOR * score / qgames + 1.0);
+    return me->search.active == ACTIVE_X ? result : 1.0 - result;
+}
+
+/* Principal variation is taken from the first worker tree only. */
+static void get_step_pv(
+    const struct mcts_ai * const me,
+    struct ai_progress * restrict const progress)
+{
+    const struct mcts_worker * const first = me->workers;
+    const struct node * node = first->root;
+    while (progress->qpv < MAX_PV_LEN) {
+        const int qchildren = get_qchildren(node);
+        if (qchildren == 0 || qchildren >= EXPANDING_MARK) {
+            break;
+        }
+
+        const struct node * child = get_node(first->multiallocator, node->children);
+        const struct node * best = child;
+        int32_t best_qgames = __atomic_load_n(&child->qgames, __ATOMIC_RELAXED);
+        for (int i=1; i<qchildren; ++i) {
+            ++child;
+            const int32_t qgames = __atomic_load_n(&child->qgames, __ATOMIC_RELAXED);
+            if (qgames > best_qgames) {
+                best = child;
+                best_qgames = qgames;
+            }
+        }
+
+        if (best_qgames <= 0) {
+            break;
+        }
+
+        if (progress->qpv == 0) {
+            progress->score = get_progress_score(me, best);
+        }
+
+        progress->pv[progress->qpv++] = get_square(best);
+        node = best;
+    }
+}
+
+/* Steps of every turn are listed in square order, not in the play order. */
+static void get_turn_pv(
+    const struct mcts_ai * const me,
+    struct ai_progress * restrict const progress)
+{
+    const struct mcts_worker * const first = me->workers;
+    const struct node * node = first->turn_root;
+    while (progress->qpv < MAX_PV_LEN) {
+        const int qchildren = get_qchildren(node);
+        if (qchildren == 0 || qchildren >= EXPANDING_MARK) {
+            break;
+        }
+
+        const struct node * const children = get_turn_children(first->multiallocator, node->children);
+        int ibest = 0;
+        int32_t best_qgames = __atomic_load_n(&children->qgames, __ATOMIC_RELAXED);
+        for (int i=1; i<qchildren; ++i) {
+            const int32_t qgames = __atomic_load_n(&children[i].qgames, __ATOMIC_RELAXED);
+            if (qgames > best_qgames) {
+                ibest = i;
+                best_qgames = qgames;
+            }
+        }
+
+        if (best_qgames <= 0) {
+            break;
+        }
+
+        if (progress->qpv == 0) {
+            progress->score = get_progress_score(me, children + ibest);
+        }
+
+        bb_t move = get_turn_moves(children, qchildren)[ibest];
+        while (move != 0 && progress->qpv < MAX_PV_LEN) {
+            const int sq = first_one(move);
+            move ^= BB_SQUARE(sq);
+            progress->pv[progress->qpv++] = sq;
+        }
+        node = children + ibest;
+    }
+}
+
+/*
+ * Endgame solver: iterative deepening alpha-beta over state_step/unstep with
+ * win, loss or unknown values for the side to move. Depth is given in steps
+ * and grows by whole turns, consecutive steps of one side are not negated.
+ */
+
+#define ENDGAME_TT_BITS         16
+#define ENDGAME_TT_SIZE         (1 << ENDGAME_TT_BITS)
+#define ENDGAME_TT_MASK         (ENDGAME_TT_SIZE - 1)
+#define ENDGAME_CHECK_PERIOD    1024
+
+#define ENDGAME_LOSS     -1
+#define ENDGAME_UNKNOWN   0
+#define ENDGAME_WIN      +1
+
+/* Win and loss values are exact, unknown values only keep the best step. */
+struct endgame_entry
+{
+    uint64_t hash;
+    int8_t value;
+    uint8_t step;
+};
+
+struct endgame_search
+{
+    struct state state;
+    struct endgame_entry * tt;
+    const int * halt;
+    uint64_t qnodes;
+    uint64_t max_qnodes;
+    uint64_t deadline;
+    int is_aborted;
+    int is_cut;
+};
+
+static int check_endgame_limits(struct endgame_search * restrict const me)
+{
+    ++me->qnodes;
+    if (me->qnodes % ENDGAME_CHECK_PERIOD != 0) {
+        return 0;
+    }
+
+    const int is_aborted = 0
+        || me->qnodes >= me->max_qnodes
+        || (me->deadline != 0 && get_time_ns() >= me->deadline)
+        || __atomic_load_n(me->halt, __ATOMIC_RELAXED)
+    ;
+
+    me->is_aborted = is_aborted;
+    return is_aborted;
+}
+
+static int endgame_alphabeta(
+    struct endgame_search * restrict const me,
+    const int depth,
+    int alpha,
+    const int beta)
+{
+    struct state * restrict const state = &me->state;
+    const bb_t steps = state_get_steps(state);
+    if (steps == 0) {
+        return ENDGAME_LOSS;
+    }
+
+    if (depth == 0) {
+        me->is_cut = 1;
+        return ENDGAME_UNKNOWN;
+    }
+
+    if (check_endgame_limits(me)) {
+        return ENDGAME_UNKNOWN;
+    }
+
+    struct endgame_entry * restrict const entry = me->tt + (state->hash & ENDGAME_TT_MASK);
+    bb_t first = 0;
+    if (entry->hash == state->hash) {
+        if (entry->value != ENDGAME_UNKNOWN) {
+            return entry->value;
+        }
+        first = BB_SQUARE(entry->step) & steps;
+    }
+
+    /* Move ordering: the best step from TT, kills, other steps. */
+    const int active = state->active;
+    const bb_t opp = active == ACTIVE_X ? state->o : state->x;
+    const bb_t kills = steps & opp & ~first;
+    const bb_t groups[3] = { first, kills, steps & ~kills & ~first };
+
+    int best_value = ENDGAME_LOSS - 1;
+    int best_step = first_one(steps);
+    for (int i=0; i<3 && alpha < beta; ++i) {
+        bb_t group = groups[i];
+        while (group != 0 && alpha < beta) {
+            const int sq = first_one(group);
+            group ^= BB_SQUARE(sq);
+
+            state_step(state, sq);
+            const int value = state->active == active
+                ? endgame_alphabeta(me, depth - 1, alpha, beta)
+                : -endgame_alphabeta(me, depth - 1, -beta, -alpha);
+            state_unstep(state, sq);
+
+            if (me->is_aborted) {
+                return ENDGAME_UNKNOWN;
+            }
+
+            if (value > best_value) {
+                best_value = value;
+                best_step = sq;
+            }
+
+            if (value > alpha) {
+                alpha = value;
+            }
+        }
+    }
+
+    entry->hash = state->hash;
+    entry->value = best_value;
+    entry->step = best_step;
+    return best_value;
+}
+
+/*
+ * Squares where any side might step until the end of the game: empty and
+ * alive opponent squares connected to own alive squares through squares of
+ * the same kind or killed by the side.
+ */
+static int calc_endgame_area(const struct state * const state)
+{
+    const struct geometry * const geometry = state->geometry;
+    const int n = geometry->n;
+    const bb_t all = geometry->all;
+    const bb_t not_lside = all ^ geometry->lside;
+    const bb_t not_rside = all ^ geometry->rside;
+    const bb_t empty = all ^ (state->x | state->o);
+
+    bb_t area = 0;
+    for (int side=0; side<2; ++side) {
+        const bb_t my = side == 0 ? state->x : state->o;
+        const bb_t opp = side == 0 ? state->o : state->x;
+        const bb_t place = empty | (opp & ~state->dead);
+        const bb_t passable = place | (opp & state->dead) | (my & ~state->dead);
+
+        bb_t cloud = my & ~state->dead;
+        for (;;) {
+            const bb_t next = grow(cloud, n, all, not_lside, not_rside) & passable;
+            if (next == cloud) {
+                break;
+            }
+            cloud = next;
+        }
+
+        area |= cloud & place;
+    }
+
+    return pop_count(area);
+}
+
+/*
+ * Entries are keyed by the hash only, and Zobrist keys do not depend on the
+ * board size, so values of the previous game must not be reused.
+ */
+static void clear_endgame_tt(struct mcts_ai * restrict const me)
+{
+    if (me->endgame_tt != NULL) {
+        memset(me->endgame_tt, 0, ENDGAME_TT_SIZE * sizeof(struct endgame_entry));
+    }
+}
+
+/*
+ * Returns the winning step or -1 when the win is not proven. The deadline is
+ * the one of the whole search, so the time spent here is charged to the step.
+ */
+static int solve_endgame(
+    struct mcts_ai * restrict const me,
+    const struct state * const state,
+    const uint64_t deadline)
+{
+    if (me->endgame == 0 || state_is_wide(state) || state_get_steps(state) == 0) {
+        return -1;
+    }
+
+    const int area = calc_endgame_area(state);
+    if (area > me->endgame) {
+        return -1;
+    }
+
+    if (me->endgame_tt == NULL) {
+        me->endgame_tt = calloc(ENDGAME_TT_SIZE, sizeof(struct endgame_entry));
+        if (me->endgame_tt == NULL) {
+            return -1;
+        }
+    }
+
+    /* A quarter of the search limits, MCTS continues with the rest. */
+    struct endgame_search search;
+    search.state = *state;
+    search.tt = me->endgame_tt;
+    search.halt = &me->halt;
+    search.qnodes = 0;
+    search.max_qnodes = me->qthink / 4 + ENDGAME_CHECK_PERIOD;
+    search.deadline = 0;
+    search.is_aborted = 0;
+    if (deadline != 0) {
+        const uint64_t now = get_time_ns();
+        search.max_qnodes = UINT64_MAX;
+        search.deadline = deadline > now ? now + (deadline - now) / 4 : now;
+    }
+
+    const int all_qsteps = pop_count(state->x | state->o) + pop_count(state->dead);
+    const int max_depth = 2 * area + 3;
+    for (int depth = 3 - all_qsteps % 3; depth <= max_depth; depth += 3) {
+        search.is_cut = 0;
+        const int value = endgame_alphabeta(&search, depth, ENDGAME_LOSS, ENDGAME_WIN);
+        if (search.is_aborted || value == ENDGAME_LOSS) {
+            return -1;
+        }
+
+        if (value == ENDGAME_WIN) {
+            const struct endgame_entry * const entry = me->endgame_tt + (state->hash & ENDGAME_TT_MASK);
+            return entry->hash == state->hash ? entry->step : -1;
+        }
+
+        if (!search.is_cut) {
+            break;
+        }
+    }
+
+    return -1;
+}
+
+static void explain_endgame(
+    struct mcts_ai * restrict const me,
+    const struct state * const state,
+    const int square)
+{
+    struct step_stat * restrict const stats = me->stats;
+    const int qsteps = state_qnext(state);
+    for (int i=0; i<qsteps; ++i) {
+        if (stats[i].square == square) {
+            stats[i] = stats[0];
+            break;
+        }
+    }
+
+    stats[0].square = square;
+    stats[0].qgames = 0;
+    stats[0].score = 1.0;
+}
+
+static void * ponder_thread(void * arg)
+{
+    run_workers(arg);
+    return NULL;
+}
+
+/*
+ * Search the position with the opponent to move without limits. The tree is
+ * kept by rebase_trees when the opponent step arrives, so statistics for the
+ * played reply are reused, other branches are discarded.
+ */
+static void start_ponder(
+    struct mcts_ai * restrict const me,
+    const struct state * const state)
+{
+    if (!me->ponder || me->our_side == 0 || (me->nn == NULL && !state_is_wide(state))) {
+        return;
+    }
+
+    if (state->active == me->our_side || state_status(state) != 0) {
+        return;
+    }
+
+    if (is_turn_tree(me)) {
+        me->plan.is_valid = 0;
+        if (prepare_turn_workers(me, state) != 0) {
+            return;
+        }
+    } else {
+        if (prepare_workers(me) != 0) {
+            return;
+        }
+    }
+
+    init_search(me, state, 0);
+    me->search.max_qthink = UINT32_MAX;
+    me->search.stop = 0; /* halt is for our own search only */
+
+    const int status = pthread_create(&me->ponder_thread, NULL, ponder_thread, me);
+    me->is_pondering = status == 0;
+}
+
+static void stop_ponder(struct mcts_ai * restrict const me)
+{
+    if (!me->is_pondering) {
+        return;
+    }
+
+    __atomic_store_n(&me->search.stop, 1, __ATOMIC_RELAXED);
+    pthread_join(me->ponder_thread, NULL);
+    me->is_pondering = 0;
+}
+
+static int ai_go(
+    struct mcts_ai * restrict const me,
+    const struct state * const state,
+    const int has_explanation)
+{
+    /* Computed once, calc_deadline starts the turn clock on the first step. */
+    const uint64_t deadline = calc_deadline(me, state);
+    const int solved = solve_endgame(me, state, deadline);
+    if (solved >= 0) {
+        if (has_explanation) {
+            explain_endgame(me, state, solved);
+        }
+        return solved;
+    }
+
+    if (me->nn == NULL && !state_is_wide(state)) {
+        sprintf(me->error_buf, "NN is not set.");
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (is_turn_tree(me)) {
+        return turn_go(me, state, deadline, has_explanation);
+    }
+
+    const int prepare_status = prepare_workers(me);
+    if (prepare_status != 0) {
+        errno = prepare_status;
+        return -1;
+    }
+
+    struct mcts_search * restrict const search = &me->search;
+    init_search(me, state, deadline);
+    set_progress(me, 1);
+
+    struct mcts_worker * restrict const first = me->workers;
+    first->vloss = 0;
+    const int status = simulate_once(first, &search->qthink);
+    if (status != 0) {
+        errno = status;
+        return -1;
+    }
+
+    if (search->qthink < search->max_qthink) {
+        run_workers(me);
+        for (unsigned int i=0; i<me->qworkers; ++i) {
+            if (me->workers[i].status != 0) {
+                errno = me->workers[i].status;
+            }
+        }
+    }
+
+    struct node children[first->root->qchildren];
+    const int qchildren = merge_root_children(me, children);
+
+    int best[qchildren];
+    const int qbest = collect_best_children(children, qchildren, best);
+
+    const int ibest = qbest == 1 ? 0 : rng_uniform(&me->workers->rng, qbest);
+    const int index = best[ibest];
+    const int square = get_square(children + index);
+
+    if (has_explanation) {
+        struct step_stat * restrict const best_stat = me->stats;
+        struct step_stat * restrict stat = best_stat + 1;
+        const struct node * child = children;
+        for (int i=0; i<qchildren; ++i) {
+
+            const float qgames = child->qgames;
+            const float score = SCORE_FACTOR * child->score;
+
+            if (i == index) {
+                best_stat->square = get_square(child);
+                best_stat->qgames = child->qgames;
+                best_stat->score = 0.5 * (score/qgames + 1.0);
+            } else {
+                stat->square = get_square(child);
+                stat->qgames = child->qgames;
+                stat->score = 0.5 * (score/qgames + 1.0);
+                ++stat;
+            }
+
+            ++child;
+        }
+
+        qsort(best_stat + 1, qchildren-1, sizeof(struct step_stat), &cmp_stats);
+    }
+
+    return square;
+}
+
+
+
+/* DEBUG */
+
+static const int file_chars[256] = {
+    [0 ... 'a'-1] = -1,
+    ['a'] = 0, ['b'] = 1, ['c'] = 2, ['d'] = 3, ['e'] = 4,
+    ['f'] = 5, ['g'] = 6, ['h'] = 7, ['i'] = 8, ['j'] = -1, ['k'] = 9,
+    ['l' ... 255] = -1
+};
+
+static const int rank_chars[256] = {
+    [0 ... '0'] = -1,
+    ['1'] = 0, ['2'] = 1, ['3'] = 2, ['4'] = 3, ['5'] = 4,
+    ['6'] = 5, ['7'] = 6, ['8'] = 7, ['9'] = 8,
+    ['9' + 1 ... 'T'-1] = -1,
+    ['T'] = 9,
+    ['T'+1 ... 255] = -1
+};
+
+static int parse_sq(const char * const s)
+{
+    if (s == NULL) {
+        printf("Error in parse_sq: cannot parse NULL");
+        return -1;
+    }
+
+    const int file_ch = s[0];
+    const int file = file_chars[file_ch];
+    if (file < 0) {
+        printf("Invalid file char with code %d (“%c”)", file_ch, file_ch);
+        return -1;
+    }
+
+    const int rank_ch = s[1];
+    const int rank = rank_chars[rank_ch];
+    if (rank < 0) {
+        printf("Invalid rank char with code %d (“%c”)", rank_ch, rank_ch);
+        return -1;
+    }
+
+    return 10 * rank + file;
+}
+
+static const char * good_game[] = {
+    "a1", "b2", "c3",      "kT", "i9", "h8",
+    "d4", "d5", "e4",      "g7", "f8", "h6",
+    "f3", "g2", "c6",      "e9", "dT", "cT",
+    "h3", "i3", "b6",      "i6", "k6", "bT",
+    "k3", "g3", "a7",      "aT", "a9", "d9",
+    "a8", "a9", "k4",      "b9", "a8", "a7",
+    "k5", "k6", "i6",      "b6", "c6", "d5",
+    "a3", "c5", "h6",      "e4", "f3", "g3",
+    "g7", "h8", "g9",      "g9", "h3", "i3",
+    "i9", "f6", "f8",      "k4", "k5", "d4",
+    "h5", "k2", "k1",      "h4", "h5", "k3",
+    "h1", "f1", "hT",      "g2", "h1", "k2",
+    "i2", "f2", "c1",      "i2", "k1", "f2",
+    "g1", "h2", "i1",      "f1", "c3", "b2",
+    "d1", "e1", "a4",      "c1", "d1", "e1",
+    "c4", "d3", "e2",      "d3", "e2", "a1",
+    "a2", "b1", "c2",      "k9", "k8", "k7",
+    "k9", "kT", "e9",      "eT", "fT", "hT",
+    "fT", "iT", "d9",      "f9", "iT", "gT",
+    "f9", "d2", "e8",      "d2", "e3", "i7",
+    "i7", "c8", "b9",      "b7", "c8", "g8",
+    "g8", "i5", "h4",      "h9", "i8", "i5",
+    "a5", "a6", "b7",      "e5", "f6", "i4",
+    "g5", "f4", "e3",      "d7", "e8", "g5",
+    "g4", "i4", "e5",      "a6", "c5", "f4",
+    "f5", "e6", "d7",      "h7", "g6", "f5",
+    "f7", "g6", "cT",      "c9", "c7", "f7",
+    "c7", "d8", "c9",
+    NULL
+};
+
+int cmp_bb(const void * const ptr_a, const void * const ptr_b)
+{
+    const bb_t * const a = ptr_a;
+    const bb_t * const b = ptr_b;
+    if (*a < *b) return -1;
+    if (*a > *b) return +1;
+    return 0;
+}
+
+#define MAX_QSCANS 131072
+
+int full_scan(
+    const struct state * const state)
+{
+    struct state storage = *state;
+    struct state * restrict const me = &storage;
+
+    int full_qscans = 0;
+    const size_t sz = MAX_QSCANS * sizeof(bb_t);
+    bb_t * restrict const buf = malloc(sz);
+    if (buf == NULL) {
+        return -1;
+    }
+
+    int qerrors = 0;
+
+    bb_t steps1 = state_get_steps(me);
+    while (steps1 != 0) {
+        bb_t bb = steps1 & (-steps1);
+        steps1 ^= bb;
+        const int step1 = first_one(bb);
+        state_step(me, step1);
+
+        bb_t steps2 = state_get_steps(me);
+        while (steps2 != 0) {
+            bb_t bb = steps2 & (-steps2);
+            steps2 ^= bb;
+            const int step2 = first_one(bb);
+
+            state_step(me, step2);
+            bb_t steps3 = state_get_steps(me);
+            while (steps3 != 0) {
+                bb_t bb = steps3 & (-steps3);
+                steps3 ^= bb;
+                const int step3 = first_one(bb);
+                if (full_qscans < MAX_QSCANS) {
+                    buf[full_qscans++] = BB_SQUARE(step1) | BB_SQUARE(step2) | BB_SQUARE(step3);
+                } else {
+                    ++full_qscans;
+                    ++qerrors;
+                }
+            }
+            state_unstep(me, step2);
+        }
+
+        state_unstep(me, step1);
+    }
+
+    if (qerrors > 0) {
+        fprintf(stderr,
+            "full_qscans overflow, maximum value is %d, but current value is %d. "
+            "Please increase MAX_QSCANS.\n", MAX_QSCANS, full_qscans);
+        return -1;
+    }
+
+    qsort(buf, full_qscans, sizeof(bb_t), cmp_bb);
+
+    int unique_qmoves = 1;
+    for (int i=1; i<full_qscans; ++i) {
+        unique_qmoves += buf[i-1] != buf[i];
+    }
+
+    free(buf);
+    return unique_qmoves;
+}
+
+void print_stats(
+    const struct geometry * const geometry,
+    const struct state * const me,
+    const bb_t move)
+{
+    const bb_t my = me->active == ACTIVE_X ? me->x : me->o;
+    const bb_t opp = me->active == ACTIVE_X ? me->o : me->x;
+    const bb_t dead = me->dead;
+    const int n = geometry->n;
+    const bb_t all = geometry->all;
+    const bb_t not_lside = all ^ geometry->lside;
+    const bb_t not_rside = all ^ geometry->rside;
+
+    bb_t output[4][4096];
+    int qmoves[4] = {
+        get_3moves_0(my, opp, dead, n, all, not_lside, not_rside, output[0]),
+        get_3moves_1(my, opp, dead, n, all, not_lside, not_rside, output[1]),
+        get_3moves_2(my, opp, dead, n, all, not_lside, not_rside, output[2]),
+        get_3moves_3(my, opp, dead, n, all, not_lside, not_rside, output[3])
+    };
+
+    int qmoves_with_killed[4][4];
+    memset(qmoves_with_killed, 0, sizeof(qmoves_with_killed));
+    for (int i=0; i<4; ++i) {
+        for (int j=0; j<qmoves[i]; ++j) {
+            int killed = pop_count(output[i][j] & opp);
+            ++qmoves_with_killed[i][killed];
+        }
+    }
+
+    int mark[4] = { 0, 0, 0, 0 };
+    for (int i=0; i<4; ++i) {
+        for (int j=0; j<qmoves[i]; ++j) {
+            if (output[i][j] == move) {
+                mark[i] = 1;
+            }
+        }
+    }
+
+    const int move_killed = pop_count(move & opp);
+
+    const int total = qmoves[0] + qmoves[1] + qmoves[2] + qmoves[3];
+    printf(" %5d", total);
+    for (int i=0; i<4; ++i) {
+        printf(" | %6d %s", qmoves[i], mark[i] ? "*" : " ");
+        for (int j=0; j<4; ++j) {
+            int put_mark = mark[i] && j == move_killed;
+            printf(" %5d %s", qmoves_with_killed[i][j], put_mark ? "x" : " ");
+        }
+    }
+
+    const int full_qmoves = full_scan(me);
+    if (full_qmoves != total) {
+        printf(" error full_qmoves = %d", full_qmoves);
+    }
+}
+
+void run_game(
+    const struct geometry * const geometry,
+    struct state * restrict const me)
+{
+    struct state base = *me;
+
+    int active = 1;
+    for (int i=0;; ++i) {
+        const char * const square_str = good_game[i];
+        if (square_str == NULL) {
+            printf("%s", active == 1 ? "X" : "O");
+            printf("  %2s %2s %2s  ", good_game[i-3], good_game[i-2], good_game[i-1]);
+            printf("\n");
+            break;
+        }
+
+        const int status = state_status(me);
+        if (state_status(me) != 0) {
+            printf("Invalid state status %d on step %d.\n", status, i);
+            return;
+        }
+
+        if (i > 0 && (i % 3) == 0) {
+            const int sq1 = parse_sq(good_game[i-3]);
+            const int sq2 = parse_sq(good_game[i-2]);
+            const int sq3 = parse_sq(good_game[i-1]);
+            const bb_t bb = BB_SQUARE(sq1) | BB_SQUARE(sq2) | BB_SQUARE(sq3);
+
+            printf("%s", active == 1 ? "X" : "O");
+            printf("  %2s-%2s-%2s  ", good_game[i-3], good_game[i-2], good_game[i-1]);
+            print_stats(geometry, &base, bb);
+            printf("\n");
+            active ^= 3;
+            base = *me;
+        }
+
+        const int sq = parse_sq(square_str);
+        if (sq < 0) {
+            printf(" during parsing step %d (“%s”).\n", i, square_str);
+            return;
+        }
+
+        state_step(me, sq);
+    }
+
+    if (state_status(me) == 0) {
+        printf("State status is zero (in progress) after end of game.\n");
+        return;
+    }
+}
+
+void mcts_test_game(void)
+{
+    struct geometry * restrict const geometry = create_std_geometry(10);
+    if (geometry == NULL) {
+        printf("create_std_geometry(7) failed, errno = %d.\n", errno);
+        return;
+    }
+
+    struct state * restrict const me = create_state(geometry);
+    if (me == NULL) {
+        printf("create_state(geometry) failed, errno = %d.\n", errno);
+        return;
+    }
+
+    run_game(geometry, me);
+
+    destroy_state(me);
+    destroy_geometry(geometry);
+}
+
+int get_random_rollout_step(
+    void * data, /* Private data */
+    bb_t my, bb_t opp, bb_t dead, /* Game data */
+    const int n, const bb_t all, const bb_t not_lside, const bb_t not_rside) /* Geometry */
+{
+    const bb_t steps = next_steps(my, opp, dead, n, all, not_lside, not_rside);
+    if (steps != 0) {
+        const int qsteps = pop_count(steps);
+        const int index = qsteps > 1 ? rand() % qsteps : 0;
+        return index == 0 ? first_one(steps) : nth_one_index(steps, index);
+    }
+
+    const int total_qsteps = pop_count(my|opp) + pop_count(dead);
+    if (total_qsteps == 0) {
+        return 0;
+    }
+
+    if (total_qsteps == 3) {
+        return n*n-1;
+    }
+
+    return -1;
+}
+
+struct rollout_expansion
+{
+    bb_t selected;
+    bb_t * buf;
+};
+
+static bb_t select_3move(
+    struct rollout_expansion * restrict const me, /* Private data */
+    bb_t my, bb_t opp, bb_t dead, /* Game data */
+    const int n, const bb_t all, const bb_t not_lside, const bb_t not_rside) /* Geometry */
+{
+    bb_t * restrict const buf = me->buf;
+
+    const int q3moves3 = get_3moves_3(my, opp, dead, n, all, not_lside, not_rside, buf);
+    if (q3moves3 != 0) {
+        const int index = q3moves3 > 1 ? rand() % q3moves3 : 0;
+        return buf[index];
+    }
+
+    const int q3moves2 = get_3moves_2(my, opp, dead, n, all, not_lside, not_rside, buf);
+    if (q3moves2 != 0) {
+        const int index = q3moves2 > 1 ? rand() % q3moves2 : 0;
+        return buf[index];
+    }
+
+    const int q3moves1 = get_3moves_1(my, opp, dead, n, all, not_lside, not_rside, buf);
+    if (q3moves1 != 0) {
+        const int index = q3moves1 > 1 ? rand() % q3moves1 : 0;
+        return buf[index];
+    }
+
+    const int q3moves0 = get_3moves_0(my, opp, dead, n, all, not_lside, not_rside, buf);
+    if (q3moves0 != 0) {
+        const int index = q3moves0 > 1 ? rand() % q3moves0 : 0;
+        return buf[index];
+    }
+
+    return 0;
+}
+
+int get_expansion_rollout_step(
+    void * data, /* Private data */
+    bb_t my, bb_t opp, bb_t dead, /* Game data */
+    const int n, const bb_t all, const bb_t not_lside, const bb_t not_rside) /* Geometry */
+{
+    struct rollout_expansion * restrict const me = data;
+    if (me->selected == 0) {
+        const int qsteps = pop_count(my|opp) + pop_count(dead);
+        const int mod = qsteps % 3;
+        if (mod != 0) {
+            printf("Warning: call rollout_expansion in the middle of a move.\n");
+            return get_random_rollout_step(NULL, my, opp, dead, n, all, not_lside, not_rside);
+        }
+
+        me->selected = select_3move(me, my, opp, dead, n, all, not_lside, not_rside);
+    }
+
+    const bb_t selected = me->selected;
+    if (selected == 0) {
+        return -1;
+    }
+
+    const bb_t next = next_steps(my, opp, dead, n, all, not_lside, not_rside);
+    if (next == 0) {
+        if (my != 0) {
+            printf("Warning, next_steps returns 0, but select_3move returns something.\n");
+            return -1;
+        }
+        if (opp == 0) {
+            if (BB_SQUARE(0) & selected) {
+                me->selected ^= BB_SQUARE(0);
+                return 0;
+            }
+            printf("Warning, X first step out of selected.\n");
+            return -1;
+        } else {
+            if (BB_SQUARE(n*n-1) & selected) {
+                me->selected ^= BB_SQUARE(n*n-1);
+                return n*n - 1;
+            }
+            printf("Warning, O first step out of selected.\n");
+            return -1;
+        }
+    }
+
+    const bb_t choice = selected & next;
+    if (choice == 0) {
+        printf("Warning, zero selected & next.\n");
+        return -1;
+    }
+
+    const bb_t bb = choice & (-choice);
+    me->selected ^= bb;
+    return first_one(bb);
+}
+
+typedef int (*get_rollout_step_f)(
+    void * data, /* Private data */
+    bb_t my, bb_t opp, bb_t dead, /* Game data */
+    const int n, const bb_t all, const bb_t not_lside, const bb_t not_rside); /* Geometry */
+
+static int run_rollout(
+    void * first_data, get_rollout_step_f first_f,
+    void * second_data, get_rollout_step_f second_f,
+    struct geometry * restrict const geometry)
+{
+    bb_t x = 0;
+    bb_t o = 0;
+    bb_t dead = 0;
+    const int n = geometry->n;
+    const bb_t all = geometry->all;
+    const bb_t not_lside = all ^ geometry->lside;
+    const bb_t not_rside = all ^ geometry->rside;
+
+    for (;;) {
+        const int step1 = first_f(first_data, x, o, dead, n, all, not_lside, not_rside);
+        if (step1 < 0) return -1;
+        const bb_t bb1 = BB_SQUARE(step1);
+        *(bb1 & o ? &dead : &x) |= bb1;
+
+        const int step2 = first_f(first_data, x, o, dead, n, all, not_lside, not_rside);
+        if (step2 < 0) return -1;
+        const bb_t bb2 = BB_SQUARE(step2);
+        *(bb2 & o ? &dead : &x) |= bb2;
+
+        const int step3 = first_f(first_data, x, o, dead, n, all, not_lside, not_rside);
+        if (step3 < 0) return -1;
+        const bb_t bb3 = BB_SQUARE(step3);
+        *(bb3 & o ? &dead : &x) |= bb3;
+
+        const int step4 = second_f(second_data, o, x, dead, n, all, not_lside, not_rside);
+        if (step4 < 0) return +1;
+        const bb_t bb4 = BB_SQUARE(step4);
+        *(bb4 & x ? &dead : &o) |= bb4;
+
+        const int step5 = second_f(second_data, o, x, dead, n, all, not_lside, not_rside);
+        if (step5 < 0) return +1;
+        const bb_t bb5 = BB_SQUARE(step5);
+        *(bb5 & x ? &dead : &o) |= bb5;
+
+        const int step6 = second_f(second_data, o, x, dead, n, all, not_lside, not_rside);
+        if (step6 < 0) return +1;
+        const bb_t bb6 = BB_SQUARE(step6);
+        *(bb6 & x ? &dead : &o) |= bb6;
+    }
+}
+
+void mcts_test_rollout(void)
+{
+    struct geometry * restrict const geometry = create_std_geometry(10);
+    if (geometry == NULL) {
+        fprintf(stderr, "create_std_geometry(10) failed, errno = %d.", errno);
+        return;
+    }
+
+    struct rollout_expansion expansion1 = { 0, NULL };
+    struct rollout_expansion expansion2 = { 0, NULL };
+    expansion1.buf = malloc(128*1024*sizeof(bb_t));
+    expansion2.buf = malloc(128*1024*sizeof(bb_t));
+
+    static const int N = 5000;
+
+    const char * const first = "RND";
+    void * const first_data = NULL;
+    void * const first_f = get_random_rollout_step;
+
+    //const char * const first = "expansion";
+    //void * const first_data = &expansion1;
+    //void * const first_f = get_expansion_rollout_step;
+
+    //const char * const second = "RND";
+    //void * const second_data = NULL;
+    //void * const second_f = get_random_rollout_step;
+
+    const char * const second = "expansion";
+    void * const second_data = &expansion2;
+    void * const second_f = get_expansion_rollout_step;
+
+    int score1 = 0;
+    int score2 = 0;
+    double start = clock();
+    for (int i=0; i<N; ++i) {
+        score1 += run_rollout(first_data, first_f, second_data, second_f, geometry);
+        score2 += run_rollout(second_data, second_f, first_data, first_f, geometry);
+    }
+    double finish = clock();
+    double all_time = (finish - start) / CLOCKS_PER_SEC;
+    double rollout_time = 0.5 * all_time / N;
+
+    double method_score = 50.0 + 25.0 * (score1 - score2) / N;
+    double side_score = 50.0 + 25.0 * (score1 + score2) / N;
+
+    printf("Geometry %dx%d, run %s vs %s, %d games, score %.2f%% (or %.2f%% from X) in %.6f second or %.6f second per rollout.\n",
+        geometry->n, geometry->n, first, second, 2*N, method_score, side_score, all_time, rollout_time);
+
+    printf("score1 = %d\n", score1);
+    printf("score2 = %d\n", score2);
+
+    free(expansion1.buf);
+    free(expansion2.buf);
+    destroy_geometry(geometry);
+}
+
+void mcts_test_nn(void)
+{
+    const char * nn_path = "nn.txt";
+    FILE * f = fopen(nn_path, "r");
+    if (f == NULL) {
+        printf("Cannot open “%s” file, errno is %d, %s\n", nn_path, errno, strerror(errno));
+        return;
+    }
+
+    char error_msg[4096];
+
+    struct nn * restrict const me = load_text_nn(f, error_msg, 4095);
+    fclose(f);
+
+    if (me == NULL) {
+        printf("load_text_nn failed, %4095s\n", error_msg);
+        return;
+    }
+
+    int weights[100];
+    static const char * const names[] = { "int32", "int16", "int8" };
+
+    for (int precision=NN_INT32; precision<=NN_INT8; ++precision) {
+        if (set_nn_precision(me, precision) != 0) {
+            printf("set_nn_precision(%s) failed.\n", names[precision]);
+            break;
+        }
+
+        static const int N = 10000;
+        const double start = clock();
+        for (int i=0; i<N; ++i) {
+            get_nn_weights(me, 0, 0, 10, 0, 0, 0, weights);
+        }
+        const double finish = clock();
+        const double total = (finish - start) / CLOCKS_PER_SEC;
+        const double one_calc = total / N;
+        printf("Kernels “%s”, %s, done %d times in %.6f, one in %.6f, %.0f evals/sec\n",
+            me->kernels->name, names[precision], N, total, one_calc, N / total);
+    }
+
+    destroy_nn(me);
+}
+
+
+
+#ifdef MAKE_CHECK
+
+#include "insider.h"
+
+void check_rollout(
+    const int auto_steps,
+    struct geometry * restrict const geometry)
+{
+    struct state * restrict const me = create_state(geometry);
+    if (me == NULL) {
+        test_fail("create_state(geometry) failed, errno = %d.", errno);
+    }
+
+    for (int i=0; i<auto_steps; ++i) {
+        bb_t steps = state_get_steps(me);
+        if (steps == 0) {
+            test_fail("cannot perform auto steps, state_get_steps(me) returns 0.");
+        }
+
+        const int qsteps = pop_count(steps);
+        const int sq = nth_one_index(steps, rand() % qsteps);
+        const int status = state_step(me, sq);
+        if (status != 0) {
+            test_fail("state_step(me, %d) fails with code %d, %s.", sq, status, strerror(status));
+        }
+    }
+
+    const bb_t x = me->x;
+    const bb_t o = me->o;
+    const bb_t dead = me->dead;
+    const int n = geometry->n;
+    struct rng rng;
+    rng_seed(&rng, auto_steps, 0);
+    uint32_t qthink = 0;
+    int debug_log[2*n*n];
+    const int result = rollout(x, o, dead, n, &rng, &qthink, debug_log);
+
+    if (result != +ONE_GAME_COST && result != -ONE_GAME_COST) {
+        test_fail("rollout returns strange result %d", result);
+    }
+
+    if (qthink-- == 0) {
+        test_fail("Unexpected zero qthink after rollout call.");
+    }
+
+
+    /* Tricky!!! Round qthink to avoid last nonvalid moves at the end. */
+    /* rollout may play one or two steps before realizing that there is no moves */
+    qthink = (3*((qthink+auto_steps)/3)) - auto_steps;
+
+    for (int i=0; i<qthink; ++i) {
+        if (state_status(me) != 0) {
+            test_fail("Unexpected state status %d during applying rollout history.", state_status(me));
+        }
+        const int sq = debug_log[i];
+        const int status = state_step(me, sq);
+        if (status != 0) {
+            test_fail("state_step(%d) failed with code %d, %s.", sq, status, strerror(status));
+        }
+    }
+
+    if (state_status(me) == 0) {
+        test_fail("Unexpected state status %d after applying rollout history.", state_status(me));
+    }
+
+    destroy_state(me);
+}
+
+int test_rollout(void)
+{
+    struct geometry * restrict const geometry4 = create_std_geometry(4);
+    if (geometry4 == NULL) {
+        test_fail("create_std_geometry(4) failed, errno = %d.", errno);
+    }
+
+    struct geometry * restrict const geometry10 = create_std_geometry(10);
+    if (geometry10 == NULL) {
+        test_fail("create_std_geometry(10) failed, errno = %d.", errno);
+    }
+
+    struct geometry * restrict const geometry11 = create_std_geometry(11);
+    if (geometry11 == NULL) {
+        test_fail("create_std_geometry(11) failed, errno = %d.", errno);
+    }
+
+    check_rollout(0, geometry4);
+    check_rollout(10, geometry4);
+    check_rollout(0, geometry10);
+    check_rollout(1, geometry10);
+    check_rollout(2, geometry11);
+    check_rollout(3, geometry11);
+    check_rollout(4, geometry10);
+    check_rollout(5, geometry10);
+    check_rollout(6, geometry11);
+    check_rollout(7, geometry11);
+    check_rollout(8, geometry10);
+    check_rollout(9, geometry10);
+    check_rollout(10, geometry11);
+    check_rollout(11, geometry11);
+    check_rollout(12, geometry10);
+    check_rollout(13, geometry10);
+    check_rollout(14, geometry11);
+    check_rollout(15, geometry11);
+
+    destroy_geometry(geometry4);
+    destroy_geometry(geometry10);
+    destroy_geometry(geometry11);
+    return 0;
+}
+
+int test_mcts_init_free(void)
+{
+    struct geometry * restrict const geometry = create_std_geometry(11);
+    if (geometry == NULL) {
+        test_fail("create_std_geometry(11) failed, errno = %d.", errno);
+    }
+
+    struct ai storage;
+    const int status = init_mcts_ai(&storage, geometry);
+    if (status != 0) {
+        test_fail("init_mcts_ai fails with code %d, %s.", status, strerror(status));
+    }
+
+    struct ai * restrict const ai = &storage;
+    ai->free(ai);
+
+    destroy_geometry(geometry);
+    return 0;
+}
+
+void rnd_steps(
+    struct ai * restrict const ai,
+    const struct geometry * const geometry,
+    const int rnd_qsteps)
+{
+    ai->reset(ai, geometry);
+    for (int i=0; i<rnd_qsteps; ++i) {
+        const bb_t steps = state_get_steps(&ai->state);
+        const int qsteps = pop_count(steps);
+        if (qsteps == 0) {
+            test_fail("Unexpected zero qsteps.");
+        }
+        const int choice = rand() % qsteps;
+        const int sq = nth_one_index(steps, choice);
+        const int status = state_step(&ai->state, sq);
+        if (status != 0) {
+            test_fail("state_step failed on %d-th step.", i);
+        }
+    }
+}
+
+void check_simulate(
+    const struct geometry * const geometry,
+    struct mcts_ai * restrict const me,
+    const struct state * const state,
+    const int qruns)
+{
+    struct node * restrict const node = create_root(me->multiallocator, me->tt);
+    if (node == NULL) {
+        test_fail("create_root failed.");
+    }
+    me->workers->root = NULL;
+
+    uint32_t qthink = 0;
+    const bb_t x = state->x;
+    const bb_t o = state->o;
+    const bb_t dead = state->dead;
+    const uint64_t hash = state->hash;
+
+    const int n = geometry->n;
+    const bb_t all = geometry->all;
+    const bb_t not_lside = all ^ geometry->lside;
+    const bb_t not_rside = all ^ geometry->rside;
+
+    for (int i=0; i<qruns; ++i) {
+        uint32_t saved_qthink = qthink;
+        const int status = simulate(me->workers, node, &qthink, x, o, dead, hash, n, all, not_lside, not_rside);
+        if (status != 0) {
+            test_fail("Unexpected status %d returned from %d-th simulate(...), %s.", status, i, strerror(status));
+        }
+        if (qthink == saved_qthink) {
+            test_fail("qthink might be increased after %d-th simulation.", i);
+        }
+    }
+}
+
+int test_simulate(void)
+{
+    struct geometry * restrict const geometry = create_std_geometry(4);
+    if (geometry == NULL) {
+        test_fail("create_std_geometry(4) failed, errno = %d.", errno);
+    }
+
+    struct ai storage;
+    const int status = init_mcts_ai(&storage, geometry);
+    if (status != 0) {
+        test_fail("init_mcts_ai fails with code %d, %s.", status, strerror(status));
+    }
+
+    struct ai * restrict const ai = &storage;
+    struct mcts_ai * restrict const me = ai->data;
+
+    const struct state * const state = ai->get_state(ai);
+    for (int i=0; i<=10; ++i) {
+        rnd_steps(ai, geometry, i);
+        check_simulate(geometry, me, state, 100);
+    }
+
+    ai->free(ai);
+
+    destroy_geometry(geometry);
+    return 0;
+}
+
+static int solve_exhaustive(struct state * restrict const state)
+{
+    const int status = state_status(state);
+    if (status != 0) {
+        return status;
+    }
+
+    const int active = state->active;
+    bb_t steps = state_get_steps(state);
+    while (steps != 0) {
+        const int sq = first_one(steps);
+        steps ^= BB_SQUARE(sq);
+
+        state_step(state, sq);
+        const int winner = solve_exhaustive(state);
+        state_unstep(state, sq);
+
+        if (winner == active) {
+            return active;
+        }
+    }
+
+    return active ^ 3;
+}
+
+int test_solver(void)
+{
+    struct geometry * restrict const geometry = create_std_geometry(5);
+    if (geometry == NULL) {
+        test_fail("create_std_geometry(5) failed, errno = %d.", errno);
+    }
+
+    struct ai storage;
+    const int status = init_mcts_ai(&storage, geometry);
+    if (status != 0) {
+        test_fail("init_mcts_ai fails with code %d, %s.", status, strerror(status));
+    }
+
+    struct ai * restrict const ai = &storage;
+    struct mcts_ai * restrict const me = ai->data;
+    const struct state * const state = ai->get_state(ai);
+
+    const int n = geometry->n;
+    const bb_t all = geometry->all;
+    const bb_t not_lside = all ^ geometry->lside;
+    const bb_t not_rside = all ^ geometry->rside;
+
+    int qsolved = 0;
+    for (int i=0; i<20; ++i) {
+        /* Random game to the end, then few steps back. */
+        int history[2 * n * n];
+        int qhistory = 0;
+        ai->reset(ai, geometry);
+        while (state_status(state) == 0) {
+            const bb_t steps = state_get_steps(state);
+            const int sq = nth_one_index(steps, rand() % pop_count(steps));
+            state_step(&ai->state, sq);
+            history[qhistory++] = sq;
+        }
+
+        const int qback = 4 + i % 6;
+        for (int j=0; j<qback && qhistory > 0; ++j) {
+            state_unstep(&ai->state, history[--qhistory]);
+        }
+
+        struct state copy = *state;
+        const int expected = solve_exhaustive(&copy);
+
+        struct node * restrict const root = create_root(me->multiallocator, me->tt);
+        if (root == NULL) {
+            test_fail("create_root failed.");
+        }
+        me->workers->root = NULL;
+
+        const int qsteps = pop_count(state->x | state->o) + pop_count(state->dead);
+        for (int j=0; j<100000 && get_proof(root) == 0; ++j) {
+            uint32_t qthink = 0;
+            const int status = simulate(me->workers, root, &qthink,
+                state->x, state->o, state->dead, state->hash, n, all, not_lside, not_rside);
+            if (status != 0) {
+                test_fail("Unexpected status %d returned from simulate(...), %s.", status, strerror(status));
+            }
+        }
+
+        const int proof = get_proof(root);
+        if (proof == 0) {
+            continue;
+        }
+
+        const int mover = get_mover(qsteps);
+        const int winner = proof == PROVEN_WIN ? mover : mover ^ 3;
+        if (winner != expected) {
+            test_fail("Solver proves %d as winner, but %d is expected.", winner, expected);
+        }
+
+        int best[pop_count(state->next)];
+        const struct node * const children = get_node(me->multiallocator, root->children);
+        const int qbest = collect_best_children(children, root->qchildren, best);
+        if (winner == state->active && (qbest != 1 || get_proof(children + best[0]) != PROVEN_WIN)) {
+            test_fail("Proven winning step is not chosen.");
+        }
+
+        ++qsolved;
+    }
+
+    if (qsolved < 10) {
+        test_fail("Too few positions are solved, %d.", qsolved);
+    }
+
+    ai->free(ai);
+    destroy_geometry(geometry);
+    return 0;
+}
+
+int test_endgame(void)
+{
+    struct geometry * restrict const geometry = create_std_geometry(5);
+    if (geometry == NULL) {
+        test_fail("create_std_geometry(5) failed, errno = %d.", errno);
+    }
+
+    struct ai storage;
+    const int status = init_mcts_ai(&storage, geometry);
+    if (status != 0) {
+        test_fail("init_mcts_ai fails with code %d, %s.", status, strerror(status));
+    }
+
+    struct ai * restrict const ai = &storage;
+    struct mcts_ai * restrict const me = ai->data;
+    const struct state * const state = ai->get_state(ai);
+    me->endgame = 2 * geometry->n * geometry->n;
+
+    const int n = geometry->n;
+    int qsolved = 0;
+    for (int i=0; i<30; ++i) {
+        /* Random game to the end, then few steps back. */
+        int history[2 * n * n];
+        int qhistory = 0;
+        ai->reset(ai, geometry);
+        while (state_status(state) == 0) {
+            const bb_t steps = state_get_steps(state);
+            const int sq = nth_one_index(steps, rand() % pop_count(steps));
+            state_step(&ai->state, sq);
+            history[qhistory++] = sq;
+        }
+
+        const int qback = 3 + i % 6;
+        for (int j=0; j<qback && qhistory > 0; ++j) {
+            state_unstep(&ai->state, history[--qhistory]);
+        }
+
+        struct state copy = *state;
+        const int expected = solve_exhaustive(&copy);
+        const int sq = solve_endgame(me, state, 0);
+        if (sq < 0) {
+            if (expected == state->active) {
+                test_fail("Winning step is not found by endgame solver.");
+            }
+            continue;
+        }
+
+        if (expected != state->active) {
+            test_fail("Endgame solver returns step %d in lost position.", sq);
+        }
+
+        if ((state->next & BB_SQUARE(sq)) == 0) {
+            test_fail("Endgame solver returns invalid step %d.", sq);
+        }
+
+        state_step(&copy, sq);
+        if (solve_exhaustive(&copy) != state->active) {
+            test_fail("Endgame solver step %d does not win.", sq);
+        }
+
+        ++qsolved;
+    }
+
+    if (qsolved < 10) {
+        test_fail("Too few positions are solved, %d.", qsolved);
+    }
+
+    ai->reset(ai, geometry);
+    for (size_t i=0; i<ENDGAME_TT_SIZE; ++i) {
+        if (me->endgame_tt[i].hash != 0) {
+            test_fail("Endgame table entry %zu is kept after reset.", i);
+        }
+    }
+
+    ai->free(ai);
+    destroy_geometry(geometry);
+    return 0;
+}
+
+static size_t check_gc_tree(
+    struct multiallocator * restrict const multiallocator,
+    const struct node * const node)
+{
+    const int qchildren = node->qchildren;
+    if (qchildren == 0 || qchildren >= EXPANDING_MARK) {
+        return 0;
+    }
+
+    const size_t counter = multiallocator->types[NODE_TYPE].counter;
+    if (node->children + qchildren > counter) {
+        test_fail("Children %u..%u are out of allocated %zu nodes.",
+            node->children, node->children + qchildren, counter);
+    }
+
+    size_t result = qchildren;
+    const struct node * const children = get_node(multiallocator, node->children);
+    for (int i=0; i<qchildren; ++i) {
+        if (children[i].square_flags & GC_MARK) {
+            test_fail("GC_MARK is left in the tree.");
+        }
+        result += check_gc_tree(multiallocator, children + i);
+    }
+
+    return result;
+}
+
+int test_gc(void)
+{
+    struct geometry * restrict const geometry = create_std_geometry(7);
+    if (geometry == NULL) {
+        test_fail("create_std_geometry(7) failed, errno = %d.", errno);
+    }
+
+    struct ai storage;
+    const int status = init_mcts_ai(&storage, geometry);
+    if (status != 0) {
+        test_fail("init_mcts_ai fails with code %d, %s.", status, strerror(status));
+    }
+
+    struct ai * restrict const ai = &storage;
+    struct mcts_ai * restrict const me = ai->data;
+    const struct state * const state = ai->get_state(ai);
+
+    const int n = geometry->n;
+    const bb_t all = geometry->all;
+    const bb_t not_lside = all ^ geometry->lside;
+    const bb_t not_rside = all ^ geometry->rside;
+
+    /* Two blocks with 256 nodes every one */
+    struct multiallocator * restrict const multiallocator = create_multiallocator(
+        2, 256 * sizeof(struct node), QNODE_TYPES, node_type_sizes);
+    if (multiallocator == NULL) {
+        test_fail("create_multiallocator failed, errno = %d.", errno);
+    }
+
+    struct mcts_worker * restrict const worker = me->workers;
+    worker->multiallocator = multiallocator;
+    worker->root = create_root(multiallocator, me->tt);
+    if (worker->root == NULL) {
+        test_fail("create_root failed.");
+    }
+
+    for (int iteration=0; iteration<3; ++iteration) {
+        int simulate_status = 0;
+        for (int i=0; i<100000 && simulate_status == 0; ++i) {
+            uint32_t qthink = 0;
+            simulate_status = simulate(worker, worker->root, &qthink,
+                state->x, state->o, state->dead, state->hash, n, all, not_lside, not_rside);
+        }
+
+        if (simulate_status != ENOMEM) {
+            test_fail("ENOMEM is expected from simulate(...), but %d is returned.", simulate_status);
+        }
+
+        const int32_t qgames = worker->root->qgames;
+        const int qchildren = worker->root->qchildren;
+        const size_t qnodes = check_gc_tree(multiallocator, worker->root);
+
+        const int gc_status = collect_garbage(me, worker);
+        if (gc_status != 0) {
+            test_fail("collect_garbage fails with code %d, %s.", gc_status, strerror(gc_status));
+        }
+
+        if (worker->root != get_node(multiallocator, 0)) {
+            test_fail("Root is not moved to the first node.");
+        }
+
+        if (worker->root->qgames != qgames || worker->root->qchildren != qchildren) {
+            test_fail("Root statistics are changed by garbage collection.");
+        }
+
+        const size_t qkept = check_gc_tree(multiallocator, worker->root);
+        if (qkept < qchildren || qkept >= qnodes) {
+            test_fail("Unexpected count of kept nodes %zu, the tree had %zu nodes.", qkept, qnodes);
+        }
+
+        if (multiallocator->types[NODE_TYPE].counter > 256) {
+            test_fail("More than a half of multiallocator is used after garbage collection.");
+        }
+    }
+
+    worker->multiallocator = me->multiallocator;
+    worker->root = NULL;
+    destroy_multiallocator(multiallocator);
+    ai->free(ai);
+    destroy_geometry(geometry);
+    return 0;
+}
+
+int test_ubc_select(void)
+{
+    struct geometry * restrict const geometry = create_std_geometry(7);
+    if (geometry == NULL) {
+        test_fail("create_std_geometry(7) failed, errno = %d.", errno);
+    }
+
+    struct ai storage;
+    const int status = init_mcts_ai(&storage, geometry);
+    if (status != 0) {
+        test_fail("init_mcts_ai fails with code %d, %s.", status, strerror(status));
+    }
+
+    struct ai * restrict const ai = &storage;
+    struct mcts_ai * restrict const me = ai->data;
+
+    typedef int (*ubc_kernel_t)(const struct mcts_ai *, struct rng *, const struct node *, int, const struct node *);
+    ubc_kernel_t kernels[2] = { &generic_ubc_select, NULL };
+    #ifdef HAS_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            kernels[1] = &avx2_ubc_select;
+        }
+    #endif
+
+    struct node parent;
+    struct node children[70];
+    for (int iteration=0; iteration<3000; ++iteration) {
+        /* Visit counts cross UBC_TABLE_SZ, repeated children make ties. */
+        const int qchildren = 2 + iteration % 69;
+        parent.qgames = 1;
+        for (int i=0; i<qchildren; ++i) {
+            struct node * restrict const child = children + i;
+            if (i > 0 && rand() % 3 == 0) {
+                *child = children[rand() % i];
+            } else {
+                const int32_t qgames = rand() % 6000;
+                child->square_flags = rand() % 10 == 0 ? (rand() % 2 ? PROVEN_LOSS : PROVEN_WIN) : 0;
+                child->qgames = qgames;
+                child->score = qgames == 0 ? 0 : rand() % (2 * ONE_GAME_COST * qgames + 1) - ONE_GAME_COST * qgames;
+            }
+            parent.qgames += children[i].qgames;
+        }
+
+        int qbest = 0;
+        int best_indexes[qchildren];
+        float best_weight = -1.0e+10f;
+        const float factor = get_ubc_factor(me, &parent);
+        for (int i=0; i<qchildren; ++i) {
+            const float weight = get_ubc_weight(me, children + i, factor);
+            if (weight > best_weight) {
+                qbest = 0;
+                best_weight = weight;
+            }
+            if (weight == best_weight) {
+                best_indexes[qbest++] = i;
+            }
+        }
+
+        struct rng rng;
+        rng_seed(&rng, iteration, 0);
+        const int expected = best_indexes[qbest == 1 ? 0 : rng_uniform(&rng, qbest)];
+        for (int k=0; k<2; ++k) {
+            if (kernels[k] == NULL) {
+                continue;
+            }
+
+            rng_seed(&rng, iteration, 0);
+            const int choice = kernels[k](me, &rng, &parent, qchildren, children);
+            if (choice != expected) {
+                test_fail("UCB kernel %d selects %d instead of %d from %d children.", k, choice, expected, qchildren);
+            }
+        }
+    }
+
+    ai->free(ai);
+    destroy_geometry(geometry);
+    return 0;
+}
+
+/* Lanes kernels play the same games as the generic one, one lane is a rollout. */
+static void check_batch_rollout(
+    const lanes_kernel_t * const kernels,
+    const struct state * const state,
+    const uint64_t seed)
+{
+    const struct geometry * const geometry = state->geometry;
+    const bb_t x = state->x;
+    const bb_t o = state->o;
+    const bb_t dead = state->dead;
+    const int n = geometry->n;
+    const bb_t all = geometry->all;
+    const bb_t not_lside = all ^ geometry->lside;
+    const bb_t not_rside = all ^ geometry->rside;
+
+    for (int qlanes=1; qlanes<=MAX_LANES; ++qlanes) {
+        struct rng expected_rng;
+        rng_seed(&expected_rng, seed, qlanes);
+        uint32_t expected_qthink = 0;
+        const int expected = batch_rollout(kernels[0], x, o, dead, n, all, not_lside, not_rside,
+            geometry->next_steps, qlanes, &expected_rng, &expected_qthink);
+
+        const int qwins = (expected / ONE_GAME_COST + qlanes) / 2;
+        if (expected % ONE_GAME_COST != 0 || qwins < 0 || qwins > qlanes || 2 * qwins - qlanes != expected / ONE_GAME_COST) {
+            test_fail("batch_rollout of %d lanes returns strange result %d.", qlanes, expected);
+        }
+
+        if (qlanes == 1) {
+            struct rng rng;
+            rng_seed(&rng, seed, qlanes);
+            uint32_t qthink = 0;
+            const int result = rollout(x, o, dead, n, &rng, &qthink, NULL);
+            if (result != expected || qthink != expected_qthink || memcmp(&rng, &expected_rng, sizeof(rng)) != 0) {
+                test_fail("batch_rollout of one lane differs from rollout: result %d vs %d, qthink %u vs %u.",
+                    expected, result, expected_qthink, qthink);
+            }
+        }
+
+        for (int k=1; k<3; ++k) {
+            if (kernels[k] == NULL) {
+                continue;
+            }
+
+            struct rng rng;
+            rng_seed(&rng, seed, qlanes);
+            uint32_t qthink = 0;
+            const int result = batch_rollout(kernels[k], x, o, dead, n, all, not_lside, not_rside,
+                geometry->next_steps, qlanes, &rng, &qthink);
+            if (result != expected || qthink != expected_qthink || memcmp(&rng, &expected_rng, sizeof(rng)) != 0) {
+                test_fail("Lanes kernel %d differs from generic on %d lanes: result %d vs %d, qthink %u vs %u.",
+                    k, qlanes, result, expected, qthink, expected_qthink);
+            }
+        }
+    }
+}
+
+int test_batch_rollout(void)
+{
+    lanes_kernel_t kernels[3] = { &generic_lanes_next_steps, NULL, NULL };
+    #ifdef HAS_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            kernels[1] = &avx2_lanes_next_steps;
+        }
+        if (__builtin_cpu_supports("avx512f")) {
+            kernels[2] = &avx512_lanes_next_steps;
+        }
+    #endif
+
+    static const int sizes[4] = { 4, 7, 10, 11 };
+    for (int isize=0; isize<4; ++isize) {
+        struct geometry * restrict const geometry = create_std_geometry(sizes[isize]);
+        if (geometry == NULL) {
+            test_fail("create_std_geometry(%d) failed, errno = %d.", sizes[isize], errno);
+        }
+
+        struct state * restrict const state = create_state(geometry);
+        if (state == NULL) {
+            test_fail("create_state(geometry) failed, errno = %d.", errno);
+        }
+
+        for (int auto_steps=0; auto_steps<24; ++auto_steps) {
+            check_batch_rollout(kernels, state, 100 * isize + auto_steps);
+
+            const bb_t steps = state_get_steps(state);
+            if (steps == 0) {
+                break;
+            }
+
+            const int sq = nth_one_index(steps, rand() % pop_count(steps));
+            const int status = state_step(state, sq);
+            if (status != 0) {
+                test_fail("state_step(state, %d) fails with code %d, %s.", sq, status, strerror(status));
+            }
+        }
+
+        destroy_state(state);
+        destroy_geometry(geometry);
+    }
+
+    struct geometry * restrict const geometry = create_std_geometry(10);
+    if (geometry == NULL) {
+        test_fail("create_std_geometry(10) failed, errno = %d.", errno);
+    }
+
+    struct ai storage;
+    const int status = init_mcts_ai(&storage, geometry);
+    if (status != 0) {
+        test_fail("init_mcts_ai fails with code %d, %s.", status, strerror(status));
+    }
+
+    struct ai * restrict const ai = &storage;
+    const uint32_t qthink = 20000;
+    const uint32_t bad_leaf_rollouts = MAX_LANES + 1;
+    const uint32_t leaf_rollouts = 8;
+    if (ai->set_param(ai, "qthink", &qthink) != 0) {
+        test_fail("set_param(qthink) fails, %s.", ai->error);
+    }
+    if (ai->set_param(ai, "leaf_rollouts", &bad_leaf_rollouts) == 0) {
+        test_fail("set_param(leaf_rollouts, %u) is expected to fail.", bad_leaf_rollouts);
+    }
+    if (ai->set_param(ai, "leaf_rollouts", &leaf_rollouts) != 0) {
+        test_fail("set_param(leaf_rollouts) fails, %s.", ai->error);
+    }
+
+    static const char * const tree_modes[2] = { "step", "turn" };
+    for (int i=0; i<2; ++i) {
+        if (ai->set_param(ai, "tree_mode", tree_modes[i]) != 0) {
+            test_fail("set_param(tree_mode, %s) fails, %s.", tree_modes[i], ai->error);
+        }
+
+        rnd_steps(ai, geometry, 7);
+        const bb_t steps = state_get_steps(&ai->state);
+        const int step = ai->go(ai, NULL);
+        if (step < 0) {
+            test_fail("ai->go fails in %s tree with leaf rollouts, %s.", tree_modes[i], ai->error);
+        }
+        if ((steps & BB_SQUARE(step)) == 0) {
+            test_fail("ai->go returns invalid step %d in %s tree with leaf rollouts.", step, tree_modes[i]);
+        }
+    }
+
+    /* Six lanes give averages like 400/6, they are rounded, not truncated. */
+    struct mcts_ai * restrict const me = ai->data;
+    struct mcts_worker * restrict const worker = me->workers;
+    const struct state * const state = ai->get_state(ai);
+    const bb_t not_lside = geometry->all ^ geometry->lside;
+    const bb_t not_rside = geometry->all ^ geometry->rside;
+    me->leaf_rollouts = 6;
+    for (int i=0; i<64; ++i) {
+        struct rng rng = worker->rng;
+        uint32_t qthink = 0;
+        const int sum = batch_rollout(me->lanes_kernel, state->x, state->o, state->dead,
+            geometry->n, geometry->all, not_lside, not_rside, geometry->next_steps, 6, &rng, &qthink);
+        const int result = leaf_rollout(worker, &qthink, state->x, state->o, state->dead,
+            geometry->n, geometry->all, not_lside, not_rside);
+        if (2 * abs(6 * result - sum) > 6) {
+            test_fail("Leaf rollout returns %d for the sum %d of 6 rollouts.", result, sum);
+        }
+    }
+
+    ai->free(ai);
+    destroy_geometry(geometry);
+    return 0;
+}
+
+/* Moves of every list are distinct turns to empty or opponent squares. */
+static size_t check_turn_tree(
+    struct multiallocator * restrict const multiallocator,
+    const struct node * const node,
+    const bb_t x, const bb_t o, const bb_t dead)
+{
+    const int qchildren = node->qchildren;
+    if (qchildren == 0 || qchildren >= EXPANDING_MARK) {
+        return 0;
+    }
+
+    const size_t counter = multiallocator->types[TURN_NODE_TYPE].counter;
+    if (node->children + qchildren > counter) {
+        test_fail("Turn children %u..%u are out of allocated %zu items.",
+            node->children, node->children + qchildren, counter);
+    }
+
+    const int qsteps = pop_count(x|o) + pop_count(dead);
+    const int active = (qsteps/3) % 2 == 0 ? ACTIVE_X : ACTIVE_O;
+    const bb_t my = active == ACTIVE_X ? x : o;
+
+    size_t result = qchildren;
+    const struct node * const children = get_turn_children(multiallocator, node->children);
+    const bb_t * const moves = get_turn_moves(children, qchildren);
+    for (int i=0; i<qchildren; ++i) {
+        if (moves[i] == 0 || (moves[i] & (my | dead)) != 0 || pop_count(moves[i]) > 3) {
+            test_fail("Invalid turn move in the list, index %d.", i);
+        }
+
+        for (int j=0; j<i; ++j) {
+            if (moves[i] == moves[j]) {
+                test_fail("Turn moves %d and %d are equal.", j, i);
+            }
+        }
+
+        if (children[i].square_flags & GC_MARK) {
+            test_fail("GC_MARK is left in the turn tree.");
+        }
+
+        bb_t new_x = x;
+        bb_t new_o = o;
+        bb_t new_dead = dead;
+        if (active == ACTIVE_X) {
+            apply_move(moves[i], &new_x, o, &new_dead);
+        } else {
+            apply_move(moves[i], &new_o, x, &new_dead);
+        }
+        result += check_turn_tree(multiallocator, children + i, new_x, new_o, new_dead);
+    }
+
+    return result;
+}
+
+int test_turn_gc(void)
+{
+    struct geometry * restrict const geometry = create_std_geometry(7);
+    if (geometry == NULL) {
+        test_fail("create_std_geometry(7) failed, errno = %d.", errno);
+    }
+
+    struct ai storage;
+    const int status = init_mcts_ai(&storage, geometry);
+    if (status != 0) {
+        test_fail("init_mcts_ai fails with code %d, %s.", status, strerror(status));
+    }
+
+    struct ai * restrict const ai = &storage;
+    struct mcts_ai * restrict const me = ai->data;
+    const struct state * const state = ai->get_state(ai);
+    me->tree = TREE_TURN;
+
+    const int n = geometry->n;
+    const bb_t all = geometry->all;
+    const bb_t not_lside = all ^ geometry->lside;
+    const bb_t not_rside = all ^ geometry->rside;
+
+    /* Two blocks with 256 turn items every one */
+    struct multiallocator * restrict const multiallocator = create_multiallocator(
+        2, 256 * TURN_NODE_SZ, QNODE_TYPES, node_type_sizes);
+    if (multiallocator == NULL) {
+        test_fail("create_multiallocator failed, errno = %d.", errno);
+    }
+
+    struct mcts_worker * restrict const worker = me->workers;
+    worker->multiallocator = multiallocator;
+    worker->turns = malloc(max_turns(n) * sizeof(bb_t));
+    if (worker->turns == NULL) {
+        test_fail("Cannot allocate turn buffer.");
+    }
+
+    me->plan.root_x = state->x;
+    me->plan.root_o = state->o;
+    me->plan.root_dead = state->dead;
+    worker->turn_root = reuse_turn_root(me, worker, state);
+    if (worker->turn_root == NULL) {
+        test_fail("reuse_turn_root failed.");
+    }
+
+    for (int iteration=0; iteration<3; ++iteration) {
+        int simulate_status = 0;
+        for (int i=0; i<100000 && simulate_status == 0; ++i) {
+            uint32_t qthink = 0;
+            simulate_status = turn_simulate(worker, worker->turn_root, &qthink,
+                state->x, state->o, state->dead, n, all, not_lside, not_rside);
+        }
+
+        if (simulate_status != ENOMEM) {
+            test_fail("ENOMEM is expected from turn_simulate(...), but %d is returned.", simulate_status);
+        }
+
+        const int qchildren = worker->turn_root->qchildren;
+        bb_t moves[qchildren];
+        memcpy(moves, get_turn_moves(get_turn_children(multiallocator, worker->turn_root->children), qchildren),
+            qchildren * sizeof(bb_t));
+        const size_t qnodes = check_turn_tree(multiallocator, worker->turn_root, state->x, state->o, state->dead);
+
+        const int gc_status = collect_garbage(me, worker);
+        if (gc_status != 0) {
+            test_fail("collect_garbage fails with code %d, %s.", gc_status, strerror(gc_status));
+        }
+
+        if (worker->turn_root != get_turn_children(multiallocator, 0) || worker->turn_root->qchildren != qchildren) {
+            test_fail("Turn root is not moved to the first item.");
+        }
+
+        const bb_t * const kept_moves = get_turn_moves(get_turn_children(multiallocator, worker->turn_root->children), qchildren);
+        if (memcmp(moves, kept_moves, qchildren * sizeof(bb_t)) != 0) {
+            test_fail("Root moves are changed by garbage collection.");
+        }
+
+        const size_t qkept = check_turn_tree(multiallocator, worker->turn_root, state->x, state->o, state->dead);
+        if (qkept < qchildren || qkept >= qnodes) {
+            test_fail("Unexpected count of kept turn nodes %zu, the tree had %zu nodes.", qkept, qnodes);
+        }
+    }
+
+    worker->multiallocator = me->multiallocator;
+    worker->turn_root = NULL;
+    destroy_multiallocator(multiallocator);
+    ai->free(ai);
+    destroy_geometry(geometry);
+    return 0;
+}
+
+int test_get_3moves_0(void)
+{
+    struct geometry * restrict const geometry = create_std_geometry(7);
+    if (geometry == NULL) {
+        test_fail("create_std_geometry(7) failed, errno = %d.", errno);
+    }
+
+    struct state * restrict const me = create_state(geometry);
+    if (me == NULL) {
+        test_fail("create_state(geometry) failed, errno = %d.", errno);
+    }
+
+    state_step(me, 0);
+    state_step(me, 8);
+    state_step(me, 16);
+
+    state_step(me, 48);
+    state_step(me, 40);
+    state_step(me, 32);
+
+    const bb_t my = me->x;
+    const bb_t opp = me->o;
+    const bb_t dead = me->dead;
+    const int n = geometry->n;
+    const bb_t all = geometry->all;
+    const bb_t not_lside = all ^ geometry->lside;
+    const bb_t not_rside = all ^ geometry->rside;
+
+    bb_t output[256];
+    const int qmoves = get_3moves_0(my, opp, dead, n, all, not_lside, not_rside, output);
+    if (qmoves != 165) {
+        test_fail("Unexpected qmoves, actual %d, expected C(11,3) = 165.", qmoves);
+    }
+
+    destroy_state(me);
+    destroy_geometry(geometry);
+    return 0;
+}
+
+int test_get_3moves_1(void)
+{
+    struct geometry * restrict const geometry = create_std_geometry(7);
+    if (geometry == NULL) {
+        test_fail("create_std_geometry(7) failed, errno = %d.", errno);
+    }
+
+    struct state * restrict const me = create_state(geometry);
+    if (me == NULL) {
+        test_fail("create_state(geometry) failed, errno = %d.", errno);
+    }
+
+    state_step(me, 0);
+    state_step(me, 8);
+    state_step(me, 16);
+
+    state_step(me, 48);
+    state_step(me, 40);
+    state_step(me, 32);
+
+    const bb_t my = me->x;
+    const bb_t opp = me->o;
+    const bb_t dead = me->dead;
+    const int n = geometry->n;
+    const bb_t all = geometry->all;
+    const bb_t not_lside = all ^ geometry->lside;
+    const bb_t not_rside = all ^ geometry->rside;
+
+    bb_t output[256];
+    const int qmoves = get_3moves_1(my, opp, dead, n, all, not_lside, not_rside, output);
+    if (qmoves != 214) {
+        test_fail("Unexpected qmoves, actual %d, expected 214.", qmoves);
+    }
+
+    destroy_state(me);
+    destroy_geometry(geometry);
+    return 0;
+}
+
+int test_get_3moves_2(void)
+{
+    struct geometry * restrict const geometry = create_std_geometry(7);
+    if (geometry == NULL) {
+        test_fail("create_std_geometry(7) failed, errno = %d.", errno);
+    }
+
+    struct state * restrict const me = create_state(geometry);
+    if (me == NULL) {
+        test_fail("create_state(geometry) failed, errno = %d.", errno);
+    }
+
+    state_step(me, 0);
+    state_step(me, 8);
+    state_step(me, 16);
+
+    state_step(me, 48);
+    state_step(me, 40);
+    state_step(me, 32);
+
+    const bb_t my = me->x;
+    const bb_t opp = me->o;
+    const bb_t dead = me->dead;
+    const int n = geometry->n;
+    const bb_t all = geometry->all;
+    const bb_t not_lside = all ^ geometry->lside;
+    const bb_t not_rside = all ^ geometry->rside;
+
+    bb_t output[256];
+    const int qmoves = get_3moves_2(my, opp, dead, n, all, not_lside, not_rside, output);
+    if (qmoves != 28) {
+        test_fail("Unexpected qmoves, actual %d, expected 28.", qmoves);
+    }
+
+    destroy_state(me);
+    destroy_geometry(geometry);
+    return 0;
+}
+
+int test_get_3moves_3(void)
+{
+    struct geometry * restrict const geometry = create_std_geometry(7);
+    if (geometry == NULL) {
+        test_fail("create_std_geometry(7) failed, errno = %d.", errno);
+    }
+
+    struct state * restrict const me = create_state(geometry);
+    if (me == NULL) {
+        test_fail("create_state(geometry) failed, errno = %d.", errno);
+    }
+
+    state_step(me, 0);
+    state_step(me, 8);
+    state_step(me, 16);
+
+    state_step(me, 48);
+    state_step(me, 40);
+    state_step(me, 32);
+
+    const bb_t my = me->x;
+    const bb_t opp = me->o;
+    const bb_t dead = me->dead;
+    const int n = geometry->n;
+    const bb_t all = geometry->all;
+    const bb_t not_lside = all ^ geometry->lside;
+    const bb_t not_rside = all ^ geometry->rside;
+
+    bb_t output[256];
+    const int qmoves = get_3moves_3(my, opp, dead, n, all, not_lside, not_rside, output);
+    if (qmoves != 71) {
+        test_fail("Unexpected qmoves, actual %d, expected 71.", qmoves);
+    }
+
+    destroy_state(me);
+    destroy_geometry(geometry);
+    return 0;
+}
+
+int test_all_3moves(void)
+{
+    struct geometry * restrict const geometry = create_std_geometry(7);
+    if (geometry == NULL) {
+        test_fail("create_std_geometry(7) failed, errno = %d.", errno);
+    }
+
+    struct state * restrict const me = create_state(geometry);
+    if (me == NULL) {
+        test_fail("create_state(geometry) failed, errno = %d.", errno);
+    }
+
+    state_step(me, 0);
+    state_step(me, 8);
+    state_step(me, 16);
+
+    state_step(me, 48);
+    state_step(me, 40);
+    state_step(me, 32);
+
+    const bb_t my = me->x;
+    const bb_t opp = me->o;
+    const bb_t dead = me->dead;
+    const int n = geometry->n;
+    const bb_t all = geometry->all;
+    const bb_t not_lside = all ^ geometry->lside;
+    const bb_t not_rside = all ^ geometry->rside;
+
+    bb_t output0[256];
+    bb_t output1[256];
+    bb_t output2[256];
+    bb_t output3[256];
+    const int qmoves0 = get_3moves_0(my, opp, dead, n, all, not_lside, not_rside, output0);
+    const int qmoves1 = get_3moves_1(my, opp, dead, n, all, not_lside, not_rside, output1);
+    const int qmoves2 = get_3moves_2(my, opp, dead, n, all, not_lside, not_rside, output2);
+    const int qmoves3 = get_3moves_3(my, opp, dead, n, all, not_lside, not_rside, output3);
+    const int total_qmoves = qmoves0 + qmoves1 + qmoves2 + qmoves3;
+
+    int full_qscans = 0;
+    bb_t full_scan[4096];
+    bb_t steps1 = state_get_steps(me);
+    while (steps1 != 0) {
+        bb_t bb = steps1 & (-steps1);
+        steps1 ^= bb;
+        const int step1 = first_one(bb);
+        state_step(me, step1);
+
+        bb_t steps2 = state_get_steps(me);
+        while (steps2 != 0) {
+            bb_t bb = steps2 & (-steps2);
+            steps2 ^= bb;
+            const int step2 = first_one(bb);
+
+            state_step(me, step2);
+            bb_t steps3 = state_get_steps(me);
+            while (steps3 != 0) {
+                bb_t bb = steps3 & (-steps3);
+                steps3 ^= bb;
+                const int step3 = first_one(bb);
+                full_scan[full_qscans++] = BB_SQUARE(step1) | BB_SQUARE(step2) | BB_SQUARE(step3);
+            }
+            state_unstep(me, step2);
+        }
+
+        state_unstep(me, step1);
+    }
+
+    qsort(full_scan, full_qscans, sizeof(bb_t), cmp_bb);
+
+    bb_t unique_moves[4096];
+    int unique_qmoves = 1;
+    unique_moves[0] = full_scan[0];
+    for (int i=1; i<full_qscans; ++i) {
+        if (full_scan[i-1] != full_scan[i]) {
+            unique_moves[unique_qmoves++] = full_scan[i];
+        }
+    }
+
+    int bad = 0;
+    for (int i=0; i<unique_qmoves; ++i) {
+        const bb_t bb = unique_moves[i];
+        int output_check = 0;
+        for (int j=0; j<qmoves0; ++j) { output_check += bb == output0[j]; }
+        for (int j=0; j<qmoves1; ++j) { output_check += bb == output1[j]; }
+        for (int j=0; j<qmoves2; ++j) { output_check += bb == output2[j]; }
+        for (int j=0; j<qmoves3; ++j) { output_check += bb == output3[j]; }
+        if (output_check != 1) {
+            printf("0x%lx - %d\n", (uint64_t)bb, output_check);
+            ++bad;
+        }
+    }
+
+    if (bad) {
+        test_fail("Some bad output checks.");
+    }
+
+    if (unique_qmoves != total_qmoves) {
+        test_fail("unique_qmoves (%d) and total_qmoves (%d) mismatch.", unique_qmoves, total_qmoves);
+    }
+
+    destroy_state(me);
+    destroy_geometry(geometry);
+    return 0;
+}
+
+#define N 10
+#define QSQUARES (N*N)
+
+int test_nn(void)
+{
+    static const int expected[QSQUARES] = {
+        301, 649, 477, 518, 454, 424, 411, 618, 637, 559, 435,
+        506, 546, 783, 327, 648, 466, 445, 374, 283, 636, 503,
+        496, 576, 535, 545, 515, 476, 416, 700, 343, 572, 571,
+        531, 578, 545, 548, 454, 571, 604, 697, 508, 535, 392,
+        429, 563, 506, 562, 461, 435, 383, 647, 578, 475, 597,
+        459, 387, 529, 331, 569, 302, 400, 465, 488, 518, 518,
+        510, 580, 644, 347, 532, 535, 458, 398, 371, 532, 516,
+        583, 310, 594, 473, 561, 439, 563, 333, 322, 622, 564,
+        620, 558, 549, 500, 376, 576, 533, 413, 437, 586, 337,
+        306   /* Calculated in ipython with using keras */
+   };
+
+    const char * nn_path = "nn.txt";
+    FILE * f = fopen(nn_path, "r");
+    if (f == NULL) {
+        test_fail("Cannot open “%s” file, errno is %d, %s\n", nn_path, errno, strerror(errno));
+    }
+
+    char error_msg[4096];
+    struct nn * restrict const me = load_text_nn(f, error_msg, 4095);
+    fclose(f);
+
+    if (me == NULL) {
+        test_fail("load_text_nn failed, %.4095s\n", error_msg);
+    }
+
+    int weights[QSQUARES];
+    get_nn_weights(me, 0, 0, N, 0, 0, 0, weights);
+
+    if (memcmp(weights, expected, sizeof(weights) != 0)) {
+        for (int i=0; i<QSQUARES; ++i) {
+            printf("%4d | %5d %5d\n", i, weights[i], expected[i]);
+        }
+        test_fail("Invalid calculation!\n");
+    }
+
+    destroy_nn(me);
+   return 0;
+}
+
+int test_nn_ignore(void)
+{
+    const char * nn_path = "nn.txt";
+    FILE * f = fopen(nn_path, "r");
+    if (f == NULL) {
+        test_fail("Cannot open “%s” file, errno is %d, %s\n", nn_path, errno, strerror(errno));
+    }
+
+    char error_msg[4096];
+    struct nn * restrict const me = load_text_nn(f, error_msg, 4095);
+    fclose(f);
+
+    if (me == NULL) {
+        test_fail("load_text_nn failed, %.4095s\n", error_msg);
+    }
+
+    const bb_t my = BB_SQUARE(44) | BB_SQUARE(45);
+    const bb_t opp = BB_SQUARE(55);
+    const bb_t dead = BB_SQUARE(54);
+    const bb_t ignore = BB_SQUARE(0) | BB_SQUARE(13) | BB_SQUARE(44) | BB_SQUARE(45) | BB_SQUARE(98);
+
+    for (int nstep=0; nstep<3; ++nstep) {
+        int expected[QSQUARES];
+        get_nn_weights(me, 0, nstep, N, my, opp, dead, expected);
+
+        int weights[QSQUARES];
+        get_nn_weights(me, ignore, nstep, N, my, opp, dead, weights);
+
+        for (int i=0; i<QSQUARES; ++i) {
+            if (BB_SQUARE(i) & ignore) {
+                if (weights[i] != -1) {
+                    test_fail("Ignored square %d has weight %d on step %d, -1 is expected.", i, weights[i], nstep);
+                }
+                continue;
+            }
+
+            if (weights[i] != expected[i]) {
+                test_fail("Square %d has weight %d on step %d with ignored squares, %d is expected.",
+                    i, weights[i], nstep, expected[i]);
+            }
+        }
+    }
+
+    destroy_nn(me);
+    return 0;
+}
+
+void check_nn_rollout(
+    const struct nn * const nn,
+    const int auto_steps,
+    struct geometry * restrict const geometry)
+{
+    const int n = geometry->n;
+
+    struct state * restrict const me = create_state(geometry);
+    if (me == NULL) {
+        test_fail("create_state(geometry) failed, errno = %d.", errno);
+    }
+
+    for (int i=0; i<auto_steps; ++i) {
+        bb_t steps = state_get_steps(me);
+        if (steps == 0) {
+            test_fail("cannot perform auto steps, state_get_steps(me) returns 0.");
+        }
+
+        const int qsteps = pop_count(steps);
+        const int sq = nth_one_index(steps, rand() % qsteps);
+        const int status = state_step(me, sq);
+        if (status != 0) {
+            test_fail("state_step(me, %d) fails with code %d, %s.", sq, status, strerror(status));
+        }
+    }
+
+    struct nn_rollout_ctx ctx_storage;
+    struct nn_rollout_ctx * restrict const ctx = &ctx_storage;
+    ctx->x = me->x;
+    ctx->o = me->o;
+    ctx->dead = me->dead;
+    ctx->n = n;
+    ctx->all = geometry->all;
+    ctx->not_lside = ctx->all ^ geometry->lside;
+    ctx->not_rside = ctx->all ^ geometry->rside;
+    ctx->next_steps = geometry->next_steps;
+    ctx->nn = nn;
+
+    int weights_buf[8*sizeof(bb_t)];
+    ctx->weights = weights_buf;
+
+    struct rng rng;
+    rng_seed(&rng, auto_steps, 0);
+    ctx->rng = &rng;
+
+    uint32_t qthink = 0;
+    int debug_log[2*n*n];
+    const int result = nn_rollout(ctx, &qthink, debug_log);
+
+    if (result != +ONE_GAME_COST && result != -ONE_GAME_COST) {
+        test_fail("rollout returns strange result %d", result);
+    }
+
+    if (qthink-- == 0) {
+        test_fail("Unexpected zero qthink after rollout call.");
+    }
+
+
+    /* Tricky!!! Round qthink to avoid last nonvalid moves at the end. */
+    /* rollout may play one or two steps before realizing that there is no moves */
+    qthink = (3*((qthink+auto_steps)/3)) - auto_steps;
+
+    for (int i=0; i<qthink; ++i) {
+        if (state_status(me) != 0) {
+            test_fail("Unexpected state status %d during applying rollout history.", state_status(me));
+        }
+        const int sq = debug_log[i];
+        const int status = state_step(me, sq);
+        if (status != 0) {
+            test_fail("state_step(%d) failed with code %d, %s.", sq, status, strerror(status));
+        }
+    }
+
+    if (state_status(me) == 0) {
+        test_fail("Unexpected state status %d after applying rollout history.", state_status(me));
+    }
+
+    destroy_state(me);
+}
+
+int test_nn_rollout(void)
+{
+    const char * nn_path = "nn.txt";
+    FILE * f = fopen(nn_path, "r");
+    if (f == NULL) {
+        test_fail("Cannot open “%s” file, errno is %d, %s\n", nn_path, errno, strerror(errno));
+    }
+
+    char error_msg[4096];
+    struct nn * restrict const nn = load_text_nn(f, error_msg, 4095);
+    fclose(f);
+
+    if (nn == NULL) {
+        test_fail("load_text_nn failed, %.4095s\n", error_msg);
+    }
+
+    struct geometry * restrict const geometry = create_std_geometry(10);
+    if (geometry == NULL) {
+        test_fail("create_std_geometry(10) failed, errno = %d.", errno);
+    }
+
+    check_nn_rollout(nn, 0, geometry);
+    check_nn_rollout(nn, 2, geometry);
+    check_nn_rollout(nn, 3, geometry);
+    check_nn_rollout(nn, 4, geometry);
+    check_nn_rollout(nn, 5, geometry);
+    check_nn_rollout(nn, 15, geometry);
+
+    destroy_geometry(geometry);
+    destroy_nn(nn);
+    return 0;
+}
+
+static void check_nn_kernels(const struct nn_kernels * const kernels)
+{
+    static const int mids[] = { 10, 16, 37, 100 };
+    enum { MAX_MID = 100, QROWS = 30 };
+
+    for (size_t t=0; t<sizeof(mids)/sizeof(mids[0]); ++t) {
+        const int MID = mids[t];
+
+        nn_value_t columns[QROWS * MAX_MID];
+        nn_value_t layer2[QSQUARES + QSQUARES * MAX_MID];
+        for (size_t i=0; i<sizeof(columns)/sizeof(columns[0]); ++i) {
+            columns[i] = rand() % 4096 - 2048;
+        }
+        for (size_t i=0; i<sizeof(layer2)/sizeof(layer2[0]); ++i) {
+            layer2[i] = rand() % 4096 - 2048;
+        }
+
+        int rows[QROWS];
+        for (int i=0; i<QROWS; ++i) {
+            rows[i] = rand() % QROWS;
+        }
+
+        nn_value_t expected[MAX_MID];
+        nn_value_t output[MAX_MID];
+        for (int i=0; i<MID; ++i) {
+            expected[i] = output[i] = rand() % 4096 - 2048;
+        }
+
+        generic_add_rows(expected, columns, rows, QROWS, MID);
+        kernels->add_rows(output, columns, rows, QROWS, MID);
+        if (memcmp(output, expected, MID * sizeof(nn_value_t)) != 0) {
+            test_fail("Kernel “%s” add_rows differs from generic one, MID = %d.", kernels->name, MID);
+        }
+
+        generic_update_row(expected, columns, columns + 2 * MID, MID);
+        kernels->update_row(output, columns, columns + 2 * MID, MID);
+        if (memcmp(output, expected, MID * sizeof(nn_value_t)) != 0) {
+            test_fail("Kernel “%s” update_row differs from generic one, MID = %d.", kernels->name, MID);
+        }
+
+        const bb_t ignore = ((bb_t)rand() << 64) | rand();
+        nn_value_t expected_2[QSQUARES];
+        nn_value_t output_2[QSQUARES];
+        generic_layer2(expected_2, layer2, expected, ignore, QSQUARES, MID);
+        kernels->layer2(output_2, layer2, output, ignore, QSQUARES, MID);
+        for (int i=0; i<QSQUARES; ++i) {
+            if ((BB_SQUARE(i) & ignore) == 0 && output_2[i] != expected_2[i]) {
+                test_fail("Kernel “%s” layer2 differs from generic one, MID = %d, square %d.", kernels->name, MID, i);
+            }
+        }
+
+        int16_t columns16[QROWS * MAX_MID];
+        int8_t columns8[QROWS * MAX_MID];
+        int16_t layer2_16[QSQUARES * MAX_MID];
+        for (size_t i=0; i<sizeof(columns16)/sizeof(columns16[0]); ++i) {
+            columns16[i] = rand() % 4096 - 2048;
+            columns8[i] = rand() % 256 - 128;
+        }
+        for (size_t i=0; i<sizeof(layer2_16)/sizeof(layer2_16[0]); ++i) {
+            layer2_16[i] = rand() % 4096 - 2048;
+        }
+
+        generic_add_rows16(expected, columns16, rows, QROWS, MID);
+        kernels->add_rows16(output, columns16, rows, QROWS, MID);
+        generic_update_row16(expected, columns16, columns16 + 2 * MID, MID);
+        kernels->update_row16(output, columns16, columns16 + 2 * MID, MID);
+        if (memcmp(output, expected, MID * sizeof(nn_value_t)) != 0) {
+            test_fail("Kernel “%s” int16 layer1 differs from generic one, MID = %d.", kernels->name, MID);
+        }
+
+        generic_add_rows8(expected, columns8, rows, QROWS, MID, 3);
+        kernels->add_rows8(output, columns8, rows, QROWS, MID, 3);
+        generic_update_row8(expected, columns8, columns8 + 2 * MID, MID, 3);
+        kernels->update_row8(output, columns8, columns8 + 2 * MID, MID, 3);
+        if (memcmp(output, expected, MID * sizeof(nn_value_t)) != 0) {
+            test_fail("Kernel “%s” int8 layer1 differs from generic one, MID = %d.", kernels->name, MID);
+        }
+
+        expected[0] = output[0] = 100000;
+        generic_layer2_16(expected_2, layer2, layer2_16, expected, ignore, QSQUARES, MID);
+        kernels->layer2_16(output_2, layer2, layer2_16, output, ignore, QSQUARES, MID);
+        for (int i=0; i<QSQUARES; ++i) {
+            if ((BB_SQUARE(i) & ignore) == 0 && output_2[i] != expected_2[i]) {
+                test_fail("Kernel “%s” int16 layer2 differs from generic one, MID = %d, square %d.", kernels->name, MID, i);
+            }
+        }
+    }
+}
+
+int test_nn_kernels(void)
+{
+    check_nn_kernels(&generic_kernels);
+
+    #ifdef HAS_X86_KERNELS
+        if (__builtin_cpu_supports("avx2")) {
+            check_nn_kernels(&avx2_kernels);
+        }
+        if (__builtin_cpu_supports("avx512f")) {
+            check_nn_kernels(&avx512_kernels);
+        }
+    #endif
+
+    return 0;
+}
+
+int test_nn_binary(void)
+{
+    const char * nn_path = "nn.txt";
+    const char * bin_path = "insider-nn.bin";
+
+    char error_msg[4096];
+    struct nn * restrict const text_nn = load_nn(nn_path, error_msg, 4095);
+    if (text_nn == NULL) {
+        test_fail("load_nn(%s) failed, %.4095s\n", nn_path, error_msg);
+    }
+
+    if (save_binary_nn(text_nn, bin_path, error_msg, 4095) != 0) {
+        test_fail("save_binary_nn failed, %.4095s\n", error_msg);
+    }
+
+    struct nn * restrict const bin_nn = load_nn(bin_path, error_msg, 4095);
+    if (bin_nn == NULL) {
+        test_fail("load_nn(%s) failed, %.4095s\n", bin_path, error_msg);
+    }
+
+    if (bin_nn->map == NULL) {
+        test_fail("Binary NN is not memory mapped.");
+    }
+
+    if (bin_nn->n != text_nn->n || bin_nn->MID != text_nn->MID) {
+        test_fail("Binary NN dimensions differ from text one.");
+    }
+
+    const int n = text_nn->n;
+    int expected[8*sizeof(bb_t)];
+    int weights[8*sizeof(bb_t)];
+    for (int nstep=0; nstep<QNN_STEPS; ++nstep) {
+        const bb_t my = BB_SQUARE(0) | BB_SQUARE(1) | BB_SQUARE(n+1);
+        const bb_t opp = BB_SQUARE(n*n-1) | BB_SQUARE(n+2);
+        const bb_t dead = BB_SQUARE(n+2);
+        get_nn_weights(text_nn, 0, nstep, n, my, opp, dead, expected);
+        get_nn_weights(bin_nn, 0, nstep, n, my, opp, dead, weights);
+        if (memcmp(weights, expected, n * n * sizeof(int)) != 0) {
+            test_fail("Binary NN weights differ from text one for step %d.", nstep);
+        }
+    }
+
+    destroy_nn(bin_nn);
+    destroy_nn(text_nn);
+
+    FILE * f = fopen(bin_path, "r+b");
+    if (f == NULL) {
+        test_fail("Cannot open “%s”, errno is %d, %s\n", bin_path, errno, strerror(errno));
+    }
+    fseek(f, 1000, SEEK_SET);
+    const int ch = fgetc(f);
+    fseek(f, 1000, SEEK_SET);
+    fputc(ch ^ 1, f);
+    fclose(f);
+
+    struct nn * restrict const broken_nn = load_nn(bin_path, error_msg, 4095);
+    unlink(bin_path);
+    if (broken_nn != NULL) {
+        test_fail("Corrupted binary NN is loaded.");
+    }
+
+    return 0;
+}
+
+static int calc_nn_choice(
+    const struct nn * const nn,
+    const struct state * const state,
+    int * restrict const weights)
+{
+    const bb_t steps = state_get_steps(state);
+    const bb_t my = state->active == ACTIVE_X ? state->x : state->o;
+    const bb_t opp = state->active == ACTIVE_X ? state->o : state->x;
+    const int nstep = pop_count(state->x | state->o) + pop_count(state->dead);
+    get_nn_weights(nn, state->geometry->all ^ steps, nstep % 3, state->geometry->n, my, opp, state->dead, weights);
+
+    int best = -1;
+    for (bb_t bb = steps; bb != 0; bb &= bb - 1) {
+        const int sq = first_one(bb);
+        if (best < 0 || weights[sq] > weights[best]) {
+            best = sq;
+        }
+    }
+    return best;
+}
+
+int test_nn_precision(void)
+{
+    const char * nn_path = "nn.txt";
+    FILE * f = fopen(nn_path, "r");
+    if (f == NULL) {
+        test_fail("Cannot open “%s” file, errno is %d, %s\n", nn_path, errno, strerror(errno));
     }
 
-    if (state_status(me) == 0) {
-        printf("State status is zero (in progress) after end of game.\n");
-        return;
+    char error_msg[4096];
+    struct nn * restrict const nn = load_text_nn(f, error_msg, 4095);
+    fclose(f);
+
+    if (nn == NULL) {
+        test_fail("load_text_nn failed, %.4095s\n", error_msg);
     }
-}
 
-void mcts_test_game(void)
-{
     struct geometry * restrict const geometry = create_std_geometry(10);
     if (geometry == NULL) {
-        printf("create_std_geometry(7) failed, errno = %d.\n", errno);
-        return;
+        test_fail("create_std_geometry(10) failed, errno = %d.", errno);
     }
 
-    struct state * restrict const me = create_state(geometry);
-    if (me == NULL) {
-        printf("create_state(geometry) failed, errno = %d.\n", errno);
-        return;
+    struct state * restrict const state = create_state(geometry);
+    if (state == NULL) {
+        test_fail("create_state(geometry) failed, errno = %d.", errno);
     }
 
-    run_game(geometry, me);
+    enum { QPOSITIONS = 200 };
+    int weights[8*sizeof(bb_t)];
+    int qmatches[3] = { 0 };
+    int qpositions = 0;
+
+    srand(2019);
+    for (int i=0; i<QPOSITIONS; ++i) {
+        init_state(state, geometry);
+        const int qsteps = 3 + rand() % 40;
+        for (int j=0; j<qsteps; ++j) {
+            const bb_t steps = state_get_steps(state);
+            if (steps == 0) {
+                break;
+            }
+            state_step(state, nth_one_index(steps, rand() % pop_count(steps)));
+        }
 
-    destroy_state(me);
-    destroy_geometry(geometry);
-}
+        if (state_get_steps(state) == 0) {
+            continue;
+        }
 
-int get_random_rollout_step(
-    void * data, /* Private data */
-    bb_t my, bb_t opp, bb_t dead, /* Game data */
-    const int n, const bb_t all, const bb_t not_lside, const bb_t not_rside) /* Geometry */
-{
-    const bb_t steps = next_steps(my, opp, dead, n, all, not_lside, not_rside);
-    if (steps != 0) {
-        const int qsteps = pop_count(steps);
-        const int index = qsteps > 1 ? rand() % qsteps : 0;
-        return index == 0 ? first_one(steps) : nth_one_index(steps, index);
+        ++qpositions;
+        int choices[3];
+        for (int precision=NN_INT32; precision<=NN_INT8; ++precision) {
+            if (set_nn_precision(nn, precision) != 0) {
+                test_fail("set_nn_precision(%d) fails.", precision);
+            }
+            choices[precision] = calc_nn_choice(nn, state, weights);
+            qmatches[precision] += choices[precision] == choices[NN_INT32];
+        }
     }
 
-    const int total_qsteps = pop_count(my|opp) + pop_count(dead);
-    if (total_qsteps == 0) {
-        return 0;
+    if (qmatches[NN_INT16] != qpositions) {
+        test_fail("int16 weights choose other square in %d of %d positions.",
+            qpositions - qmatches[NN_INT16], qpositions);
     }
 
-    if (total_qsteps == 3) {
-        return n*n-1;
+    if (10 * qmatches[NN_INT8] < 9 * qpositions) {
+        test_fail("int8 weights choose other square in %d of %d positions.",
+            qpositions - qmatches[NN_INT8], qpositions);
     }
 
-    return -1;
+    destroy_state(state);
+    destroy_geometry(geometry);
+    destroy_nn(nn);
+    return 0;
 }
 
-struct rollout_expansion
-{
-    bb_t selected;
-    bb_t * buf;
-};
-
-static bb_t select_3move(
-    struct rollout_expansion * restrict const me, /* Private data */
-    bb_t my, bb_t opp, bb_t dead, /* Game data */
-    const int n, const bb_t all, const bb_t not_lside, const bb_t not_rside) /* Geometry */
+int test_nn_accumulators(void)
 {
-    bb_t * restrict const buf = me->buf;
-
-    const int q3moves3 = get_3moves_3(my, opp, dead, n, all, not_lside, not_rside, buf);
-    if (q3moves3 != 0) {
-        const int index = q3moves3 > 1 ? rand() % q3moves3 : 0;
-        return buf[index];
+    const char * nn_path = "nn.txt";
+    FILE * f = fopen(nn_path, "r");
+    if (f == NULL) {
+        test_fail("Cannot open “%s” file, errno is %d, %s\n", nn_path, errno, strerror(errno));
     }
 
-    const int q3moves2 = get_3moves_2(my, opp, dead, n, all, not_lside, not_rside, buf);
-    if (q3moves2 != 0) {
-        const int index = q3moves2 > 1 ? rand() % q3moves2 : 0;
-        return buf[index];
-    }
+    char error_msg[4096];
+    struct nn * restrict const nn = load_text_nn(f, error_msg, 4095);
+    fclose(f);
 
-    const int q3moves1 = get_3moves_1(my, opp, dead, n, all, not_lside, not_rside, buf);
-    if (q3moves1 != 0) {
-        const int index = q3moves1 > 1 ? rand() % q3moves1 : 0;
-        return buf[index];
+    if (nn == NULL) {
+        test_fail("load_text_nn failed, %.4095s\n", error_msg);
     }
 
-    const int q3moves0 = get_3moves_0(my, opp, dead, n, all, not_lside, not_rside, buf);
-    if (q3moves0 != 0) {
-        const int index = q3moves0 > 1 ? rand() % q3moves0 : 0;
-        return buf[index];
+    struct geometry * restrict const geometry = create_std_geometry(10);
+    if (geometry == NULL) {
+        test_fail("create_std_geometry(10) failed, errno = %d.", errno);
     }
 
-    return 0;
-}
+    struct state * restrict const state = create_state(geometry);
+    if (state == NULL) {
+        test_fail("create_state(geometry) failed, errno = %d.", errno);
+    }
 
-int get_expansion_rollout_step(
-    void * data, /* Private data */
-    bb_t my, bb_t opp, bb_t dead, /* Game data */
-    const int n, const bb_t all, const bb_t not_lside, const bb_t not_rside) /* Geometry */
-{
-    struct rollout_expansion * restrict const me = data;
-    if (me->selected == 0) {
-        const int qsteps = pop_count(my|opp) + pop_count(dead);
-        const int mod = qsteps % 3;
-        if (mod != 0) {
-            printf("Warning: call rollout_expansion in the middle of a move.\n");
-            return get_random_rollout_step(NULL, my, opp, dead, n, all, not_lside, not_rside);
+    const int MID = nn->MID;
+    int weights[8*sizeof(bb_t)];
+    nn_value_t accumulators[2 * QNN_STEPS * MID];
+    nn_value_t expected[MID];
+
+    for (int igame=0; igame<10; ++igame) {
+        init_state(state, geometry);
+
+        struct nn_rollout_ctx ctx_storage;
+        struct nn_rollout_ctx * restrict const ctx = &ctx_storage;
+        ctx->x = 0;
+        ctx->o = 0;
+        ctx->dead = 0;
+        ctx->n = geometry->n;
+        ctx->all = geometry->all;
+        ctx->not_lside = geometry->all ^ geometry->lside;
+        ctx->not_rside = geometry->all ^ geometry->rside;
+        ctx->next_steps = geometry->next_steps;
+        ctx->nn = nn;
+        ctx->weights = weights;
+        ctx->accumulators = accumulators;
+        ctx->accumulators_mask = 0;
+
+        for (int nstep=0; nstep<QNN_STEPS; ++nstep) {
+            get_accumulator(ctx, nstep, ACTIVE_X);
+            get_accumulator(ctx, nstep, ACTIVE_O);
         }
 
-        me->selected = select_3move(me, my, opp, dead, n, all, not_lside, not_rside);
-    }
+        for (int qsteps=0;; ++qsteps) {
+            for (int nstep=0; nstep<QNN_STEPS; ++nstep)
+            for (int active=ACTIVE_X; active<=ACTIVE_O; ++active) {
+                const bb_t my = active == ACTIVE_X ? ctx->x : ctx->o;
+                const bb_t opp = active == ACTIVE_X ? ctx->o : ctx->x;
+                calc_nn_layer1(nn, nstep, ctx->n, my, opp, ctx->dead, expected);
+                const nn_value_t * const accumulator = get_accumulator(ctx, nstep, active);
+                if (memcmp(accumulator, expected, sizeof(expected)) != 0) {
+                    test_fail("Accumulator %d for %s differs from calculated one after %d steps.",
+                        nstep, active == ACTIVE_X ? "X" : "O", qsteps);
+                }
+            }
 
-    const bb_t selected = me->selected;
-    if (selected == 0) {
-        return -1;
-    }
+            const bb_t steps = state_get_steps(state);
+            if (steps == 0) {
+                break;
+            }
 
-    const bb_t next = next_steps(my, opp, dead, n, all, not_lside, not_rside);
-    if (next == 0) {
-        if (my != 0) {
-            printf("Warning, next_steps returns 0, but select_3move returns something.\n");
-            return -1;
-        }
-        if (opp == 0) {
-            if (BB_SQUARE(0) & selected) {
-                me->selected ^= BB_SQUARE(0);
-                return 0;
+            const int sq = nth_one_index(steps, rand() % pop_count(steps));
+            const int active = state->active;
+            if (state_step(state, sq) != 0) {
+                test_fail("state_step(%d) failed.", sq);
             }
-            printf("Warning, X first step out of selected.\n");
-            return -1;
-        } else {
-            if (BB_SQUARE(n*n-1) & selected) {
-                me->selected ^= BB_SQUARE(n*n-1);
-                return n*n - 1;
+
+            nn_do_step(ctx, BB_SQUARE(sq), active);
+            if (ctx->x != state->x || ctx->o != state->o || ctx->dead != state->dead) {
+                test_fail("Rollout position differs from the state after step %d.", sq);
             }
-            printf("Warning, O first step out of selected.\n");
-            return -1;
         }
     }
 
-    const bb_t choice = selected & next;
-    if (choice == 0) {
-        printf("Warning, zero selected & next.\n");
-        return -1;
-    }
-
-    const bb_t bb = choice & (-choice);
-    me->selected ^= bb;
-    return first_one(bb);
+    destroy_state(state);
+    destroy_geometry(geometry);
+    destroy_nn(nn);
+    return 0;
 }
 
-typedef int (*get_rollout_step_f)(
-    void * data, /* Private data */
-    bb_t my, bb_t opp, bb_t dead, /* Game data */
-    const int n, const bb_t all, const bb_t not_lside, const bb_t not_rside); /* Geometry */
-
-static int run_rollout(
-    void * first_data, get_rollout_step_f first_f,
-    void * second_data, get_rollout_step_f second_f,
-    struct geometry * restrict const geometry)
+void check_nn_simulate(
+    const struct geometry * const geometry,
+    struct mcts_ai * restrict const me,
+    const struct state * const state,
+    const int qruns)
 {
-    bb_t x = 0;
-    bb_t o = 0;
-    bb_t dead = 0;
+    struct node * restrict const node = create_root(me->multiallocator, me->tt);
+    if (node == NULL) {
+        test_fail("create_root failed.");
+    }
+    me->workers->root = NULL;
+
+    uint32_t qthink = 0;
+    const bb_t x = state->x;
+    const bb_t o = state->o;
+    const bb_t dead = state->dead;
+    const uint64_t hash = state->hash;
+
     const int n = geometry->n;
     const bb_t all = geometry->all;
     const bb_t not_lside = all ^ geometry->lside;
     const bb_t not_rside = all ^ geometry->rside;
 
-    for (;;) {
-        const int step1 = first_f(first_data, x, o, dead, n, all, not_lside, not_rside);
-        if (step1 < 0) return -1;
-        const bb_t bb1 = BB_SQUARE(step1);
-        *(bb1 & o ? &dead : &x) |= bb1;
-
-        const int step2 = first_f(first_data, x, o, dead, n, all, not_lside, not_rside);
-        if (step2 < 0) return -1;
-        const bb_t bb2 = BB_SQUARE(step2);
-        *(bb2 & o ? &dead : &x) |= bb2;
-
-        const int step3 = first_f(first_data, x, o, dead, n, all, not_lside, not_rside);
-        if (step3 < 0) return -1;
-        const bb_t bb3 = BB_SQUARE(step3);
-        *(bb3 & o ? &dead : &x) |= bb3;
-
-        const int step4 = second_f(second_data, o, x, dead, n, all, not_lside, not_rside);
-        if (step4 < 0) return +1;
-        const bb_t bb4 = BB_SQUARE(step4);
-        *(bb4 & x ? &dead : &o) |= bb4;
-
-        const int step5 = second_f(second_data, o, x, dead, n, all, not_lside, not_rside);
-        if (step5 < 0) return +1;
-        const bb_t bb5 = BB_SQUARE(step5);
-        *(bb5 & x ? &dead : &o) |= bb5;
-
-        const int step6 = second_f(second_data, o, x, dead, n, all, not_lside, not_rside);
-        if (step6 < 0) return +1;
-        const bb_t bb6 = BB_SQUARE(step6);
-        *(bb6 & x ? &dead : &o) |= bb6;
+    for (int i=0; i<qruns; ++i) {
+        uint32_t saved_qthink = qthink;
+        const int status = nn_simulate(me->workers, node, &qthink, x, o, dead, hash, n, all, not_lside, not_rside);
+        if (status != 0) {
+            test_fail("Unexpected status %d returned from %d-th nn_simulate(...), %s.", status, i, strerror(status));
+        }
+        if (qthink == saved_qthink) {
+            test_fail("qthink might be increased after %d-th NN simulation.", i);
+        }
     }
 }
 
-void mcts_test_rollout(void)
+int test_nn_simulate(void)
 {
     struct geometry * restrict const geometry = create_std_geometry(10);
     if (geometry == NULL) {
-        fprintf(stderr, "create_std_geometry(10) failed, errno = %d.", errno);
-        return;
+        test_fail("create_std_geometry(10) failed, errno = %d.", errno);
     }
 
-    struct rollout_expansion expansion1 = { 0, NULL };
-    struct rollout_expansion expansion2 = { 0, NULL };
-    expansion1.buf = malloc(128*1024*sizeof(bb_t));
-    expansion2.buf = malloc(128*1024*sizeof(bb_t));
-
-    static const int N = 5000;
-
-    const char * const first = "RND";
-    void * const first_data = NULL;
-    void * const first_f = get_random_rollout_step;
-
-    //const char * const first = "expansion";
-    //void * const first_data = &expansion1;
-    //void * const first_f = get_expansion_rollout_step;
-
-    //const char * const second = "RND";
-    //void * const second_data = NULL;
-    //void * const second_f = get_random_rollout_step;
-
-    const char * const second = "expansion";
-    void * const second_data = &expansion2;
-    void * const second_f = get_expansion_rollout_step;
-
-    int score1 = 0;
-    int score2 = 0;
-    double start = clock();
-    for (int i=0; i<N; ++i) {
-        score1 += run_rollout(first_data, first_f, second_data, second_f, geometry);
-        score2 += run_rollout(second_data, second_f, first_data, first_f, geometry);
+    struct ai storage;
+    const int status = init_mcts_ai(&storage, geometry);
+    if (status != 0) {
+        test_fail("init_mcts_ai fails with code %d, %s.", status, strerror(status));
     }
-    double finish = clock();
-    double all_time = (finish - start) / CLOCKS_PER_SEC;
-    double rollout_time = 0.5 * all_time / N;
-
-    double method_score = 50.0 + 25.0 * (score1 - score2) / N;
-    double side_score = 50.0 + 25.0 * (score1 + score2) / N;
 
-    printf("Geometry %dx%d, run %s vs %s, %d games, score %.2f%% (or %.2f%% from X) in %.6f second or %.6f second per rollout.\n",
-        geometry->n, geometry->n, first, second, 2*N, method_score, side_score, all_time, rollout_time);
+    struct ai * restrict const ai = &storage;
+    struct mcts_ai * restrict const me = ai->data;
 
-    printf("score1 = %d\n", score1);
-    printf("score2 = %d\n", score2);
+    const struct state * const state = ai->get_state(ai);
+    check_nn_simulate(geometry, me, state, 2);
 
-    free(expansion1.buf);
-    free(expansion2.buf);
+    ai->free(ai);
     destroy_geometry(geometry);
+    return 0;
 }
 
-void mcts_test_nn(void)
+/*
+ * After a search no leaf is left claimed, and every virtual loss is replaced
+ * with a real result, so a score does not exceed one game cost per game.
+ */
+static void check_parallel_tree(
+    struct multiallocator * restrict const multiallocator,
+    const struct node * const node,
+    const int depth)
 {
-    const char * nn_path = "nn.txt";
-    FILE * f = fopen(nn_path, "r");
-    if (f == NULL) {
-        printf("Cannot open “%s” file, errno is %d, %s\n", nn_path, errno, strerror(errno));
-        return;
+    const int64_t qgames = node->qgames;
+    const int64_t score = node->score;
+    if (qgames < 1) {
+        test_fail("Node with %ld games is found after the search.", qgames);
     }
 
-    char error_msg[4096];
+    if (score > qgames * ONE_GAME_COST || score < -qgames * ONE_GAME_COST) {
+        test_fail("Node score %ld is out of range for %ld games.", score, qgames);
+    }
 
-    struct nn * restrict const me = load_text_nn(f, error_msg, 4095);
-    fclose(f);
+    const int qchildren = node->qchildren;
+    if (qchildren == EXPANDING_MARK) {
+        test_fail("Leaf is left claimed after the search.");
+    }
 
-    if (me == NULL) {
-        printf("load_text_nn failed, %4095s\n", error_msg);
+    if (qchildren == 0 || qchildren == TERMINAL_MARK || depth == 0) {
         return;
     }
 
-    int weights[100];
-
-    static const int N = 10000;
-    const double start = clock();
-    for (int i=0; i<N; ++i) {
-        get_nn_weights(me, 0, 0, 10, 0, 0, 0, weights);
+    const size_t counter = multiallocator->types[NODE_TYPE].counter;
+    if (node->children + qchildren > counter) {
+        test_fail("Children %u..%u are out of allocated %zu nodes.",
+            node->children, node->children + qchildren, counter);
     }
-    const double finish = clock();
-    const double total = (finish - start) / CLOCKS_PER_SEC;
-    const double one_calc = total / N;
-    printf("Done %d times in %.6f, one in %.6f\n", N, total, one_calc);
 
-    destroy_nn(me);
+    const struct node * const children = get_node(multiallocator, node->children);
+    for (int i=0; i<qchildren; ++i) {
+        check_parallel_tree(multiallocator, children + i, depth - 1);
+    }
 }
 
+int test_tree_parallel(void)
+{
+    struct geometry * restrict const geometry = create_std_geometry(10);
+    if (geometry == NULL) {
+        test_fail("create_std_geometry(10) failed, errno = %d.", errno);
+    }
 
+    struct ai storage;
+    const int status = init_mcts_ai(&storage, geometry);
+    if (status != 0) {
+        test_fail("init_mcts_ai fails with code %d, %s.", status, strerror(status));
+    }
 
-#ifdef MAKE_CHECK
-
-#include "insider.h"
-
-void check_rollout(
-    const int auto_steps,
-    struct geometry * restrict const geometry)
-{
-    struct state * restrict const me = create_state(geometry);
-    if (me == NULL) {
-        test_fail("create_state(geometry) failed, errno = %d.", errno);
+    struct ai * restrict const ai = &storage;
+    struct mcts_ai * restrict const me = ai->data;
+    const uint32_t threads = 4;
+    const uint32_t qthink = 5000;
+    if (ai->set_param(ai, "threads", &threads) != 0) {
+        test_fail("set_param(threads) fails, %s.", ai->error);
+    }
+    if (ai->set_param(ai, "qthink", &qthink) != 0) {
+        test_fail("set_param(qthink) fails, %s.", ai->error);
     }
 
-    for (int i=0; i<auto_steps; ++i) {
-        bb_t steps = state_get_steps(me);
-        if (steps == 0) {
-            test_fail("cannot perform auto steps, state_get_steps(me) returns 0.");
+    for (int i=0; i<3; ++i) {
+        rnd_steps(ai, geometry, 7 + i);
+        const bb_t steps = state_get_steps(&ai->state);
+        const int sq = ai->go(ai, NULL);
+        if (sq < 0) {
+            test_fail("ai->go fails with %u threads, %s.", threads, ai->error);
         }
 
-        const int qsteps = pop_count(steps);
-        const int sq = nth_one_index(steps, rand() % qsteps);
-        const int status = state_step(me, sq);
-        if (status != 0) {
-            test_fail("state_step(me, %d) fails with code %d, %s.", sq, status, strerror(status));
+        if ((steps & BB_SQUARE(sq)) == 0) {
+            test_fail("ai->go returns invalid step %d with %u threads.", sq, threads);
+        }
+
+        if (me->qworkers != threads) {
+            test_fail("Search runs %u workers, %u are expected.", me->qworkers, threads);
         }
+
+        const struct mcts_worker * const worker = me->workers;
+        check_parallel_tree(worker->multiallocator, worker->root, 8);
     }
 
-    const bb_t x = me->x;
-    const bb_t o = me->o;
-    const bb_t dead = me->dead;
-    const int n = geometry->n;
-    const bb_t all = geometry->all;
-    const bb_t not_lside = all ^ geometry->lside;
-    const bb_t not_rside = all ^ geometry->rside;
-    uint32_t qthink = 0;
-    int debug_log[2*n*n];
-    const int result = rollout(x, o, dead, n, all, not_lside, not_rside, &qthink, debug_log);
+    ai->free(ai);
+    destroy_geometry(geometry);
+    return 0;
+}
 
-    if (result != +ONE_GAME_COST && result != -ONE_GAME_COST) {
-        test_fail("rollout returns strange result %d", result);
+void check_parallel_go(
+    struct ai * restrict const ai,
+    const char * const parallel_mode)
+{
+    const int status = ai->set_param(ai, "parallel_mode", parallel_mode);
+    if (status != 0) {
+        test_fail("set_param(parallel_mode, %s) fails with code %d, %s.", parallel_mode, status, ai->error);
     }
 
-    if (qthink-- == 0) {
-        test_fail("Unexpected zero qthink after rollout call.");
+    const bb_t steps = state_get_steps(&ai->state);
+    struct ai_explanation explanation;
+    const int sq = ai->go(ai, &explanation);
+    if (sq < 0) {
+        test_fail("ai->go fails in “%s” parallel mode, %s.", parallel_mode, ai->error);
     }
 
+    if ((steps & BB_SQUARE(sq)) == 0) {
+        test_fail("ai->go returns invalid step %d in “%s” parallel mode.", sq, parallel_mode);
+    }
 
-    /* Tricky!!! Round qthink to avoid last nonvalid moves at the end. */
-    /* rollout may play one or two steps before realizing that there is no moves */
-    qthink = (3*((qthink+auto_steps)/3)) - auto_steps;
+    if (explanation.stats[0].square != sq) {
+        test_fail("Best step %d does not match explanation step %d.", sq, explanation.stats[0].square);
+    }
 
-    for (int i=0; i<qthink; ++i) {
-        if (state_status(me) != 0) {
-            test_fail("Unexpected state status %d during applying rollout history.", state_status(me));
+    struct mcts_ai * restrict const me = ai->data;
+    const struct node * const root = me->workers[0].root;
+    if (strcmp(parallel_mode, "tree") == 0) {
+        for (unsigned int i=1; i<me->qworkers; ++i) {
+            if (me->workers[i].root != root) {
+                test_fail("Root node of %u-th worker is not shared in tree mode.", i);
+            }
         }
-        const int sq = debug_log[i];
-        const int status = state_step(me, sq);
-        if (status != 0) {
-            test_fail("state_step(%d) failed with code %d, %s.", sq, status, strerror(status));
+        return;
+    }
+
+    uint32_t qgames = 0;
+    for (unsigned int i=0; i<me->qworkers; ++i) {
+        const struct mcts_worker * const worker = me->workers + i;
+        if (i > 0 && worker->root == root) {
+            test_fail("Root node of %u-th worker is shared in root mode.", i);
         }
+        qgames += worker->root->qgames;
     }
 
-    if (state_status(me) == 0) {
-        test_fail("Unexpected state status %d after applying rollout history.", state_status(me));
+    uint32_t merged_qgames = 0;
+    for (size_t i=0; i<explanation.qstats; ++i) {
+        merged_qgames += explanation.stats[i].qgames;
     }
 
-    destroy_state(me);
+    if (merged_qgames < qgames) {
+        test_fail("Merged root stats contain %u games, but workers played %u games.", merged_qgames, qgames);
+    }
 }
 
-int test_rollout(void)
+int test_parallel_go(void)
 {
-    struct geometry * restrict const geometry4 = create_std_geometry(4);
-    if (geometry4 == NULL) {
-        test_fail("create_std_geometry(4) failed, errno = %d.", errno);
+    struct geometry * restrict const geometry = create_std_geometry(10);
+    if (geometry == NULL) {
+        test_fail("create_std_geometry(10) failed, errno = %d.", errno);
     }
 
-    struct geometry * restrict const geometry10 = create_std_geometry(10);
-    if (geometry10 == NULL) {
-        test_fail("create_std_geometry(10) failed, errno = %d.", errno);
+    struct ai storage;
+    const int status = init_mcts_ai(&storage, geometry);
+    if (status != 0) {
+        test_fail("init_mcts_ai fails with code %d, %s.", status, strerror(status));
     }
 
-    struct geometry * restrict const geometry11 = create_std_geometry(11);
-    if (geometry11 == NULL) {
-        test_fail("create_std_geometry(11) failed, errno = %d.", errno);
+    struct ai * restrict const ai = &storage;
+    const uint32_t threads = 3;
+    const uint32_t qthink = 3000;
+    if (ai->set_param(ai, "threads", &threads) != 0) {
+        test_fail("set_param(threads) fails, %s.", ai->error);
+    }
+    if (ai->set_param(ai, "qthink", &qthink) != 0) {
+        test_fail("set_param(qthink) fails, %s.", ai->error);
     }
 
-    check_rollout(0, geometry4);
-    check_rollout(10, geometry4);
-    check_rollout(0, geometry10);
-    check_rollout(1, geometry10);
-    check_rollout(2, geometry11);
-    check_rollout(3, geometry11);
-    check_rollout(4, geometry10);
-    check_rollout(5, geometry10);
-    check_rollout(6, geometry11);
-    check_rollout(7, geometry11);
-    check_rollout(8, geometry10);
-    check_rollout(9, geometry10);
-    check_rollout(10, geometry11);
-    check_rollout(11, geometry11);
-    check_rollout(12, geometry10);
-    check_rollout(13, geometry10);
-    check_rollout(14, geometry11);
-    check_rollout(15, geometry11);
+    if (ai->set_param(ai, "parallel_mode", "leaf") == 0) {
+        test_fail("set_param(parallel_mode, leaf) is expected to fail.");
+    }
 
-    destroy_geometry(geometry4);
-    destroy_geometry(geometry10);
-    destroy_geometry(geometry11);
+    rnd_steps(ai, geometry, 7);
+    check_parallel_go(ai, "tree");
+    check_parallel_go(ai, "root");
+
+    ai->free(ai);
+    destroy_geometry(geometry);
     return 0;
 }
 
-int test_mcts_init_free(void)
+/* Searches with the same seed in the same position are equal. */
+/* Two AIs with the same seed search the same position with threads in mode. */
+static void check_rng_seed(
+    const struct geometry * const geometry,
+    const uint32_t threads,
+    const char * const mode)
 {
-    struct geometry * restrict const geometry = create_std_geometry(11);
+    struct ai storages[2];
+    struct ai_explanation explanations[2];
+    int steps[2];
+    const uint32_t qthink = 20000;
+    const uint32_t seed = 7;
+    for (int i=0; i<2; ++i) {
+        struct ai * restrict const ai = storages + i;
+        const int status = init_mcts_ai(ai, geometry);
+        if (status != 0) {
+            test_fail("init_mcts_ai fails with code %d, %s.", status, strerror(status));
+        }
+
+        if (ai->set_param(ai, "qthink", &qthink) != 0) {
+            test_fail("set_param(qthink) fails, %s.", ai->error);
+        }
+        if (ai->set_param(ai, "rng_seed", &seed) != 0) {
+            test_fail("set_param(rng_seed) fails, %s.", ai->error);
+        }
+        if (ai->set_param(ai, "threads", &threads) != 0) {
+            test_fail("set_param(threads) fails, %s.", ai->error);
+        }
+        if (ai->set_param(ai, "parallel_mode", mode) != 0) {
+            test_fail("set_param(parallel_mode, %s) fails, %s.", mode, ai->error);
+        }
+
+        srand(11);
+        rnd_steps(ai, geometry, 7);
+        steps[i] = ai->go(ai, explanations + i);
+        if (steps[i] < 0) {
+            test_fail("ai->go fails, %s.", ai->error);
+        }
+
+        const struct mcts_ai * const me = ai->data;
+        for (unsigned int k=0; me->parallel == PARALLEL_ROOT && k < me->qworkers; ++k) {
+            if (me->workers[k].qthink < qthink / me->qworkers) {
+                test_fail("Root worker %u spends %u of %u qthink.", k, me->workers[k].qthink, qthink);
+            }
+        }
+    }
+
+    if (steps[0] != steps[1] || explanations[0].qstats != explanations[1].qstats) {
+        test_fail("Searches with the same seed choose %d and %d, %u threads in %s mode.",
+            steps[0], steps[1], threads, mode);
+    }
+
+    for (size_t i=0; i<explanations[0].qstats; ++i) {
+        const struct step_stat * const a = explanations[0].stats + i;
+        const struct step_stat * const b = explanations[1].stats + i;
+        if (a->square != b->square || a->qgames != b->qgames || a->score != b->score) {
+            test_fail("Statistics of %zu-th step differ for the same seed, %u threads in %s mode.",
+                i, threads, mode);
+        }
+    }
+
+    for (int i=0; i<2; ++i) {
+        storages[i].free(storages + i);
+    }
+}
+
+int test_rng_seed(void)
+{
+    struct geometry * restrict const geometry = create_std_geometry(10);
     if (geometry == NULL) {
-        test_fail("create_std_geometry(11) failed, errno = %d.", errno);
+        test_fail("create_std_geometry(10) failed, errno = %d.", errno);
     }
 
     struct ai storage;
@@ -2442,77 +8994,99 @@ int test_mcts_init_free(void)
         test_fail("init_mcts_ai fails with code %d, %s.", status, strerror(status));
     }
 
-    struct ai * restrict const ai = &storage;
-    ai->free(ai);
+    const struct mcts_ai * const me = storage.data;
+    if (me->rng_seed != def_seed) {
+        test_fail("Initial rng_seed is %u, %u is expected.", me->rng_seed, def_seed);
+    }
+    storage.free(&storage);
+
+    /* Parameter names are case insensitive in both AIs. */
+    const uint32_t seed = 5;
+    const int random_status = init_random_ai(&storage, geometry);
+    if (random_status != 0) {
+        test_fail("init_random_ai fails with code %d, %s.", random_status, strerror(random_status));
+    }
+    if (storage.set_param(&storage, "RNG_SEED", &seed) != 0) {
+        test_fail("Random AI set_param(RNG_SEED) fails, %s.", storage.error);
+    }
+    if (storage.set_param(&storage, "rng_seeds", &seed) == 0) {
+        test_fail("Random AI set_param(rng_seeds) is expected to fail.");
+    }
+    storage.free(&storage);
 
+    check_rng_seed(geometry, 1, "tree");
+    check_rng_seed(geometry, 3, "root");
     destroy_geometry(geometry);
     return 0;
 }
 
-void rnd_steps(
-    struct ai * restrict const ai,
-    const struct geometry * const geometry,
-    const int rnd_qsteps)
+int test_tree_reuse(void)
 {
-    ai->reset(ai, geometry);
-    for (int i=0; i<rnd_qsteps; ++i) {
-        const bb_t steps = state_get_steps(&ai->state);
-        const int qsteps = pop_count(steps);
-        if (qsteps == 0) {
-            test_fail("Unexpected zero qsteps.");
-        }
-        const int choice = rand() % qsteps;
-        const int sq = nth_one_index(steps, choice);
-        const int status = state_step(&ai->state, sq);
-        if (status != 0) {
-            test_fail("state_step failed on %d-th step.", i);
-        }
+    struct geometry * restrict const geometry = create_std_geometry(10);
+    if (geometry == NULL) {
+        test_fail("create_std_geometry(10) failed, errno = %d.", errno);
     }
-}
 
-void check_simulate(
-    const struct geometry * const geometry,
-    struct mcts_ai * restrict const me,
-    const struct state * const state,
-    const int qruns)
-{
-    multiallocator_reset(me->multiallocator);
+    struct ai storage;
+    const int status = init_mcts_ai(&storage, geometry);
+    if (status != 0) {
+        test_fail("init_mcts_ai fails with code %d, %s.", status, strerror(status));
+    }
 
-    const size_t inode = multiallocator_alloc(me->multiallocator, 0);
-    if (inode == BAD_ALLOC_INDEX) {
-        test_fail("multiallocator->alloc(0) failed.");
+    struct ai * restrict const ai = &storage;
+    struct mcts_ai * restrict const me = ai->data;
+    const uint32_t qthink = 3000;
+    if (ai->set_param(ai, "qthink", &qthink) != 0) {
+        test_fail("set_param(qthink) fails, %s.", ai->error);
     }
 
-    struct node * restrict const node = get_node(me, inode);
-    node->square = -1;
-    node->qchildren = 0;
-    node->score = 0;
-    node->qgames = 0;
-    node->children = 0;
+    rnd_steps(ai, geometry, 6);
 
-    uint32_t qthink = 0;
-    const bb_t x = state->x;
-    const bb_t o = state->o;
-    const bb_t dead = state->dead;
+    const int sq = ai->go(ai, NULL);
+    if (sq < 0) {
+        test_fail("ai->go fails, %s.", ai->error);
+    }
 
-    const int n = geometry->n;
-    const bb_t all = geometry->all;
-    const bb_t not_lside = all ^ geometry->lside;
-    const bb_t not_rside = all ^ geometry->rside;
+    if (me->workers[0].root == NULL) {
+        test_fail("Search tree is not kept after ai->go.");
+    }
 
-    for (int i=0; i<qruns; ++i) {
-        uint32_t saved_qthink = qthink;
-        const int status = simulate(me, node, &qthink, x, o, dead, n, all, not_lside, not_rside);
-        if (status != 0) {
-            test_fail("Unexpected status %d returned from %d-th simulate(...), %s.", status, i, strerror(status));
-        }
-        if (qthink == saved_qthink) {
-            test_fail("qthink might be increased after %d-th simulation.", i);
-        }
+    const struct node * const expected = find_child(me->multiallocator, me->workers[0].root, sq);
+    if (expected == NULL) {
+        test_fail("Step %d is not found in the tree.", sq);
+    }
+    const int32_t qgames = expected->qgames;
+
+    if (ai->do_step(ai, sq) != 0) {
+        test_fail("ai->do_step(%d) fails, %s.", sq, ai->error);
+    }
+
+    if (me->workers[0].root != expected) {
+        test_fail("Tree is not rebased to the played step %d.", sq);
+    }
+
+    if (ai->go(ai, NULL) < 0) {
+        test_fail("ai->go fails, %s.", ai->error);
+    }
+
+    if (me->workers[0].root != expected || expected->qgames <= qgames) {
+        test_fail("Subtree of step %d is not reused.", sq);
+    }
+
+    if (ai->undo_step(ai) != 0) {
+        test_fail("ai->undo_step fails, %s.", ai->error);
     }
+
+    if (me->workers[0].root != NULL) {
+        test_fail("Tree is not forgotten after undo.");
+    }
+
+    ai->free(ai);
+    destroy_geometry(geometry);
+    return 0;
 }
 
-int test_simulate(void)
+int test_transpositions(void)
 {
     struct geometry * restrict const geometry = create_std_geometry(4);
     if (geometry == NULL) {
@@ -2527,497 +9101,640 @@ int test_simulate(void)
 
     struct ai * restrict const ai = &storage;
     struct mcts_ai * restrict const me = ai->data;
+    struct multiallocator * restrict const multiallocator = me->multiallocator;
 
+    rnd_steps(ai, geometry, 6);
     const struct state * const state = ai->get_state(ai);
-    for (int i=0; i<=10; ++i) {
-        rnd_steps(ai, geometry, i);
-        check_simulate(geometry, me, state, 100);
+    check_simulate(geometry, me, state, 1000);
+
+    const struct node * const root = get_node(multiallocator, 0);
+    if (root->qchildren == 0 || root->qchildren >= EXPANDING_MARK) {
+        test_fail("Root node is not expanded.");
+    }
+
+    int qshared = 0;
+    const struct node * const children = get_node(multiallocator, root->children);
+    for (int i=0; i<root->qchildren; ++i) {
+        for (int j=i+1; j<root->qchildren; ++j) {
+            const int sq1 = get_square(children + i);
+            const int sq2 = get_square(children + j);
+            const struct node * const a = find_child(multiallocator, children + i, sq2);
+            const struct node * const b = find_child(multiallocator, children + j, sq1);
+            if (a == NULL || b == NULL) {
+                continue;
+            }
+
+            const int is_a_expanded = a->qchildren != 0 && a->qchildren < EXPANDING_MARK;
+            const int is_b_expanded = b->qchildren != 0 && b->qchildren < EXPANDING_MARK;
+            if (!is_a_expanded || !is_b_expanded) {
+                continue;
+            }
+
+            if (a->children != b->children || a->qchildren != b->qchildren) {
+                test_fail("Transposed positions after steps %d and %d do not share children.", sq1, sq2);
+            }
+            ++qshared;
+        }
     }
 
-    ai->free(ai);
+    if (qshared == 0) {
+        test_fail("No transposed expanded positions found.");
+    }
 
+    ai->free(ai);
     destroy_geometry(geometry);
     return 0;
 }
 
-int test_get_3moves_0(void)
+int test_time_control(void)
 {
-    struct geometry * restrict const geometry = create_std_geometry(7);
+    struct geometry * restrict const geometry = create_std_geometry(10);
     if (geometry == NULL) {
-        test_fail("create_std_geometry(7) failed, errno = %d.", errno);
+        test_fail("create_std_geometry(10) failed, errno = %d.", errno);
     }
 
-    struct state * restrict const me = create_state(geometry);
-    if (me == NULL) {
-        test_fail("create_state(geometry) failed, errno = %d.", errno);
+    struct ai storage;
+    const int status = init_mcts_ai(&storage, geometry);
+    if (status != 0) {
+        test_fail("init_mcts_ai fails with code %d, %s.", status, strerror(status));
     }
 
-    state_step(me, 0);
-    state_step(me, 8);
-    state_step(me, 16);
+    struct ai * restrict const ai = &storage;
+    struct mcts_ai * restrict const me = ai->data;
+    const uint32_t qthink = 1;
+    const uint32_t threads = 2;
+    const uint32_t move_time = 300;
+    if (ai->set_param(ai, "qthink", &qthink) != 0) {
+        test_fail("set_param(qthink) fails, %s.", ai->error);
+    }
+    if (ai->set_param(ai, "threads", &threads) != 0) {
+        test_fail("set_param(threads) fails, %s.", ai->error);
+    }
+    if (ai->set_param(ai, "move_time", &move_time) != 0) {
+        test_fail("set_param(move_time) fails, %s.", ai->error);
+    }
+
+    rnd_steps(ai, geometry, 6);
+
+    /*
+     * Deadlines are checked against the turn clock, not the wall time, so a
+     * slow run (valgrind) does not fail: the first step gets a half of the
+     * turn budget, the last one gets all remaining time or none when the
+     * budget is already spent.
+     */
+    const struct mcts_clock * const clock = &me->clock;
+    for (int i=0; i<3; ++i) {
+        const int has_search = pop_count(state_get_steps(&ai->state)) > 1;
+        const int sq = ai->go(ai, NULL);
+        if (sq < 0) {
+            test_fail("ai->go fails on %d-th step of the turn, %s.", i+1, ai->error);
+        }
 
-    state_step(me, 48);
-    state_step(me, 40);
-    state_step(me, 32);
+        if (has_search) {
+            if (me->search.qthink <= qthink) {
+                test_fail("qthink limit is used with time control.");
+            }
 
-    const bb_t my = me->x;
-    const bb_t opp = me->o;
-    const bb_t dead = me->dead;
-    const int n = geometry->n;
-    const bb_t all = geometry->all;
-    const bb_t not_lside = all ^ geometry->lside;
-    const bb_t not_rside = all ^ geometry->rside;
+            if (clock->turn_budget < move_time * NS_IN_MS / 2) {
+                test_fail("Turn budget %lu ns is too small for move_time %u ms.",
+                    (unsigned long)clock->turn_budget, move_time);
+            }
+            if (i == 0 && me->search.deadline != clock->turn_start + clock->turn_budget / 100 * 50) {
+                test_fail("The first step does not get a half of the turn budget.");
+            }
+            if (i == 2 && me->search.deadline + 20 < clock->turn_start + clock->turn_budget) {
+                test_fail("The last step does not get all remaining time.");
+            }
+        }
 
-    bb_t output[256];
-    const int qmoves = get_3moves_0(my, opp, dead, n, all, not_lside, not_rside, output);
-    if (qmoves != 165) {
-        test_fail("Unexpected qmoves, actual %d, expected C(11,3) = 165.", qmoves);
+        if (ai->do_step(ai, sq) != 0) {
+            test_fail("ai->do_step(%d) fails, %s.", sq, ai->error);
+        }
     }
 
-    destroy_state(me);
+    /* The endgame solver runs on the step clock, a quarter of the step time. */
+    me->endgame = geometry->n * geometry->n;
+    const uint64_t go_start = get_time_ns();
+    if (ai->go(ai, NULL) < 0) {
+        test_fail("ai->go fails with endgame solver, %s.", ai->error);
+    }
+
+    const uint64_t solver_time = me->clock.turn_budget / 8;
+    if (me->clock.turn_start > go_start + solver_time / 2) {
+        test_fail("Turn clock starts %lu ns after ai->go, endgame solver time is not charged.",
+            (unsigned long)(me->clock.turn_start - go_start));
+    }
+    me->endgame = 0;
+
+    const uint32_t zero = 0;
+    const uint32_t time_left = 2000;
+    if (ai->set_param(ai, "move_time", &zero) != 0 || ai->set_param(ai, "time_left", &time_left) != 0) {
+        test_fail("set_param(time_left) fails, %s.", ai->error);
+    }
+
+    const uint64_t budget = calc_turn_budget(me, ai->get_state(ai));
+    if (budget == 0 || budget > time_left * NS_IN_MS / 2) {
+        test_fail("Turn budget %lu ns is out of range for time_left %u ms.", (unsigned long)budget, time_left);
+    }
+
+    ai->free(ai);
     destroy_geometry(geometry);
     return 0;
 }
 
-int test_get_3moves_1(void)
+int test_ponder(void)
 {
-    struct geometry * restrict const geometry = create_std_geometry(7);
+    struct geometry * restrict const geometry = create_std_geometry(10);
     if (geometry == NULL) {
-        test_fail("create_std_geometry(7) failed, errno = %d.", errno);
+        test_fail("create_std_geometry(10) failed, errno = %d.", errno);
     }
 
-    struct state * restrict const me = create_state(geometry);
-    if (me == NULL) {
-        test_fail("create_state(geometry) failed, errno = %d.", errno);
+    struct ai storage;
+    const int status = init_mcts_ai(&storage, geometry);
+    if (status != 0) {
+        test_fail("init_mcts_ai fails with code %d, %s.", status, strerror(status));
     }
 
-    state_step(me, 0);
-    state_step(me, 8);
-    state_step(me, 16);
+    struct ai * restrict const ai = &storage;
+    struct mcts_ai * restrict const me = ai->data;
+    const uint32_t qthink = 2000;
+    const uint32_t threads = 2;
+    if (ai->set_param(ai, "qthink", &qthink) != 0) {
+        test_fail("set_param(qthink) fails, %s.", ai->error);
+    }
+    if (ai->set_param(ai, "threads", &threads) != 0) {
+        test_fail("set_param(threads) fails, %s.", ai->error);
+    }
+    if (ai->set_param(ai, "ponder", "maybe") == 0) {
+        test_fail("set_param(ponder, maybe) is expected to fail.");
+    }
+    if (ai->set_param(ai, "ponder", "on") != 0) {
+        test_fail("set_param(ponder, on) fails, %s.", ai->error);
+    }
 
-    state_step(me, 48);
-    state_step(me, 40);
-    state_step(me, 32);
+    rnd_steps(ai, geometry, 6);
 
-    const bb_t my = me->x;
-    const bb_t opp = me->o;
-    const bb_t dead = me->dead;
-    const int n = geometry->n;
-    const bb_t all = geometry->all;
-    const bb_t not_lside = all ^ geometry->lside;
-    const bb_t not_rside = all ^ geometry->rside;
+    const struct state * const state = ai->get_state(ai);
+    const int active = state->active;
+    while (state->active == active) {
+        if (me->is_pondering) {
+            test_fail("Pondering is started during own turn.");
+        }
 
-    bb_t output[256];
-    const int qmoves = get_3moves_1(my, opp, dead, n, all, not_lside, not_rside, output);
-    if (qmoves != 214) {
-        test_fail("Unexpected qmoves, actual %d, expected 214.", qmoves);
+        const int sq = ai->go(ai, NULL);
+        if (sq < 0) {
+            test_fail("ai->go fails, %s.", ai->error);
+        }
+        if (ai->do_step(ai, sq) != 0) {
+            test_fail("ai->do_step(%d) fails, %s.", sq, ai->error);
+        }
     }
 
-    destroy_state(me);
-    destroy_geometry(geometry);
-    return 0;
-}
+    if (!me->is_pondering) {
+        test_fail("Pondering is not started after own turn.");
+    }
 
-int test_get_3moves_2(void)
-{
-    struct geometry * restrict const geometry = create_std_geometry(7);
-    if (geometry == NULL) {
-        test_fail("create_std_geometry(7) failed, errno = %d.", errno);
+    /* Wait for some games instead of a fixed time, the runner limits the test. */
+    const struct node * root = me->workers[0].root;
+    while (__atomic_load_n(&root->qgames, __ATOMIC_RELAXED) < 100) {
+        usleep(1000);
     }
 
-    struct state * restrict const me = create_state(geometry);
-    if (me == NULL) {
-        test_fail("create_state(geometry) failed, errno = %d.", errno);
+    stop_ponder(me);
+    const int32_t root_qgames = root->qgames;
+    if (root_qgames <= 1) {
+        test_fail("Pondering does not search.");
     }
 
-    state_step(me, 0);
-    state_step(me, 8);
-    state_step(me, 16);
+    const struct node * expected = get_node(me->workers[0].multiallocator, root->children);
+    const int sq = get_square(expected);
+    const int32_t qgames = expected->qgames;
 
-    state_step(me, 48);
-    state_step(me, 40);
-    state_step(me, 32);
+    if (ai->do_step(ai, sq) != 0) {
+        test_fail("ai->do_step(%d) fails, %s.", sq, ai->error);
+    }
 
-    const bb_t my = me->x;
-    const bb_t opp = me->o;
-    const bb_t dead = me->dead;
-    const int n = geometry->n;
-    const bb_t all = geometry->all;
-    const bb_t not_lside = all ^ geometry->lside;
-    const bb_t not_rside = all ^ geometry->rside;
+    if (me->workers[0].root != expected) {
+        test_fail("Pondered subtree of step %d is not kept.", sq);
+    }
 
-    bb_t output[256];
-    const int qmoves = get_3moves_2(my, opp, dead, n, all, not_lside, not_rside, output);
-    if (qmoves != 28) {
-        test_fail("Unexpected qmoves, actual %d, expected 28.", qmoves);
+    if (!me->is_pondering) {
+        test_fail("Pondering is not continued during opponent turn.");
     }
 
-    destroy_state(me);
+    if (ai->go(ai, NULL) < 0) {
+        test_fail("ai->go fails, %s.", ai->error);
+    }
+
+    if (me->is_pondering || expected->qgames < qgames) {
+        test_fail("Pondering is not stopped on ai->go or pondered statistics are lost.");
+    }
+
+    ai->free(ai);
     destroy_geometry(geometry);
     return 0;
 }
 
-int test_get_3moves_3(void)
+struct stop_test_ctx
 {
-    struct geometry * restrict const geometry = create_std_geometry(7);
+    struct ai * ai;
+    int square;
+};
+
+static void * stop_test_thread(void * arg)
+{
+    struct stop_test_ctx * restrict const ctx = arg;
+    ctx->square = ctx->ai->go(ctx->ai, NULL);
+    return NULL;
+}
+
+int test_stop(void)
+{
+    struct geometry * restrict const geometry = create_std_geometry(10);
     if (geometry == NULL) {
-        test_fail("create_std_geometry(7) failed, errno = %d.", errno);
+        test_fail("create_std_geometry(10) failed, errno = %d.", errno);
     }
 
-    struct state * restrict const me = create_state(geometry);
-    if (me == NULL) {
-        test_fail("create_state(geometry) failed, errno = %d.", errno);
+    struct ai storage;
+    const int status = init_mcts_ai(&storage, geometry);
+    if (status != 0) {
+        test_fail("init_mcts_ai fails with code %d, %s.", status, strerror(status));
     }
 
-    state_step(me, 0);
-    state_step(me, 8);
-    state_step(me, 16);
+    struct ai * restrict const ai = &storage;
+    const uint32_t qthink = UINT32_MAX;
+    if (ai->set_param(ai, "qthink", &qthink) != 0) {
+        test_fail("set_param(qthink) fails, %s.", ai->error);
+    }
 
-    state_step(me, 48);
-    state_step(me, 40);
-    state_step(me, 32);
+    rnd_steps(ai, geometry, 6);
 
-    const bb_t my = me->x;
-    const bb_t opp = me->o;
-    const bb_t dead = me->dead;
-    const int n = geometry->n;
-    const bb_t all = geometry->all;
-    const bb_t not_lside = all ^ geometry->lside;
-    const bb_t not_rside = all ^ geometry->rside;
+    struct stop_test_ctx ctx = { ai, -1 };
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, stop_test_thread, &ctx) != 0) {
+        test_fail("pthread_create fails.");
+    }
 
-    bb_t output[256];
-    const int qmoves = get_3moves_3(my, opp, dead, n, all, not_lside, not_rside, output);
-    if (qmoves != 71) {
-        test_fail("Unexpected qmoves, actual %d, expected 71.", qmoves);
+    /* Wait for progress instead of a fixed time, the runner limits the test. */
+    struct ai_progress progress = { 0 };
+    while (progress.qthink < 1000) {
+        usleep(1000);
+        ai->get_progress(ai, &progress);
     }
 
-    destroy_state(me);
-    destroy_geometry(geometry);
-    return 0;
-}
+    ai->set_stop(ai, 1);
+    pthread_join(thread, NULL);
 
-int test_all_3moves(void)
-{
-    struct geometry * restrict const geometry = create_std_geometry(7);
-    if (geometry == NULL) {
-        test_fail("create_std_geometry(7) failed, errno = %d.", errno);
+    struct mcts_ai * restrict const me = ai->data;
+    if (me->search.qthink >= me->search.max_qthink) {
+        test_fail("ai->go is not stopped, qthink %u.", me->search.qthink);
     }
 
-    struct state * restrict const me = create_state(geometry);
-    if (me == NULL) {
-        test_fail("create_state(geometry) failed, errno = %d.", errno);
+    const struct state * const state = ai->get_state(ai);
+    if (ctx.square < 0 || (state->next & BB_SQUARE(ctx.square)) == 0) {
+        test_fail("Invalid step %d is returned after stop.", ctx.square);
     }
 
-    state_step(me, 0);
-    state_step(me, 8);
-    state_step(me, 16);
+    /* The flag is kept until it is cleared. */
+    const uint32_t small_qthink = 1000;
+    if (ai->go(ai, NULL) < 0) {
+        test_fail("ai->go fails, %s.", ai->error);
+    }
+    if (me->search.qthink >= small_qthink) {
+        test_fail("ai->go searches when the stop flag is set, qthink %u.", me->search.qthink);
+    }
 
-    state_step(me, 48);
-    state_step(me, 40);
-    state_step(me, 32);
+    if (ai->set_param(ai, "qthink", &small_qthink) != 0) {
+        test_fail("set_param(qthink) fails, %s.", ai->error);
+    }
 
-    const bb_t my = me->x;
-    const bb_t opp = me->o;
-    const bb_t dead = me->dead;
-    const int n = geometry->n;
-    const bb_t all = geometry->all;
-    const bb_t not_lside = all ^ geometry->lside;
-    const bb_t not_rside = all ^ geometry->rside;
+    ai->set_stop(ai, 0);
+    if (ai->go(ai, NULL) < 0) {
+        test_fail("ai->go fails, %s.", ai->error);
+    }
 
-    bb_t output0[256];
-    bb_t output1[256];
-    bb_t output2[256];
-    bb_t output3[256];
-    const int qmoves0 = get_3moves_0(my, opp, dead, n, all, not_lside, not_rside, output0);
-    const int qmoves1 = get_3moves_1(my, opp, dead, n, all, not_lside, not_rside, output1);
-    const int qmoves2 = get_3moves_2(my, opp, dead, n, all, not_lside, not_rside, output2);
-    const int qmoves3 = get_3moves_3(my, opp, dead, n, all, not_lside, not_rside, output3);
-    const int total_qmoves = qmoves0 + qmoves1 + qmoves2 + qmoves3;
+    if (me->search.qthink < small_qthink) {
+        test_fail("ai->go does not search after the stop flag is cleared.");
+    }
 
-    int full_qscans = 0;
-    bb_t full_scan[4096];
-    bb_t steps1 = state_get_steps(me);
-    while (steps1 != 0) {
-        bb_t bb = steps1 & (-steps1);
-        steps1 ^= bb;
-        const int step1 = first_one(bb);
-        state_step(me, step1);
+    ai->free(ai);
+    destroy_geometry(geometry);
+    return 0;
+}
 
-        bb_t steps2 = state_get_steps(me);
-        while (steps2 != 0) {
-            bb_t bb = steps2 & (-steps2);
-            steps2 ^= bb;
-            const int step2 = first_one(bb);
+int test_progress(void)
+{
+    struct geometry * restrict const geometry = create_std_geometry(10);
+    if (geometry == NULL) {
+        test_fail("create_std_geometry(10) failed, errno = %d.", errno);
+    }
+
+    static const char * const tree_modes[] = { "step", "turn" };
+    for (int mode=0; mode<2; ++mode) {
+        struct ai storage;
+        const int status = init_mcts_ai(&storage, geometry);
+        if (status != 0) {
+            test_fail("init_mcts_ai fails with code %d, %s.", status, strerror(status));
+        }
+
+        struct ai * restrict const ai = &storage;
+        const uint32_t qthink = UINT32_MAX;
+        const uint32_t threads = 2;
+        if (ai->set_param(ai, "qthink", &qthink) != 0) {
+            test_fail("set_param(qthink) fails, %s.", ai->error);
+        }
+        if (ai->set_param(ai, "threads", &threads) != 0) {
+            test_fail("set_param(threads) fails, %s.", ai->error);
+        }
+        if (ai->set_param(ai, "tree_mode", tree_modes[mode]) != 0) {
+            test_fail("set_param(tree_mode, %s) fails, %s.", tree_modes[mode], ai->error);
+        }
+
+        rnd_steps(ai, geometry, 6);
 
-            state_step(me, step2);
-            bb_t steps3 = state_get_steps(me);
-            while (steps3 != 0) {
-                bb_t bb = steps3 & (-steps3);
-                steps3 ^= bb;
-                const int step3 = first_one(bb);
-                full_scan[full_qscans++] = BB_SQUARE(step1) | BB_SQUARE(step2) | BB_SQUARE(step3);
+        struct ai_progress progress;
+        ai->get_progress(ai, &progress);
+        if (progress.qplayouts != 0 || progress.qpv != 0) {
+            test_fail("Progress is reported without a search in %s mode.", tree_modes[mode]);
+        }
+
+        struct stop_test_ctx ctx = { ai, -1 };
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, stop_test_thread, &ctx) != 0) {
+            test_fail("pthread_create fails.");
+        }
+
+        for (int i=0; i<2000; ++i) {
+            usleep(1000);
+            ai->get_progress(ai, &progress);
+            if (progress.qpv >= 3 && progress.qplayouts >= 100) {
+                break;
             }
-            state_unstep(me, step2);
         }
 
-        state_unstep(me, step1);
-    }
+        ai->set_stop(ai, 1);
+        pthread_join(thread, NULL);
 
-    qsort(full_scan, full_qscans, sizeof(bb_t), cmp_bb);
+        if (progress.qpv < 3 || progress.qplayouts < 100) {
+            test_fail("Progress is not updated in %s mode, qpv = %u, qplayouts = %lu.",
+                tree_modes[mode], progress.qpv, (unsigned long)progress.qplayouts);
+        }
 
-    bb_t unique_moves[4096];
-    int unique_qmoves = 1;
-    unique_moves[0] = full_scan[0];
-    for (int i=1; i<full_qscans; ++i) {
-        if (full_scan[i-1] != full_scan[i]) {
-            unique_moves[unique_qmoves++] = full_scan[i];
+        if (progress.memory == 0 || progress.qthink < progress.qplayouts) {
+            test_fail("Invalid memory or qthink progress in %s mode.", tree_modes[mode]);
         }
-    }
 
-    int bad = 0;
-    for (int i=0; i<unique_qmoves; ++i) {
-        const bb_t bb = unique_moves[i];
-        int output_check = 0;
-        for (int j=0; j<qmoves0; ++j) { output_check += bb == output0[j]; }
-        for (int j=0; j<qmoves1; ++j) { output_check += bb == output1[j]; }
-        for (int j=0; j<qmoves2; ++j) { output_check += bb == output2[j]; }
-        for (int j=0; j<qmoves3; ++j) { output_check += bb == output3[j]; }
-        if (output_check != 1) {
-            printf("0x%lx - %d\n", (uint64_t)bb, output_check);
-            ++bad;
+        if (progress.score < 0.0 || progress.score > 1.0) {
+            test_fail("Invalid progress score %f in %s mode.", progress.score, tree_modes[mode]);
         }
-    }
 
-    if (bad) {
-        test_fail("Some bad output checks.");
-    }
+        const struct state * const state = ai->get_state(ai);
+        if (mode == 0 && (state->next & BB_SQUARE(progress.pv[0])) == 0) {
+            test_fail("First PV step %d is not possible.", progress.pv[0]);
+        }
 
-    if (unique_qmoves != total_qmoves) {
-        test_fail("unique_qmoves (%d) and total_qmoves (%d) mismatch.", unique_qmoves, total_qmoves);
+        ai->get_progress(ai, &progress);
+        if (progress.qpv != 0) {
+            test_fail("Progress is reported after the search in %s mode.", tree_modes[mode]);
+        }
+
+        ai->free(ai);
     }
 
-    destroy_state(me);
     destroy_geometry(geometry);
     return 0;
 }
 
-#define N 10
-#define QSQUARES (N*N)
-
-int test_nn(void)
+int test_turn_mode(void)
 {
-    static const int expected[QSQUARES] = {
-        301, 649, 477, 518, 454, 424, 411, 618, 637, 559, 435,
-        506, 546, 783, 327, 648, 466, 445, 374, 283, 636, 503,
-        496, 576, 535, 545, 515, 476, 416, 700, 343, 572, 571,
-        531, 578, 545, 548, 454, 571, 604, 697, 508, 535, 392,
-        429, 563, 506, 562, 461, 435, 383, 647, 578, 475, 597,
-        459, 387, 529, 331, 569, 302, 400, 465, 488, 518, 518,
-        510, 580, 644, 347, 532, 535, 458, 398, 371, 532, 516,
-        583, 310, 594, 473, 561, 439, 563, 333, 322, 622, 564,
-        620, 558, 549, 500, 376, 576, 533, 413, 437, 586, 337,
-        306   /* Calculated in ipython with using keras */
-   };
+    struct geometry * restrict const geometry = create_std_geometry(10);
+    if (geometry == NULL) {
+        test_fail("create_std_geometry(10) failed, errno = %d.", errno);
+    }
 
-    const char * nn_path = "nn.txt";
-    FILE * f = fopen(nn_path, "r");
-    if (f == NULL) {
-        test_fail("Cannot open “%s” file, errno is %d, %s\n", nn_path, errno, strerror(errno));
+    struct ai storage;
+    const int status = init_mcts_ai(&storage, geometry);
+    if (status != 0) {
+        test_fail("init_mcts_ai fails with code %d, %s.", status, strerror(status));
     }
 
-    char error_msg[4096];
-    struct nn * restrict const me = load_text_nn(f, error_msg, 4095);
-    fclose(f);
+    struct ai * restrict const ai = &storage;
+    struct mcts_ai * restrict const me = ai->data;
+    const uint32_t threads = 2;
+    const uint32_t qthink = 3000;
+    if (ai->set_param(ai, "threads", &threads) != 0) {
+        test_fail("set_param(threads) fails, %s.", ai->error);
+    }
+    if (ai->set_param(ai, "qthink", &qthink) != 0) {
+        test_fail("set_param(qthink) fails, %s.", ai->error);
+    }
 
-    if (me == NULL) {
-        test_fail("load_text_nn failed, %.4095s\n", error_msg);
+    if (ai->set_param(ai, "tree_mode", "half") == 0) {
+        test_fail("set_param(tree_mode, half) is expected to fail.");
+    }
+    if (ai->set_param(ai, "tree_mode", "turn") != 0) {
+        test_fail("set_param(tree_mode, turn) fails, %s.", ai->error);
     }
 
-    int weights[QSQUARES];
-    get_nn_weights(me, 0, 0, N, 0, 0, 0, weights);
+    rnd_steps(ai, geometry, 6);
+    const struct state * const state = ai->get_state(ai);
+    const bb_t x = state->x;
+    const bb_t o = state->o;
+    const bb_t dead = state->dead;
 
-    if (memcmp(weights, expected, sizeof(weights) != 0)) {
-        for (int i=0; i<QSQUARES; ++i) {
-            printf("%4d | %5d %5d\n", i, weights[i], expected[i]);
+    bb_t move = 0;
+    for (int i=0; i<3; ++i) {
+        const bb_t steps = state_get_steps(&ai->state);
+        struct ai_explanation explanation;
+        const int sq = ai->go(ai, &explanation);
+        if (sq < 0) {
+            test_fail("ai->go fails on %d-th step of the turn, %s.", i+1, ai->error);
         }
-        test_fail("Invalid calculation!\n");
-    }
 
-    destroy_nn(me);
-   return 0;
-}
+        if ((steps & BB_SQUARE(sq)) == 0) {
+            test_fail("ai->go returns invalid step %d.", sq);
+        }
 
-void check_nn_rollout(
-    const struct nn * const nn,
-    const int auto_steps,
-    struct geometry * restrict const geometry)
-{
-    const int n = geometry->n;
+        if (explanation.stats[0].square != sq) {
+            test_fail("Best step %d does not match explanation step %d.", sq, explanation.stats[0].square);
+        }
 
-    struct state * restrict const me = create_state(geometry);
-    if (me == NULL) {
-        test_fail("create_state(geometry) failed, errno = %d.", errno);
-    }
+        if (i == 0) {
+            move = me->plan.move;
+            if (!me->plan.is_valid || pop_count(move) != 3) {
+                test_fail("Turn search does not produce a planned turn.");
+            }
+        }
 
-    for (int i=0; i<auto_steps; ++i) {
-        bb_t steps = state_get_steps(me);
-        if (steps == 0) {
-            test_fail("cannot perform auto steps, state_get_steps(me) returns 0.");
+        if (!me->plan.is_valid || me->plan.move != move || (move & BB_SQUARE(sq)) == 0) {
+            test_fail("Step %d on %d-th step of the turn does not follow the plan.", sq, i+1);
         }
 
-        const int qsteps = pop_count(steps);
-        const int sq = nth_one_index(steps, rand() % qsteps);
-        const int status = state_step(me, sq);
-        if (status != 0) {
-            test_fail("state_step(me, %d) fails with code %d, %s.", sq, status, strerror(status));
+        if (ai->do_step(ai, sq) != 0) {
+            test_fail("ai->do_step(%d) fails, %s.", sq, ai->error);
         }
     }
 
-    struct nn_rollout_ctx ctx_storage;
-    struct nn_rollout_ctx * restrict const ctx = &ctx_storage;
-    ctx->x = me->x;
-    ctx->o = me->o;
-    ctx->dead = me->dead;
-    ctx->n = n;
-    ctx->all = geometry->all;
-    ctx->not_lside = ctx->all ^ geometry->lside;
-    ctx->not_rside = ctx->all ^ geometry->rside;
-    ctx->nn = nn;
+    const bb_t played = (state->x ^ x) | (state->o ^ o) | (state->dead ^ dead);
+    if (played != move) {
+        test_fail("Played steps do not match the planned turn.");
+    }
 
-    int weights_buf[8*sizeof(bb_t)];
-    ctx->weights = weights_buf;
+    if (ai->go(ai, NULL) < 0) {
+        test_fail("ai->go fails for the opponent turn, %s.", ai->error);
+    }
 
-    uint32_t qthink = 0;
-    int debug_log[2*n*n];
-    const int result = nn_rollout(ctx, &qthink, debug_log);
+    ai->free(ai);
+    destroy_geometry(geometry);
+    return 0;
+}
 
-    if (result != +ONE_GAME_COST && result != -ONE_GAME_COST) {
-        test_fail("rollout returns strange result %d", result);
+/* MCTS with X against the random AI with O on a wide board through ai interface. */
+static void check_wide_game(const int n)
+{
+    struct geometry * restrict const geometry = create_geometry(n);
+    if (geometry == NULL || geometry->wide == NULL) {
+        test_fail("create_geometry(%d) does not give a wide geometry, errno = %d.", n, errno);
     }
 
-    if (qthink-- == 0) {
-        test_fail("Unexpected zero qthink after rollout call.");
+    struct ai storages[2];
+    struct ai * restrict const mcts = storages + 0;
+    struct ai * restrict const rnd = storages + 1;
+    int status = init_mcts_ai(mcts, geometry);
+    if (status != 0) {
+        test_fail("init_mcts_ai fails with code %d, %s.", status, strerror(status));
     }
 
+    status = init_random_ai(rnd, geometry);
+    if (status != 0) {
+        test_fail("init_random_ai fails with code %d, %s.", status, strerror(status));
+    }
 
-    /* Tricky!!! Round qthink to avoid last nonvalid moves at the end. */
-    /* rollout may play one or two steps before realizing that there is no moves */
-    qthink = (3*((qthink+auto_steps)/3)) - auto_steps;
+    /* The turn tree and NN are not used on wide boards. */
+    const uint32_t threads = 2;
+    const uint32_t qthink = 3000;
+    if (mcts->set_param(mcts, "threads", &threads) != 0) {
+        test_fail("set_param(threads) fails, %s.", mcts->error);
+    }
+    if (mcts->set_param(mcts, "qthink", &qthink) != 0) {
+        test_fail("set_param(qthink) fails, %s.", mcts->error);
+    }
+    if (mcts->set_param(mcts, "tree_mode", "turn") != 0) {
+        test_fail("set_param(tree_mode, turn) fails, %s.", mcts->error);
+    }
 
-    for (int i=0; i<qthink; ++i) {
-        if (state_status(me) != 0) {
-            test_fail("Unexpected state status %d during applying rollout history.", state_status(me));
+    int qsteps = 0;
+    const struct state * const state = mcts->get_state(mcts);
+    while (state_status(state) == 0) {
+        struct ai * restrict const ai = state->active == ACTIVE_X ? mcts : rnd;
+        struct ai_explanation explanation;
+        const int sq = ai->go(ai, &explanation);
+        if (sq < 0) {
+            test_fail("ai->go fails on %d-th step, n = %d, %s.", qsteps + 1, n, ai->error);
         }
-        const int sq = debug_log[i];
-        const int status = state_step(me, sq);
-        if (status != 0) {
-            test_fail("state_step(%d) failed with code %d, %s.", sq, status, strerror(status));
+
+        if (!state_is_next(state, sq)) {
+            test_fail("ai->go returns invalid step %d, n = %d.", sq, n);
         }
-    }
 
-    if (state_status(me) == 0) {
-        test_fail("Unexpected state status %d after applying rollout history.", state_status(me));
-    }
+        if (ai == mcts && explanation.qstats > 0 && explanation.stats[0].square != sq) {
+            test_fail("Best step %d does not match explanation step %d.", sq, explanation.stats[0].square);
+        }
 
-    destroy_state(me);
-}
+        for (int i=0; i<2; ++i) {
+            if (storages[i].do_step(storages + i, sq) != 0) {
+                test_fail("ai->do_step(%d) fails, %s.", sq, storages[i].error);
+            }
+        }
 
-int test_nn_rollout(void)
-{
-    const char * nn_path = "nn.txt";
-    FILE * f = fopen(nn_path, "r");
-    if (f == NULL) {
-        test_fail("Cannot open “%s” file, errno is %d, %s\n", nn_path, errno, strerror(errno));
+        ++qsteps;
     }
 
-    char error_msg[4096];
-    struct nn * restrict const nn = load_text_nn(f, error_msg, 4095);
-    fclose(f);
+    const struct state * const rnd_state = rnd->get_state(rnd);
+    if (state_status(rnd_state) != state_status(state) || qsteps != state_qstones(state) + state_qdead(state)) {
+        test_fail("States of AIs differ after the game, n = %d.", n);
+    }
 
-    if (nn == NULL) {
-        test_fail("load_text_nn failed, %.4095s\n", error_msg);
+    if (qsteps < 12) {
+        test_fail("Too short game on %dx%d board.", n, n);
     }
 
-    struct geometry * restrict const geometry = create_std_geometry(10);
-    if (geometry == NULL) {
-        test_fail("create_std_geometry(10) failed, errno = %d.", errno);
+    if (mcts->undo_steps(mcts, 5) != 0 || state_status(state) != 0 || state_qnext(state) == 0) {
+        test_fail("Undo does not continue the game, n = %d, %s.", n, mcts->error);
     }
 
-    check_nn_rollout(nn, 0, geometry);
-    check_nn_rollout(nn, 2, geometry);
-    check_nn_rollout(nn, 3, geometry);
-    check_nn_rollout(nn, 4, geometry);
-    check_nn_rollout(nn, 5, geometry);
-    check_nn_rollout(nn, 15, geometry);
+    if (mcts->go(mcts, NULL) < 0) {
+        test_fail("ai->go fails after undo, %s.", mcts->error);
+    }
 
+    for (int i=0; i<2; ++i) {
+        storages[i].free(storages + i);
+    }
     destroy_geometry(geometry);
-    destroy_nn(nn);
-    return 0;
 }
 
-void check_nn_simulate(
-    const struct geometry * const geometry,
-    struct mcts_ai * restrict const me,
-    const struct state * const state,
-    const int qruns)
+/* The random AI plays both sides, then the game is undone and replayed. */
+static void check_wide_random_game(const int n)
 {
-    multiallocator_reset(me->multiallocator);
-
-    const size_t inode = multiallocator_alloc(me->multiallocator, 0);
-    if (inode == BAD_ALLOC_INDEX) {
-        test_fail("multiallocator->alloc(0) failed.");
+    struct geometry * restrict const geometry = create_geometry(n);
+    if (geometry == NULL || geometry->wide == NULL) {
+        test_fail("create_geometry(%d) does not give a wide geometry, errno = %d.", n, errno);
     }
 
-    struct node * restrict const node = get_node(me, inode);
-    node->square = -1;
-    node->qchildren = 0;
-    node->score = 0;
-    node->qgames = 0;
-    node->children = 0;
-
-    uint32_t qthink = 0;
-    const bb_t x = state->x;
-    const bb_t o = state->o;
-    const bb_t dead = state->dead;
-
-    const int n = geometry->n;
-    const bb_t all = geometry->all;
-    const bb_t not_lside = all ^ geometry->lside;
-    const bb_t not_rside = all ^ geometry->rside;
+    struct ai storage;
+    struct ai * restrict const ai = &storage;
+    const int status = init_random_ai(ai, geometry);
+    if (status != 0) {
+        test_fail("init_random_ai fails with code %d, %s.", status, strerror(status));
+    }
 
-    for (int i=0; i<qruns; ++i) {
-        uint32_t saved_qthink = qthink;
-        const int status = nn_simulate(me, node, &qthink, x, o, dead, n, all, not_lside, not_rside);
-        if (status != 0) {
-            test_fail("Unexpected status %d returned from %d-th nn_simulate(...), %s.", status, i, strerror(status));
+    int qsteps = 0;
+    int steps[2*n*n];
+    const struct state * const state = ai->get_state(ai);
+    while (state_status(state) == 0) {
+        const int sq = ai->go(ai, NULL);
+        if (sq < 0 || !state_is_next(state, sq)) {
+            test_fail("ai->go returns invalid step %d on %d-th step, n = %d.", sq, qsteps + 1, n);
         }
-        if (qthink == saved_qthink) {
-            test_fail("qthink might be increased after %d-th NN simulation.", i);
+
+        if (ai->do_step(ai, sq) != 0) {
+            test_fail("ai->do_step(%d) fails, %s.", sq, ai->error);
         }
+        steps[qsteps++] = sq;
     }
-}
 
-int test_nn_simulate(void)
-{
-    struct geometry * restrict const geometry = create_std_geometry(10);
-    if (geometry == NULL) {
-        test_fail("create_std_geometry(10) failed, errno = %d.", errno);
+    const int winner = state_status(state);
+    if (ai->undo_steps(ai, qsteps) != 0) {
+        test_fail("ai->undo_steps(%d) fails, %s.", qsteps, ai->error);
     }
 
-    struct ai storage;
-    const int status = init_mcts_ai(&storage, geometry);
-    if (status != 0) {
-        test_fail("init_mcts_ai fails with code %d, %s.", status, strerror(status));
+    if (state->active != ACTIVE_X || state_qstones(state) != 0 || state_status(state) != 0) {
+        test_fail("Undo of the whole game does not give an empty board, n = %d.", n);
     }
 
-    struct ai * restrict const ai = &storage;
-    struct mcts_ai * restrict const me = ai->data;
+    for (int i=0; i<qsteps; ++i) {
+        if (ai->do_step(ai, steps[i]) != 0) {
+            test_fail("ai->do_step(%d) fails on replay, %s.", steps[i], ai->error);
+        }
+    }
 
-    const struct state * const state = ai->get_state(ai);
-    check_nn_simulate(geometry, me, state, 2);
+    if (state_status(state) != winner) {
+        test_fail("Replayed game ends with %d, %d is expected.", state_status(state), winner);
+    }
 
     ai->free(ai);
     destroy_geometry(geometry);
+}
+
+int test_wide_game(void)
+{
+    if (create_geometry(MAX_WIDE_N + 1) != NULL) {
+        test_fail("create_geometry(%d) is expected to fail.", MAX_WIDE_N + 1);
+    }
+
+    check_wide_random_game(MAX_WIDE_N);
+    check_wide_game(12);
+    check_wide_game(MAX_WIDE_N);
     return 0;
 }
 
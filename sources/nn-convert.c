@@ -0,0 +1,42 @@
+#include "virus-war.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define MAX_ERROR_MSG_LEN  1024
+
+static void usage(const char * const name)
+{
+    printf("Usage: %s input output\n", name);
+    printf("Convert NN weights from text (or binary) format to binary one.\n");
+}
+
+int main(int argc, char * argv[])
+{
+    if (argc != 3) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const char * const input = argv[1];
+    const char * const output = argv[2];
+
+    char error_buf[MAX_ERROR_MSG_LEN];
+    error_buf[0] = '\0';
+
+    struct nn * restrict const nn = load_nn(input, error_buf, MAX_ERROR_MSG_LEN-1);
+    if (nn == NULL) {
+        fprintf(stderr, "Cannot load NN from “%s”: %s\n", input, error_buf[0] ? error_buf : strerror(errno));
+        return 1;
+    }
+
+    const int status = save_binary_nn(nn, output, error_buf, MAX_ERROR_MSG_LEN-1);
+    destroy_nn(nn);
+
+    if (status != 0) {
+        fprintf(stderr, "%s\n", error_buf);
+        return 1;
+    }
+
+    return 0;
+}
@@ -2,6 +2,8 @@
 
 #include <string.h>
 
+static const uint32_t def_seed = 1;
+
 struct random_ai
 {
     void * static_data;
@@ -10,6 +12,10 @@ struct random_ai
     int n;
     int * history;
     size_t qhistory;
+
+    uint32_t rng_seed;
+    struct rng rng;
+    struct ai_param params[2];
 };
 
 static int reset_dynamic(
@@ -148,8 +154,8 @@ static int random_ai_go(
 	struct ai_explanation * restrict const explanation)
 {
     const struct state * const state = &ai->state;
-    bb_t steps = state_get_steps(state);
-    if (steps == 0) {
+    const int qsteps = state_qnext(state);
+    if (qsteps == 0) {
         ai->error = "No moves";
         errno = EINVAL;
         return -1;
@@ -162,19 +168,34 @@ static int random_ai_go(
         explanation->score = 0.5;
     }
 
-    const int qsteps = pop_count(steps);
     if (qsteps == 1) {
-        return first_one(steps);
+        return state_nth_next(state, 0);
     }
 
-    const int choice = rand() % qsteps;
-    return nth_one_index(steps, choice);
+    struct random_ai * restrict const me = ai->data;
+    const int choice = rng_uniform(&me->rng, qsteps);
+    return state_nth_next(state, choice);
+}
+
+static void random_ai_set_stop(struct ai * restrict const ai, const int is_stop)
+{
+}
+
+static void random_ai_get_progress(
+    const struct ai * const ai,
+    struct ai_progress * restrict const progress)
+{
+    progress->qthink = 0;
+    progress->qplayouts = 0;
+    progress->memory = 0;
+    progress->score = -1.0;
+    progress->qpv = 0;
 }
 
 static const struct ai_param * random_ai_get_params(const struct ai * const ai)
 {
-	static const struct ai_param terminator = { NULL, NULL, NO_TYPE, 0 };
-	return &terminator;
+    const struct random_ai * const me = ai->data;
+    return me->params;
 }
 
 static int random_ai_set_param(
@@ -182,8 +203,16 @@ static int random_ai_set_param(
 	const char * const name,
 	const void * const value)
 {
-	ai->error = "Unknown parameter name.";
-	return EINVAL;
+    if (strcasecmp(name, "rng_seed") != 0) {
+        ai->error = "Unknown parameter name.";
+        return EINVAL;
+    }
+
+    struct random_ai * restrict const me = ai->data;
+    me->rng_seed = *(const uint32_t *)value;
+    rng_seed(&me->rng, me->rng_seed, 0);
+    ai->error = NULL;
+    return 0;
 }
 
 static void free_random_ai(struct ai * restrict const ai)
@@ -218,6 +247,10 @@ int init_random_ai(
     }
 
     ai->data = me;
+    me->params[0] = (struct ai_param){ "rng_seed", &me->rng_seed, U32, offsetof(struct random_ai, rng_seed) };
+    me->params[1] = (struct ai_param){ NULL, NULL, NO_TYPE, 0 };
+    me->rng_seed = def_seed;
+    rng_seed(&me->rng, me->rng_seed, 0);
 
     ai->reset = random_ai_reset;
     ai->do_step = random_ai_do_step;
@@ -225,6 +258,8 @@ int init_random_ai(
     ai->undo_step = random_ai_undo_step;
     ai->undo_steps = random_ai_undo_steps;
     ai->go = random_ai_go;
+    ai->set_stop = random_ai_set_stop;
+    ai->get_progress = random_ai_get_progress;
     ai->get_params = random_ai_get_params;
     ai->set_param = random_ai_set_param;
     ai->get_state = ai_get_state;
@@ -1,6 +1,14 @@
 #include "virus-war.h"
 
 #include <string.h>
+#include <sys/mman.h>
+
+#define PAGE_SZ        4096
+#define HUGE_PAGE_SZ  (2 * 1024 * 1024)
+#define QCHUNKS_IN_BLOCK  16
+
+/* Epochs are unique among all multiallocators, so a cursor never matches a new one. */
+static size_t last_epoch;
 
 static inline ptrdiff_t ptr_diff(const void * const a, const void * const b)
 {
@@ -52,6 +60,7 @@ void multiallocator_reset(
     struct multiallocator * restrict const me)
 {
     me->used_blocks = 0;
+    me->epoch = __atomic_add_fetch(&last_epoch, 1, __ATOMIC_RELAXED);
     const size_t pointers_sz = me->max_blocks * sizeof(void *);
     for (unsigned int i=0; i<me->qtypes; ++i) {
         struct multiallocator_type * restrict const type = me->types + i;
@@ -87,6 +96,10 @@ struct multiallocator * create_multiallocator(
     }
 
     void * data = multialloc(n, sizes, ptrs, 64);
+    if (data == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
 
     index = 0;
     struct multiallocator * me = ptrs[index++];
@@ -98,6 +111,7 @@ struct multiallocator * create_multiallocator(
         type->pointers = ptrs[index++];
         type->sz = type_sizes[i];
         type->qitems = block_sz / type->sz;
+        type->chunk = type->qitems >= QCHUNKS_IN_BLOCK ? type->qitems / QCHUNKS_IN_BLOCK : 1;
     }
 
     me->data = data;
@@ -107,6 +121,16 @@ struct multiallocator * create_multiallocator(
     me->block_sz = block_sz;
     me->qtypes = qtypes;
     me->types = types;
+    me->arena = NULL;
+    me->arena_sz = 0;
+    me->backend = ARENA_MALLOC;
+
+    const int status = pthread_mutex_init(&me->lock, NULL);
+    if (status != 0) {
+        free(data);
+        errno = status;
+        return NULL;
+    }
 
     multiallocator_reset(me);
 
@@ -116,17 +140,98 @@ struct multiallocator * create_multiallocator(
 void destroy_multiallocator(
     struct multiallocator * restrict const me)
 {
-    const size_t max_blocks = me->max_blocks;
-    for (size_t i=0; i<max_blocks; ++i) {
-        void * const ptr = me->blocks[i];
-        if (ptr != NULL) {
-            free(ptr);
+    if (me->arena != NULL) {
+        munmap(me->arena, me->arena_sz);
+    } else {
+        const size_t max_blocks = me->max_blocks;
+        for (size_t i=0; i<max_blocks; ++i) {
+            void * const ptr = me->blocks[i];
+            if (ptr != NULL) {
+                free(ptr);
+            }
         }
     }
 
+    pthread_mutex_destroy(&me->lock);
     free(me->data);
 }
 
+static char * map_aligned(const size_t sz, const size_t align)
+{
+    const size_t reserve_sz = sz + align;
+    char * const ptr = mmap(NULL, reserve_sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return NULL;
+    }
+
+    const ptrdiff_t address = ptr_diff(NULL, ptr);
+    const size_t mod = address % align;
+    const size_t head = mod == 0 ? 0 : align - mod;
+    if (head > 0) {
+        munmap(ptr, head);
+    }
+
+    munmap(ptr + head + sz, align - head);
+    return ptr + head;
+}
+
+int multiallocator_map_arena(
+    struct multiallocator * restrict const me,
+    const int backend,
+    const int is_prefault)
+{
+    if (me->arena != NULL || me->used_blocks != 0) {
+        return EBUSY;
+    }
+
+    if (backend == ARENA_MALLOC) {
+        return 0;
+    }
+
+    const size_t need_sz = me->max_blocks * me->block_sz;
+    const size_t sz = (need_sz + HUGE_PAGE_SZ - 1) / HUGE_PAGE_SZ * HUGE_PAGE_SZ;
+
+    char * arena = NULL;
+    int active = ARENA_MMAP;
+
+#ifdef MAP_HUGETLB
+    if (backend >= ARENA_HUGETLB) {
+        /* Fails at once if the pool of huge pages is not large enough. */
+        void * const ptr = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (ptr != MAP_FAILED) {
+            arena = ptr;
+            active = ARENA_HUGETLB;
+        }
+    }
+#endif
+
+    if (arena == NULL) {
+        arena = map_aligned(sz, HUGE_PAGE_SZ);
+        if (arena == NULL) {
+            return errno;
+        }
+
+#ifdef MADV_HUGEPAGE
+        if (backend >= ARENA_THP && madvise(arena, sz, MADV_HUGEPAGE) == 0) {
+            active = ARENA_THP;
+        }
+#endif
+    }
+
+    if (is_prefault) {
+        volatile char * const ptr = arena;
+        for (size_t offset = 0; offset < sz; offset += PAGE_SZ) {
+            ptr[offset] = 0;
+        }
+    }
+
+    me->arena = arena;
+    me->arena_sz = sz;
+    me->backend = active;
+    return 0;
+}
+
 static void * get_block(
     struct multiallocator * restrict const me,
     size_t index)
@@ -139,6 +244,11 @@ static void * get_block(
         return me->blocks[index];
     }
 
+    if (me->arena != NULL) {
+        me->blocks[index] = me->arena + index * me->block_sz;
+        return me->blocks[index];
+    }
+
     void * ptr = malloc(me->block_sz);
     if (ptr == NULL) {
         return NULL;
@@ -204,6 +314,129 @@ size_t multiallocator_allocn(
     return result;
 }
 
+static int install_block_mt(
+    struct multiallocator * restrict const me,
+    struct multiallocator_type * restrict const type,
+    const size_t iblock)
+{
+    pthread_mutex_lock(&me->lock);
+
+    int status = 0;
+    if (type->pointers[iblock] == NULL) {
+        void * ptr = get_block(me, me->used_blocks);
+        if (ptr != NULL) {
+            ++me->used_blocks;
+            __atomic_store_n(type->pointers + iblock, ptr, __ATOMIC_RELEASE);
+        } else {
+            status = ENOMEM;
+        }
+    }
+
+    pthread_mutex_unlock(&me->lock);
+    return status;
+}
+
+size_t multiallocator_allocn_mt(
+    struct multiallocator * restrict const me,
+    const int itype,
+    size_t n)
+{
+    struct multiallocator_type * restrict const type = me->types + itype;
+    if (n > type->qitems) {
+        return BAD_ALLOC_INDEX;
+    }
+
+    size_t counter = __atomic_load_n(&type->counter, __ATOMIC_RELAXED);
+    size_t result;
+    size_t iblock;
+    for (;;) {
+        result = counter;
+        const size_t last = result + n - 1;
+        iblock = last / type->qitems;
+        if (result / type->qitems != iblock) {
+            result = iblock * type->qitems;
+        }
+
+        const int ok = __atomic_compare_exchange_n(&type->counter, &counter, result + n,
+            1, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        if (ok) {
+            break;
+        }
+    }
+
+    if (iblock >= me->max_blocks) {
+        return BAD_ALLOC_INDEX;
+    }
+
+    if (__atomic_load_n(type->pointers + iblock, __ATOMIC_ACQUIRE) != NULL) {
+        return result;
+    }
+
+    const int status = install_block_mt(me, type, iblock);
+    return status == 0 ? result : BAD_ALLOC_INDEX;
+}
+
+size_t multiallocator_allocn_chunk(
+    struct multiallocator * restrict const me,
+    struct multiallocator_cursor * restrict const cursor,
+    const int itype,
+    size_t n)
+{
+    const struct multiallocator_type * const type = me->types + itype;
+    const size_t chunk = type->chunk > n ? type->chunk : n;
+    size_t result = multiallocator_allocn_mt(me, itype, chunk);
+    size_t end = result + chunk;
+    if (result == BAD_ALLOC_INDEX && chunk > n) {
+        /* The last block may still have place for n items. */
+        result = multiallocator_allocn_mt(me, itype, n);
+        end = result + n;
+    }
+
+    if (result == BAD_ALLOC_INDEX) {
+        return BAD_ALLOC_INDEX;
+    }
+
+    cursor->epoch = me->epoch;
+    cursor->next = result + n;
+    cursor->end = end;
+    return result;
+}
+
+
+
+
+void rng_seed(
+    struct rng * restrict const me,
+    const uint64_t seed,
+    const unsigned int stream)
+{
+    static const uint64_t jump[4] = {
+        0x180EC6D33CFD0ABAull, 0xD5A61266F0C9392Cull,
+        0xA9582618E03FC9AAull, 0x39ABDC4529B1661Cull
+    };
+
+    uint64_t state = seed;
+    for (int i=0; i<4; ++i) {
+        me->s[i] = splitmix64(&state);
+    }
+
+    for (unsigned int istream=0; istream<stream; ++istream) {
+        uint64_t s[4] = { 0, 0, 0, 0 };
+        for (int i=0; i<4; ++i) {
+            for (int bit=0; bit<64; ++bit) {
+                if (jump[i] & ((uint64_t)1 << bit)) {
+                    s[0] ^= me->s[0];
+                    s[1] ^= me->s[1];
+                    s[2] ^= me->s[2];
+                    s[3] ^= me->s[3];
+                }
+                rng_next(me);
+            }
+        }
+        memcpy(me->s, s, sizeof(s));
+    }
+}
+
 
 
 #ifdef MAKE_CHECK
@@ -593,4 +826,303 @@ int test_allocn(void)
     return 0;
 }
 
+#define QCURSOR_THREADS  4
+
+struct cursor_test_ctx
+{
+    struct multiallocator * multiallocator;
+    uint32_t id;
+    size_t qallocated;
+};
+
+static void * cursor_test_thread(void * arg)
+{
+    struct cursor_test_ctx * restrict const ctx = arg;
+    struct multiallocator_cursor cursor = { 0, 0, 0 };
+    for (;;) {
+        const size_t n = rand() % 11 + 1;
+        const size_t index = multiallocator_allocn_local(ctx->multiallocator, &cursor, 0, n);
+        if (index == BAD_ALLOC_INDEX) {
+            break;
+        }
+
+        for (size_t i=0; i<n; ++i) {
+            uint32_t * restrict const ptr = multiallocator_get(ctx->multiallocator, 0, index + i);
+            *ptr = ctx->id;
+        }
+        ctx->qallocated += n;
+    }
+    return NULL;
+}
+
+int test_cursors(void)
+{
+    size_t type_sizes[QTYPES] = { 4, 8, 16 };
+
+    size_t max_blocks = 16;
+    size_t block_sz = 64 * 1024;
+    struct multiallocator * restrict const me = create_multiallocator(max_blocks, block_sz, QTYPES, type_sizes);
+    if (me == NULL) {
+        test_fail("create_multiallocator(%lu, %lu, %u, sizes) failed with NULL as result. errno = %d, %s.",
+            max_blocks, block_sz, QTYPES, errno, strerror(errno));
+    }
+
+    /* Zeroed memory, so gaps between chunks are never counted. */
+    const int status = multiallocator_map_arena(me, ARENA_MMAP, 0);
+    if (status != 0) {
+        test_fail("multiallocator_map_arena fails with code %d, %s.", status, strerror(status));
+    }
+
+    for (int iteration=0; iteration<2; ++iteration) {
+        pthread_t threads[QCURSOR_THREADS];
+        struct cursor_test_ctx ctxs[QCURSOR_THREADS];
+        for (int i=0; i<QCURSOR_THREADS; ++i) {
+            ctxs[i].multiallocator = me;
+            ctxs[i].id = i + 1;
+            ctxs[i].qallocated = 0;
+            const int status = pthread_create(threads + i, NULL, cursor_test_thread, ctxs + i);
+            if (status != 0) {
+                test_fail("pthread_create fails with code %d, %s.", status, strerror(status));
+            }
+        }
+
+        size_t qallocated = 0;
+        for (int i=0; i<QCURSOR_THREADS; ++i) {
+            pthread_join(threads[i], NULL);
+            qallocated += ctxs[i].qallocated;
+        }
+
+        if (qallocated * type_sizes[0] < (max_blocks-1) * block_sz) {
+            test_fail("allocated size %lu too small.", qallocated * type_sizes[0]);
+        }
+
+        /* Every item keeps the last writer, so overlapped ranges change counts. */
+        size_t counts[QCURSOR_THREADS + 1] = { 0 };
+        const size_t counter = me->types[0].counter < max_blocks * me->types[0].qitems
+            ? me->types[0].counter : max_blocks * me->types[0].qitems;
+        for (size_t i=0; i<counter; ++i) {
+            const uint32_t id = *(const uint32_t *)multiallocator_get(me, 0, i);
+            if (id <= QCURSOR_THREADS) {
+                ++counts[id];
+            }
+        }
+
+        for (int i=0; i<QCURSOR_THREADS; ++i) {
+            if (counts[i+1] != ctxs[i].qallocated) {
+                test_fail("Thread %d allocates %lu items, but %lu are found.", i, ctxs[i].qallocated, counts[i+1]);
+            }
+        }
+
+        multiallocator_reset(me);
+        memset(me->arena, 0, me->arena_sz);
+    }
+
+    destroy_multiallocator(me);
+    return 0;
+}
+
+#define QALLOCN_MT_THREADS 4
+
+struct allocn_mt_test_ctx
+{
+    struct multiallocator * multiallocator;
+    unsigned char * marks;
+    unsigned int seed;
+    size_t qallocated;
+    size_t qcrossed;
+};
+
+static void * allocn_mt_test_thread(void * arg)
+{
+    struct allocn_mt_test_ctx * restrict const ctx = arg;
+    const size_t qitems = ctx->multiallocator->types[0].qitems;
+    for (;;) {
+        const size_t n = rand_r(&ctx->seed) % 37 + 1;
+        const size_t index = multiallocator_allocn_mt(ctx->multiallocator, 0, n);
+        if (index == BAD_ALLOC_INDEX) {
+            break;
+        }
+
+        if (index / qitems != (index + n - 1) / qitems) {
+            ++ctx->qcrossed;
+        }
+
+        for (size_t i=0; i<n; ++i) {
+            uint32_t * restrict const ptr = multiallocator_get(ctx->multiallocator, 0, index + i);
+            *ptr = index + i;
+            __atomic_add_fetch(ctx->marks + index + i, 1, __ATOMIC_RELAXED);
+        }
+        ctx->qallocated += n;
+    }
+    return NULL;
+}
+
+int test_allocn_mt(void)
+{
+    size_t type_sizes[QTYPES] = { 4, 8, 16 };
+
+    size_t max_blocks = 16;
+    size_t block_sz = 64 * 1024;
+    struct multiallocator * restrict const me = create_multiallocator(max_blocks, block_sz, QTYPES, type_sizes);
+    if (me == NULL) {
+        test_fail("create_multiallocator(%lu, %lu, %u, sizes) failed with NULL as result. errno = %d, %s.",
+            max_blocks, block_sz, QTYPES, errno, strerror(errno));
+    }
+
+    const size_t qitems = max_blocks * me->types[0].qitems;
+    unsigned char * restrict const marks = calloc(qitems, 1);
+    if (marks == NULL) {
+        test_fail("calloc(%lu, 1) failed with NULL as result.", qitems);
+    }
+
+    pthread_t threads[QALLOCN_MT_THREADS];
+    struct allocn_mt_test_ctx ctxs[QALLOCN_MT_THREADS];
+    for (int i=0; i<QALLOCN_MT_THREADS; ++i) {
+        ctxs[i].multiallocator = me;
+        ctxs[i].marks = marks;
+        ctxs[i].seed = i + 1;
+        ctxs[i].qallocated = 0;
+        ctxs[i].qcrossed = 0;
+        const int status = pthread_create(threads + i, NULL, allocn_mt_test_thread, ctxs + i);
+        if (status != 0) {
+            test_fail("pthread_create fails with code %d, %s.", status, strerror(status));
+        }
+    }
+
+    size_t qallocated = 0;
+    for (int i=0; i<QALLOCN_MT_THREADS; ++i) {
+        pthread_join(threads[i], NULL);
+        qallocated += ctxs[i].qallocated;
+        if (ctxs[i].qcrossed != 0) {
+            test_fail("Thread %d gets %lu ranges which cross a block border.", i, ctxs[i].qcrossed);
+        }
+    }
+
+    if (me->used_blocks != max_blocks) {
+        test_fail("Only %lu blocks of %lu are used.", me->used_blocks, max_blocks);
+    }
+
+    if (qallocated * type_sizes[0] < (max_blocks-1) * block_sz) {
+        test_fail("allocated size %lu too small.", qallocated * type_sizes[0]);
+    }
+
+    size_t qmarked = 0;
+    for (size_t i=0; i<qitems; ++i) {
+        if (marks[i] > 1) {
+            test_fail("Item %lu is allocated %u times.", i, marks[i]);
+        }
+        if (marks[i] == 0) {
+            continue;
+        }
+        const uint32_t * ptr = multiallocator_get(me, 0, i);
+        if (*ptr != i) {
+            test_fail("Item %lu contains %u, values are mixed.", i, *ptr);
+        }
+        ++qmarked;
+    }
+
+    if (qmarked != qallocated) {
+        test_fail("Threads allocate %lu items, but %lu are marked.", qallocated, qmarked);
+    }
+
+    free(marks);
+    destroy_multiallocator(me);
+    return 0;
+}
+
+int test_arena(void)
+{
+    size_t type_sizes[QTYPES] = { 4, 8, 16 };
+
+    for (int backend = ARENA_MMAP; backend <= ARENA_HUGETLB; ++backend) {
+        size_t max_blocks = 4;
+        size_t block_sz = 128 * 1024;
+        struct multiallocator * restrict const me = create_multiallocator(max_blocks, block_sz, QTYPES, type_sizes);
+        if (me == NULL) {
+            test_fail("create_multiallocator(%lu, %lu, %u, sizes) failed with NULL as result. errno = %d, %s.",
+                max_blocks, block_sz, QTYPES, errno, strerror(errno));
+        }
+
+        const int status = multiallocator_map_arena(me, backend, backend == ARENA_MMAP);
+        if (status != 0) {
+            test_fail("multiallocator_map_arena(me, %d, ...) fails with code %d, %s.", backend, status, strerror(status));
+        }
+
+        if (me->backend < ARENA_MMAP || me->backend > backend) {
+            test_fail("Unexpected backend %d, requested %d.", me->backend, backend);
+        }
+
+        if (multiallocator_map_arena(me, backend, 0) != EBUSY) {
+            test_fail("Second multiallocator_map_arena(...) call should fail with EBUSY.");
+        }
+
+        check_multiallocator(me, type_sizes);
+        for (size_t i=0; i<max_blocks; ++i) {
+            const char * const block = me->blocks[i];
+            if (block != me->arena + i * block_sz) {
+                test_fail("Block %lu is out of arena.", i);
+            }
+        }
+
+        multiallocator_reset(me);
+        check_allocn(me, type_sizes);
+        destroy_multiallocator(me);
+    }
+
+    return 0;
+}
+
+int test_rng(void)
+{
+    struct rng a, b;
+    rng_seed(&a, 42, 0);
+    rng_seed(&b, 42, 0);
+    for (int i=0; i<1000; ++i) {
+        if (rng_next(&a) != rng_next(&b)) {
+            test_fail("Generators with the same seed differ on %d-th value.", i);
+        }
+    }
+
+    rng_seed(&a, 42, 0);
+    rng_seed(&b, 42, 1);
+    int qequal = 0;
+    for (int i=0; i<1000; ++i) {
+        qequal += rng_next(&a) == rng_next(&b);
+    }
+    if (qequal > 0) {
+        test_fail("Streams 0 and 1 have %d equal values.", qequal);
+    }
+
+    /* Chi-squared with 6 degrees of freedom, 30 is far beyond 0.9999 quantile. */
+    static const uint32_t bounds[] = { 1, 2, 3, 7, 1000, 0x80000001u };
+    for (size_t k=0; k<sizeof(bounds)/sizeof(bounds[0]); ++k) {
+        const uint32_t bound = bounds[k];
+        uint32_t counts[7] = { 0 };
+        const int qsamples = 70000;
+        for (int i=0; i<qsamples; ++i) {
+            const uint32_t value = rng_uniform(&a, bound);
+            if (value >= bound) {
+                test_fail("rng_uniform(%u) returns %u.", bound, value);
+            }
+            ++counts[(uint64_t)value * 7 / bound];
+        }
+
+        if (bound < 7) {
+            continue;
+        }
+
+        double chi2 = 0.0;
+        for (int i=0; i<7; ++i) {
+            const double expected = (double)qsamples / 7;
+            const double diff = counts[i] - expected;
+            chi2 += diff * diff / expected;
+        }
+        if (chi2 > 30.0) {
+            test_fail("rng_uniform(%u) is not uniform, chi2 = %f.", bound, chi2);
+        }
+    }
+
+    return 0;
+}
+
 #endif
@@ -48,6 +48,35 @@ struct test_item
 
 const struct test_item tests[] = {
     { "empty", &test_empty },
+    { "incremental-steps", &test_incremental_steps },
+    { "wide-game", &test_wide_game },
+    { "wide-board", &test_wide_board },
+    { "std-next-steps", &test_std_next_steps },
+    { "batch-rollout", &test_batch_rollout },
+    { "rng-seed", &test_rng_seed },
+    { "rng", &test_rng },
+    { "ubc-select", &test_ubc_select },
+    { "turn-gc", &test_turn_gc },
+    { "cursors", &test_cursors },
+    { "arena", &test_arena },
+    { "gc", &test_gc },
+    { "endgame", &test_endgame },
+    { "solver", &test_solver },
+    { "progress", &test_progress },
+    { "stop", &test_stop },
+    { "ponder", &test_ponder },
+    { "time-control", &test_time_control },
+    { "nn-binary", &test_nn_binary },
+    { "nn-precision", &test_nn_precision },
+    { "nn-kernels", &test_nn_kernels },
+    { "nn-ignore", &test_nn_ignore },
+    { "nn-accumulators", &test_nn_accumulators },
+    { "turn-mode", &test_turn_mode },
+    { "transpositions", &test_transpositions },
+    { "tree-reuse", &test_tree_reuse },
+    { "parallel-go", &test_parallel_go },
+    { "tree-parallel", &test_tree_parallel },
+    { "allocn-mt", &test_allocn_mt },
     { "nn-simulate", &test_nn_simulate },
     { "nn-rollout", &test_nn_rollout },
     { "nn", &test_nn },
@@ -62,6 +91,7 @@ const struct test_item tests[] = {
     { "multiallocator", &test_multiallocator },
     { "rollout", &test_rollout },
     { "random-ai", &test_random_ai },
+    { "hash", &test_hash },
     { "unstep", &test_unstep },
     { "nth-one-index", &test_nth_one_index },
     { "first-one", &test_first_one },